@@ -7,8 +7,22 @@ extern "C" {
 
 #include <stdint.h>
 
+/*
+ * Fixed point format, see poet_math.h:
+ * Q16.16 by default, Q32.32 with POET_FP_64 and POET_FP_FRAC_BITS=32.
+ * Other formats, like Q8.24 with POET_FP_FRAC_BITS=24, are only supported by
+ * the arithmetic of poet_math.h.
+ */
+#ifndef POET_FP_FRAC_BITS
+#define POET_FP_FRAC_BITS 16
+#endif
+
 #ifdef FIXED_POINT
+#ifdef POET_FP_64
+typedef int64_t real_t;
+#else
 typedef int32_t real_t;
+#endif
 #else
 typedef double real_t;
 #endif
@@ -18,15 +32,24 @@ typedef double real_t;
  * poet_apply_control function.
  * Allows disabling POET at runtime, removing the overhead of calculations.
  * Of course, no system changes will then be made either.
+ * Read once by poet_init(), see poet_set_control_enabled().
  */
 #define POET_DISABLE_CONTROL "POET_DISABLE_CONTROL"
 
 /**
  * Setting this environment variable tells POET not to call the apply function.
  * POET will run all its calculations but not make any system changes.
+ * Read once by poet_init(), see poet_set_apply_enabled().
  */
 #define POET_DISABLE_APPLY "POET_DISABLE_APPLY"
 
+/**
+ * Setting this environment variable tells POET to use the scalar n^2
+ * translation kernel instead of the AVX one.
+ * Read once by poet_init().
+ */
+#define POET_DISABLE_SIMD "POET_DISABLE_SIMD"
+
 typedef struct poet_internal_state poet_state;
 
 /**
@@ -52,6 +75,28 @@ typedef struct {
   real_t cost;
 } poet_control_state_t;
 
+/**
+ * Algorithms for translating a target speedup into a schedule of a lower and
+ * an upper state.
+ *
+ * POET_TRANSLATE_N2 checks all pairs of states (the default).
+ *
+ * POET_TRANSLATE_HULL looks up the bracketing segment of the lower convex hull
+ * of (1 / speedup, cost / speedup), which is built once in poet_init().
+ * It picks the same schedule as the n^2 search at any period. The segment
+ * bounds the cost of rounding the low state iterations to an integer, so only
+ * the pairs of states close enough to it to win are scored. With long periods
+ * these are a few states around the target; with short periods rounding
+ * matters more and more pairs are scored.
+ *
+ * In both modes a schedule that runs one state for the whole period has that
+ * state as both its lower and upper state and no low state iterations.
+ */
+typedef enum {
+  POET_TRANSLATE_N2 = 0,
+  POET_TRANSLATE_HULL
+} poet_translate_mode;
+
 /**
  * Initializes a poet_state struct which is needed to call other functions.
  *
@@ -67,7 +112,7 @@ typedef struct {
  * @param num_system_states
  *   Must be > 0
  * @param control_states
- *   Must not be NULL
+ *   Must not be NULL, a copy is kept
  * @param apply_states
  * @param apply
  * @param current
@@ -98,6 +143,8 @@ void poet_destroy(poet_state * state);
 
 /**
  * Change the performance goal at runtime.
+ * Like the other functions that set the goal, safe to call while other threads
+ * report work, see poet_set_work_reporting().
  *
  * @param state
  * @param perf_goal
@@ -106,6 +153,335 @@ void poet_destroy(poet_state * state);
 void poet_set_performance_goal(poet_state * state,
                                real_t perf_goal);
 
+/**
+ * Replace the performance goal with a goal for a quantile of the iteration
+ * latencies, e.g. 0.99 for the p99 latency. Latencies are passed to
+ * poet_apply_latency(), which tracks the quantile over a decaying window of
+ * recent iterations and controls it instead of the mean rate.
+ * poet_set_performance_goal() returns to a rate goal.
+ * Safe to call while other threads report work.
+ *
+ * In fixed point builds, rates of 1 / latency that do not fit real_t, which in
+ * Q16.16 are latencies below about 31 us, are clamped to the largest real_t.
+ *
+ * @param state
+ * @param quantile
+ *   Must be > 0 and < 1
+ * @param latency
+ *   Seconds, must be > 0
+ *
+ * @return 0 on success, -1 on failure (errno will be set)
+ */
+int poet_set_latency_goal(poet_state * state,
+                          double quantile,
+                          double latency);
+
+/**
+ * Replace the performance goal with a deadline: finish the provided number of
+ * iterations within the provided time from now, at the lowest cost. Once per
+ * period, the goal is set to the rate that finishes the remaining iterations
+ * in the remaining time, with a margin for the variation of the rate observed
+ * so far. Each call of poet_apply_control(), poet_apply_latency(),
+ * poet_decide() or poet_beat() after this one counts as an iteration, and so
+ * does the work reported with poet_report_work() after this one.
+ * poet_set_performance_goal() returns to a rate goal.
+ * Safe to call while other threads report work.
+ *
+ * @param state
+ * @param iterations
+ *   Must be > 0
+ * @param seconds
+ *   Must be > 0
+ *
+ * @return 0 on success, -1 on failure (errno will be set)
+ */
+int poet_set_deadline(poet_state * state,
+                      uint64_t iterations,
+                      double seconds);
+
+/**
+ * Replace the performance goal with a power cap: run as fast as possible while
+ * the average power stays at or below the cap. Power is the pwr argument of
+ * poet_apply_control() and the other functions that run the decision engine,
+ * and is assumed to be proportional to the cost of the states. Once per
+ * period, POET picks the fastest schedule whose cost averaged over time draws
+ * the cap. The schedule is not adjusted for switch costs or the minimum dwell
+ * time.
+ * Calling it again changes the cap at runtime.
+ * poet_set_performance_goal() returns to a rate goal.
+ * Safe to call while other threads report work.
+ *
+ * @param state
+ * @param cap
+ *   Power in the units of pwr, must be > 0
+ *
+ * @return 0 on success, -1 on failure (errno will be set)
+ */
+int poet_set_power_cap(poet_state * state,
+                       real_t cap);
+
+/**
+ * Enable or disable the decision engine at runtime, overriding the
+ * POET_DISABLE_CONTROL environment variable.
+ * Safe to call from any thread.
+ *
+ * @param state
+ * @param enabled
+ */
+void poet_set_control_enabled(poet_state * state,
+                              int enabled);
+
+/**
+ * Enable or disable calls to the apply function at runtime, overriding the
+ * POET_DISABLE_APPLY environment variable.
+ * While disabled, the system is assumed to stay in the last state applied, so
+ * poet_get_applied_state() returns that state and the samples are attributed
+ * to it. Once enabled, the scheduled state is applied if it differs.
+ * Safe to call from any thread.
+ *
+ * @param state
+ * @param enabled
+ */
+void poet_set_apply_enabled(poet_state * state,
+                            int enabled);
+
+/**
+ * Enable or disable online estimation of the cost of each control state,
+ * which is off by default.
+ *
+ * When enabled, Kalman filters learn each state's cost relative to the others
+ * from the pwr values passed to poet_apply_control(). Each sample is taken as
+ * the power averaged over the same iterations as the rate, see
+ * poet_set_speedup_estimation(), and only teaches the cost of a state when
+ * all of those iterations ran in it. The estimates replace the configured
+ * costs during translation. Samples with pwr <= 0 are ignored.
+ * Disabling restores the configured costs.
+ *
+ * @param state
+ * @param enabled
+ *
+ * @return 0 on success, -1 on failure (errno will be set)
+ */
+int poet_set_cost_estimation(poet_state * state,
+                             int enabled);
+
+/**
+ * Enable or disable online estimation of the speedup of each control state,
+ * which is off by default.
+ *
+ * When enabled, Kalman filters learn each state's speedup relative to the
+ * others from the perf values passed to poet_apply_control(). Each sample is
+ * taken as the rate over the last period of iterations and is credited to the
+ * states those iterations ran in, by their share of the iterations.
+ * poet_beat() learns from the beats since the last state change when its
+ * window holds more, a poet_apply_latency() sample covers one iteration and a
+ * work reporting sample the work since the last step. The estimates replace
+ * the configured speedups for the minimum and maximum speedups and for
+ * translation, so POET stops requesting more resources when the real speedup
+ * is lower than configured.
+ * Samples with perf <= 0 are ignored.
+ * Disabling restores the configured speedups.
+ *
+ * @param state
+ * @param enabled
+ *
+ * @return 0 on success, -1 on failure (errno will be set)
+ */
+int poet_set_speedup_estimation(poet_state * state,
+                                int enabled);
+
+/**
+ * Copy the control states as translation sees them, with the costs and
+ * speedups learned by estimation in place of the configured ones.
+ * Must be called from the thread that runs the decision engine.
+ *
+ * @param state
+ * @param control_states
+ *   Receives num_system_states states, in the order given to poet_init()
+ * @param num_system_states
+ *   Must be the number of control states POET has
+ *
+ * @return 0 on success, -1 on failure (errno will be set)
+ */
+int poet_get_control_states(const poet_state * state,
+                            poet_control_state_t * control_states,
+                            unsigned int num_system_states);
+
+/**
+ * Change the translation algorithm at runtime.
+ *
+ * @param state
+ * @param mode
+ */
+void poet_set_translate_mode(poet_state * state,
+                             poet_translate_mode mode);
+
+/**
+ * Gets the cost of switching from one control state to another: the time the
+ * switch takes in seconds and the energy it uses in joules, on top of what the
+ * application uses meanwhile. Should return 0 on success, -1 if the cost is
+ * unknown, which counts as free.
+ */
+typedef int (* poet_switch_cost_func) (void * arg,
+                                       unsigned int from_id,
+                                       unsigned int to_id,
+                                       double * seconds,
+                                       double * joules);
+
+/**
+ * Set the costs of switching states, which are ignored by default.
+ *
+ * After translation, POET compares the schedule's state switches to running
+ * the whole period in the faster state, or staying in the current state if it
+ * is fast enough, and picks the cheapest. Latencies are weighted by the
+ * workload estimate, energies by the power of a state with cost 1 estimated
+ * from the pwr samples (ignored until there are some).
+ *
+ * @param state
+ * @param switch_cost
+ *   NULL to ignore switching costs
+ * @param arg
+ *   passed to the switch cost function
+ */
+void poet_set_switch_costs(poet_state * state,
+                           poet_switch_cost_func switch_cost,
+                           void * arg);
+
+/**
+ * Set the minimum number of iterations to spend in a state before switching to
+ * another, 0 by default. Schedules are rounded so that neither of their states
+ * is used for fewer iterations, and switches requested earlier are deferred.
+ * With work reporting, iterations are the reported work.
+ *
+ * @param state
+ * @param iterations
+ */
+void poet_set_min_dwell(poet_state * state,
+                        unsigned int iterations);
+
+/**
+ * Replace the control states at runtime, e.g. after the config files changed,
+ * without the convergence transient of calling poet_destroy() and poet_init().
+ *
+ * The performance filter and the speedup history are kept. The maximum speedup
+ * and the translation tables are recomputed, and online estimators that are
+ * enabled restart from the new states. The current state becomes the new state
+ * with the closest speedup; the system is not changed until the next decision.
+ * On failure the old states stay in use. If only asynchronous actuation could
+ * not be restarted, the new states are in use with synchronous actuation and
+ * 1 is returned.
+ *
+ * Must be called from the thread that calls poet_apply_control(). Waits for
+ * the actuator thread and for threads reporting work to finish with the old
+ * states, so the old apply_states may be freed when this returns.
+ *
+ * @param state
+ * @param num_system_states
+ * @param control_states
+ *   Copied, like in poet_init()
+ * @param apply_states
+ *   Replaces the apply_states given to poet_init(), allowed to be NULL
+ *
+ * @return 0 on success, 1 if the new states are in use but asynchronous
+ *   actuation could not be restarted, -1 on failure (errno will be set in both
+ *   cases)
+ */
+int poet_update_states(poet_state * state,
+                       unsigned int num_system_states,
+                       const poet_control_state_t * control_states,
+                       void * apply_states);
+
+/**
+ * Policies for writing records from the log buffer to the log file.
+ *
+ * POET_LOG_FLUSH_SYNC: the thread calling poet_apply_control() writes the
+ * buffer when it is full (the default).
+ *
+ * The other policies start a background thread that writes one buffer while
+ * the next one is being filled. A buffer is always handed over when it is
+ * full, and also:
+ * POET_LOG_FLUSH_RECORDS: every N records (N <= buffer_depth)
+ * POET_LOG_FLUSH_TIME: when a record is logged at least T ms after the last
+ * hand over
+ * POET_LOG_FLUSH_DESTROY: only when poet_destroy() is called
+ *
+ * poet_destroy() writes all pending records with any policy.
+ */
+typedef enum {
+  POET_LOG_FLUSH_SYNC = 0,
+  POET_LOG_FLUSH_RECORDS,
+  POET_LOG_FLUSH_TIME,
+  POET_LOG_FLUSH_DESTROY
+} poet_log_flush_policy;
+
+/**
+ * Change the log flush policy. Requires a log file to be given to poet_init(),
+ * unless the policy is POET_LOG_FLUSH_SYNC.
+ * Must be called from the thread that calls poet_apply_control().
+ *
+ * @param state
+ * @param policy
+ * @param value
+ *   N for POET_LOG_FLUSH_RECORDS, T for POET_LOG_FLUSH_TIME, otherwise ignored
+ *
+ * @return 0 on success, -1 on failure (errno will be set)
+ */
+int poet_set_log_flush_policy(poet_state * state,
+                              poet_log_flush_policy policy,
+                              unsigned int value);
+
+/**
+ * Log to a binary file instead of, or in addition to, the text log file given
+ * to poet_init().
+ *
+ * The file is memory mapped and used as a ring buffer of the last num_records
+ * records, so logging a record only stores it in memory. The format is
+ * described in poet_log.h. Use the poet_log_decode tool to convert it to the
+ * text log format.
+ *
+ * @param state
+ * @param log_filename
+ *   The file to create, or NULL to close the binary log
+ * @param num_records
+ *   Must be > 0 if log_filename is specified
+ *
+ * @return 0 on success, -1 on failure (errno will be set)
+ */
+int poet_set_binary_log(poet_state * state,
+                        const char * log_filename,
+                        unsigned int num_records);
+
+/**
+ * Enable or disable asynchronous actuation, which is off by default.
+ *
+ * When enabled, poet_apply_control() does not call the apply function itself.
+ * It posts the requested state id to a single slot mailbox read by a dedicated
+ * actuator thread. A request that has not been applied yet is replaced by a
+ * newer one. The apply function is then called from the actuator thread.
+ *
+ * Must be called from the thread that calls poet_apply_control(), usually
+ * right after poet_init(). poet_destroy() stops the actuator thread.
+ *
+ * @param state
+ * @param async
+ *   Non-zero to enable, requires an apply function
+ *
+ * @return 0 on success, -1 on failure (errno will be set)
+ */
+int poet_set_apply_async(poet_state * state,
+                         int async);
+
+/**
+ * Get the id of the last state that was applied. With asynchronous
+ * actuation, this may lag behind the state most recently requested.
+ *
+ * @param state
+ *   Must not be NULL
+ *
+ * @return the state id
+ */
+unsigned int poet_get_applied_state(const poet_state * state);
+
 /**
  * Runs POET decision engine and requests system changes by calling the apply
  * function provided in poet_init().
@@ -123,6 +499,191 @@ void poet_apply_control(poet_state * state,
                         real_t perf,
                         real_t pwr);
 
+/**
+ * Same as poet_apply_control(), but takes the latency of one iteration. With a
+ * latency goal, POET controls the quantile of the latencies, otherwise the
+ * latency is used as a rate of 1 / latency. Rates are clamped like in
+ * poet_set_latency_goal().
+ *
+ * @param state
+ * @param id
+ *   user-specified identifier for current iteration
+ * @param latency
+ *   the latency of the iteration in seconds
+ * @param pwr
+ *   the actual achieved power
+ */
+void poet_apply_latency(poet_state * state,
+                        unsigned long id,
+                        double latency,
+                        real_t pwr);
+
+/**
+ * A schedule returned by poet_decide(): run the first low_state_iters
+ * iterations of the period in lower_id and the rest in upper_id. The ids are
+ * -1 if POET has no schedule.
+ */
+typedef struct {
+  int lower_id;
+  int upper_id;
+  unsigned int low_state_iters;
+  unsigned int period;
+  // predicted rate and average cost of the schedule, 0 without a schedule
+  real_t rate;
+  real_t cost;
+} poet_schedule_t;
+
+/**
+ * Runs POET decision engine like poet_apply_control(), but never calls the
+ * apply function. Once per period, returns the new schedule, which the
+ * application applies when convenient and reports with
+ * poet_report_applied(). The minimum dwell time is left to the application.
+ * Do not mix with poet_apply_control() on the same state.
+ *
+ * @param state
+ * @param id
+ *   user-specified identifier for current iteration, increasing
+ * @param perf
+ *   the actual achieved performance
+ * @param pwr
+ *   the actual achieved power
+ * @param schedule
+ *   Set when a new schedule is decided
+ *
+ * @return 1 if a new schedule was decided, 0 if not, -1 on failure (errno will
+ *   be set)
+ */
+int poet_decide(poet_state * state,
+                unsigned long id,
+                real_t perf,
+                real_t pwr,
+                poet_schedule_t * schedule);
+
+/**
+ * Tell POET that the application applied a state after poet_decide().
+ * Samples of iterations before id are still attributed to the previous state.
+ * Not allowed with asynchronous actuation.
+ *
+ * @param state
+ * @param state_id
+ *   The state that was applied
+ * @param id
+ *   The first iteration run in the state
+ *
+ * @return 0 on success, -1 on failure (errno will be set)
+ */
+int poet_report_applied(poet_state * state,
+                        unsigned int state_id,
+                        unsigned long id);
+
+/**
+ * Reads a cumulative energy counter in joules. Should return 0 on success,
+ * -1 on failure.
+ */
+typedef int (* poet_energy_func) (void * arg,
+                                  double * joules);
+
+/**
+ * Change the number of beats over which poet_beat() measures the rate and
+ * power, which is the period given to poet_init() by default. The window
+ * starts over.
+ *
+ * @param state
+ * @param window
+ *   Must be > 0
+ *
+ * @return 0 on success, -1 on failure (errno will be set)
+ */
+int poet_set_beat_window(poet_state * state,
+                         unsigned int window);
+
+/**
+ * Set the energy counter that poet_beat() and work reporting use to measure
+ * power, which is not measured by default (the power is then 0).
+ *
+ * @param state
+ * @param energy
+ *   NULL to stop measuring power
+ * @param energy_arg
+ *   passed to the energy function
+ */
+void poet_set_energy_source(poet_state * state,
+                            poet_energy_func energy,
+                            void * energy_arg);
+
+/**
+ * Call once per iteration instead of measuring the performance and calling
+ * poet_apply_control().
+ *
+ * Timestamps the iteration with CLOCK_MONOTONIC, and reads the energy source
+ * if there is one. Then runs poet_apply_control() with the rate in iterations
+ * per second and the power in watts over the last window of beats, see
+ * poet_set_beat_window(). The first beat only starts the window.
+ * In fixed point builds, the rate must fit real_t.
+ *
+ * @param state
+ */
+void poet_beat(poet_state * state);
+
+/**
+ * Enable or disable reporting work with poet_report_work(), for applications
+ * that complete iterations on many threads. Off by default.
+ *
+ * Each thread adds its work to one of num_slots counters, on its own cache
+ * line, and only publishes it to the shared total once it reaches batch
+ * iterations. Threads are assigned slots round robin on their first report,
+ * so use at least as many slots as reporting threads to avoid sharing.
+ *
+ * With timer_ms = 0, the thread whose report completes a period of work runs
+ * the decision engine, using the rate over that period. The thread whose
+ * report reaches the switch from the lower to the upper state of the schedule
+ * applies it. Steps never block: a report that crosses a boundary while
+ * another thread is stepping leaves the step to a later report.
+ * Decisions may therefore lag by up to num_slots * batch iterations.
+ *
+ * With timer_ms > 0, a timer thread publishes all work and runs the decision
+ * engine every timer_ms instead, using the rate since the last decision.
+ * Reports only switch to the upper state.
+ *
+ * Rates are in counts per second, which must fit real_t in fixed point builds;
+ * report coarser units of work otherwise. Power is measured between
+ * decisions if an energy source is set, see poet_set_energy_source().
+ * The apply function may be called from any reporting thread.
+ * poet_apply_control() must not be called while work reporting is enabled,
+ * and this function must not be called while other threads report work.
+ * The apply function must not change the goal, since it is called while the
+ * step holds the lock that the goal setters wait for.
+ * poet_destroy() disables work reporting.
+ *
+ * @param state
+ * @param num_slots
+ *   Number of counters, 0 to disable
+ * @param batch
+ *   Must be > 0 if num_slots > 0
+ * @param timer_ms
+ *
+ * @return 0 on success, -1 on failure (errno will be set)
+ */
+int poet_set_work_reporting(poet_state * state,
+                            unsigned int num_slots,
+                            unsigned int batch,
+                            unsigned int timer_ms);
+
+/**
+ * Reports completed work, see poet_set_work_reporting().
+ * Safe to call from any thread. Does nothing unless work reporting is enabled.
+ *
+ * @param state
+ * @param count
+ *   iterations completed
+ * @param timestamp_ns
+ *   completion time in ns of CLOCK_MONOTONIC, or 0 to read the clock if the
+ *   report runs a step
+ */
+void poet_report_work(poet_state * state,
+                      unsigned int count,
+                      uint64_t timestamp_ns);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,106 @@
+#ifndef _POET_CALIBRATE_H
+#define _POET_CALIBRATE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "poet_config.h"
+
+/**
+ * Runs one iteration of the workload being calibrated.
+ */
+typedef void (* poet_calibrate_work_func) (void * arg);
+
+/**
+ * Reads a cumulative energy counter in joules. The value must not decrease, so
+ * counters that wrap around, like RAPL's energy_uj, must be unwrapped by the
+ * caller. Should return 0 on success, -1 on failure.
+ */
+typedef int (* poet_calibrate_energy_func) (void * arg,
+                                            double * joules);
+
+typedef struct {
+  // id of the CPU state that was measured
+  unsigned int id;
+  // iterations per second
+  double rate;
+  // average power in watts, or a relative estimate without an energy function
+  double power;
+} poet_calibration_t;
+
+/**
+ * Measure the workload in every CPU state using the in-process actuator.
+ *
+ * For each state, the state is applied, one warm-up iteration is run, and then
+ * the rate and power of the next iterations are measured. If energy is NULL,
+ * power is estimated as proportional to the number of cores times the
+ * frequency.
+ *
+ * The affinity of the process and the frequency of each core are restored to
+ * their starting values afterwards. A failure to restore them is reported on
+ * stderr but does not fail the calibration.
+ *
+ * @param states
+ * @param num_states
+ * @param iterations
+ *   Must be > 0
+ * @param work
+ *   Must not be NULL
+ * @param work_arg
+ * @param energy
+ * @param energy_arg
+ * @param results
+ *   Must have room for num_states entries, results[i] is for states[i]
+ *
+ * @return 0 on success, -1 on failure (errno will be set)
+ */
+int poet_calibrate(const poet_cpu_state_t* states,
+                   unsigned int num_states,
+                   unsigned int iterations,
+                   poet_calibrate_work_func work,
+                   void* work_arg,
+                   poet_calibrate_energy_func energy,
+                   void* energy_arg,
+                   poet_calibration_t* results);
+
+/**
+ * Sort results by increasing rate and remove states that are dominated, that
+ * is states that are not cheaper than some faster state. The remaining states
+ * have increasing rate and power.
+ *
+ * @param results
+ * @param num_results
+ *
+ * @return the number of results remaining
+ */
+unsigned int poet_calibration_prune(poet_calibration_t* results,
+                                    unsigned int num_results);
+
+/**
+ * Write a control_config and a matching cpu_config for the results.
+ * States are renumbered in the order of the results. Speedup and cost are
+ * normalized to the first result.
+ *
+ * @param control_path
+ * @param cpu_path
+ * @param states
+ *   The states that results refer to
+ * @param num_states
+ * @param results
+ * @param num_results
+ *
+ * @return 0 on success, -1 on failure
+ */
+int poet_calibration_write(const char* control_path,
+                           const char* cpu_path,
+                           const poet_cpu_state_t* states,
+                           unsigned int num_states,
+                           const poet_calibration_t* results,
+                           unsigned int num_results);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -7,6 +7,13 @@ extern "C" {
 
 #include "poet.h"
 
+// Directory with the cpuN/cpufreq files, tests point it at a fake tree
+#ifndef POET_CPU_SYSFS_DIR
+  #define POET_CPU_SYSFS_DIR "/sys/devices/system/cpu"
+#endif
+// Room for a cpufreq file path under POET_CPU_SYSFS_DIR
+#define POET_CPUFREQ_PATH_LEN (sizeof(POET_CPU_SYSFS_DIR) + 64)
+
 typedef struct {
   unsigned int id;
   unsigned long freq;
@@ -29,6 +36,182 @@ void apply_cpu_config(void* states,
                       unsigned int id,
                       unsigned int last_id);
 
+/**
+ * An in-process actuator for CPU states. Sets thread affinity directly with
+ * sched_setaffinity and writes frequencies to sysfs through file descriptors
+ * that are kept open, instead of running shell commands for every change.
+ */
+typedef struct poet_cpu_actuator poet_cpu_actuator;
+
+/**
+ * Errors from each step of cpu_actuator_apply(). An errno value of 0 means the
+ * step succeeded or was not needed.
+ */
+typedef struct {
+  // threads in /proc/self/task whose affinity could not be set
+  unsigned int affinity_failures;
+  int affinity_errno;
+  // cores whose frequency could not be set
+  unsigned int freq_failures;
+  int freq_errno;
+} poet_cpu_apply_result;
+
+/**
+ * Create an actuator for the provided CPU states and open the scaling_setspeed
+ * file of every core used by the states. The states are not copied and must
+ * remain valid until cpu_actuator_destroy() is called.
+ *
+ * @param states
+ * @param num_states
+ *
+ * @return poet_cpu_actuator pointer, or NULL on failure (errno will be set)
+ */
+poet_cpu_actuator* cpu_actuator_init(const poet_cpu_state_t* states,
+                                     unsigned int num_states);
+
+/**
+ * Close the actuator's file descriptors and free it.
+ *
+ * @param actuator
+ */
+void cpu_actuator_destroy(poet_cpu_actuator* actuator);
+
+/**
+ * Apply the CPU state with the provided id. Affinity is only changed if the
+ * number of cores differs from the state with id last_id.
+ * If result is not NULL, it is filled with the errors from each step.
+ *
+ * @param actuator
+ * @param id
+ * @param last_id
+ * @param result
+ *
+ * @return 0 on success, -1 if any step failed
+ */
+int cpu_actuator_apply(poet_cpu_actuator* actuator,
+                       unsigned int id,
+                       unsigned int last_id,
+                       poet_cpu_apply_result* result);
+
+/**
+ * Get the errors from the last call to cpu_actuator_apply(), including calls
+ * made by apply_cpu_config_native().
+ *
+ * @param actuator
+ * @param result
+ */
+void cpu_actuator_get_result(const poet_cpu_actuator* actuator,
+                             poet_cpu_apply_result* result);
+
+/**
+ * Same as apply_cpu_config, but uses the in-process actuator.
+ *
+ * Compatible with the poet_apply_func definition.
+ *
+ * @param states - must be a poet_cpu_actuator*
+ * @param num_states
+ * @param id
+ * @param last_id
+ */
+void apply_cpu_config_native(void* states,
+                             unsigned int num_states,
+                             unsigned int id,
+                             unsigned int last_id);
+
+/**
+ * Sets the number of threads an application runs in parallel, parking or
+ * waking its own workers. Should return 0 on success, -1 on failure.
+ */
+typedef int (* poet_parallelism_func) (void * arg,
+                                       unsigned int threads);
+
+/**
+ * Applies the core count of CPU states cooperatively: instead of pinning every
+ * thread onto cores 0 to N, the application is told to run N + 1 threads.
+ *
+ * If actuator is not NULL, it sets the frequency, and it also narrows the
+ * affinity if narrow_affinity is non-zero. Without narrow_affinity, the time
+ * the callback takes is measured as the actuator's core count latency.
+ */
+typedef struct {
+  const poet_cpu_state_t* states;
+  unsigned int num_states;
+  poet_parallelism_func parallelism;
+  void* parallelism_arg;
+  poet_cpu_actuator* actuator;
+  int narrow_affinity;
+} poet_cpu_cooperative;
+
+/**
+ * Same as apply_cpu_config_native, but calls the parallelism function of the
+ * poet_cpu_cooperative when the number of cores changes. When the number of
+ * cores grows, affinity is widened before the callback, and when it shrinks,
+ * narrowed after it.
+ *
+ * Compatible with the poet_apply_func definition.
+ *
+ * @param states - must be a poet_cpu_cooperative*
+ * @param num_states
+ * @param id
+ * @param last_id
+ */
+void apply_cpu_config_cooperative(void* states,
+                                  unsigned int num_states,
+                                  unsigned int id,
+                                  unsigned int last_id);
+
+/**
+ * A model of the cost of switching CPU states: changing the frequency and
+ * changing the number of cores each take some time and energy.
+ */
+typedef struct {
+  const poet_cpu_state_t* states;
+  unsigned int num_states;
+  double freq_seconds;
+  double freq_joules;
+  double core_seconds;
+  double core_joules;
+} poet_cpu_switch_model;
+
+/**
+ * Get the cost of switching between CPU states from a model.
+ *
+ * Compatible with the poet_switch_cost_func definition.
+ *
+ * @param arg - must be a poet_cpu_switch_model*
+ * @param from_id
+ * @param to_id
+ * @param seconds
+ * @param joules
+ *
+ * @return 0 on success, -1 if an id is out of range
+ */
+int cpu_switch_cost(void* arg,
+                    unsigned int from_id,
+                    unsigned int to_id,
+                    double* seconds,
+                    double* joules);
+
+/**
+ * Get the cost of switching between CPU states as measured by the actuator:
+ * the mean time its frequency and affinity steps took so far. Energies are 0.
+ *
+ * Compatible with the poet_switch_cost_func definition.
+ *
+ * @param arg - must be a poet_cpu_actuator*
+ * @param from_id
+ * @param to_id
+ * @param seconds
+ * @param joules
+ *
+ * @return 0 on success, -1 if an id is out of range
+ */
+int cpu_actuator_switch_cost(void* arg,
+                             unsigned int from_id,
+                             unsigned int to_id,
+                             double* seconds,
+                             double* joules);
+
 /**
  * Read the control states from the file at the provided path and store in the
  * states pointer (states* is assigned). The number of states found is stored
@@ -59,6 +242,102 @@ int get_cpu_states(const char* path,
                    poet_cpu_state_t** states,
                    unsigned int* num_states);
 
+/**
+ * Same as get_control_states, but loads a compiled binary form of the file
+ * from cache_path when it is up to date, and otherwise parses the text file and
+ * (re)writes the cache. The cache is only used if its checksum is valid and it
+ * was built from a text file with the same modification time and size, by a
+ * build with the same number format. Failing to write the cache is not an
+ * error.
+ *
+ * The caller is responsible for freeing the memory this function allocates.
+ *
+ * @param path - NULL for the default config file
+ * @param cache_path - NULL for path with ".cache" appended
+ * @param states
+ * @param num_states
+ */
+int get_control_states_cached(const char* path,
+                              const char* cache_path,
+                              poet_control_state_t** states,
+                              unsigned int* num_states);
+
+/**
+ * Same as get_cpu_states, but uses a compiled binary cache like
+ * get_control_states_cached.
+ *
+ * The caller is responsible for freeing the memory this function allocates.
+ *
+ * @param path - NULL for the default config file
+ * @param cache_path - NULL for path with ".cache" appended
+ * @param states
+ * @param num_states
+ */
+int get_cpu_states_cached(const char* path,
+                          const char* cache_path,
+                          poet_cpu_state_t** states,
+                          unsigned int* num_states);
+
+/**
+ * Watches a control_config and cpu_config pair and reloads them when they
+ * change, so POET picks up new states without being re-initialized.
+ */
+typedef struct poet_config_watcher poet_config_watcher;
+
+/**
+ * Read both config files and start a thread that waits for changes to them
+ * with inotify. The files must have the same number of states, changes that
+ * break this are ignored.
+ *
+ * Get the tables to pass to poet_init() with config_watcher_get_states(). The
+ * CPU states are used as the apply_states, as with apply_cpu_config().
+ *
+ * @param control_path
+ * @param cpu_path
+ *
+ * @return poet_config_watcher pointer, or NULL on failure (errno will be set)
+ */
+poet_config_watcher* config_watcher_init(const char* control_path,
+                                         const char* cpu_path);
+
+/**
+ * Get the tables currently given to POET. They belong to the watcher and
+ * remain valid until config_watcher_update() replaces them or
+ * config_watcher_destroy() is called.
+ *
+ * @param watcher
+ * @param control_states
+ * @param cpu_states
+ * @param num_states
+ */
+void config_watcher_get_states(const poet_config_watcher* watcher,
+                               poet_control_state_t** control_states,
+                               poet_cpu_state_t** cpu_states,
+                               unsigned int* num_states);
+
+/**
+ * Give the tables read since the last call to POET with poet_update_states().
+ * Only checks a flag when nothing changed, so it can be called every
+ * iteration. Must be called from the thread that calls poet_apply_control().
+ *
+ * @param watcher
+ * @param state
+ *
+ * @return 1 if the states were updated, 0 if nothing changed, -1 on failure
+ *   (errno will be set). If only asynchronous actuation could not be
+ *   restarted, -1 is returned but the new states are in use and belong to the
+ *   watcher, see poet_update_states().
+ */
+int config_watcher_update(poet_config_watcher* watcher,
+                          poet_state* state);
+
+/**
+ * Stop watching and free the watcher and its tables.
+ *
+ * @param watcher
+ */
+void config_watcher_destroy(poet_config_watcher* watcher);
+
 /**
  * Attempt to determine the current system state and return the id.
  * Set curr_state_id if possible and return 0, otherwise return -1.
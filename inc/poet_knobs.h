@@ -0,0 +1,111 @@
+#ifndef _POET_KNOBS_H
+#define _POET_KNOBS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "poet.h"
+
+/**
+ * A set of independent knobs, e.g. CPU frequency, core count and an
+ * application quality setting, each with its own speedup and cost table and
+ * apply function. The knobs are composed into one table of control states for
+ * poet_init() without enumerating the Cartesian product of all knobs.
+ *
+ * The speedup and cost of a combination of settings are the products of the
+ * speedups and costs of the settings. A combination that is not faster or not
+ * cheaper than some other combination is never optimal, so the knobs are
+ * merged one at a time and the dominated combinations are pruned after each
+ * merge; only the Pareto frontiers of the partial compositions are built.
+ */
+typedef struct poet_knobs poet_knobs;
+
+/**
+ * Create an empty set of knobs.
+ *
+ * @return poet_knobs pointer, or NULL on failure (errno will be set)
+ */
+poet_knobs* poet_knobs_init(void);
+
+/**
+ * Destroy the knobs. Must not be called while a poet_state applies them.
+ *
+ * @param knobs
+ */
+void poet_knobs_destroy(poet_knobs* knobs);
+
+/**
+ * Add a knob. The apply function is called with the apply_states, the number
+ * of states of this knob and indexes into its table, like the apply function
+ * of poet_init(), and only when the setting of this knob changes.
+ *
+ * Knobs cannot be added after poet_knobs_compose().
+ *
+ * @param knobs
+ *   Must not be NULL
+ * @param states
+ *   Must not be NULL, a copy is kept. Speedups and costs must be > 0.
+ * @param num_states
+ *   Must be > 0
+ * @param apply_states
+ * @param apply
+ *
+ * @return the index of the knob, or -1 on failure (errno will be set)
+ */
+int poet_knobs_add(poet_knobs* knobs,
+                   const poet_control_state_t* states,
+                   unsigned int num_states,
+                   void* apply_states,
+                   poet_apply_func apply);
+
+/**
+ * Compose the knobs into control states for poet_init(), sorted by increasing
+ * speedup and cost, with ids equal to their index. Pass the knobs as the
+ * apply_states and poet_knobs_apply() as the apply function. Must not be
+ * called while a poet_state applies the knobs.
+ *
+ * @param knobs
+ *   Must not be NULL and have at least one knob
+ * @param states
+ *   Set to the composed states, must be freed by the caller
+ * @param num_states
+ *   Set to the number of composed states
+ *
+ * @return 0 on success, -1 on failure (errno will be set)
+ */
+int poet_knobs_compose(poet_knobs* knobs,
+                       poet_control_state_t** states,
+                       unsigned int* num_states);
+
+/**
+ * Apply function for composed states. Calls the apply function of each knob
+ * whose setting differs between the composed states id and last_id.
+ * Safe to call from the actuator thread of poet_set_apply_async().
+ */
+void poet_knobs_apply(void* knobs,
+                      unsigned int num_states,
+                      unsigned int id,
+                      unsigned int last_id);
+
+/**
+ * Get the setting of a knob in a composed state.
+ *
+ * @param knobs
+ * @param id
+ *   A composed state
+ * @param knob
+ *   A knob index from poet_knobs_add()
+ *
+ * @return the index into the table of the knob, or -1 on failure (errno will
+ *   be set)
+ */
+int poet_knobs_get_setting(const poet_knobs* knobs,
+                           unsigned int id,
+                           unsigned int knob);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef _POET_LOG_H
+#define _POET_LOG_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/*
+ * Binary log file format, see poet_set_binary_log().
+ *
+ * The file is a poet_log_header followed by a ring buffer of 'capacity'
+ * poet_log_record entries. Record number n (counting from 0) is stored at
+ * index n % capacity, so once 'count' exceeds 'capacity' the oldest record is
+ * at index count % capacity.
+ *
+ * All values are in host byte order.
+ */
+
+#define POET_LOG_MAGIC "POETLOG"
+#define POET_LOG_VERSION 1
+
+// Formats of the real_t values in the log
+#define POET_LOG_REAL_DOUBLE 0
+#define POET_LOG_REAL_FIXED 1
+
+typedef struct {
+  // POET_LOG_MAGIC, null terminated
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  // POET_LOG_REAL_DOUBLE or POET_LOG_REAL_FIXED
+  uint32_t real_format;
+  // fractional bits of fixed point values
+  uint32_t real_frac_bits;
+  uint64_t capacity;
+  // total number of records written, updated after each record is complete
+  uint64_t count;
+} poet_log_header;
+
+// A double, or a sign-extended fixed point value
+typedef union {
+  double d;
+  int64_t fp;
+} poet_log_real;
+
+typedef struct {
+  uint64_t tag;
+  poet_log_real act_rate;
+  poet_log_real x_hat_minus;
+  poet_log_real x_hat;
+  poet_log_real p_minus;
+  poet_log_real h;
+  poet_log_real k;
+  poet_log_real p;
+  poet_log_real speedup;
+  poet_log_real error;
+  poet_log_real workload;
+  int32_t lower_id;
+  int32_t upper_id;
+  int32_t low_state_iters;
+  int32_t reserved;
+} poet_log_record;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -10,42 +10,53 @@ extern "C" {
 #include "poet.h"
 
 /*
- * Define Q16 fixed point type
+ * Define the fixed point type, Q16.16 unless POET_FP_FRAC_BITS and POET_FP_64
+ * select another format (see poet.h)
  * Define addition, subtraction, multiplication, and division operations
  * for type
+ * Results that do not fit the type saturate at MAX_FP or MIN_FP
  */
 
-#define MAX_FP 0x7FFFFFFF
-#define MIN_FP 0x80000000
-
 #define UNDERFLOW_MARGIN .01
 
 // must be aligned with FIXED_POINT real_t in poet.h, we just don't want to expose this type
+#ifdef POET_FP_64
+typedef int64_t fp_t;
+// holds the full product of two fp_t
+__extension__ typedef __int128 fp_wide_t;
+#define MAX_FP INT64_MAX
+#define MIN_FP INT64_MIN
+#else
 typedef int32_t fp_t;
+typedef int64_t fp_wide_t;
+#define MAX_FP INT32_MAX
+#define MIN_FP INT32_MIN
+#endif
+
+#define FP_FRAC_BITS POET_FP_FRAC_BITS
+#define FP_ONE ((fp_wide_t) 1 << FP_FRAC_BITS)
+#define FP_SCALE ((double) FP_ONE)
 
-#define FP_CONST(x) ((fp_t) (((x) >= 0) ? ((x) * 65536.0 + 0.5) : ((x * 65536.0 - 0.5))))
+#define FP_CONST(x) ((fp_t) (((x) >= 0) ? ((x) * FP_SCALE + 0.5) : ((x) * FP_SCALE - 0.5)))
 #define DB_CONST(x) (x)
 
-static inline fp_t FP_ADD2(fp_t a, fp_t b) {
-  fp_t sum = a + b;
-
-#ifdef POET_MATH_OVERFLOW
-  // Check for overflow
-  // Can only happen if a and b have the same sign,
-  // and the sign of the sum is not equal to that sign
-	if (!((a ^ b) & 0x80000000) && ((a ^ sum) & 0x80000000)) {
-    if (a > 0) {
-      sum = (fp_t) MAX_FP;
-    } else {
-      sum = (fp_t) MIN_FP;
-    }
+static inline fp_t FP_SATURATE(fp_wide_t a) {
+  if (a > MAX_FP) {
+    return MAX_FP;
   }
-#endif
+  if (a < MIN_FP) {
+    return MIN_FP;
+  }
+  return (fp_t) a;
+}
+
+static inline fp_t FP_ADD2(fp_t a, fp_t b) {
+  fp_t sum = FP_SATURATE((fp_wide_t) a + b);
 
 #ifdef OVERFLOW_WARNING
-  double a1 = (double) (a / ((double) (1 << 16)));
-  double b1 = (double) (b / ((double) (1 << 16)));
-  double answer1 = (double) (sum / ((double) (1 << 16)));
+  double a1 = (double) (a / FP_SCALE);
+  double b1 = (double) (b / FP_SCALE);
+  double answer1 = (double) (sum / FP_SCALE);
 
   double temp = answer1 - (a1+b1);
   if (!(temp < 1 && temp > -1)) {
@@ -58,25 +69,12 @@ static inline fp_t FP_ADD2(fp_t a, fp_t b) {
 }
 
 static inline fp_t FP_SUB(fp_t a, fp_t b) {
-  fp_t difference = a - b;
-
-#ifdef POET_MATH_OVERFLOW
-  // Check for overflow
-  // Can only happen if a and b have different signs,
-  // and the sign of the difference is not equal to that sign
-	if (((a ^ b) & 0x80000000) && ((a ^ difference) & 0x80000000)) {
-    if (a > 0) {
-      difference = (fp_t) MAX_FP;
-    } else {
-      difference = (fp_t) MIN_FP;
-    }
-  }
-#endif
+  fp_t difference = FP_SATURATE((fp_wide_t) a - b);
 
 #ifdef OVERFLOW_WARNING
-  double a1 = (double) (a / ((double) (1 << 16)));
-  double b1 = (double) (b / ((double) (1 << 16)));
-  double answer1 = (double) (difference / ((double) (1 << 16)));
+  double a1 = (double) (a / FP_SCALE);
+  double b1 = (double) (b / FP_SCALE);
+  double answer1 = (double) (difference / FP_SCALE);
 
   double temp = answer1 - (a1-b1);
   if (!(temp < 1 && temp > -1)) {
@@ -90,27 +88,13 @@ static inline fp_t FP_SUB(fp_t a, fp_t b) {
 
 
 static inline fp_t FP_MULT2(fp_t a, fp_t b) {
-  int64_t prod = (int64_t) a * b;
-  fp_t answer = prod >> 16;
-
-#ifdef POET_MATH_OVERFLOW
-  // Check for overflow
-  // Upper 17 bits should all be the same
-  // If they are not, return the maximum f
-  uint32_t upper = (prod >> 47);
-  if ((prod < 0 && ~upper) || (prod > 0 && upper)) {
-    if ((a >= 0) == (b >= 0)) {
-      answer = (fp_t) MAX_FP;
-    } else {
-      answer = (fp_t) MIN_FP;
-    }
-  }
-#endif
+  // the shift rounds towards negative infinity
+  fp_t answer = FP_SATURATE(((fp_wide_t) a * b) >> FP_FRAC_BITS);
 
 #ifdef OVERFLOW_WARNING
-  double a1 = (double) (a / ((double) (1 << 16)));
-  double b1 = (double) (b / ((double) (1 << 16)));
-  double answer1 = (double) (answer / ((double) (1 << 16)));
+  double a1 = (double) (a / FP_SCALE);
+  double b1 = (double) (b / FP_SCALE);
+  double answer1 = (double) (answer / FP_SCALE);
 
   double temp = answer1 - (a1*b1);
   if (!(temp < 1 && temp > -1)) {
@@ -126,12 +110,12 @@ static inline fp_t FP_MULT2(fp_t a, fp_t b) {
   }
 
 
-  double a2 = (double) (a / ((double) (1 << 16)));
-  double b2 = (double) (b / ((double) (1 << 16)));
-  double answer2 = (double) (answer / ((double) (1 << 16)));
+  double a2 = (double) (a / FP_SCALE);
+  double b2 = (double) (b / FP_SCALE);
+  double answer2 = (double) (answer / FP_SCALE);
 
   double temp2 = 1 - answer2 / (a2*b2);
-  if (!(temp2 < UNDERFLOW_MARGIN && temp > -UNDERFLOW_MARGIN)) {
+  if (!(temp2 < UNDERFLOW_MARGIN && temp2 > -UNDERFLOW_MARGIN)) {
     printf("\nFixed point underflow...attempted to multiply %f by %f\n", a2, b2);
     printf("Expected %f but received %f\n", a2*b2, answer2);
   }
@@ -141,27 +125,19 @@ static inline fp_t FP_MULT2(fp_t a, fp_t b) {
 }
 
 static inline fp_t FP_DIV(fp_t a, fp_t b) {
-  int64_t quotient = ((((int64_t) a) << 16) / b);
-  fp_t answer = (fp_t) quotient;
-
-#ifdef POET_MATH_OVERFLOW
-  // Check for overflow
-  // Upper 17 bits should all be the same
-  // If they are not, return the maximum f
-  uint32_t upper = (quotient >> 31);
-  if ((answer < 0 && ~upper) || (answer > 0 && upper)) {
-    if ((a >= 0) == (b >= 0)) {
-      answer = (fp_t) MAX_FP;
-    } else {
-      answer = (fp_t) MIN_FP;
-    }
+  fp_t answer;
+
+  if (b == 0) {
+    // the limit, as if b was the smallest positive value
+    answer = a >= 0 ? MAX_FP : MIN_FP;
+  } else {
+    answer = FP_SATURATE(((fp_wide_t) a * FP_ONE) / b);
   }
-#endif
 
 #ifdef OVERFLOW_WARNING
-  double a1 = (double) (a / ((double) (1 << 16)));
-  double b1 = (double) (b / ((double) (1 << 16)));
-  double answer1 = (double) (answer / ((double) (1 << 16)));
+  double a1 = (double) (a / FP_SCALE);
+  double b1 = (double) (b / FP_SCALE);
+  double answer1 = (double) (answer / FP_SCALE);
 
   double temp = answer1 - (a1/b1);
   if (!(temp < 1 && temp > -1)) {
@@ -176,12 +152,12 @@ static inline fp_t FP_DIV(fp_t a, fp_t b) {
     return answer;
   }
 
-  double a2 = (double) (a / ((double) (1 << 16)));
-  double b2 = (double) (b / ((double) (1 << 16)));
-  double answer2 = (double) (answer / ((double) (1 << 16)));
+  double a2 = (double) (a / FP_SCALE);
+  double b2 = (double) (b / FP_SCALE);
+  double answer2 = (double) (answer / FP_SCALE);
 
   double temp2 = 1 - answer2 / (a2/b2);
-  if (!(temp2 < UNDERFLOW_MARGIN && temp > -UNDERFLOW_MARGIN)) {
+  if (!(temp2 < UNDERFLOW_MARGIN && temp2 > -UNDERFLOW_MARGIN)) {
     printf("\nFixed point underflow...attempted to divide %f by %f\n", a2, b2);
     printf("Expected %f but received %f\n", a2/b2, answer2);
   }
@@ -213,9 +189,9 @@ static inline fp_t FP_DIV(fp_t a, fp_t b) {
 #define mult4(a,b,c,d) (FP_MULT4((a), (b), (c), (d)))
 #define div(a,b) (FP_DIV((a),(b)))
 
-#define int_to_real(a) ((real_t) (a) << 16)
-#define real_to_db(a) ((double) ((a) / ((double) (1 << 16))))
-#define real_to_int(a) (((a) + CONST(.5)) >> 16)
+#define int_to_real(a) (FP_SATURATE((fp_wide_t) (a) * FP_ONE))
+#define real_to_db(a) ((double) ((a) / FP_SCALE))
+#define real_to_int(a) (((a) + CONST(.5)) >> FP_FRAC_BITS)
 
 #else
 
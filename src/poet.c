@@ -1,15 +1,75 @@
 #include <errno.h>
+#include <math.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
 #include "poet.h"
 #include "poet_constants.h"
+#include "poet_log.h"
 #include "poet_math.h"
+#ifdef POET_PROFILE
+#include "poet_profile.h"
+#endif
 
 #ifdef FIXED_POINT
+// smaller integer parts cannot hold the rates and periods of the controller
+#if !defined(POET_FP_64) && POET_FP_FRAC_BITS != 16
+#error "The controller supports the Q16.16 and Q32.32 fixed point formats"
+#endif
 #pragma message "Compiling fixed point version"
+#define LOG_REAL_FORMAT POET_LOG_REAL_FIXED
+#define LOG_REAL_FRAC_BITS FP_FRAC_BITS
+#define to_log_real(r, v) ((r).fp = (v))
 #else
 #pragma message "Compiling floating point version"
+#define LOG_REAL_FORMAT POET_LOG_REAL_DOUBLE
+#define LOG_REAL_FRAC_BITS 0
+#define to_log_real(r, v) ((r).d = (v))
+#endif
+
+// Vectorized n^2 translation on x86-64, the fixed point version is scalar only
+#if !defined(FIXED_POINT) && defined(__x86_64__)
+#define POET_N2_AVX
+#include <immintrin.h>
+#endif
+
+// Alignment in bytes and padding in elements of the SoA state arrays
+#define SOA_ALIGN 32
+#define SOA_PAD 8
+
+// Bound on the error of the rounded low state iterations in iterations, and
+// relative slack for the arithmetic of the costs, for pruning states in
+// POET_TRANSLATE_HULL
+#ifdef FIXED_POINT
+#define POET_HULL_ROUNDING 1.0
+#define POET_HULL_SLACK 1e-3
+#else
+#define POET_HULL_ROUNDING 0.5
+#define POET_HULL_SLACK 1e-9
+#endif
+
+// Runs of states kept to tell which states a sample's window ran in, enough
+// for the end of one schedule and a whole lower and upper phase of the next
+#define STATE_RUNS 4
+
+// keeps counters written by different threads on different cache lines
+#define INGEST_ALIGN 64
+
+#ifdef POET_PROFILE
+#define PROFILE_START(t) uint64_t t = poet_profile_cycles()
+#define PROFILE_END(state, counter, t) \
+  ((state)->profile.counter += poet_profile_cycles() - (t))
+#else
+#define PROFILE_START(t)
+#define PROFILE_END(state, counter, t)
 #endif
 
 /*
@@ -35,9 +95,130 @@ typedef struct {
   real_t uoo;
   real_t e;
   real_t eo;
+  real_t umin;
   real_t umax;
 } calc_xup_state;
 
+// Online estimate of one column (cost or speedup) of the control states
+typedef struct {
+  // one filter per state, NULL if the estimator is disabled, which estimates
+  // the correction of the configured value in priors
+  filter_state * filters;
+  real_t * priors;
+  // tracks changes that affect all states
+  filter_state base;
+  // scale of the samples, set by the first one
+  double ref;
+} state_estimator;
+
+// Iterations that ran in one state in a row
+typedef struct {
+  unsigned int id;
+  uint64_t iters;
+} state_run;
+
+// Best pair of states found by an n^2 translation kernel
+typedef struct {
+  real_t cost;
+  int lower_id;
+  int upper_id;
+  int low_state_iters;
+} n2_choice;
+
+// Evaluates every pair of an upper state in [first_upper, num_states) and a
+// lower state in [0, num_lower) of the SoA arrays
+typedef void (* n2_kernel_func) (const real_t * speedup,
+                                 const real_t * energy,
+                                 const unsigned int * ids,
+                                 unsigned int num_lower,
+                                 unsigned int first_upper,
+                                 unsigned int num_states,
+                                 real_t target_xup,
+                                 real_t r_period,
+                                 n2_choice * best);
+
+// Time and energy of a beat, joules < 0 if they could not be read
+typedef struct {
+  uint64_t ns;
+  double joules;
+} beat_record;
+
+/*
+ * A fixed amount of work due by a deadline. The mean and variance are of the
+ * rate of each period relative to the goal it had.
+ */
+typedef struct {
+  uint64_t total;
+  uint64_t done;
+  // total reported work already counted in done, with work reporting
+  uint64_t reported;
+  uint64_t end_ns;
+  double mean;
+  double var;
+  int has_stats;
+} deadline_state;
+
+/*
+ * Streaming quantile of the iteration latencies for a latency goal, from a
+ * log spaced histogram. Samples are added with a weight that grows by growth,
+ * so older samples decay without touching every bin.
+ */
+typedef struct {
+  double quantile;
+  double min;
+  double weight;
+  double growth;
+  double total;
+  double bins[LATENCY_BINS];
+} latency_state;
+
+/*
+ * Power cap controller. The filter estimates the power of a state with cost 1
+ * from the power drawn by a schedule of known average cost, and the energy and
+ * time of the samples since the last decision give that power.
+ */
+typedef struct {
+  real_t cap;
+  filter_state pfs;
+  // time averaged cost the cap allows, and of the schedule in use
+  real_t cost;
+  real_t applied_cost;
+  double energy;
+  double time;
+} power_cap_state;
+
+// Work reported by the threads assigned to a slot, usually just one
+typedef struct {
+  uint64_t pending;
+} __attribute__((aligned(INGEST_ALIGN))) ingest_slot;
+
+// Work reported from many threads, see poet_set_work_reporting()
+typedef struct {
+  ingest_slot * slots;
+  unsigned int num_slots;
+  unsigned int batch;
+  unsigned int timer_ms;
+
+  // published work and the total at which the next step runs
+  uint64_t total __attribute__((aligned(INGEST_ALIGN)));
+  uint64_t next_event;
+  int step_lock;
+
+  // only used by the thread holding step_lock
+  uint64_t start __attribute__((aligned(INGEST_ALIGN)));
+  uint64_t start_ns;
+  double start_joules;
+  uint64_t switch_at;
+  // total work when the dwell time and the runs were last counted
+  uint64_t dwell_total;
+
+  // steps on a timer instead of on period boundaries
+  pthread_t timer;
+  pthread_mutex_t timer_mutex;
+  pthread_cond_t timer_cond;
+  int timer_stop;
+} ingest_state;
+
 // Container for log records
 typedef struct {
   unsigned long tag;
@@ -50,11 +231,38 @@ typedef struct {
   int low_state_iters;
 } poet_record;
 
+// A control state, its time per iteration and its height above the hull in
+// energy per iteration
+typedef struct {
+  unsigned int id;
+  real_t speedup;
+  real_t energy;
+  double time;
+  double gap;
+} hull_state;
+
 struct poet_internal_state {
   // log file and log buffer
   FILE * log_file;
   unsigned int buffer_depth;
   poet_record * lb;
+  unsigned int lb_count;
+
+  // background log flusher, writes lb_flush while lb is filled
+  poet_log_flush_policy flush_policy;
+  unsigned int flush_value;
+  struct timespec flush_time;
+  poet_record * lb_flush;
+  unsigned int lb_flush_count;
+  int flusher_stop;
+  pthread_t flusher;
+  pthread_mutex_t flush_mutex;
+  pthread_cond_t flush_cond;
+
+  // memory mapped binary log
+  poet_log_header * log_map;
+  poet_log_record * log_records;
+  size_t log_map_size;
 
   real_t perf_goal;
 
@@ -66,10 +274,20 @@ struct poet_internal_state {
 
   // general
   int current_action;
+  int control_enabled;
+  int apply_enabled;
 
   int lower_id;
   int upper_id;
   unsigned int last_id;
+  // with poet_decide(), the state before last_id and the first iteration of
+  // last_id as reported by poet_report_applied()
+  unsigned int prev_id;
+  unsigned long applied_iter;
+  // the states the last sampled iterations ran in, newest at run_pos, to
+  // credit the estimators with the state behind each sample
+  state_run runs[STATE_RUNS];
+  unsigned int run_pos;
   int low_state_iters;
   unsigned int period;
 
@@ -77,6 +295,69 @@ struct poet_internal_state {
   poet_apply_func apply;
   poet_control_state_t * control_states;
   void * apply_states;
+
+  // translation
+  poet_translate_mode translate_mode;
+  // control states sorted by speedup as aligned arrays padded to SOA_PAD,
+  // energy is the cost per iteration (cost / speedup)
+  real_t * soa_speedup;
+  real_t * soa_energy;
+  unsigned int * soa_id;
+  int soa_dirty;
+  n2_kernel_func n2_kernel;
+  // lower convex hull in order of decreasing speedup, and all states in order
+  // of increasing height above it
+  unsigned int * hull;
+  hull_state * hull_states;
+  unsigned int hull_size;
+  unsigned int hull_pos;
+  int hull_dirty;
+  // costs of switching states, see poet_set_switch_costs()
+  poet_switch_cost_func switch_cost;
+  void * switch_cost_arg;
+  // power of a state with cost 1, estimated from the pwr samples
+  double base_power;
+  unsigned int min_dwell;
+  // iterations since the last switch, counts up to min_dwell
+  unsigned int dwell_iters;
+
+  // online estimation of state costs and speedups
+  state_estimator cost_est;
+  state_estimator speedup_est;
+
+  // asynchronous actuation
+  int async;
+  pthread_t actuator;
+  sem_t actuator_sem;
+  int actuator_stop;
+  // single slot mailbox, holds the pending state id or -1 if empty
+  int mailbox;
+  unsigned int requested_id;
+  unsigned int applied_id;
+  // set by the actuator when it drops a request because apply is disabled
+  int request_dropped;
+
+  // work reported from many threads, NULL if disabled
+  ingest_state * ingest;
+
+  // rate and power measured by poet_beat() over the last beat_window beats
+  beat_record * beats;
+  unsigned int beat_window;
+  unsigned int beat_pos;
+  unsigned long num_beats;
+  poet_energy_func energy;
+  void * energy_arg;
+
+  // latency goal, NULL for a rate goal
+  latency_state * latency;
+  // deadline, NULL for a rate goal
+  deadline_state * deadline;
+  // power cap, NULL for a rate goal
+  power_cap_state * power_cap;
+
+#ifdef POET_PROFILE
+  poet_profile profile;
+#endif
 };
 
 /*
@@ -85,6 +366,539 @@ struct poet_internal_state {
 ##################################################
 */
 
+static inline uint64_t get_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * (uint64_t) 1000000000 + ts.tv_nsec;
+}
+
+// Point on the (time, energy) plane used for building the convex hull
+typedef struct {
+  unsigned int id;
+  real_t time;
+  real_t energy;
+} hull_point;
+
+static int hull_point_cmp(const void * a, const void * b) {
+  const hull_point * pa = (const hull_point *) a;
+  const hull_point * pb = (const hull_point *) b;
+  if (pa->time < pb->time) {
+    return -1;
+  }
+  if (pa->time > pb->time) {
+    return 1;
+  }
+  if (pa->energy < pb->energy) {
+    return -1;
+  }
+  if (pa->energy > pb->energy) {
+    return 1;
+  }
+  return pa->id < pb->id ? -1 : (pa->id > pb->id ? 1 : 0);
+}
+
+static int hull_state_cmp(const void * a, const void * b) {
+  const hull_state * sa = (const hull_state *) a;
+  const hull_state * sb = (const hull_state *) b;
+  if (sa->gap < sb->gap) {
+    return -1;
+  }
+  if (sa->gap > sb->gap) {
+    return 1;
+  }
+  return sa->id < sb->id ? -1 : (sa->id > sb->id ? 1 : 0);
+}
+
+// Time per iteration of a hull vertex
+static inline double hull_time(const poet_state * state,
+                               unsigned int pos) {
+  return 1.0 / real_to_db(state->control_states[state->hull[pos]].speedup);
+}
+
+// Energy per iteration of a hull vertex
+static inline double hull_vertex_energy(const poet_state * state,
+                                        unsigned int pos) {
+  const poet_control_state_t * cs = &state->control_states[state->hull[pos]];
+  return real_to_db(div(cs->cost, cs->speedup));
+}
+
+// Slope of the hull between two vertices
+static double hull_slope(const poet_state * state,
+                         unsigned int lo,
+                         unsigned int hi) {
+  double t_lo = hull_time(state, lo);
+  double t_hi = hull_time(state, hi);
+  if (t_hi <= t_lo) {
+    return 0;
+  }
+  return (hull_vertex_energy(state, hi) - hull_vertex_energy(state, lo)) /
+         (t_hi - t_lo);
+}
+
+// Energy per iteration of the hull between two vertices at a time
+static double hull_energy(const poet_state * state,
+                          unsigned int lo,
+                          unsigned int hi,
+                          double time) {
+  return hull_vertex_energy(state, lo) +
+         hull_slope(state, lo, hi) * (time - hull_time(state, lo));
+}
+
+/*
+ * Builds the lower convex hull of the control states on the plane of time per
+ * iteration (1 / speedup) and energy per iteration (cost / speedup).
+ * Any schedule between two states is a point on the line joining them, so the
+ * cheapest schedule for a target speedup always lies on a segment of this
+ * hull. Dominated states lie above the hull and are dropped.
+ * The hull is stored in order of decreasing speedup. Rounding the low state
+ * iterations of short periods can favor states close above the hull, so all
+ * states are also kept in order of their height above it.
+ */
+static int build_hull(poet_state * state) {
+  unsigned int i;
+  unsigned int n = 0;
+  unsigned int lo;
+  unsigned int hi;
+  unsigned int mid;
+  hull_point * pts;
+  hull_point * h;
+  hull_state * hs;
+
+  pts = malloc(state->num_system_states * sizeof(hull_point));
+  if (pts == NULL) {
+    return -1;
+  }
+  for (i = 0; i < state->num_system_states; i++) {
+    pts[i].id = i;
+    pts[i].time = div(R_ONE, state->control_states[i].speedup);
+    pts[i].energy = div(state->control_states[i].cost,
+                        state->control_states[i].speedup);
+  }
+  qsort(pts, state->num_system_states, sizeof(hull_point), hull_point_cmp);
+
+  // Andrew's monotone chain, lower half only - reuse pts as the stack
+  h = pts;
+  for (i = 0; i < state->num_system_states; i++) {
+    // states with equal speedup: the first one sorted is the cheapest
+    if (n > 0 && pts[i].time <= h[n - 1].time && pts[i].time >= h[n - 1].time) {
+      continue;
+    }
+    // drop the top of the stack while it is on or above the new segment, in
+    // double since the products of small differences underflow fixed point
+    while (n >= 2 &&
+           real_to_db(h[n - 1].energy - h[n - 2].energy) *
+           real_to_db(pts[i].time - h[n - 2].time) >=
+           real_to_db(pts[i].energy - h[n - 2].energy) *
+           real_to_db(h[n - 1].time - h[n - 2].time)) {
+      n--;
+    }
+    h[n++] = pts[i];
+  }
+
+  for (i = 0; i < n; i++) {
+    state->hull[i] = h[i].id;
+  }
+  state->hull_size = n;
+  state->hull_pos = 0;
+  free(pts);
+
+  // height of every state above the hull segment below it
+  for (i = 0; i < state->num_system_states; i++) {
+    hs = &state->hull_states[i];
+    hs->id = i;
+    hs->speedup = state->control_states[i].speedup;
+    hs->energy = div(state->control_states[i].cost, hs->speedup);
+    hs->time = 1.0 / real_to_db(hs->speedup);
+    lo = 0;
+    hi = n - 1;
+    while (hi - lo > 1) {
+      mid = lo + (hi - lo) / 2;
+      if (hull_time(state, mid) <= hs->time) {
+        lo = mid;
+      } else {
+        hi = mid;
+      }
+    }
+    hs->gap = real_to_db(hs->energy) - hull_energy(state, lo, hi, hs->time);
+  }
+  qsort(state->hull_states, state->num_system_states, sizeof(hull_state),
+        hull_state_cmp);
+  return 0;
+}
+
+// Recalculate the minimum and maximum speedups, neither is below one
+static void update_speedup_range(poet_state * state) {
+  unsigned int i;
+  state->scs.umin = state->control_states[0].speedup;
+  state->scs.umax = R_ONE;
+  for (i = 0; i < state->num_system_states; i++) {
+    if (state->control_states[i].speedup < state->scs.umin) {
+      state->scs.umin = state->control_states[i].speedup;
+    }
+    if (state->control_states[i].speedup >= state->scs.umax) {
+      state->scs.umax = state->control_states[i].speedup;
+    }
+  }
+  if (state->scs.umin < R_ONE) {
+    state->scs.umin = R_ONE;
+  }
+}
+
+// Forgets the states of the sampled iterations
+static void reset_runs(poet_state * state) {
+  unsigned int i;
+  for (i = 0; i < STATE_RUNS; i++) {
+    state->runs[i].id = state->last_id;
+    state->runs[i].iters = 0;
+  }
+  state->run_pos = 0;
+}
+
+// Records that the next iters sampled iterations ran in state id
+static inline void record_run(poet_state * state,
+                              unsigned int id,
+                              uint64_t iters) {
+  if (state->runs[state->run_pos].id != id) {
+    state->run_pos = (state->run_pos + 1) % STATE_RUNS;
+    state->runs[state->run_pos].id = id;
+    state->runs[state->run_pos].iters = 0;
+  }
+  state->runs[state->run_pos].iters += iters;
+}
+
+static int control_state_speedup_cmp(const void * a, const void * b) {
+  const poet_control_state_t * sa = (const poet_control_state_t *) a;
+  const poet_control_state_t * sb = (const poet_control_state_t *) b;
+  if (sa->speedup < sb->speedup) {
+    return -1;
+  }
+  if (sa->speedup > sb->speedup) {
+    return 1;
+  }
+  return sa->id < sb->id ? -1 : (sa->id > sb->id ? 1 : 0);
+}
+
+// Fill the SoA arrays from the control states
+static int build_soa(poet_state * state) {
+  unsigned int n = state->num_system_states;
+  unsigned int i;
+  poet_control_state_t * sorted = malloc(n * sizeof(poet_control_state_t));
+  if (sorted == NULL) {
+    return -1;
+  }
+  for (i = 0; i < n; i++) {
+    sorted[i].id = i;
+    sorted[i].speedup = state->control_states[i].speedup;
+    sorted[i].cost = state->control_states[i].cost;
+  }
+  qsort(sorted, n, sizeof(poet_control_state_t), control_state_speedup_cmp);
+  for (i = 0; i < n; i++) {
+    state->soa_speedup[i] = sorted[i].speedup;
+    state->soa_energy[i] = div(sorted[i].cost, sorted[i].speedup);
+    state->soa_id[i] = sorted[i].id;
+  }
+  free(sorted);
+  return 0;
+}
+
+static int soa_init(poet_state * state) {
+  unsigned int size = (state->num_system_states + SOA_PAD - 1) / SOA_PAD * SOA_PAD;
+  unsigned int i;
+  void * speedup = NULL;
+  void * energy = NULL;
+  void * ids = NULL;
+
+  if (posix_memalign(&speedup, SOA_ALIGN, size * sizeof(real_t)) ||
+      posix_memalign(&energy, SOA_ALIGN, size * sizeof(real_t)) ||
+      posix_memalign(&ids, SOA_ALIGN, size * sizeof(unsigned int))) {
+    free(speedup);
+    free(energy);
+    errno = ENOMEM;
+    return -1;
+  }
+  state->soa_speedup = speedup;
+  state->soa_energy = energy;
+  state->soa_id = ids;
+  // kernels mask the padding by index, just keep it finite
+  for (i = state->num_system_states; i < size; i++) {
+    state->soa_speedup[i] = R_ONE;
+    state->soa_energy[i] = R_ZERO;
+    state->soa_id[i] = i;
+  }
+  state->soa_dirty = 0;
+  return build_soa(state);
+}
+
+/*
+ * Fraction of the iterations to spend in the lower state so that the combined
+ * speedup is the target speedup
+ */
+static inline real_t time_division(real_t lower_xup,
+                                   real_t upper_xup,
+                                   real_t target_xup) {
+  // If lower rate and upper rate are equal, no need for time division
+  if (upper_xup <= lower_xup && upper_xup >= lower_xup) {
+    return R_ZERO;
+  }
+  // This equation ensures the time period of the combined rates is equal
+  // to the time period of the target rate
+  // 1 / Target rate = X / (lower rate) + (1 - X) / (upper rate)
+  // Solve for X
+  return div(mult(upper_xup, lower_xup) - mult(target_xup, lower_xup),
+             mult(upper_xup, target_xup) - mult(target_xup, lower_xup));
+}
+
+// Whether the pair (upper, lower) comes before the best pair in id order
+static inline int n2_ids_before(unsigned int upper_id,
+                                unsigned int lower_id,
+                                const n2_choice * best) {
+  return best->upper_id < 0 || upper_id < (unsigned int) best->upper_id ||
+         (upper_id == (unsigned int) best->upper_id &&
+          lower_id < (unsigned int) best->lower_id);
+}
+
+/*
+ * Round the low state iterations of a pair of states and compute the cost of
+ * the period. Of the pairs with the lowest cost, the one with the lowest upper
+ * and then lower state ids wins.
+ */
+static inline void n2_score(real_t lower_speedup,
+                            real_t lower_energy,
+                            unsigned int lower_id,
+                            real_t upper_speedup,
+                            real_t upper_energy,
+                            unsigned int upper_id,
+                            real_t target_xup,
+                            real_t r_period,
+                            n2_choice * best) {
+  int low_state_iters = real_to_int(mult(r_period,
+                                         time_division(lower_speedup,
+                                                       upper_speedup,
+                                                       target_xup)));
+  real_t r_low_state_iters = int_to_real(low_state_iters);
+  real_t cost = mult(r_low_state_iters, lower_energy) +
+                mult(r_period - r_low_state_iters, upper_energy);
+  if (cost < best->cost ||
+      (cost <= best->cost && n2_ids_before(upper_id, lower_id, best))) {
+    best->cost = cost;
+    best->lower_id = lower_id;
+    best->upper_id = upper_id;
+    best->low_state_iters = low_state_iters;
+  }
+}
+
+/*
+ * Scalar n^2 kernel: scores every pair of an upper state that is fast enough
+ * and a lower state that is slow enough.
+ */
+static void translate_n2_scalar(const real_t * speedup,
+                                const real_t * energy,
+                                const unsigned int * ids,
+                                unsigned int num_lower,
+                                unsigned int first_upper,
+                                unsigned int num_states,
+                                real_t target_xup,
+                                real_t r_period,
+                                n2_choice * best) {
+  // work on a copy, stores through best could alias the arrays
+  n2_choice b = *best;
+  unsigned int i;
+  unsigned int j;
+
+  for (i = first_upper; i < num_states; i++) {
+    for (j = 0; j < num_lower; j++) {
+      n2_score(speedup[j], energy[j], ids[j], speedup[i], energy[i], ids[i],
+               target_xup, r_period, &b);
+    }
+  }
+  *best = b;
+}
+
+#ifdef POET_N2_AVX
+/*
+ * Merge the per-lane best lower states for one upper state, ties go to the
+ * lowest lower state id
+ */
+static inline void n2_reduce(const double * lane_cost,
+                             const double * lane_id,
+                             const double * lane_low,
+                             unsigned int lanes,
+                             unsigned int upper_id,
+                             n2_choice * best) {
+  unsigned int k;
+  unsigned int m = 0;
+  for (k = 1; k < lanes; k++) {
+    if (lane_cost[k] < lane_cost[m] ||
+        (lane_cost[k] <= lane_cost[m] && lane_id[k] < lane_id[m])) {
+      m = k;
+    }
+  }
+  if (lane_cost[m] < best->cost ||
+      (lane_cost[m] <= best->cost &&
+       n2_ids_before(upper_id, (unsigned int) lane_id[m], best))) {
+    best->cost = lane_cost[m];
+    best->lower_id = (int) lane_id[m];
+    best->upper_id = upper_id;
+    best->low_state_iters = (int) lane_low[m];
+  }
+}
+
+// mask ? a : b with bitwise operations, which GCC keeps as vector code
+__attribute__((target("avx"), always_inline))
+static inline __m256d avx_select(__m256d mask,
+                                 __m256d a,
+                                 __m256d b) {
+  return _mm256_or_pd(_mm256_and_pd(mask, a), _mm256_andnot_pd(mask, b));
+}
+
+// Evaluate four lower states starting at j against the upper state
+__attribute__((target("avx"), always_inline))
+static inline void avx_n2_step(const real_t * speedup,
+                               const real_t * energy,
+                               const unsigned int * ids,
+                               unsigned int j,
+                               __m256d vu,
+                               __m256d veu,
+                               __m256d vut,
+                               __m256d vt,
+                               __m256d vp,
+                               __m256d vj,
+                               __m256d vn,
+                               __m256d * best_cost,
+                               __m256d * best_id,
+                               __m256d * best_low) {
+  __m256d vl = _mm256_load_pd(&speedup[j]);
+  __m256d vel = _mm256_load_pd(&energy[j]);
+  // ids are below 2^31, so the signed conversion is exact
+  __m256d vid = _mm256_cvtepi32_pd(_mm_load_si128((const __m128i *) &ids[j]));
+  __m256d vtl = _mm256_mul_pd(vt, vl);
+  __m256d x = _mm256_div_pd(_mm256_sub_pd(_mm256_mul_pd(vu, vl), vtl),
+                            _mm256_sub_pd(vut, vtl));
+  x = _mm256_andnot_pd(_mm256_cmp_pd(vu, vl, _CMP_EQ_OQ), x);
+  __m256d low = _mm256_floor_pd(_mm256_add_pd(_mm256_mul_pd(vp, x),
+                                              _mm256_set1_pd(0.5)));
+  __m256d cost = _mm256_add_pd(_mm256_mul_pd(low, vel),
+                               _mm256_mul_pd(_mm256_sub_pd(vp, low), veu));
+  __m256d better = _mm256_or_pd(
+    _mm256_cmp_pd(cost, *best_cost, _CMP_LT_OQ),
+    _mm256_and_pd(_mm256_cmp_pd(cost, *best_cost, _CMP_LE_OQ),
+                  _mm256_cmp_pd(vid, *best_id, _CMP_LT_OQ)));
+  better = _mm256_and_pd(better, _mm256_cmp_pd(vj, vn, _CMP_LT_OQ));
+  *best_cost = avx_select(better, cost, *best_cost);
+  *best_id = avx_select(better, vid, *best_id);
+  *best_low = avx_select(better, low, *best_low);
+}
+
+/*
+ * AVX kernel, evaluates eight lower states at a time with the same operations
+ * as the scalar kernel. Two sets of per-lane bests keep the compare and select
+ * chains short.
+ */
+__attribute__((target("avx")))
+static void translate_n2_avx(const real_t * speedup,
+                             const real_t * energy,
+                             const unsigned int * ids,
+                             unsigned int num_lower,
+                             unsigned int first_upper,
+                             unsigned int num_states,
+                             real_t target_xup,
+                             real_t r_period,
+                             n2_choice * best) {
+  const __m256d vt = _mm256_set1_pd(target_xup);
+  const __m256d vp = _mm256_set1_pd(r_period);
+  const __m256d vn = _mm256_set1_pd(num_lower);
+  const __m256d step = _mm256_set1_pd(SOA_PAD);
+  double lane_cost[SOA_PAD];
+  double lane_id[SOA_PAD];
+  double lane_low[SOA_PAD];
+  unsigned int i;
+  unsigned int j;
+
+  for (i = first_upper; i < num_states; i++) {
+    __m256d vu = _mm256_set1_pd(speedup[i]);
+    __m256d veu = _mm256_set1_pd(energy[i]);
+    __m256d vut = _mm256_mul_pd(vu, vt);
+    __m256d vj0 = _mm256_set_pd(3.0, 2.0, 1.0, 0.0);
+    __m256d vj1 = _mm256_set_pd(7.0, 6.0, 5.0, 4.0);
+    __m256d best_cost0 = _mm256_set1_pd(HUGE_VAL);
+    __m256d best_cost1 = best_cost0;
+    __m256d best_id0 = _mm256_setzero_pd();
+    __m256d best_id1 = best_id0;
+    __m256d best_low0 = best_id0;
+    __m256d best_low1 = best_id0;
+    for (j = 0; j < num_lower; j += SOA_PAD) {
+      avx_n2_step(speedup, energy, ids, j, vu, veu, vut, vt, vp, vj0, vn,
+                  &best_cost0, &best_id0, &best_low0);
+      avx_n2_step(speedup, energy, ids, j + 4, vu, veu, vut, vt, vp, vj1, vn,
+                  &best_cost1, &best_id1, &best_low1);
+      vj0 = _mm256_add_pd(vj0, step);
+      vj1 = _mm256_add_pd(vj1, step);
+    }
+    _mm256_storeu_pd(lane_cost, best_cost0);
+    _mm256_storeu_pd(lane_cost + 4, best_cost1);
+    _mm256_storeu_pd(lane_id, best_id0);
+    _mm256_storeu_pd(lane_id + 4, best_id1);
+    _mm256_storeu_pd(lane_low, best_low0);
+    _mm256_storeu_pd(lane_low + 4, best_low1);
+    n2_reduce(lane_cost, lane_id, lane_low, SOA_PAD, ids[i], best);
+  }
+}
+#endif
+
+static void init_filter(filter_state * f,
+                        real_t x_hat) {
+  f->x_hat_minus = X_HAT_MINUS_START;
+  f->x_hat = x_hat;
+  f->p_minus = P_MINUS_START;
+  f->h = H_START;
+  f->k = K_START;
+  f->p = P_START;
+}
+
+// Start estimating a column, the configured values are the initial estimates
+// and the corrections start at 1
+static int estimator_init(state_estimator * est,
+                          const poet_control_state_t * cs,
+                          unsigned int num_states,
+                          size_t column) {
+  unsigned int i;
+
+  est->filters = malloc(num_states * sizeof(filter_state));
+  est->priors = malloc(num_states * sizeof(real_t));
+  if (est->filters == NULL || est->priors == NULL) {
+    free(est->filters);
+    free(est->priors);
+    est->filters = NULL;
+    return -1;
+  }
+  for (i = 0; i < num_states; i++) {
+    est->priors[i] = *(const real_t *) ((const char *) &cs[i] + column);
+    init_filter(&est->filters[i], R_ONE);
+  }
+  init_filter(&est->base, R_ONE);
+  est->ref = 0;
+  return 0;
+}
+
+// Stop estimating a column and restore the configured values
+static void estimator_restore(state_estimator * est,
+                              poet_control_state_t * cs,
+                              unsigned int num_states,
+                              size_t column) {
+  unsigned int i;
+  for (i = 0; i < num_states; i++) {
+    *(real_t *) ((char *) &cs[i] + column) = est->priors[i];
+  }
+}
+
+static void estimator_destroy(state_estimator * est) {
+  if (est->filters != NULL) {
+    free(est->filters);
+    free(est->priors);
+    est->filters = NULL;
+  }
+}
+
 // Allocates and initializes a new poet state variable
 poet_state * poet_init(real_t perf_goal,
                        unsigned int num_system_states,
@@ -95,8 +909,6 @@ poet_state * poet_init(real_t perf_goal,
                        unsigned int period,
                        unsigned int buffer_depth,
                        const char * log_filename) {
-  unsigned int i;
-
   if (perf_goal <= R_ZERO || num_system_states == 0 || control_states == NULL || period == 0 ||
       (buffer_depth == 0 && log_filename != NULL)) {
     errno = EINVAL;
@@ -117,6 +929,9 @@ poet_state * poet_init(real_t perf_goal,
 
   // Allocate memory for log buffer
   state->buffer_depth = buffer_depth;
+  state->lb_count = 0;
+  state->flush_policy = POET_LOG_FLUSH_SYNC;
+  state->lb_flush = NULL;
   if (buffer_depth > 0) {
     state->lb = malloc(buffer_depth * sizeof(poet_record));
     if (state->lb == NULL) {
@@ -127,6 +942,8 @@ poet_state * poet_init(real_t perf_goal,
     state->lb = NULL;
   }
 
+  state->log_map = NULL;
+
   // Open log file
   if (log_filename == NULL) {
     state->log_file = NULL;
@@ -154,11 +971,25 @@ poet_state * poet_init(real_t perf_goal,
 
   // initialize general poet variables
   state->current_action = CURRENT_ACTION_START;
+  state->control_enabled = getenv(POET_DISABLE_CONTROL) == NULL;
+  state->apply_enabled = getenv(POET_DISABLE_APPLY) == NULL;
   state->num_system_states = num_system_states;
   state->apply = apply;
-  state->control_states = control_states;
   state->apply_states = apply_states; // allowed to be NULL
 
+  // Keep a private copy of the control states, estimators may modify it
+  state->control_states = malloc(num_system_states * sizeof(poet_control_state_t));
+  if (state->control_states == NULL) {
+    if (state->log_file != NULL) {
+      fclose(state->log_file);
+    }
+    free(state->lb);
+    free(state);
+    return NULL;
+  }
+  memcpy(state->control_states, control_states,
+         num_system_states * sizeof(poet_control_state_t));
+
   state->upper_id = -1;
   state->lower_id = -1;
 
@@ -167,6 +998,9 @@ poet_state * poet_init(real_t perf_goal,
     // default to the highest state id
     state->last_id = state->num_system_states - 1;
   }
+  state->prev_id = state->last_id;
+  state->applied_iter = 0;
+  reset_runs(state);
 
   // initialize variables used for calculating speedup
   state->scs.u = state->control_states[state->last_id].speedup;
@@ -177,71 +1011,725 @@ poet_state * poet_init(real_t perf_goal,
 
   state->low_state_iters = 0;
 
-  // Calculate max_speedup
-  state->scs.umax = R_ONE;
-  for (i = 0; i < state->num_system_states; i++) {
-    if (state->control_states[i].speedup >= state->scs.umax) {
-      state->scs.umax = state->control_states[i].speedup;
-    }
+  // Calculate the minimum and maximum speedups
+  update_speedup_range(state);
+
+  state->cost_est.filters = NULL;
+  state->speedup_est.filters = NULL;
+  state->hull_dirty = 0;
+
+  state->switch_cost = NULL;
+  state->switch_cost_arg = NULL;
+  state->base_power = 0;
+  state->min_dwell = 0;
+  state->dwell_iters = 0;
+
+  state->async = 0;
+  state->mailbox = -1;
+  state->requested_id = state->last_id;
+  state->applied_id = state->last_id;
+
+  state->ingest = NULL;
+
+  state->beats = NULL;
+  state->energy = NULL;
+  state->energy_arg = NULL;
+
+  state->latency = NULL;
+  state->deadline = NULL;
+  state->power_cap = NULL;
+
+#ifdef POET_PROFILE
+  poet_reset_profile(state);
+#endif
+
+  // Precompute the convex hull used by POET_TRANSLATE_HULL
+  state->translate_mode = POET_TRANSLATE_N2;
+  state->soa_speedup = NULL;
+  state->soa_energy = NULL;
+  state->soa_id = NULL;
+  state->hull = malloc(num_system_states * sizeof(unsigned int));
+  state->hull_states = malloc(num_system_states * sizeof(hull_state));
+  if (state->hull == NULL || state->hull_states == NULL || build_hull(state) ||
+      soa_init(state) ||
+      poet_set_beat_window(state, period)) {
+    poet_destroy(state);
+    return NULL;
+  }
+
+  // Pick the n^2 translation kernel
+  state->n2_kernel = translate_n2_scalar;
+#ifdef POET_N2_AVX
+  if (getenv(POET_DISABLE_SIMD) == NULL && __builtin_cpu_supports("avx")) {
+    state->n2_kernel = translate_n2_avx;
   }
+#endif
 
   return state;
 }
 
+static void write_records(FILE * log_file,
+                          const poet_record * lb,
+                          unsigned int count) {
+  unsigned int i;
+  for (i = 0; i < count; i++) {
+    fprintf(log_file, "%16lu %16f %16f %16f %16f %16f %16f %16f %16f %16f %16f %16d %16d %16d\n",
+            lb[i].tag,
+            real_to_db(lb[i].act_rate),
+            real_to_db(lb[i].pfs.x_hat_minus),
+            real_to_db(lb[i].pfs.x_hat),
+            real_to_db(lb[i].pfs.p_minus),
+            real_to_db(lb[i].pfs.h),
+            real_to_db(lb[i].pfs.k),
+            real_to_db(lb[i].pfs.p),
+            real_to_db(lb[i].scs.u),
+            real_to_db(lb[i].scs.e),
+            real_to_db(lb[i].workload),
+            lb[i].lower_id,
+            lb[i].upper_id,
+            lb[i].low_state_iters);
+  }
+}
+
+// Writes batches handed over by the application thread
+static void * flusher_thread(void * arg) {
+  poet_state * state = (poet_state *) arg;
+
+  pthread_mutex_lock(&state->flush_mutex);
+  while (1) {
+    while (state->lb_flush_count == 0 && !state->flusher_stop) {
+      pthread_cond_wait(&state->flush_cond, &state->flush_mutex);
+    }
+    if (state->lb_flush_count == 0) {
+      break;
+    }
+    pthread_mutex_unlock(&state->flush_mutex);
+    write_records(state->log_file, state->lb_flush, state->lb_flush_count);
+    fflush(state->log_file);
+    pthread_mutex_lock(&state->flush_mutex);
+    state->lb_flush_count = 0;
+    pthread_cond_broadcast(&state->flush_cond);
+  }
+  pthread_mutex_unlock(&state->flush_mutex);
+
+  return NULL;
+}
+
+// Swap the log buffers and wake the flusher, waits if it is still busy
+static void hand_off_records(poet_state * state) {
+  poet_record * tmp;
+
+  pthread_mutex_lock(&state->flush_mutex);
+  while (state->lb_flush_count > 0) {
+    pthread_cond_wait(&state->flush_cond, &state->flush_mutex);
+  }
+  tmp = state->lb_flush;
+  state->lb_flush = state->lb;
+  state->lb = tmp;
+  state->lb_flush_count = state->lb_count;
+  state->lb_count = 0;
+  pthread_cond_broadcast(&state->flush_cond);
+  pthread_mutex_unlock(&state->flush_mutex);
+  clock_gettime(CLOCK_MONOTONIC, &state->flush_time);
+}
+
+// Change how log records are written
+int poet_set_log_flush_policy(poet_state * state,
+                              poet_log_flush_policy policy,
+                              unsigned int value) {
+  int err;
+
+  if (state == NULL ||
+      (policy != POET_LOG_FLUSH_SYNC && state->log_file == NULL) ||
+      (policy == POET_LOG_FLUSH_RECORDS && (value == 0 || value > state->buffer_depth)) ||
+      (policy == POET_LOG_FLUSH_TIME && value == 0) ||
+      policy < POET_LOG_FLUSH_SYNC || policy > POET_LOG_FLUSH_DESTROY) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (state->flush_policy != POET_LOG_FLUSH_SYNC && policy == POET_LOG_FLUSH_SYNC) {
+    // write pending records and stop the flusher
+    if (state->lb_count > 0) {
+      hand_off_records(state);
+    }
+    pthread_mutex_lock(&state->flush_mutex);
+    state->flusher_stop = 1;
+    pthread_cond_broadcast(&state->flush_cond);
+    pthread_mutex_unlock(&state->flush_mutex);
+    pthread_join(state->flusher, NULL);
+    pthread_cond_destroy(&state->flush_cond);
+    pthread_mutex_destroy(&state->flush_mutex);
+    free(state->lb_flush);
+    state->lb_flush = NULL;
+  } else if (state->flush_policy == POET_LOG_FLUSH_SYNC && policy != POET_LOG_FLUSH_SYNC) {
+    state->lb_flush = malloc(state->buffer_depth * sizeof(poet_record));
+    if (state->lb_flush == NULL) {
+      return -1;
+    }
+    state->lb_flush_count = 0;
+    state->flusher_stop = 0;
+    pthread_mutex_init(&state->flush_mutex, NULL);
+    pthread_cond_init(&state->flush_cond, NULL);
+    err = pthread_create(&state->flusher, NULL, flusher_thread, state);
+    if (err) {
+      pthread_cond_destroy(&state->flush_cond);
+      pthread_mutex_destroy(&state->flush_mutex);
+      free(state->lb_flush);
+      state->lb_flush = NULL;
+      errno = err;
+      return -1;
+    }
+  }
+
+  state->flush_policy = policy;
+  state->flush_value = value;
+  clock_gettime(CLOCK_MONOTONIC, &state->flush_time);
+  return 0;
+}
+
 // Destroys poet state variable
 void poet_destroy(poet_state * state) {
   if (state != NULL) {
+    poet_set_work_reporting(state, 0, 0, 0);
+    poet_set_apply_async(state, 0);
+    poet_set_binary_log(state, NULL, 0);
     if (state->log_file != NULL) {
+      // write everything still pending
+      poet_set_log_flush_policy(state, POET_LOG_FLUSH_SYNC, 0);
+      write_records(state->log_file, state->lb, state->lb_count);
       fclose(state->log_file);
     }
     free(state->lb);
+    free(state->hull);
+    free(state->hull_states);
+    free(state->beats);
+    free(state->latency);
+    free(state->deadline);
+    free(state->power_cap);
+    free(state->soa_speedup);
+    free(state->soa_energy);
+    free(state->soa_id);
+    estimator_destroy(&state->cost_est);
+    estimator_destroy(&state->speedup_est);
+    free(state->control_states);
     free(state);
   }
 }
 
-// Change the performance goal at runtime.
-void poet_set_performance_goal(poet_state * state,
-                               real_t perf_goal) {
-  if (state != NULL && perf_goal > R_ZERO) {
-    state->perf_goal = perf_goal;
+// Wait until no thread is running a work reporting step, and keep new ones
+// from starting
+static inline void lock_steps(poet_state * state) {
+  if (state->ingest != NULL) {
+    while (__atomic_exchange_n(&state->ingest->step_lock, 1, __ATOMIC_ACQUIRE)) {
+      sched_yield();
+    }
+  }
+}
+
+static inline void unlock_steps(poet_state * state) {
+  if (state->ingest != NULL) {
+    __atomic_store_n(&state->ingest->step_lock, 0, __ATOMIC_RELEASE);
+  }
+}
+
+// Change the performance goal at runtime.
+void poet_set_performance_goal(poet_state * state,
+                               real_t perf_goal) {
+  if (state != NULL && perf_goal > R_ZERO) {
+    lock_steps(state);
+    state->perf_goal = perf_goal;
+    free(state->latency);
+    state->latency = NULL;
+    free(state->deadline);
+    state->deadline = NULL;
+    free(state->power_cap);
+    state->power_cap = NULL;
+    unlock_steps(state);
+  }
+}
+
+// Enable or disable the decision engine at runtime.
+void poet_set_control_enabled(poet_state * state,
+                              int enabled) {
+  if (state != NULL) {
+    __atomic_store_n(&state->control_enabled, enabled != 0, __ATOMIC_RELAXED);
+  }
+}
+
+// Enable or disable calls to the apply function at runtime.
+void poet_set_apply_enabled(poet_state * state,
+                            int enabled) {
+  if (state != NULL) {
+    __atomic_store_n(&state->apply_enabled, enabled != 0, __ATOMIC_RELAXED);
+  }
+}
+
+// Enable or disable online estimation of state costs
+int poet_set_cost_estimation(poet_state * state,
+                             int enabled) {
+  if (state == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (enabled && state->cost_est.filters == NULL) {
+    return estimator_init(&state->cost_est, state->control_states,
+                          state->num_system_states,
+                          offsetof(poet_control_state_t, cost));
+  } else if (!enabled && state->cost_est.filters != NULL) {
+    estimator_restore(&state->cost_est, state->control_states,
+                      state->num_system_states,
+                      offsetof(poet_control_state_t, cost));
+    estimator_destroy(&state->cost_est);
+    state->hull_dirty = 1;
+    state->soa_dirty = 1;
+  }
+
+  return 0;
+}
+
+// Enable or disable online estimation of state speedups
+int poet_set_speedup_estimation(poet_state * state,
+                                int enabled) {
+  if (state == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (enabled && state->speedup_est.filters == NULL) {
+    return estimator_init(&state->speedup_est, state->control_states,
+                          state->num_system_states,
+                          offsetof(poet_control_state_t, speedup));
+  } else if (!enabled && state->speedup_est.filters != NULL) {
+    estimator_restore(&state->speedup_est, state->control_states,
+                      state->num_system_states,
+                      offsetof(poet_control_state_t, speedup));
+    estimator_destroy(&state->speedup_est);
+    update_speedup_range(state);
+    state->hull_dirty = 1;
+    state->soa_dirty = 1;
+  }
+
+  return 0;
+}
+
+// Copy the control states with the estimated costs and speedups
+int poet_get_control_states(const poet_state * state,
+                            poet_control_state_t * control_states,
+                            unsigned int num_system_states) {
+  if (state == NULL || control_states == NULL ||
+      num_system_states != state->num_system_states) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  memcpy(control_states, state->control_states,
+         num_system_states * sizeof(poet_control_state_t));
+  return 0;
+}
+
+// Change the translation algorithm at runtime.
+void poet_set_translate_mode(poet_state * state,
+                             poet_translate_mode mode) {
+  if (state != NULL &&
+      (mode == POET_TRANSLATE_N2 || mode == POET_TRANSLATE_HULL)) {
+    state->translate_mode = mode;
+  }
+}
+
+// Set the costs of switching states
+void poet_set_switch_costs(poet_state * state,
+                           poet_switch_cost_func switch_cost,
+                           void * arg) {
+  if (state != NULL) {
+    state->switch_cost = switch_cost;
+    state->switch_cost_arg = arg;
+    state->base_power = 0;
+  }
+}
+
+// Set the minimum iterations between state switches
+void poet_set_min_dwell(poet_state * state,
+                        unsigned int iterations) {
+  if (state != NULL) {
+    state->min_dwell = iterations;
+    state->dwell_iters = iterations;
+  }
+}
+
+// Id of the state in cs with the speedup closest to the target, the cheapest
+// one if several are equally close
+static unsigned int nearest_state(const poet_control_state_t * cs,
+                                  unsigned int num_states,
+                                  real_t speedup) {
+  unsigned int best = 0;
+  unsigned int i;
+  real_t best_d = R_ZERO;
+  real_t d;
+  for (i = 0; i < num_states; i++) {
+    d = cs[i].speedup > speedup ? cs[i].speedup - speedup :
+                                  speedup - cs[i].speedup;
+    if (i == 0 || d < best_d || (d <= best_d && cs[i].cost < cs[best].cost)) {
+      best = i;
+      best_d = d;
+    }
+  }
+  return best;
+}
+
+// Replace the control states at runtime
+int poet_update_states(poet_state * state,
+                       unsigned int num_system_states,
+                       const poet_control_state_t * control_states,
+                       void * apply_states) {
+  poet_control_state_t * old_states;
+  unsigned int old_num_states;
+  unsigned int * old_hull;
+  hull_state * old_hull_states;
+  real_t * old_soa_speedup;
+  real_t * old_soa_energy;
+  unsigned int * old_soa_id;
+  state_estimator cost_est;
+  state_estimator speedup_est;
+  poet_control_state_t * cs;
+  unsigned int * hull;
+  hull_state * hull_states;
+  int async;
+  int ret = 0;
+
+  if (state == NULL || num_system_states == 0 || control_states == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  // everything that can fail is allocated before touching the controller
+  cost_est.filters = NULL;
+  speedup_est.filters = NULL;
+  cs = malloc(num_system_states * sizeof(poet_control_state_t));
+  hull = malloc(num_system_states * sizeof(unsigned int));
+  hull_states = malloc(num_system_states * sizeof(hull_state));
+  if (cs == NULL || hull == NULL || hull_states == NULL) {
+    goto fail;
+  }
+  memcpy(cs, control_states, num_system_states * sizeof(poet_control_state_t));
+  if ((state->cost_est.filters != NULL &&
+       estimator_init(&cost_est, cs, num_system_states,
+                      offsetof(poet_control_state_t, cost))) ||
+      (state->speedup_est.filters != NULL &&
+       estimator_init(&speedup_est, cs, num_system_states,
+                      offsetof(poet_control_state_t, speedup)))) {
+    goto fail;
+  }
+
+  // wait for the actuator and work reporting threads to leave the old table
+  async = state->async;
+  if (async && poet_set_apply_async(state, 0)) {
+    goto fail;
+  }
+  lock_steps(state);
+
+  old_states = state->control_states;
+  old_num_states = state->num_system_states;
+  old_hull = state->hull;
+  old_hull_states = state->hull_states;
+  old_soa_speedup = state->soa_speedup;
+  old_soa_energy = state->soa_energy;
+  old_soa_id = state->soa_id;
+
+  state->control_states = cs;
+  state->num_system_states = num_system_states;
+  state->hull = hull;
+  state->hull_states = hull_states;
+  state->soa_speedup = NULL;
+  state->soa_energy = NULL;
+  state->soa_id = NULL;
+  if (build_hull(state) || soa_init(state)) {
+    // roll back to the old table
+    free(state->soa_speedup);
+    free(state->soa_energy);
+    free(state->soa_id);
+    state->control_states = old_states;
+    state->num_system_states = old_num_states;
+    state->hull = old_hull;
+    state->hull_states = old_hull_states;
+    state->soa_speedup = old_soa_speedup;
+    state->soa_energy = old_soa_energy;
+    state->soa_id = old_soa_id;
+    errno = ENOMEM;
+    ret = -1;
+  } else {
+    // the system stays in the old state until the next decision, which
+    // should see the closest new state as the current one
+    state->last_id = nearest_state(cs, num_system_states,
+                                   old_states[state->last_id].speedup);
+    state->requested_id = state->last_id;
+    state->applied_id = state->last_id;
+    state->prev_id = state->last_id;
+    state->applied_iter = 0;
+    reset_runs(state);
+    state->apply_states = apply_states;
+    state->upper_id = -1;
+    state->lower_id = -1;
+    state->low_state_iters = 0;
+    state->hull_dirty = 0;
+    if (state->ingest != NULL) {
+      state->ingest->switch_at = 0;
+    }
+    // the filters keep their estimates of the workload and the speedups
+    // history, only the maximum speedup changes
+    update_speedup_range(state);
+
+    estimator_destroy(&state->cost_est);
+    estimator_destroy(&state->speedup_est);
+    state->cost_est = cost_est;
+    state->speedup_est = speedup_est;
+    cost_est.filters = NULL;
+    speedup_est.filters = NULL;
+    cs = NULL;
+    hull = NULL;
+    hull_states = NULL;
+    free(old_states);
+    free(old_hull);
+    free(old_hull_states);
+    free(old_soa_speedup);
+    free(old_soa_energy);
+    free(old_soa_id);
+  }
+
+  unlock_steps(state);
+  if (async && poet_set_apply_async(state, 1) && ret == 0) {
+    // the new states are in use, only the actuator thread is missing
+    return 1;
+  }
+  if (ret == 0) {
+    return 0;
+  }
+
+fail:
+  estimator_destroy(&cost_est);
+  estimator_destroy(&speedup_est);
+  free(cs);
+  free(hull);
+  free(hull_states);
+  return -1;
+}
+
+/*
+ * Applies the state ids posted to the mailbox. Only the newest request is
+ * kept, so requests that arrive while a change is in progress are coalesced.
+ */
+static void * actuator_thread(void * arg) {
+  poet_state * state = (poet_state *) arg;
+  int id;
+  unsigned int applied_id = state->applied_id;
+
+  while (1) {
+    while (sem_wait(&state->actuator_sem) && errno == EINTR);
+    if (__atomic_load_n(&state->actuator_stop, __ATOMIC_ACQUIRE)) {
+      break;
+    }
+    id = __atomic_exchange_n(&state->mailbox, -1, __ATOMIC_ACQ_REL);
+    if (id < 0 || (unsigned int) id == applied_id) {
+      continue;
+    }
+    if (!__atomic_load_n(&state->apply_enabled, __ATOMIC_RELAXED)) {
+      // the system stays in applied_id, ask for the request again
+      __atomic_store_n(&state->request_dropped, 1, __ATOMIC_RELAXED);
+      continue;
+    }
+    state->apply(state->apply_states, state->num_system_states, id,
+                 applied_id);
+    applied_id = id;
+    __atomic_store_n(&state->applied_id, applied_id, __ATOMIC_RELEASE);
+  }
+
+  return NULL;
+}
+
+// Start or stop the actuator thread
+int poet_set_apply_async(poet_state * state,
+                         int async) {
+  int err;
+
+  if (state == NULL || (async && state->apply == NULL)) {
+    errno = EINVAL;
+    return -1;
+  }
+  if ((async != 0) == (state->async != 0)) {
+    return 0;
+  }
+
+  if (async) {
+    if (sem_init(&state->actuator_sem, 0, 0)) {
+      return -1;
+    }
+    state->actuator_stop = 0;
+    state->mailbox = -1;
+    state->request_dropped = 0;
+    state->requested_id = state->last_id;
+    state->applied_id = state->last_id;
+    err = pthread_create(&state->actuator, NULL, actuator_thread, state);
+    if (err) {
+      sem_destroy(&state->actuator_sem);
+      errno = err;
+      return -1;
+    }
+  } else {
+    __atomic_store_n(&state->actuator_stop, 1, __ATOMIC_RELEASE);
+    sem_post(&state->actuator_sem);
+    pthread_join(state->actuator, NULL);
+    sem_destroy(&state->actuator_sem);
+    state->last_id = state->applied_id;
+  }
+  state->async = async;
+
+  return 0;
+}
+
+// Get the id of the last state that was applied
+unsigned int poet_get_applied_state(const poet_state * state) {
+  if (state->async) {
+    return __atomic_load_n(&state->applied_id, __ATOMIC_ACQUIRE);
+  }
+  return state->last_id;
+}
+
+// Open or close the memory mapped binary log
+int poet_set_binary_log(poet_state * state,
+                        const char * log_filename,
+                        unsigned int num_records) {
+  int fd;
+  int err;
+  size_t size;
+  void * map;
+
+  if (state == NULL || (log_filename != NULL && num_records == 0)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (state->log_map != NULL) {
+    munmap(state->log_map, state->log_map_size);
+    state->log_map = NULL;
+    state->log_records = NULL;
+  }
+  if (log_filename == NULL) {
+    return 0;
+  }
+
+  size = sizeof(poet_log_header) + num_records * sizeof(poet_log_record);
+  fd = open(log_filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    perror(log_filename);
+    return -1;
+  }
+  if (ftruncate(fd, size)) {
+    err = errno;
+    perror(log_filename);
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  err = errno;
+  close(fd);
+  if (map == MAP_FAILED) {
+    errno = err;
+    perror(log_filename);
+    return -1;
+  }
+
+  state->log_map = (poet_log_header *) map;
+  state->log_records = (poet_log_record *) (state->log_map + 1);
+  state->log_map_size = size;
+  memcpy(state->log_map->magic, POET_LOG_MAGIC, sizeof(POET_LOG_MAGIC));
+  state->log_map->version = POET_LOG_VERSION;
+  state->log_map->record_size = sizeof(poet_log_record);
+  state->log_map->real_format = LOG_REAL_FORMAT;
+  state->log_map->real_frac_bits = LOG_REAL_FRAC_BITS;
+  state->log_map->capacity = num_records;
+  state->log_map->count = 0;
+
+  return 0;
+}
+
+// Store a record in the next slot of the binary log ring buffer
+static inline void binary_logger(const poet_state * state,
+                                 real_t workload,
+                                 unsigned long id,
+                                 real_t perf) {
+  uint64_t count = state->log_map->count;
+  poet_log_record * r = &state->log_records[count % state->log_map->capacity];
+
+  r->tag = id;
+  to_log_real(r->act_rate, perf);
+  to_log_real(r->x_hat_minus, state->pfs.x_hat_minus);
+  to_log_real(r->x_hat, state->pfs.x_hat);
+  to_log_real(r->p_minus, state->pfs.p_minus);
+  to_log_real(r->h, state->pfs.h);
+  to_log_real(r->k, state->pfs.k);
+  to_log_real(r->p, state->pfs.p);
+  to_log_real(r->speedup, state->scs.u);
+  to_log_real(r->error, state->scs.e);
+  to_log_real(r->workload, workload);
+  r->lower_id = state->lower_id;
+  r->upper_id = state->upper_id;
+  r->low_state_iters = state->low_state_iters;
+  r->reserved = 0;
+
+  // publish the record for readers of a live log
+  __atomic_store_n(&state->log_map->count, count + 1, __ATOMIC_RELEASE);
+}
+
+// Check if the flush policy calls for writing the current log buffer
+static inline int flush_due(poet_state * state) {
+  struct timespec now;
+  long elapsed_ms;
+
+  if (state->lb_count == state->buffer_depth) {
+    return 1;
+  }
+  switch (state->flush_policy) {
+    case POET_LOG_FLUSH_RECORDS:
+      return state->lb_count >= state->flush_value;
+    case POET_LOG_FLUSH_TIME:
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      elapsed_ms = (now.tv_sec - state->flush_time.tv_sec) * 1000 +
+                   (now.tv_nsec - state->flush_time.tv_nsec) / 1000000;
+      return elapsed_ms >= (long) state->flush_value;
+    default:
+      return 0;
   }
 }
 
-static inline void logger(const poet_state * state,
+static inline void logger(poet_state * state,
                           real_t workload,
                           unsigned long id,
                           real_t perf) {
-  unsigned int index;
-  unsigned int i;
+  poet_record * r;
+
+  if (state->log_map != NULL) {
+    binary_logger(state, workload, id, perf);
+  }
 
   if (state->log_file != NULL) {
-    index = (id / state->period) % state->buffer_depth;
-    state->lb[index].tag = id;
-    state->lb[index].act_rate = perf;
-    memcpy(&state->lb[index].pfs, &state->pfs, sizeof(filter_state));
-    memcpy(&state->lb[index].scs, &state->scs, sizeof(calc_xup_state));
-    state->lb[index].workload = workload;
-    state->lb[index].lower_id = state->lower_id;
-    state->lb[index].upper_id = state->upper_id;
-    state->lb[index].low_state_iters = state->low_state_iters;
-
-    if (index == state->buffer_depth - 1) {
-      for (i = 0; i < state->buffer_depth; i++) {
-        fprintf(state->log_file, "%16lu %16f %16f %16f %16f %16f %16f %16f %16f %16f %16f %16d %16d %16d\n",
-                state->lb[i].tag,
-                real_to_db(state->lb[i].act_rate),
-                real_to_db(state->lb[i].pfs.x_hat_minus),
-                real_to_db(state->lb[i].pfs.x_hat),
-                real_to_db(state->lb[i].pfs.p_minus),
-                real_to_db(state->lb[i].pfs.h),
-                real_to_db(state->lb[i].pfs.k),
-                real_to_db(state->lb[i].pfs.p),
-                real_to_db(state->lb[i].scs.u),
-                real_to_db(state->lb[i].scs.e),
-                real_to_db(state->lb[i].workload),
-                state->lb[i].lower_id,
-                state->lb[i].upper_id,
-                state->lb[i].low_state_iters);
+    r = &state->lb[state->lb_count++];
+    r->tag = id;
+    r->act_rate = perf;
+    memcpy(&r->pfs, &state->pfs, sizeof(filter_state));
+    memcpy(&r->scs, &state->scs, sizeof(calc_xup_state));
+    r->workload = workload;
+    r->lower_id = state->lower_id;
+    r->upper_id = state->upper_id;
+    r->low_state_iters = state->low_state_iters;
+
+    if (flush_due(state)) {
+      if (state->flush_policy == POET_LOG_FLUSH_SYNC) {
+        write_records(state->log_file, state->lb, state->lb_count);
+        state->lb_count = 0;
+      } else {
+        hand_off_records(state);
       }
     }
   }
@@ -255,26 +1743,213 @@ static inline void logger(const poet_state * state,
  *
  * Uses a Kalman Filter
  */
-static inline real_t estimate_base_workload(real_t current_workload,
-                                            real_t last_xup,
-                                            filter_state * state) {
-  real_t _w;
-
+static inline void kalman_filter(real_t z,
+                                 real_t h,
+                                 real_t q,
+                                 real_t r,
+                                 filter_state * state) {
   state->x_hat_minus = state->x_hat;
-  state->p_minus = state->p + Q;
+  state->p_minus = state->p + q;
 
-  state->h = last_xup;
+  state->h = h;
   state->k = div(mult(state->p_minus, state->h),
-                 mult3(state->h, state->p_minus, state->h) + R);
+                 mult3(state->h, state->p_minus, state->h) + r);
   state->x_hat = state->x_hat_minus + mult(state->k,
-                  (current_workload - mult(state->h, state->x_hat_minus)));
+                  (z - mult(state->h, state->x_hat_minus)));
   state->p = mult(R_ONE - mult(state->k, state->h), state->p_minus);
+}
+
+static inline real_t estimate_base_workload(real_t current_workload,
+                                            real_t last_xup,
+                                            filter_state * state) {
+  real_t _w;
+
+  kalman_filter(current_workload, last_xup, Q, R, state);
 
   _w = div(R_ONE, state->x_hat);
 
   return _w;
 }
 
+/*
+ * Learns the states from a sample of a value averaged over the iterations of
+ * several states, for example the seconds per iteration from a rate sample.
+ * The sample is modeled as a base factor times the sum of h[i], the weight of
+ * state ids[i] in the sample times its configured value, each times the
+ * correction of the state. Samples are normalized by the first one.
+ *
+ * The base filter tracks changes that affect all states, like temperature or
+ * workload phases, and the corrections learn the states relative to each
+ * other. A sample corrects the states it averages over in proportion to the
+ * uncertainty of each, so a sample of a well known state and a new one teaches
+ * the new one. The per-state error covariance weights new samples by the
+ * confidence in the current correction.
+ *
+ * Uses Kalman Filters
+ */
+static void estimate_state_values(double sample,
+                                  const unsigned int * ids,
+                                  const double * h,
+                                  unsigned int num,
+                                  real_t base_q,
+                                  real_t q,
+                                  real_t r,
+                                  state_estimator * est) {
+  filter_state * f;
+  double predicted = 0;
+  double y;
+  double s;
+  double k;
+  unsigned int i;
+
+  for (i = 0; i < num; i++) {
+    predicted += h[i] * real_to_db(est->filters[ids[i]].x_hat);
+  }
+  if (est->ref <= 0) {
+    // the first sample sets the scale
+    est->ref = sample / predicted;
+  }
+  y = sample / (est->ref * real_to_db(est->base.x_hat));
+
+  // the states against the base before this sample, the noise is relative
+  s = real_to_db(r) * predicted * predicted;
+  for (i = 0; i < num; i++) {
+    f = &est->filters[ids[i]];
+    f->p_minus = f->p + q;
+    s += h[i] * h[i] * real_to_db(f->p_minus);
+  }
+  for (i = 0; i < num; i++) {
+    f = &est->filters[ids[i]];
+    k = h[i] * real_to_db(f->p_minus) / s;
+    f->x_hat_minus = f->x_hat;
+    f->x_hat = f->x_hat_minus + CONST(k * (y - predicted));
+    f->p = CONST((1.0 - k * h[i]) * real_to_db(f->p_minus));
+  }
+
+  // then the base
+  predicted = 0;
+  for (i = 0; i < num; i++) {
+    predicted += h[i] * real_to_db(est->filters[ids[i]].x_hat);
+  }
+  if (predicted > 0) {
+    kalman_filter(CONST(sample / (est->ref * predicted)), R_ONE, base_q, r,
+                  &est->base);
+  }
+}
+
+/*
+ * Finds the states the last window sampled iterations ran in and how many
+ * iterations each ran. Returns the number of states, 0 if the runs kept do not
+ * cover the window.
+ */
+static unsigned int window_mix(const poet_state * state,
+                               uint64_t window,
+                               unsigned int * ids,
+                               uint64_t * iters) {
+  const state_run * run;
+  uint64_t n;
+  unsigned int num = 0;
+  unsigned int i;
+  unsigned int j;
+
+  for (i = 0; i < STATE_RUNS && window > 0; i++) {
+    run = &state->runs[(state->run_pos + STATE_RUNS - i) % STATE_RUNS];
+    n = run->iters < window ? run->iters : window;
+    if (n == 0) {
+      continue;
+    }
+    for (j = 0; j < num && ids[j] != run->id; j++);
+    if (j == num) {
+      ids[num] = run->id;
+      iters[num++] = 0;
+    }
+    iters[j] += n;
+    window -= n;
+  }
+  return window > 0 ? 0 : num;
+}
+
+/*
+ * Update the cost and speedup estimates from samples averaged over the last
+ * window iterations, which may have run in several states. The rate is
+ * learned as the seconds per iteration, which average over the iterations of
+ * each state, and the power only from windows that ran in one state.
+ */
+static inline void estimate_state(poet_state * state,
+                                  uint64_t window,
+                                  real_t perf,
+                                  real_t pwr) {
+  unsigned int ids[STATE_RUNS];
+  uint64_t iters[STATE_RUNS];
+  double h[STATE_RUNS];
+  unsigned int num;
+  unsigned int i;
+  real_t old_speedup;
+  real_t speedup;
+  real_t cost;
+  double power;
+
+  // the power cap controls the power averaged over the time of the samples
+  if (state->power_cap != NULL && pwr > R_ZERO && perf > R_ZERO) {
+    state->power_cap->energy += real_to_db(pwr) / real_to_db(perf);
+    state->power_cap->time += 1.0 / real_to_db(perf);
+  }
+
+  num = window_mix(state, window, ids, iters);
+
+  // switching energies are weighed against the power of a state with cost 1
+  if (state->switch_cost != NULL && num == 1 && pwr > R_ZERO) {
+    power = real_to_db(pwr) / real_to_db(state->control_states[ids[0]].cost);
+    state->base_power = state->base_power > 0 ?
+      state->base_power + BASE_POWER_WEIGHT * (power - state->base_power) :
+      power;
+  }
+
+  if (state->speedup_est.filters != NULL && num > 0 && perf > R_ZERO) {
+    for (i = 0; i < num; i++) {
+      h[i] = (double) iters[i] / window /
+             real_to_db(state->speedup_est.priors[ids[i]]);
+    }
+    estimate_state_values(1.0 / real_to_db(perf), ids, h, num, RATE_BASE_Q,
+                          SPEEDUP_Q, RATE_R, &state->speedup_est);
+    for (i = 0; i < num; i++) {
+      if (state->speedup_est.filters[ids[i]].x_hat <= R_ZERO) {
+        continue;
+      }
+      speedup = div(state->speedup_est.priors[ids[i]],
+                    state->speedup_est.filters[ids[i]].x_hat);
+      old_speedup = state->control_states[ids[i]].speedup;
+      state->control_states[ids[i]].speedup = speedup;
+      state->hull_dirty = 1;
+      state->soa_dirty = 1;
+      // only rescan all states if the fastest one slowed down or the
+      // slowest one sped up
+      if (old_speedup >= state->scs.umax || old_speedup <= state->scs.umin) {
+        update_speedup_range(state);
+      } else if (speedup > state->scs.umax) {
+        state->scs.umax = speedup;
+      } else if (speedup < state->scs.umin) {
+        state->scs.umin = speedup > R_ONE ? speedup : R_ONE;
+      }
+    }
+  }
+
+  // mixes of the same states do not tell their powers apart, only samples
+  // whose window ran in one state teach its cost
+  if (state->cost_est.filters != NULL && num == 1 && pwr > R_ZERO) {
+    h[0] = real_to_db(state->cost_est.priors[ids[0]]);
+    estimate_state_values(real_to_db(pwr), ids, h, 1, POWER_BASE_Q, COST_Q,
+                          POWER_R, &state->cost_est);
+    cost = mult(state->cost_est.priors[ids[0]],
+                state->cost_est.filters[ids[0]].x_hat);
+    if (cost > R_ZERO) {
+      state->control_states[ids[0]].cost = cost;
+      state->hull_dirty = 1;
+      state->soa_dirty = 1;
+    }
+  }
+}
+
 /*
  * Calculates the speedup necessary to achieve the target performance
  */
@@ -298,9 +1973,9 @@ static inline void calculate_xup(real_t current_rate,
   // Calculate speedup
   state->u = mult(F , mult(A, state->uo) + mult(B, state->uoo) + mult(C, state->e) + mult(D, state->eo));
 
-  // Speedups less than one have no effect
-  if (state->u < R_ONE) {
-    state->u = R_ONE;
+  // Speedups below the slowest state's have no effect
+  if (state->u < state->umin) {
+    state->u = state->umin;
   }
 
   // A speedup greater than the maximum is not achievable
@@ -339,125 +2014,1339 @@ static inline void calculate_time_division(poet_state * state,
     // configuration
     // Conversely, (1 - x) is the percentage of iterations in the second
     // (upper) configuration
-    real_t x;
+    real_t x = time_division(lower_xup, upper_xup, target_xup);
+    // Num of iterations (in lower state) = x * (controller period)
+    state->low_state_iters = real_to_int(mult(r_period, x));
+  }
+}
+
+/*
+ * Use the best configuration. A schedule that runs one state for the whole
+ * period is the same whichever state tied with it, so it is always written as
+ * that state alone without low state iterations.
+ */
+static inline void use_choice(poet_state * state,
+                              const n2_choice * best) {
+  state->lower_id = best->lower_id;
+  state->upper_id = best->upper_id;
+  state->low_state_iters = best->low_state_iters;
+  if (best->low_state_iters == 0) {
+    state->lower_id = best->upper_id;
+  } else if (best->low_state_iters == (int) state->period) {
+    state->upper_id = best->lower_id;
+    state->low_state_iters = 0;
+  }
+}
+
+/*
+ * Find the states sorted by speedup that can be the lower state of a pair,
+ * [0, num_lower), and the upper state, [first_upper, num_system_states).
+ */
+static inline void n2_bounds(poet_state * state,
+                             unsigned int * num_lower,
+                             unsigned int * first_upper) {
+  const real_t * speedup;
+  real_t target_xup = state->scs.u;
+  unsigned int lo;
+  unsigned int hi;
+  unsigned int mid;
+
+  // estimators changed the states, build_soa only fails on malloc
+  if (state->soa_dirty && build_soa(state) == 0) {
+    state->soa_dirty = 0;
+  }
+  speedup = state->soa_speedup;
 
-    // If lower rate and upper rate are equal, no need for time division
-    if (upper_xup <= lower_xup && upper_xup >= lower_xup) {
-      x = R_ZERO;
+  // number of states with speedup <= target
+  lo = 0;
+  hi = state->num_system_states;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (speedup[mid] <= target_xup) {
+      lo = mid + 1;
     } else {
-      // This equation ensures the time period of the combined rates is equal
-      // to the time period of the target rate
-      // 1 / Target rate = X / (lower rate) + (1 - X) / (upper rate)
-      // Solve for X
-      x = div(mult(upper_xup, lower_xup) - mult(target_xup, lower_xup),
-              mult(upper_xup, target_xup) - mult(target_xup, lower_xup));
+      hi = mid;
+    }
+  }
+  *num_lower = lo;
+  // first state with speedup >= target
+  hi = lo;
+  lo = 0;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (speedup[mid] < target_xup) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
     }
-    // Num of iterations (in lower state) = x * (controller period)
-    state->low_state_iters = real_to_int(mult(r_period, x));
   }
+  *first_upper = lo;
+}
+
+// Score all pairs of the states within the bounds with the n^2 kernel
+static inline void n2_search(poet_state * state,
+                             unsigned int num_lower,
+                             unsigned int first_upper) {
+  n2_choice best;
+  best.cost = BIG_REAL_T;
+  best.lower_id = -1;
+  best.upper_id = -1;
+  best.low_state_iters = -1;
+  state->n2_kernel(state->soa_speedup, state->soa_energy, state->soa_id,
+                   num_lower, first_upper, state->num_system_states,
+                   state->scs.u, int_to_real(state->period), &best);
+  use_choice(state, &best);
 }
 
 /**
  * Check all pairs of states that can achieve the target and choose the pair
- * with the lowest cost. Uses an n^2 algorithm.
+ * with the lowest cost. Uses an n^2 algorithm over the states sorted by
+ * speedup, so only pairs that bracket the target are visited.
  */
 static inline void translate_n2_with_time(poet_state * state) {
+  unsigned int num_lower;
+  unsigned int first_upper;
+  n2_bounds(state, &num_lower, &first_upper);
+  n2_search(state, num_lower, first_upper);
+}
+
+// Number of states with a height above the hull of at most the limit
+static inline unsigned int hull_states_below(const poet_state * state,
+                                             double limit) {
+  unsigned int lo = 0;
+  unsigned int hi = state->num_system_states;
+  unsigned int mid;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (state->hull_states[mid].gap <= limit) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// Height of a state above the line of a hull segment
+static inline double line_height(const hull_state * hs,
+                                 double time,
+                                 double energy,
+                                 double slope) {
+  return real_to_db(hs->energy) - energy - slope * (hs->time - time);
+}
+
+// Least iterations the partner of a state must run to reach the target, the
+// further the state is from the target the longer its partner runs
+static inline double partner_iters(const poet_state * state,
+                                   const hull_state * hs,
+                                   double target_time,
+                                   double spread) {
+  double iters = spread > 0 ?
+                 state->period * fabs(hs->time - target_time) / spread -
+                 POET_HULL_ROUNDING : 0;
+  return iters > 1 ? iters : 1;
+}
+
+/**
+ * Picks the same schedule as the n^2 search without scoring all pairs. The
+ * hull segment that brackets the target lies below all states. A schedule of P
+ * iterations costs P times the segment at the target, plus the height above
+ * the segment of each state times its iterations, plus the segment slope times
+ * the time the rounding moves it off the target, which is at most half an
+ * iteration of the time spread of the states. Rounding the end points of the
+ * segment gives a cost to beat, so a state that runs for at least half the
+ * period must lie within 2 / P of the slack of the segment, and its partner
+ * within the slack divided by the iterations the partner must run to reach the
+ * target. Only these pairs are scored, and a state that runs alone is scored
+ * with the slowest or the fastest state, which round to it whenever any state
+ * does. If that leaves more pairs than bracket the target, the n^2 kernel
+ * scores those instead. The search for the segment walks from the segment
+ * chosen last time, so slowly moving targets cost O(1) to bracket.
+ */
+static inline void translate_hull_with_time(poet_state * state) {
+  const poet_control_state_t * cs = state->control_states;
+  const unsigned int * hull = state->hull;
+  const hull_state * hs = state->hull_states;
+  unsigned int pos;
+  unsigned int lower;
+  unsigned int slowest;
+  unsigned int fastest;
   unsigned int i;
   unsigned int j;
+  real_t target_xup = state->scs.u;
   real_t r_period = int_to_real(state->period);
-  real_t target_xup;
-  real_t best_cost = BIG_REAL_T;
-  int best_lower_id = -1;
-  int best_upper_id = -1;
-  int best_low_state_iters = -1;
-  real_t lower_xup;
-  real_t upper_xup;
-  real_t lower_xup_cost;
-  real_t upper_xup_cost;
-  real_t r_low_state_iters;
-  real_t cost;
-  target_xup = state->scs.u;
+  double target_time;
+  double slope;
+  double energy;
+  double spread;
+  double bound;
+  double heavy;
+  double light;
+  unsigned int num_heavy;
+  unsigned int num_light;
+  unsigned int num_lower;
+  unsigned int first_upper;
+  unsigned long pairs;
+  n2_choice best;
 
-  for (i = 0; i < state->num_system_states; i++) {
-    upper_xup = state->control_states[i].speedup;
-    upper_xup_cost = state->control_states[i].cost;
-    if (upper_xup < target_xup) {
-      continue;
-    }
-    state->upper_id = i;
-    for (j = 0; j < state->num_system_states; j++) {
-      lower_xup = state->control_states[j].speedup;
-      lower_xup_cost = state->control_states[j].cost;
-      if (lower_xup > target_xup) {
-        continue;
-      }
-      state->lower_id = j;
-      // find time for both states
-      calculate_time_division(state, r_period);
-      // find cost of this state combination
-      r_low_state_iters = int_to_real(state->low_state_iters);
-      cost = mult(div(r_low_state_iters, lower_xup), lower_xup_cost) +
-             mult(div(r_period - r_low_state_iters, upper_xup), upper_xup_cost);
-      // if this is the best configuration so far, remember it
-      if (cost < best_cost) {
-        best_lower_id = j;
-        best_upper_id = i;
-        best_low_state_iters = state->low_state_iters;
-        best_cost = cost;
-      }
+  // estimators changed the states, build_hull only fails on malloc
+  if (state->hull_dirty) {
+    if (build_hull(state)) {
+      translate_n2_with_time(state);
+      return;
     }
+    state->hull_dirty = 0;
   }
+  pos = state->hull_pos;
 
-  // use the best configuration
-  state->lower_id = best_lower_id;
-  state->upper_id = best_upper_id;
-  state->low_state_iters = best_low_state_iters;
-}
+  // move toward faster states while the current state is too slow
+  while (pos > 0 && cs[hull[pos]].speedup < target_xup) {
+    pos--;
+  }
+  // move toward slower states while the next state is still fast enough
+  while (pos + 1 < state->hull_size && cs[hull[pos + 1]].speedup >= target_xup) {
+    pos++;
+  }
+  state->hull_pos = pos;
 
-// Runs POET decision engine and requests system changes
-void poet_apply_control(poet_state * state,
-                        unsigned long id,
-                        real_t perf,
-                        real_t pwr) {
-  (void) pwr;
-  if (state == NULL || getenv(POET_DISABLE_CONTROL) != NULL) {
+  best.cost = BIG_REAL_T;
+  best.lower_id = -1;
+  best.upper_id = -1;
+  best.low_state_iters = -1;
+  if (cs[hull[pos]].speedup < target_xup ||
+      (pos + 1 == state->hull_size && cs[hull[pos]].speedup > target_xup)) {
+    // target is faster or slower than any state
+    use_choice(state, &best);
     return;
   }
 
-  if (state->current_action == 0) {
-    // Estimate the performance workload
-    // estimate time between iterations given minimum amount of resources
-    real_t time_workload = estimate_base_workload(perf,
-                                                  state->scs.u,
-                                                  &state->pfs);
-
-    // Get a new goal speedup to apply to the application
-    calculate_xup(perf, state->perf_goal, time_workload, &state->scs);
-
-    // Xup is translated into a system configuration
-    // A certain amount of time is assigned to each system configuration
-    // in order to achieve the requested Xup
-    translate_n2_with_time(state);
+  // score the bracketing pair, or the slowest state if it is the target
+  lower = pos + 1 < state->hull_size ? pos + 1 : pos;
+  n2_score(cs[hull[lower]].speedup,
+           div(cs[hull[lower]].cost, cs[hull[lower]].speedup), hull[lower],
+           cs[hull[pos]].speedup,
+           div(cs[hull[pos]].cost, cs[hull[pos]].speedup), hull[pos],
+           target_xup, r_period, &best);
 
-    logger(state, time_workload, id, perf);
+  // the last segment also lies below all states if the target is the slowest
+  if (lower == pos && pos > 0) {
+    pos--;
   }
+  target_time = 1.0 / real_to_db(target_xup);
+  slope = hull_slope(state, pos, lower);
+  energy = hull_energy(state, pos, lower, target_time);
+  slowest = hull[state->hull_size - 1];
+  fastest = hull[0];
+  spread = hull_time(state, state->hull_size - 1) - hull_time(state, 0);
+  bound = real_to_db(best.cost) - state->period * energy +
+          POET_HULL_ROUNDING * fabs(slope) * spread;
+  bound += POET_HULL_SLACK * (real_to_db(best.cost) +
+                              state->period * fabs(energy));
+  heavy = 2 * bound / state->period;
 
-  // Check which speedup should be applied, upper or lower
-  int config_id = -1;
-  if (state->low_state_iters > 0) {
-    config_id = state->lower_id;
-    state->low_state_iters--;
-  } else if (state->upper_id >= 0) {
-    config_id = state->upper_id;
+  // states are in order of height above the hull, which is at most their
+  // height above the segment; short periods round so coarsely that the n^2
+  // kernel may be cheaper
+  num_heavy = hull_states_below(state, heavy);
+  pairs = 0;
+  for (i = 0; i < num_heavy; i++) {
+    if (line_height(&hs[i], target_time, energy, slope) <= heavy) {
+      pairs += hull_states_below(state, bound / partner_iters(state, &hs[i],
+                                                              target_time,
+                                                              spread));
+    }
   }
+  n2_bounds(state, &num_lower, &first_upper);
+  // the kernel scores a padded row of lower states for each upper state
+  if (pairs >= (unsigned long) (num_lower + SOA_PAD) *
+               (state->num_system_states - first_upper)) {
+    n2_search(state, num_lower, first_upper);
+    return;
+  }
+
+  for (i = 0; i < num_heavy; i++) {
+    if (line_height(&hs[i], target_time, energy, slope) > heavy) {
+      continue;
+    }
+    if (hs[i].speedup >= target_xup) {
+      n2_score(cs[slowest].speedup,
+               div(cs[slowest].cost, cs[slowest].speedup), slowest,
+               hs[i].speedup, hs[i].energy, hs[i].id,
+               target_xup, r_period, &best);
+    }
+    if (hs[i].speedup <= target_xup) {
+      n2_score(hs[i].speedup, hs[i].energy, hs[i].id,
+               cs[fastest].speedup,
+               div(cs[fastest].cost, cs[fastest].speedup), fastest,
+               target_xup, r_period, &best);
+    }
+    light = bound / partner_iters(state, &hs[i], target_time, spread);
+    num_light = hull_states_below(state, light);
+    for (j = 0; j < num_light; j++) {
+      if (line_height(&hs[j], target_time, energy, slope) > light) {
+        continue;
+      }
+      if (hs[i].speedup >= target_xup && hs[j].speedup <= target_xup) {
+        n2_score(hs[j].speedup, hs[j].energy, hs[j].id,
+                 hs[i].speedup, hs[i].energy, hs[i].id,
+                 target_xup, r_period, &best);
+      }
+      if (hs[i].speedup <= target_xup && hs[j].speedup >= target_xup) {
+        n2_score(hs[i].speedup, hs[i].energy, hs[i].id,
+                 hs[j].speedup, hs[j].energy, hs[j].id,
+                 target_xup, r_period, &best);
+      }
+    }
+  }
+  use_choice(state, &best);
+}
+
+// Cost of switching between two states in the units of the translation
+// objective: the energy of an iteration in a state with speedup and cost 1
+static double switching_cost(const poet_state * state,
+                             int from_id,
+                             int to_id) {
+  double seconds = 0;
+  double joules = 0;
+  double base_rate = real_to_db(state->pfs.x_hat);
+  double cost;
+
+  if (from_id < 0 || from_id == to_id ||
+      state->switch_cost(state->switch_cost_arg, from_id, to_id, &seconds,
+                         &joules)) {
+    return 0;
+  }
+  // the application keeps drawing the new state's power during the switch
+  cost = seconds * base_rate * real_to_db(state->control_states[to_id].cost);
+  if (state->base_power > 0) {
+    cost += joules * base_rate / state->base_power;
+  }
+  return cost;
+}
+
+// Energy of an iteration in the state
+static inline double state_energy(const poet_state * state,
+                                  int id) {
+  return real_to_db(state->control_states[id].cost) /
+         real_to_db(state->control_states[id].speedup);
+}
 
-  if (config_id >= 0 && (unsigned int) config_id != state->last_id) {
-    if (state->apply != NULL && getenv(POET_DISABLE_APPLY) == NULL) {
+/*
+ * Adjusts the translated schedule for the minimum dwell time and the costs of
+ * switching states. A schedule of two states switches from the current state
+ * to the lower state and back to the upper state every period, so running the
+ * whole period in the upper state, or staying in the current state if it is
+ * between the target and the upper state, may be cheaper once the switches are
+ * paid for.
+ */
+static inline void schedule_switches(poet_state * state) {
+  int period = state->period;
+  int dwell = state->min_dwell;
+  int current = state->last_id;
+  int lower = state->lower_id;
+  int upper = state->upper_id;
+  int low = state->low_state_iters;
+  double best;
+  double cost;
+
+  if (upper < 0 || lower < 0) {
+    return;
+  }
+
+  // round the schedule so both states are used for at least dwell iterations,
+  // erring on the faster side
+  if (low > 0 && lower != upper && low < dwell) {
+    low = 0;
+  } else if (low > 0 && lower != upper && period - low < dwell) {
+    low = period - dwell >= dwell ? period - dwell : 0;
+  }
+
+  if (state->switch_cost != NULL) {
+    best = period * state_energy(state, upper) +
+           switching_cost(state, current, upper);
+    if (low > 0 && lower != upper) {
+      cost = low * state_energy(state, lower) +
+             (period - low) * state_energy(state, upper) +
+             switching_cost(state, current, lower) +
+             switching_cost(state, lower, upper);
+      if (cost <= best) {
+        best = cost;
+      } else {
+        low = 0;
+      }
+    }
+    // not faster than the upper state, so the rate overshoots no more
+    if (current >= 0 && current != upper &&
+        state->control_states[current].speedup >= state->scs.u &&
+        state->control_states[current].speedup <=
+        state->control_states[upper].speedup &&
+        period * state_energy(state, current) < best) {
+      lower = current;
+      upper = current;
+      low = 0;
+    }
+  }
+
+  if (low == 0) {
+    lower = upper;
+  }
+  state->lower_id = lower;
+  state->upper_id = upper;
+  state->low_state_iters = low;
+}
+
+static inline void translate(poet_state * state) {
+  switch (state->translate_mode) {
+    case POET_TRANSLATE_HULL:
+      translate_hull_with_time(state);
+      break;
+    case POET_TRANSLATE_N2:
+    default:
+      translate_n2_with_time(state);
+      break;
+  }
+}
+
+/*
+ * Finds the schedule with the highest speedup whose cost, averaged over time,
+ * is at most the target. The best schedule either runs a single state or
+ * splits the time between a cheaper and a more expensive state so that the
+ * average is the target. Runs the cheapest state if none is cheap enough.
+ * Records the speedup and the cost of the schedule after rounding it to
+ * iterations.
+ */
+static void translate_power(poet_state * state) {
+  const poet_control_state_t * cs = state->control_states;
+  power_cap_state * pc = state->power_cap;
+  double target = real_to_db(pc->cost);
+  double best_speedup = -1;
+  double best_low_time = 0;
+  double low_time;
+  double high_time;
+  double speedup;
+  int lower = -1;
+  int upper = -1;
+  int cheapest = 0;
+  int low;
+  unsigned int i;
+  unsigned int j;
+
+  for (i = 0; i < state->num_system_states; i++) {
+    if (cs[i].cost < cs[cheapest].cost ||
+        (cs[i].cost <= cs[cheapest].cost &&
+         cs[i].speedup > cs[cheapest].speedup)) {
+      cheapest = i;
+    }
+    if (real_to_db(cs[i].cost) > target) {
+      continue;
+    }
+    if (real_to_db(cs[i].speedup) > best_speedup) {
+      best_speedup = real_to_db(cs[i].speedup);
+      best_low_time = 0;
+      lower = i;
+      upper = i;
+    }
+    // pair with each state over the target, low_time is the time in state i
+    for (j = 0; j < state->num_system_states; j++) {
+      if (real_to_db(cs[j].cost) <= target || cs[j].speedup <= cs[i].speedup) {
+        continue;
+      }
+      low_time = (real_to_db(cs[j].cost) - target) /
+                 (real_to_db(cs[j].cost) - real_to_db(cs[i].cost));
+      speedup = low_time * real_to_db(cs[i].speedup) +
+                (1 - low_time) * real_to_db(cs[j].speedup);
+      if (speedup > best_speedup) {
+        best_speedup = speedup;
+        best_low_time = low_time;
+        lower = i;
+        upper = j;
+      }
+    }
+  }
+  if (lower < 0) {
+    lower = cheapest;
+    upper = cheapest;
+  }
+
+  // iterations in the lower state are its share of the time at its speedup
+  low = 0;
+  if (lower != upper) {
+    low = (int) (state->period * best_low_time * real_to_db(cs[lower].speedup) /
+                 best_speedup + 0.5);
+    if (low >= (int) state->period) {
+      upper = lower;
+      low = 0;
+    } else if (low == 0) {
+      lower = upper;
+    }
+  }
+  state->lower_id = lower;
+  state->upper_id = upper;
+  state->low_state_iters = low;
+
+  low_time = low / real_to_db(cs[lower].speedup);
+  high_time = (state->period - low) / real_to_db(cs[upper].speedup);
+  pc->applied_cost = CONST((low_time * real_to_db(cs[lower].cost) +
+                            high_time * real_to_db(cs[upper].cost)) /
+                           (low_time + high_time));
+  state->scs.u = CONST(state->period / (low_time + high_time));
+  state->scs.uo = state->scs.u;
+  state->scs.uoo = state->scs.u;
+}
+
+// Translates the new target speedup and logs the decision
+static inline void finish_decision(poet_state * state,
+                                   real_t time_workload,
+                                   unsigned long id,
+                                   real_t perf) {
+  // Xup is translated into a system configuration
+  // A certain amount of time is assigned to each system configuration
+  // in order to achieve the requested Xup
+  PROFILE_START(t_translate);
+  if (state->power_cap != NULL) {
+    // switching to meet a dwell time or save energy would break the cap
+    translate_power(state);
+  } else {
+    translate(state);
+    if (state->switch_cost != NULL || state->min_dwell > 0) {
+      schedule_switches(state);
+    }
+  }
+  PROFILE_END(state, translate_cycles, t_translate);
+#ifdef POET_PROFILE
+  state->profile.decisions++;
+#endif
+
+  logger(state, time_workload, id, perf);
+}
+
+// Requests a state change, config_id < 0 keeps the current state
+static inline void apply_config(poet_state * state, int config_id) {
+  // too early to leave the current state
+  if (state->dwell_iters < state->min_dwell) {
+    config_id = -1;
+  }
+  if (state->async) {
+    // hand the change to the actuator thread, last_id follows what it applied
+    if (config_id >= 0 &&
+        ((unsigned int) config_id != state->requested_id ||
+         (__atomic_load_n(&state->request_dropped, __ATOMIC_RELAXED) &&
+          __atomic_load_n(&state->apply_enabled, __ATOMIC_RELAXED)))) {
+      __atomic_store_n(&state->request_dropped, 0, __ATOMIC_RELAXED);
+      if (__atomic_exchange_n(&state->mailbox, config_id, __ATOMIC_ACQ_REL) < 0) {
+        sem_post(&state->actuator_sem);
+      }
+      state->requested_id = config_id;
+      state->dwell_iters = 0;
+    }
+    state->last_id = __atomic_load_n(&state->applied_id, __ATOMIC_ACQUIRE);
+  } else if (config_id >= 0 && (unsigned int) config_id != state->last_id &&
+             __atomic_load_n(&state->apply_enabled, __ATOMIC_RELAXED)) {
+    // while apply is disabled the system stays in last_id, so the samples
+    // are still attributed to it and the change is made once it is enabled
+    if (state->apply != NULL) {
       state->apply(state->apply_states, state->num_system_states, config_id,
                    state->last_id);
     }
     state->last_id = config_id;
+    state->dwell_iters = 0;
+  }
+}
+
+// Applies the state scheduled for this iteration
+static inline void apply_schedule(poet_state * state) {
+  // Check which speedup should be applied, upper or lower
+  int config_id = -1;
+  if (state->dwell_iters < state->min_dwell) {
+    state->dwell_iters++;
+  }
+  if (state->low_state_iters > 0) {
+    config_id = state->lower_id;
+    state->low_state_iters--;
+  } else if (state->upper_id >= 0) {
+    config_id = state->upper_id;
   }
 
+  apply_config(state, config_id);
+
   state->current_action = (state->current_action + 1) % state->period;
 }
+
+// Converts a rate, clamped to the range of real_t in fixed point
+static inline real_t rate_to_real(double rate) {
+#ifdef FIXED_POINT
+  return rate < real_to_db(BIG_REAL_T) ? CONST(rate) : BIG_REAL_T;
+#else
+  return rate;
+#endif
+}
+
+// Counts an iteration toward the deadline
+static inline void count_iteration(poet_state * state) {
+  if (state->deadline != NULL) {
+    state->deadline->done++;
+  }
+}
+
+/*
+ * Sets the goal to the rate that finishes the remaining work by the deadline,
+ * given the iterations done so far and the rate of the last period.
+ * The margin covers the variation of the rate over the remaining periods,
+ * which shrinks as fewer periods remain.
+ */
+static void update_deadline(poet_state * state,
+                            real_t perf) {
+  deadline_state * d = state->deadline;
+  uint64_t now = get_ns();
+  uint64_t remaining;
+  double ratio;
+  double periods;
+  double goal;
+
+  if (d->done >= d->total) {
+    return;
+  }
+  remaining = d->total - d->done;
+
+  ratio = real_to_db(perf) / real_to_db(state->perf_goal);
+  if (d->has_stats) {
+    d->var = (1 - DEADLINE_STATS_WEIGHT) *
+             (d->var + DEADLINE_STATS_WEIGHT * (ratio - d->mean) *
+                       (ratio - d->mean));
+    d->mean += DEADLINE_STATS_WEIGHT * (ratio - d->mean);
+  } else if (perf > R_ZERO) {
+    d->mean = ratio;
+    d->var = 0;
+    d->has_stats = 1;
+  }
+
+  // past the deadline, ask for the work within a millisecond
+  goal = remaining * 1000000000.0 /
+         (now < d->end_ns ? d->end_ns - now : 1000000);
+  periods = (double) remaining / state->period;
+  if (periods < 1) {
+    periods = 1;
+  }
+  goal *= 1 + DEADLINE_SIGMAS * sqrt(d->var / periods);
+  state->perf_goal = rate_to_real(goal);
+}
+
+// Set a number of iterations to finish within a time
+int poet_set_deadline(poet_state * state,
+                      uint64_t iterations,
+                      double seconds) {
+  deadline_state * d;
+
+  if (state == NULL || iterations == 0 || seconds <= 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  d = calloc(1, sizeof(deadline_state));
+  if (d == NULL) {
+    return -1;
+  }
+  d->total = iterations;
+  d->end_ns = get_ns() + (uint64_t) (seconds * 1000000000.0);
+
+  lock_steps(state);
+  // work reported before now does not count
+  if (state->ingest != NULL) {
+    d->reported = __atomic_load_n(&state->ingest->total, __ATOMIC_ACQUIRE);
+  }
+  free(state->deadline);
+  state->deadline = d;
+  free(state->latency);
+  state->latency = NULL;
+  free(state->power_cap);
+  state->power_cap = NULL;
+  state->perf_goal = rate_to_real(iterations / seconds);
+  unlock_steps(state);
+  return 0;
+}
+
+/*
+ * Calculates the time averaged cost that the power cap allows, from the power
+ * drawn since the last decision. The filter estimates the power of a state
+ * with cost 1 given the cost of the schedule that drew it, and the cost moves
+ * toward the one whose power is the cap with a pole of POWER_CAP_POLE.
+ */
+static inline void calculate_cost(poet_state * state) {
+  power_cap_state * pc = state->power_cap;
+  real_t power;
+
+  if (pc->time > 0) {
+    power = CONST(pc->energy / pc->time);
+    kalman_filter(power, pc->applied_cost, Q, R, &pc->pfs);
+    if (pc->pfs.x_hat > R_ZERO) {
+      pc->cost = pc->applied_cost + mult(R_ONE - POWER_CAP_POLE,
+                                         div(pc->cap - power, pc->pfs.x_hat));
+    }
+    state->scs.e = pc->cap - power;
+  }
+  pc->energy = 0;
+  pc->time = 0;
+}
+
+// Set an average power not to exceed
+int poet_set_power_cap(poet_state * state,
+                       real_t cap) {
+  power_cap_state * pc;
+
+  if (state == NULL || cap <= R_ZERO) {
+    errno = EINVAL;
+    return -1;
+  }
+  pc = calloc(1, sizeof(power_cap_state));
+  if (pc == NULL) {
+    return -1;
+  }
+  pc->cap = cap;
+  init_filter(&pc->pfs, X_HAT_START);
+
+  lock_steps(state);
+  if (state->power_cap != NULL) {
+    // keep what was learned about the power
+    state->power_cap->cap = cap;
+    free(pc);
+  } else {
+    pc->cost = state->control_states[state->last_id].cost;
+    pc->applied_cost = pc->cost;
+    state->power_cap = pc;
+    free(state->latency);
+    state->latency = NULL;
+    free(state->deadline);
+    state->deadline = NULL;
+  }
+  unlock_steps(state);
+  return 0;
+}
+
+// Runs the decision engine on a performance sample of the iterations since the
+// last decision
+static inline void decide(poet_state * state,
+                          unsigned long id,
+                          real_t perf) {
+  if (state->deadline != NULL) {
+    update_deadline(state, perf);
+  }
+
+  // Estimate the performance workload
+  // estimate time between iterations given minimum amount of resources
+  PROFILE_START(t_estimate);
+  real_t time_workload = estimate_base_workload(perf,
+                                                state->scs.u,
+                                                &state->pfs);
+  PROFILE_END(state, estimate_cycles, t_estimate);
+
+  // Get a new goal speedup to apply to the application, or the cost allowed
+  // by the power cap
+  PROFILE_START(t_xup);
+  if (state->power_cap != NULL) {
+    calculate_cost(state);
+  } else {
+    calculate_xup(perf, state->perf_goal, time_workload, &state->scs);
+  }
+  PROFILE_END(state, xup_cycles, t_xup);
+
+  finish_decision(state, time_workload, id, perf);
+  // the goal follows the rate expected under the cap
+  if (state->power_cap != NULL) {
+    state->perf_goal = mult(state->pfs.x_hat, state->scs.u);
+  }
+}
+
+// Runs POET decision engine once the estimators saw the samples
+static inline void apply_control(poet_state * state,
+                                 unsigned long id,
+                                 real_t perf) {
+  count_iteration(state);
+
+  if (state->current_action == 0) {
+    decide(state, id, perf);
+  }
+
+  apply_schedule(state);
+}
+
+// Runs POET decision engine and requests system changes
+void poet_apply_control(poet_state * state,
+                        unsigned long id,
+                        real_t perf,
+                        real_t pwr) {
+  if (state == NULL || !__atomic_load_n(&state->control_enabled, __ATOMIC_RELAXED)) {
+    return;
+  }
+
+  // the samples are averaged over the last period, and the iteration ran in
+  // the last state applied
+  record_run(state, state->last_id, 1);
+  estimate_state(state, state->period, perf, pwr);
+  apply_control(state, id, perf);
+}
+
+/*
+ * Predicts the rate and the average cost of the current schedule. The filter
+ * estimates the rate as the base workload times the target speedup, so that
+ * is the rate it expects; the cost is averaged over the time in each state.
+ */
+static void predict_schedule(const poet_state * state,
+                             poet_schedule_t * schedule) {
+  const poet_control_state_t * lower;
+  const poet_control_state_t * upper;
+  unsigned int low = state->low_state_iters;
+  unsigned int high = state->period - low;
+  double low_time;
+  double high_time;
+
+  lower = &state->control_states[state->lower_id];
+  upper = &state->control_states[state->upper_id];
+  low_time = low / real_to_db(lower->speedup);
+  high_time = high / real_to_db(upper->speedup);
+  schedule->rate = mult(state->pfs.x_hat, state->scs.u);
+  schedule->cost = CONST((low_time * real_to_db(lower->cost) +
+                          high_time * real_to_db(upper->cost)) /
+                         (low_time + high_time));
+}
+
+// Runs POET decision engine and returns the schedule without applying it
+int poet_decide(poet_state * state,
+                unsigned long id,
+                real_t perf,
+                real_t pwr,
+                poet_schedule_t * schedule) {
+  unsigned int sample_id;
+  int decided = 0;
+
+  if (state == NULL || schedule == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (!__atomic_load_n(&state->control_enabled, __ATOMIC_RELAXED)) {
+    return 0;
+  }
+
+  // iterations before the last reported change ran in the previous state
+  sample_id = id < state->applied_iter ? state->prev_id : state->last_id;
+  record_run(state, sample_id, 1);
+  estimate_state(state, state->period, perf, pwr);
+  count_iteration(state);
+
+  if (state->current_action == 0) {
+    decide(state, id, perf);
+    schedule->lower_id = state->lower_id;
+    schedule->upper_id = state->upper_id;
+    schedule->low_state_iters = state->low_state_iters;
+    schedule->period = state->period;
+    if (state->upper_id >= 0 && state->lower_id >= 0) {
+      predict_schedule(state, schedule);
+    } else {
+      schedule->rate = R_ZERO;
+      schedule->cost = R_ZERO;
+    }
+    decided = 1;
+  }
+
+  state->current_action = (state->current_action + 1) % state->period;
+  return decided;
+}
+
+// Records a state the application applied after poet_decide()
+int poet_report_applied(poet_state * state,
+                        unsigned int state_id,
+                        unsigned long id) {
+  if (state == NULL || state_id >= state->num_system_states || state->async) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (state_id != state->last_id) {
+    state->prev_id = state->last_id;
+    state->last_id = state_id;
+    state->applied_iter = id;
+    state->dwell_iters = 0;
+  }
+  return 0;
+}
+
+// Set a goal for a quantile of the iteration latencies
+int poet_set_latency_goal(poet_state * state,
+                          double quantile,
+                          double latency) {
+  latency_state * lat;
+  double samples;
+
+  if (state == NULL || quantile <= 0 || quantile >= 1 || latency <= 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  lat = calloc(1, sizeof(latency_state));
+  if (lat == NULL) {
+    return -1;
+  }
+  lat->quantile = quantile;
+  lat->min = ldexp(latency, -LATENCY_OCTAVES / 2);
+  lat->weight = 1;
+  // long enough to see a few samples beyond the quantile, and a few periods
+  samples = LATENCY_TAIL_SAMPLES / (1 - quantile);
+  if (samples < LATENCY_WINDOW_PERIODS * state->period) {
+    samples = LATENCY_WINDOW_PERIODS * state->period;
+  }
+  lat->growth = samples / (samples - 1);
+
+  lock_steps(state);
+  free(state->latency);
+  state->latency = lat;
+  free(state->deadline);
+  state->deadline = NULL;
+  free(state->power_cap);
+  state->power_cap = NULL;
+  state->perf_goal = rate_to_real(1.0 / latency);
+  unlock_steps(state);
+  return 0;
+}
+
+// Adds a latency sample to the histogram
+static void latency_add(latency_state * lat,
+                        double latency) {
+  double pos = floor(log2(latency / lat->min) * LATENCY_BINS_PER_OCTAVE);
+  int bin = pos < 0 ? 0 : (pos < LATENCY_BINS ? (int) pos : LATENCY_BINS - 1);
+  unsigned int i;
+
+  lat->bins[bin] += lat->weight;
+  lat->total += lat->weight;
+  lat->weight *= lat->growth;
+  // rescale before the weights overflow
+  if (lat->weight > 1e100) {
+    for (i = 0; i < LATENCY_BINS; i++) {
+      lat->bins[i] /= lat->weight;
+    }
+    lat->total /= lat->weight;
+    lat->weight = 1;
+  }
+}
+
+// Estimates the quantile, interpolating within its bin on the log scale
+static double latency_quantile(const latency_state * lat) {
+  double target = lat->quantile * lat->total;
+  double sum = 0;
+  unsigned int i;
+
+  for (i = 0; i < LATENCY_BINS - 1; i++) {
+    if (sum + lat->bins[i] >= target) {
+      break;
+    }
+    sum += lat->bins[i];
+  }
+  return lat->min * exp2((i + (lat->bins[i] > 0 ?
+                               (target - sum) / lat->bins[i] : 0)) /
+                         LATENCY_BINS_PER_OCTAVE);
+}
+
+// Runs POET decision engine on the latency of an iteration
+void poet_apply_latency(poet_state * state,
+                        unsigned long id,
+                        double latency,
+                        real_t pwr) {
+  real_t perf;
+
+  if (state == NULL || latency <= 0 ||
+      !__atomic_load_n(&state->control_enabled, __ATOMIC_RELAXED)) {
+    return;
+  }
+
+  // the sample was produced by the last state applied, in one iteration
+  record_run(state, state->last_id, 1);
+  estimate_state(state, 1, rate_to_real(1.0 / latency), pwr);
+
+  // the controller sees the quantile as a rate against the goal's rate
+  if (state->latency != NULL) {
+    latency_add(state->latency, latency);
+    perf = rate_to_real(1.0 / latency_quantile(state->latency));
+  } else {
+    perf = rate_to_real(1.0 / latency);
+  }
+  count_iteration(state);
+  if (state->current_action == 0) {
+    decide(state, id, perf);
+  }
+
+  apply_schedule(state);
+}
+
+// Reads the energy source, returns joules < 0 if there is none or it failed
+static inline double read_energy(poet_state * state) {
+  double joules;
+  if (state->energy == NULL || state->energy(state->energy_arg, &joules) ||
+      joules < 0) {
+    return -1;
+  }
+  return joules;
+}
+
+// Change the number of beats in the window of poet_beat()
+int poet_set_beat_window(poet_state * state,
+                         unsigned int window) {
+  beat_record * beats;
+
+  if (state == NULL || window == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  beats = malloc(window * sizeof(beat_record));
+  if (beats == NULL) {
+    return -1;
+  }
+  free(state->beats);
+  state->beats = beats;
+  state->beat_window = window;
+  state->beat_pos = 0;
+  state->num_beats = 0;
+
+  return 0;
+}
+
+// Set the energy source read by poet_beat() and work reporting
+void poet_set_energy_source(poet_state * state,
+                            poet_energy_func energy,
+                            void * energy_arg) {
+  if (state != NULL) {
+    state->energy = energy;
+    state->energy_arg = energy_arg;
+  }
+}
+
+// Timestamps an iteration and runs the decision engine with the windowed rate
+void poet_beat(poet_state * state) {
+  beat_record oldest;
+  beat_record first;
+  uint64_t now;
+  uint64_t elapsed;
+  uint64_t run;
+  unsigned long n;
+  double joules;
+  real_t perf;
+  real_t pwr = R_ZERO;
+  real_t est_perf;
+  real_t est_pwr;
+
+  if (state == NULL || !__atomic_load_n(&state->control_enabled, __ATOMIC_RELAXED)) {
+    return;
+  }
+
+  now = get_ns();
+  joules = read_energy(state);
+
+  // the slot about to be replaced holds the beat a window ago once it is full,
+  // copy it before the new beat overwrites it
+  n = state->num_beats < state->beat_window ? state->num_beats :
+                                              state->beat_window;
+  elapsed = 0;
+  if (n > 0) {
+    oldest = n < state->beat_window ? state->beats[0] :
+                                      state->beats[state->beat_pos];
+    elapsed = now - oldest.ns;
+  }
+
+  state->beats[state->beat_pos].ns = now;
+  state->beats[state->beat_pos].joules = joules;
+  if (++state->beat_pos == state->beat_window) {
+    state->beat_pos = 0;
+  }
+  state->num_beats++;
+
+  // the first beat only starts the window, but it ends an iteration
+  if (elapsed == 0) {
+    count_iteration(state);
+    return;
+  }
+  perf = CONST(n * 1000000000.0 / elapsed);
+  if (joules >= 0 && oldest.joules >= 0) {
+    pwr = CONST((joules - oldest.joules) * 1000000000.0 / elapsed);
+  }
+
+  // the beats since the last state change ran in one state, the estimators
+  // learn from those alone when the window holds more
+  record_run(state, state->last_id, 1);
+  run = state->runs[state->run_pos].iters;
+  if (run < n) {
+    first = state->beats[(state->beat_pos + state->beat_window - 1 - run) %
+                         state->beat_window];
+    est_perf = CONST(run * 1000000000.0 / (now - first.ns));
+    est_pwr = joules >= 0 && first.joules >= 0 ?
+              CONST((joules - first.joules) * 1000000000.0 / (now - first.ns)) :
+              R_ZERO;
+    estimate_state(state, run, est_perf, est_pwr);
+  } else {
+    estimate_state(state, n, perf, pwr);
+  }
+  apply_control(state, state->num_beats - 1, perf);
+}
+
+/*
+##################################################
+###########  WORK REPORTING  #####################
+##################################################
+*/
+
+// Slot index + 1 of the calling thread, assigned round robin on first use
+static __thread unsigned int ingest_thread_slot;
+static unsigned int ingest_next_slot;
+
+static inline unsigned int get_ingest_slot(void) {
+  if (ingest_thread_slot == 0) {
+    ingest_thread_slot = __atomic_add_fetch(&ingest_next_slot, 1,
+                                            __ATOMIC_RELAXED);
+  }
+  return ingest_thread_slot - 1;
+}
+
+/*
+ * Runs a controller step for the work published so far. Decides once a period
+ * of work is done, or on every timer tick, using the rate since the last
+ * decision. The schedule is for period iterations, on a timer it is scaled to
+ * the work expected until the next tick at the goal rate.
+ * Must hold step_lock.
+ */
+static void ingest_step(poet_state * state,
+                        uint64_t now_ns,
+                        int tick) {
+  ingest_state * ing = state->ingest;
+  uint64_t total = __atomic_load_n(&ing->total, __ATOMIC_ACQUIRE);
+  uint64_t delta = total - ing->start;
+  uint64_t next;
+  uint64_t low_iters;
+  double joules;
+  real_t perf;
+  real_t pwr;
+
+  // the dwell time counts reported work
+  if (state->dwell_iters < state->min_dwell) {
+    state->dwell_iters = total - ing->dwell_total >=
+                         state->min_dwell - state->dwell_iters ?
+                         state->min_dwell :
+                         state->dwell_iters + (total - ing->dwell_total);
+  }
+  // the work since ran in the last state applied
+  record_run(state, state->last_id, total - ing->dwell_total);
+  ing->dwell_total = total;
+
+  if ((tick || (ing->timer_ms == 0 && delta >= state->period)) &&
+      delta > 0 && now_ns > ing->start_ns) {
+    perf = CONST((double) delta * 1000000000.0 / (now_ns - ing->start_ns));
+    joules = read_energy(state);
+    pwr = R_ZERO;
+    if (joules >= 0 && ing->start_joules >= 0) {
+      pwr = CONST((joules - ing->start_joules) * 1000000000.0 /
+                  (now_ns - ing->start_ns));
+    }
+    ing->start_joules = joules;
+    // the samples were produced by the last state applied
+    estimate_state(state, delta, perf, pwr);
+    if (state->deadline != NULL && total > state->deadline->reported) {
+      state->deadline->done += total - state->deadline->reported;
+      state->deadline->reported = total;
+    }
+    decide(state, total, perf);
+    // -1 when no states bracket the target, there is no low state phase then
+    low_iters = state->low_state_iters > 0 ?
+                (uint64_t) state->low_state_iters : 0;
+    if (ing->timer_ms > 0) {
+      low_iters = low_iters * real_to_db(state->perf_goal) * ing->timer_ms /
+                  (1000.0 * state->period);
+    }
+    ing->switch_at = total + low_iters;
+    ing->start = total;
+    ing->start_ns = now_ns;
+    apply_config(state, ing->switch_at > total ? state->lower_id :
+                                                 state->upper_id);
+  } else if (ing->switch_at > 0 && total >= ing->switch_at) {
+    apply_config(state, state->upper_id);
+    ing->switch_at = 0;
+  }
+
+  next = ing->switch_at > total ? ing->switch_at : UINT64_MAX;
+  if (ing->timer_ms == 0 && ing->start + state->period < next) {
+    next = ing->start + state->period;
+  }
+  __atomic_store_n(&ing->next_event, next, __ATOMIC_RELEASE);
+}
+
+// Publishes the work of all slots, including batches that are not full
+static void ingest_collect(ingest_state * ing) {
+  uint64_t pending;
+  unsigned int i;
+
+  for (i = 0; i < ing->num_slots; i++) {
+    pending = __atomic_exchange_n(&ing->slots[i].pending, 0, __ATOMIC_RELAXED);
+    if (pending > 0) {
+      __atomic_add_fetch(&ing->total, pending, __ATOMIC_RELEASE);
+    }
+  }
+}
+
+// Steps the controller every timer_ms
+static void * ingest_timer_thread(void * arg) {
+  poet_state * state = (poet_state *) arg;
+  ingest_state * ing = state->ingest;
+  struct timespec deadline;
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  pthread_mutex_lock(&ing->timer_mutex);
+  while (!ing->timer_stop) {
+    deadline.tv_nsec += (ing->timer_ms % 1000) * 1000000L;
+    deadline.tv_sec += ing->timer_ms / 1000 + deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+    while (!ing->timer_stop &&
+           pthread_cond_timedwait(&ing->timer_cond, &ing->timer_mutex,
+                                  &deadline) != ETIMEDOUT);
+    if (ing->timer_stop) {
+      break;
+    }
+    pthread_mutex_unlock(&ing->timer_mutex);
+
+    if (__atomic_load_n(&state->control_enabled, __ATOMIC_RELAXED)) {
+      ingest_collect(ing);
+      // a reporting thread may be switching states
+      while (__atomic_exchange_n(&ing->step_lock, 1, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+      }
+      ingest_step(state, get_ns(), 1);
+      __atomic_store_n(&ing->step_lock, 0, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_lock(&ing->timer_mutex);
+  }
+  pthread_mutex_unlock(&ing->timer_mutex);
+
+  return NULL;
+}
+
+static void ingest_destroy(ingest_state * ing) {
+  if (ing->timer_ms > 0) {
+    pthread_mutex_lock(&ing->timer_mutex);
+    ing->timer_stop = 1;
+    pthread_cond_broadcast(&ing->timer_cond);
+    pthread_mutex_unlock(&ing->timer_mutex);
+    pthread_join(ing->timer, NULL);
+    pthread_cond_destroy(&ing->timer_cond);
+    pthread_mutex_destroy(&ing->timer_mutex);
+  }
+  free(ing->slots);
+  free(ing);
+}
+
+// Enable or disable reporting work from many threads
+int poet_set_work_reporting(poet_state * state,
+                            unsigned int num_slots,
+                            unsigned int batch,
+                            unsigned int timer_ms) {
+  ingest_state * ing;
+  pthread_condattr_t attr;
+  void * mem;
+  int err;
+
+  if (state == NULL || (num_slots > 0 && batch == 0)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (state->ingest != NULL) {
+    ingest_destroy(state->ingest);
+    state->ingest = NULL;
+  }
+  if (num_slots == 0) {
+    return 0;
+  }
+
+  if (posix_memalign(&mem, INGEST_ALIGN, sizeof(ingest_state))) {
+    errno = ENOMEM;
+    return -1;
+  }
+  ing = (ingest_state *) mem;
+  memset(ing, 0, sizeof(ingest_state));
+  if (posix_memalign(&mem, INGEST_ALIGN, num_slots * sizeof(ingest_slot))) {
+    free(ing);
+    errno = ENOMEM;
+    return -1;
+  }
+  ing->slots = (ingest_slot *) mem;
+  memset(ing->slots, 0, num_slots * sizeof(ingest_slot));
+  ing->num_slots = num_slots;
+  ing->batch = batch;
+  ing->timer_ms = timer_ms;
+  ing->start_ns = get_ns();
+  ing->start_joules = read_energy(state);
+  ing->next_event = timer_ms > 0 ? UINT64_MAX : state->period;
+  state->ingest = ing;
+  // the new counters start from 0
+  if (state->deadline != NULL) {
+    state->deadline->reported = 0;
+  }
+
+  if (timer_ms > 0) {
+    pthread_mutex_init(&ing->timer_mutex, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ing->timer_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    err = pthread_create(&ing->timer, NULL, ingest_timer_thread, state);
+    if (err) {
+      pthread_cond_destroy(&ing->timer_cond);
+      pthread_mutex_destroy(&ing->timer_mutex);
+      ing->timer_ms = 0;
+      ingest_destroy(ing);
+      state->ingest = NULL;
+      errno = err;
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+// Report completed work from any thread
+void poet_report_work(poet_state * state,
+                      unsigned int count,
+                      uint64_t timestamp_ns) {
+  ingest_state * ing;
+  ingest_slot * slot;
+  uint64_t pending;
+  uint64_t total;
+
+  if (state == NULL || state->ingest == NULL || count == 0 ||
+      !__atomic_load_n(&state->control_enabled, __ATOMIC_RELAXED)) {
+    return;
+  }
+  ing = state->ingest;
+
+  // only threads sharing the slot touch its cache line
+  slot = &ing->slots[get_ingest_slot() % ing->num_slots];
+  pending = __atomic_add_fetch(&slot->pending, count, __ATOMIC_RELAXED);
+  if (pending < ing->batch) {
+    return;
+  }
+  pending = __atomic_exchange_n(&slot->pending, 0, __ATOMIC_RELAXED);
+  if (pending == 0) {
+    return;
+  }
+  total = __atomic_add_fetch(&ing->total, pending, __ATOMIC_RELEASE);
+
+  // step if this crossed a boundary and no other thread is stepping
+  if (total < __atomic_load_n(&ing->next_event, __ATOMIC_ACQUIRE) ||
+      __atomic_exchange_n(&ing->step_lock, 1, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+  ingest_step(state, timestamp_ns > 0 ? timestamp_ns : get_ns(), 0);
+  __atomic_store_n(&ing->step_lock, 0, __ATOMIC_RELEASE);
+}
+
+#ifdef POET_PROFILE
+void poet_get_profile(const poet_state * state,
+                      poet_profile * profile) {
+  *profile = state->profile;
+}
+
+void poet_reset_profile(poet_state * state) {
+  memset(&state->profile, 0, sizeof(poet_profile));
+}
+#endif
@@ -0,0 +1,402 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "poet_calibrate.h"
+#include "poet_config.h"
+
+static inline double get_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+// The affinity and frequencies before calibrating, restored afterwards
+typedef struct {
+  cpu_set_t* mask;
+  size_t mask_size;
+  // scaling_setspeed of each core, 0 if it could not be read
+  unsigned long* freqs;
+  unsigned int num_cores;
+} saved_cpu_state;
+
+static unsigned long read_setspeed(unsigned int cpu) {
+  FILE* fp;
+  char path[POET_CPUFREQ_PATH_LEN];
+  unsigned long freq;
+
+  snprintf(path, sizeof(path),
+           POET_CPU_SYSFS_DIR "/cpu%u/cpufreq/scaling_setspeed", cpu);
+  fp = fopen(path, "r");
+  if (fp == NULL) {
+    return 0;
+  }
+  // reads "<unsupported>" unless the governor is userspace
+  if (fscanf(fp, "%lu", &freq) != 1) {
+    freq = 0;
+  }
+  fclose(fp);
+  return freq;
+}
+
+static int write_setspeed(unsigned int cpu, unsigned long freq) {
+  FILE* fp;
+  char path[POET_CPUFREQ_PATH_LEN];
+  int ret = 0;
+
+  snprintf(path, sizeof(path),
+           POET_CPU_SYSFS_DIR "/cpu%u/cpufreq/scaling_setspeed", cpu);
+  fp = fopen(path, "w");
+  if (fp == NULL) {
+    return -1;
+  }
+  if (fprintf(fp, "%lu\n", freq) < 0) {
+    ret = -1;
+  }
+  if (fclose(fp)) {
+    ret = -1;
+  }
+  return ret;
+}
+
+static int save_cpu_state(saved_cpu_state* saved,
+                          const poet_cpu_state_t* states,
+                          unsigned int num_states) {
+  long num_configured_cpus = sysconf(_SC_NPROCESSORS_CONF);
+  unsigned int i;
+
+  memset(saved, 0, sizeof(saved_cpu_state));
+  if (num_configured_cpus <= 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  saved->mask = CPU_ALLOC(num_configured_cpus);
+  if (saved->mask == NULL) {
+    return -1;
+  }
+  saved->mask_size = CPU_ALLOC_SIZE(num_configured_cpus);
+  if (sched_getaffinity(0, saved->mask_size, saved->mask)) {
+    CPU_FREE(saved->mask);
+    return -1;
+  }
+
+  for (i = 0; i < num_states; i++) {
+    if (states[i].cores >= saved->num_cores) {
+      saved->num_cores = states[i].cores + 1;
+    }
+  }
+  saved->freqs = malloc(saved->num_cores * sizeof(unsigned long));
+  if (saved->freqs == NULL) {
+    CPU_FREE(saved->mask);
+    return -1;
+  }
+  for (i = 0; i < saved->num_cores; i++) {
+    saved->freqs[i] = read_setspeed(i);
+  }
+  return 0;
+}
+
+// Sets the affinity of every thread in this process, returns the number of
+// failures
+static unsigned int set_process_affinity(size_t mask_size,
+                                         const cpu_set_t* mask) {
+  DIR* dir;
+  struct dirent* entry;
+  pid_t tid;
+  unsigned int failures = 0;
+
+  dir = opendir("/proc/self/task");
+  if (dir == NULL) {
+    return 1;
+  }
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    tid = (pid_t) strtol(entry->d_name, NULL, 10);
+    // threads may exit while we iterate, that's not an error
+    if (sched_setaffinity(tid, mask_size, mask) && errno != ESRCH) {
+      failures++;
+    }
+  }
+  closedir(dir);
+  return failures;
+}
+
+// Restores the affinity of every thread and the frequency of every core that
+// was read, returns the number of failures
+static unsigned int restore_cpu_state(saved_cpu_state* saved) {
+  unsigned int i;
+  unsigned int failures = 0;
+
+  for (i = 0; i < saved->num_cores; i++) {
+    if (saved->freqs[i] > 0 && write_setspeed(i, saved->freqs[i])) {
+      failures++;
+    }
+  }
+  // the actuator set the affinity of every thread, not just this one
+  failures += set_process_affinity(saved->mask_size, saved->mask);
+
+  free(saved->freqs);
+  CPU_FREE(saved->mask);
+  return failures;
+}
+
+// Pins every thread to the cores of the state, which the actuator only does
+// when the number of cores changes
+static int set_state_affinity(const poet_cpu_state_t* state) {
+  long num_configured_cpus = sysconf(_SC_NPROCESSORS_CONF);
+  cpu_set_t* mask;
+  size_t mask_size;
+  unsigned int i;
+  unsigned int failures;
+
+  if (num_configured_cpus <= 0) {
+    return -1;
+  }
+  mask = CPU_ALLOC(num_configured_cpus);
+  if (mask == NULL) {
+    return -1;
+  }
+  mask_size = CPU_ALLOC_SIZE(num_configured_cpus);
+  CPU_ZERO_S(mask_size, mask);
+  for (i = 0; i <= state->cores; i++) {
+    CPU_SET_S(i, mask_size, mask);
+  }
+  failures = set_process_affinity(mask_size, mask);
+  CPU_FREE(mask);
+  return failures ? -1 : 0;
+}
+
+// Measures every state, returns 0 on success or the errno to fail with
+static int calibrate_states(poet_cpu_actuator* act,
+                            const poet_cpu_state_t* states,
+                            unsigned int num_states,
+                            unsigned int iterations,
+                            poet_calibrate_work_func work,
+                            void* work_arg,
+                            poet_calibrate_energy_func energy,
+                            void* energy_arg,
+                            poet_calibration_t* results) {
+  unsigned int i;
+  unsigned int j;
+  unsigned int last_id;
+  double start;
+  double elapsed;
+  double energy_start = 0;
+  double energy_end = 0;
+
+  // measure the first state on its own cores rather than the inherited ones
+  if (set_state_affinity(&states[0])) {
+    fprintf(stderr, "poet_calibrate: Failed to set the affinity of state 0\n");
+    return EIO;
+  }
+  last_id = 0;
+
+  for (i = 0; i < num_states; i++) {
+    if (cpu_actuator_apply(act, i, last_id, NULL)) {
+      fprintf(stderr, "poet_calibrate: Failed to apply state %u\n", i);
+      return EIO;
+    }
+    last_id = i;
+
+    // warm up in the new state
+    work(work_arg);
+
+    if (energy != NULL && energy(energy_arg, &energy_start)) {
+      fprintf(stderr, "poet_calibrate: Failed to read energy\n");
+      return EIO;
+    }
+    start = get_seconds();
+    for (j = 0; j < iterations; j++) {
+      work(work_arg);
+    }
+    elapsed = get_seconds() - start;
+    if (energy != NULL && energy(energy_arg, &energy_end)) {
+      fprintf(stderr, "poet_calibrate: Failed to read energy\n");
+      return EIO;
+    }
+    if (energy_end < energy_start) {
+      fprintf(stderr, "poet_calibrate: Energy counter went backwards in "
+              "state %u\n", i);
+      return EIO;
+    }
+
+    results[i].id = states[i].id;
+    results[i].rate = iterations / elapsed;
+    if (energy != NULL) {
+      results[i].power = (energy_end - energy_start) / elapsed;
+    } else {
+      results[i].power = (states[i].cores + 1) * (double) states[i].freq;
+    }
+  }
+  return 0;
+}
+
+int poet_calibrate(const poet_cpu_state_t* states,
+                   unsigned int num_states,
+                   unsigned int iterations,
+                   poet_calibrate_work_func work,
+                   void* work_arg,
+                   poet_calibrate_energy_func energy,
+                   void* energy_arg,
+                   poet_calibration_t* results) {
+  poet_cpu_actuator* act;
+  saved_cpu_state saved;
+  int err;
+
+  if (states == NULL || num_states == 0 || iterations == 0 || work == NULL ||
+      results == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  act = cpu_actuator_init(states, num_states);
+  if (act == NULL) {
+    return -1;
+  }
+  if (save_cpu_state(&saved, states, num_states)) {
+    err = errno;
+    fprintf(stderr, "poet_calibrate: Failed to save the starting CPU state\n");
+    cpu_actuator_destroy(act);
+    errno = err;
+    return -1;
+  }
+
+  err = calibrate_states(act, states, num_states, iterations, work, work_arg,
+                         energy, energy_arg, results);
+
+  // the results are still valid, so only warn
+  if (restore_cpu_state(&saved)) {
+    fprintf(stderr, "poet_calibrate: Failed to restore the starting CPU "
+            "state\n");
+  }
+  cpu_actuator_destroy(act);
+  if (err) {
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
+static int calibration_cmp(const void* a, const void* b) {
+  const poet_calibration_t* ca = (const poet_calibration_t*) a;
+  const poet_calibration_t* cb = (const poet_calibration_t*) b;
+  if (ca->rate < cb->rate) {
+    return -1;
+  }
+  if (ca->rate > cb->rate) {
+    return 1;
+  }
+  if (ca->power < cb->power) {
+    return -1;
+  }
+  if (ca->power > cb->power) {
+    return 1;
+  }
+  return ca->id < cb->id ? -1 : (ca->id > cb->id ? 1 : 0);
+}
+
+unsigned int poet_calibration_prune(poet_calibration_t* results,
+                                    unsigned int num_results) {
+  unsigned int i;
+  unsigned int k;
+  double min_power;
+
+  if (results == NULL || num_results == 0) {
+    return 0;
+  }
+
+  qsort(results, num_results, sizeof(poet_calibration_t), calibration_cmp);
+
+  // walk from the fastest state, keep a state only if it is cheaper than every
+  // faster state that was kept; kept states are packed at the end of the array
+  k = num_results - 1;
+  min_power = results[k].power;
+  for (i = num_results - 1; i-- > 0;) {
+    if (results[i].power < min_power) {
+      min_power = results[i].power;
+      // a cheaper state at the same rate replaces the kept one
+      if (results[i].rate < results[k].rate) {
+        k--;
+      }
+      results[k] = results[i];
+    }
+  }
+
+  memmove(results, &results[k], (num_results - k) * sizeof(poet_calibration_t));
+  return num_results - k;
+}
+
+static const poet_cpu_state_t* find_cpu_state(const poet_cpu_state_t* states,
+                                              unsigned int num_states,
+                                              unsigned int id) {
+  unsigned int i;
+  for (i = 0; i < num_states; i++) {
+    if (states[i].id == id) {
+      return &states[i];
+    }
+  }
+  return NULL;
+}
+
+int poet_calibration_write(const char* control_path,
+                           const char* cpu_path,
+                           const poet_cpu_state_t* states,
+                           unsigned int num_states,
+                           const poet_calibration_t* results,
+                           unsigned int num_results) {
+  FILE* control_file;
+  FILE* cpu_file;
+  const poet_cpu_state_t* cpu_state;
+  unsigned int i;
+  int ret = 0;
+
+  if (control_path == NULL || cpu_path == NULL || states == NULL ||
+      results == NULL || num_results == 0 ||
+      results[0].rate <= 0 || results[0].power <= 0) {
+    fprintf(stderr, "poet_calibration_write: Invalid arguments\n");
+    return -1;
+  }
+
+  control_file = fopen(control_path, "w");
+  if (control_file == NULL) {
+    fprintf(stderr, "poet_calibration_write: Could not open file %s\n",
+            control_path);
+    return -1;
+  }
+  cpu_file = fopen(cpu_path, "w");
+  if (cpu_file == NULL) {
+    fprintf(stderr, "poet_calibration_write: Could not open file %s\n",
+            cpu_path);
+    fclose(control_file);
+    return -1;
+  }
+
+  fprintf(control_file, "#id\tSpeedup\tPower\n");
+  fprintf(cpu_file, "#id\tfreq\tcores\n");
+  for (i = 0; i < num_results; i++) {
+    // results may be pruned, so look up the CPU state by id
+    cpu_state = find_cpu_state(states, num_states, results[i].id);
+    if (cpu_state == NULL) {
+      fprintf(stderr, "poet_calibration_write: No CPU state with id %u\n",
+              results[i].id);
+      ret = -1;
+      break;
+    }
+    fprintf(control_file, "%u\t%f\t%f\n", i,
+            results[i].rate / results[0].rate,
+            results[i].power / results[0].power);
+    fprintf(cpu_file, "%u\t%lu\t%u\n", i, cpu_state->freq, cpu_state->cores);
+  }
+
+  fclose(control_file);
+  fclose(cpu_file);
+  return ret;
+}
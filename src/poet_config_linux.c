@@ -1,12 +1,24 @@
 #define _GNU_SOURCE
 
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sched.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 #include "poet.h"
 #include "poet_config.h"
+#include "poet_math.h"
 
 #ifndef POET_CONTROL_STATE_CONFIG_FILE
   #define POET_CONTROL_STATE_CONFIG_FILE "/etc/poet/control_config"
@@ -54,12 +66,12 @@ static inline unsigned int get_current_cpu_count(void) {
  */
 static inline int cpu_governor_cmp(unsigned int cpu, const char* governor) {
   FILE* fp;
-  char buffer[128];
+  char buffer[POET_CPUFREQ_PATH_LEN];
   int governor_cmp = -1;
   size_t len;
 
   snprintf(buffer, sizeof(buffer),
-           "/sys/devices/system/cpu/cpu%u/cpufreq/scaling_governor", cpu);
+           POET_CPU_SYSFS_DIR "/cpu%u/cpufreq/scaling_governor", cpu);
   fp = fopen(buffer, "r");
   if (fp == NULL) {
     fprintf(stderr, "cpu_governor_cmp: Failed to open %s\n", buffer);
@@ -84,11 +96,11 @@ static inline int cpu_governor_cmp(unsigned int cpu, const char* governor) {
  */
 static inline unsigned long get_current_cpu_frequency(unsigned int cpu) {
   FILE* fp;
-  char buffer[128];
+  char buffer[POET_CPUFREQ_PATH_LEN];
   unsigned long curr_freq = 0;
 
   snprintf(buffer, sizeof(buffer),
-           "/sys/devices/system/cpu/cpu%u/cpufreq/scaling_cur_freq", cpu);
+           POET_CPU_SYSFS_DIR "/cpu%u/cpufreq/scaling_cur_freq", cpu);
   fp = fopen(buffer, "r");
   if (fp == NULL) {
     fprintf(stderr, "get_current_cpu_frequency: Failed to open %s\n", buffer);
@@ -192,7 +204,7 @@ static void apply_cpu_config_taskset(poet_cpu_state_t* cpu_states,
   printf("apply_cpu_config_taskset: Applying CPU frequency: %lu\n", cpu_states[id].freq);
   for (i = 0; i <= cpu_states[num_states - 1].cores; i++) {
     snprintf(command, sizeof(command),
-             "echo %lu > /sys/devices/system/cpu/cpu%u/cpufreq/scaling_setspeed",
+             "echo %lu > " POET_CPU_SYSFS_DIR "/cpu%u/cpufreq/scaling_setspeed",
              cpu_states[id].freq, i);
     retvalsyscall = system(command);
     if (retvalsyscall != 0) {
@@ -210,29 +222,520 @@ void apply_cpu_config(void* states,
                            last_id);
 }
 
-static inline unsigned int get_num_states(FILE* rfile) {
-  char line[BUFSIZ];
+struct poet_cpu_actuator {
+  const poet_cpu_state_t* states;
+  unsigned int num_states;
+  // scaling_setspeed file descriptors for cores 0 to max_core
+  int* freq_fds;
+  unsigned int max_core;
+  // affinity mask and its size for the configured CPUs
+  cpu_set_t* mask;
+  size_t mask_size;
+  long num_configured_cpus;
+  poet_cpu_apply_result result;
+  // mean latencies of the successful affinity and frequency steps, 0 until
+  // measured, may be read from other threads
+  double affinity_seconds;
+  double freq_seconds;
+};
+
+poet_cpu_actuator* cpu_actuator_init(const poet_cpu_state_t* states,
+                                     unsigned int num_states) {
+  poet_cpu_actuator* act;
+  char path[POET_CPUFREQ_PATH_LEN];
+  unsigned int i;
+  int err;
+
+  if (states == NULL || num_states == 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  act = calloc(1, sizeof(poet_cpu_actuator));
+  if (act == NULL) {
+    return NULL;
+  }
+  act->states = states;
+  act->num_states = num_states;
+  for (i = 0; i < num_states; i++) {
+    if (states[i].cores > act->max_core) {
+      act->max_core = states[i].cores;
+    }
+  }
+
+  act->num_configured_cpus = sysconf(_SC_NPROCESSORS_CONF);
+  if (act->num_configured_cpus <= 0 ||
+      act->max_core >= (unsigned long) act->num_configured_cpus) {
+    fprintf(stderr, "cpu_actuator_init: States use more cores than are "
+            "configured\n");
+    free(act);
+    errno = EINVAL;
+    return NULL;
+  }
+  act->mask = CPU_ALLOC(act->num_configured_cpus);
+  if (act->mask == NULL) {
+    free(act);
+    return NULL;
+  }
+  act->mask_size = CPU_ALLOC_SIZE(act->num_configured_cpus);
+
+  act->freq_fds = malloc((act->max_core + 1) * sizeof(int));
+  if (act->freq_fds == NULL) {
+    CPU_FREE(act->mask);
+    free(act);
+    return NULL;
+  }
+  for (i = 0; i <= act->max_core; i++) {
+    snprintf(path, sizeof(path),
+             POET_CPU_SYSFS_DIR "/cpu%u/cpufreq/scaling_setspeed", i);
+    act->freq_fds[i] = open(path, O_WRONLY | O_CLOEXEC);
+    if (act->freq_fds[i] < 0) {
+      err = errno;
+      fprintf(stderr, "cpu_actuator_init: Failed to open %s: %s\n", path,
+              strerror(err));
+      act->max_core = i;
+      cpu_actuator_destroy(act);
+      errno = err;
+      return NULL;
+    }
+  }
+
+  return act;
+}
+
+void cpu_actuator_destroy(poet_cpu_actuator* actuator) {
+  unsigned int i;
+  if (actuator != NULL) {
+    for (i = 0; i <= actuator->max_core; i++) {
+      if (actuator->freq_fds[i] >= 0) {
+        close(actuator->freq_fds[i]);
+      }
+    }
+    free(actuator->freq_fds);
+    CPU_FREE(actuator->mask);
+    free(actuator);
+  }
+}
+
+// Set the affinity of every thread in this process, returns number of failures
+static unsigned int set_process_affinity(poet_cpu_actuator* act,
+                                         unsigned int cores,
+                                         int* err) {
+  DIR* dir;
+  struct dirent* entry;
+  pid_t tid;
+  unsigned int i;
+  unsigned int failures = 0;
+
+  CPU_ZERO_S(act->mask_size, act->mask);
+  for (i = 0; i <= cores; i++) {
+    CPU_SET_S(i, act->mask_size, act->mask);
+  }
+
+  dir = opendir("/proc/self/task");
+  if (dir == NULL) {
+    *err = errno;
+    return 1;
+  }
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    tid = (pid_t) strtol(entry->d_name, NULL, 10);
+    // threads may exit while we iterate, that's not an error
+    if (sched_setaffinity(tid, act->mask_size, act->mask) && errno != ESRCH) {
+      *err = errno;
+      failures++;
+    }
+  }
+  closedir(dir);
+  return failures;
+}
+
+// Write the frequency to every core, returns number of failures
+static unsigned int set_frequency(poet_cpu_actuator* act,
+                                  unsigned long freq,
+                                  int* err) {
+  char buf[32];
+  int len;
+  unsigned int i;
+  unsigned int failures = 0;
+
+  len = snprintf(buf, sizeof(buf), "%lu\n", freq);
+  for (i = 0; i <= act->max_core; i++) {
+    if (pwrite(act->freq_fds[i], buf, len, 0) != len) {
+      *err = errno;
+      failures++;
+    }
+  }
+  return failures;
+}
+
+// Weight of a new sample in the mean latency of an actuator step
+#define LATENCY_WEIGHT 0.25
+
+static inline double get_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+// Running mean of the latency of an actuator step, the first sample sets it
+static void update_latency(double* mean, double seconds) {
+  double m;
+  __atomic_load(mean, &m, __ATOMIC_RELAXED);
+  m = m > 0 ? m + LATENCY_WEIGHT * (seconds - m) : seconds;
+  __atomic_store(mean, &m, __ATOMIC_RELAXED);
+}
+
+// Applies a state, changing affinity only if allowed and the cores differ
+static int actuator_apply(poet_cpu_actuator* actuator,
+                          unsigned int id,
+                          unsigned int last_id,
+                          int affinity,
+                          poet_cpu_apply_result* result) {
+  const poet_cpu_state_t* states;
+  double t;
+
+  if (actuator == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+  states = actuator->states;
+  memset(&actuator->result, 0, sizeof(poet_cpu_apply_result));
+
+  if (id >= actuator->num_states || last_id >= actuator->num_states) {
+    fprintf(stderr, "cpu_actuator_apply: id '%u' or last_id '%u' are not "
+            "acceptable values, they must be less than the number of states, "
+            "'%u'.\n", id, last_id, actuator->num_states);
+    actuator->result.affinity_errno = EINVAL;
+    actuator->result.freq_errno = EINVAL;
+  } else {
+    // only change affinity if number of cores has changed
+    if (affinity && states[id].cores != states[last_id].cores) {
+      t = get_seconds();
+      actuator->result.affinity_failures =
+        set_process_affinity(actuator, states[id].cores,
+                             &actuator->result.affinity_errno);
+      if (actuator->result.affinity_failures == 0) {
+        update_latency(&actuator->affinity_seconds, get_seconds() - t);
+      }
+    }
+    t = get_seconds();
+    actuator->result.freq_failures =
+      set_frequency(actuator, states[id].freq, &actuator->result.freq_errno);
+    if (actuator->result.freq_failures == 0) {
+      update_latency(&actuator->freq_seconds, get_seconds() - t);
+    }
+  }
+
+  if (result != NULL) {
+    memcpy(result, &actuator->result, sizeof(poet_cpu_apply_result));
+  }
+  return (actuator->result.affinity_errno || actuator->result.freq_errno) ? -1 : 0;
+}
+
+int cpu_actuator_apply(poet_cpu_actuator* actuator,
+                       unsigned int id,
+                       unsigned int last_id,
+                       poet_cpu_apply_result* result) {
+  return actuator_apply(actuator, id, last_id, 1, result);
+}
+
+void cpu_actuator_get_result(const poet_cpu_actuator* actuator,
+                             poet_cpu_apply_result* result) {
+  if (actuator != NULL && result != NULL) {
+    memcpy(result, &actuator->result, sizeof(poet_cpu_apply_result));
+  }
+}
+
+void apply_cpu_config_native(void* states,
+                             unsigned int num_states,
+                             unsigned int id,
+                             unsigned int last_id) {
+  poet_cpu_actuator* act = (poet_cpu_actuator*) states;
+  poet_cpu_apply_result result;
+  (void) num_states;
+  if (act == NULL) {
+    fprintf(stderr, "apply_cpu_config_native: states cannot be null.\n");
+    return;
+  }
+  if (cpu_actuator_apply(act, id, last_id, &result)) {
+    fprintf(stderr, "apply_cpu_config_native: Failed to apply state %u: "
+            "affinity failures=%u (%s), frequency failures=%u (%s)\n", id,
+            result.affinity_failures, strerror(result.affinity_errno),
+            result.freq_failures, strerror(result.freq_errno));
+  }
+}
+
+// Applies the frequency, and the affinity if narrowing it, with the actuator
+static void cooperative_actuator_apply(poet_cpu_cooperative* coop,
+                                       unsigned int id,
+                                       unsigned int last_id) {
+  poet_cpu_apply_result result;
+  if (actuator_apply(coop->actuator, id, last_id, coop->narrow_affinity,
+                     &result)) {
+    fprintf(stderr, "apply_cpu_config_cooperative: Failed to apply state %u: "
+            "affinity failures=%u (%s), frequency failures=%u (%s)\n", id,
+            result.affinity_failures, strerror(result.affinity_errno),
+            result.freq_failures, strerror(result.freq_errno));
+  }
+}
+
+void apply_cpu_config_cooperative(void* states,
+                                  unsigned int num_states,
+                                  unsigned int id,
+                                  unsigned int last_id) {
+  poet_cpu_cooperative* coop = (poet_cpu_cooperative*) states;
+  const poet_cpu_state_t* cpu_states;
+  int grow;
+  double t;
+  (void) num_states;
+
+  if (coop == NULL || coop->states == NULL || coop->parallelism == NULL) {
+    fprintf(stderr, "apply_cpu_config_cooperative: states and parallelism "
+            "cannot be null.\n");
+    return;
+  }
+  if (id >= coop->num_states || last_id >= coop->num_states) {
+    fprintf(stderr, "apply_cpu_config_cooperative: id '%u' or last_id '%u' "
+            "are not acceptable values, they must be less than the number of "
+            "states, '%u'.\n", id, last_id, coop->num_states);
+    return;
+  }
+  cpu_states = coop->states;
+
+  // widen the affinity before waking workers, park them before narrowing it
+  grow = cpu_states[id].cores > cpu_states[last_id].cores;
+  if (coop->actuator != NULL && grow) {
+    cooperative_actuator_apply(coop, id, last_id);
+  }
+  if (cpu_states[id].cores != cpu_states[last_id].cores) {
+    t = get_seconds();
+    if (coop->parallelism(coop->parallelism_arg, cpu_states[id].cores + 1)) {
+      fprintf(stderr, "apply_cpu_config_cooperative: Failed to set "
+              "parallelism %u\n", cpu_states[id].cores + 1);
+    } else if (coop->actuator != NULL && !coop->narrow_affinity) {
+      // the callback is the core count step
+      update_latency(&coop->actuator->affinity_seconds, get_seconds() - t);
+    }
+  }
+  if (coop->actuator != NULL && !grow) {
+    cooperative_actuator_apply(coop, id, last_id);
+  }
+}
+
+int cpu_switch_cost(void* arg,
+                    unsigned int from_id,
+                    unsigned int to_id,
+                    double* seconds,
+                    double* joules) {
+  const poet_cpu_switch_model* model = (const poet_cpu_switch_model*) arg;
+  const poet_cpu_state_t* from;
+  const poet_cpu_state_t* to;
+
+  if (model == NULL || from_id >= model->num_states ||
+      to_id >= model->num_states) {
+    return -1;
+  }
+  from = &model->states[from_id];
+  to = &model->states[to_id];
+  *seconds = 0;
+  *joules = 0;
+  if (from->freq != to->freq) {
+    *seconds += model->freq_seconds;
+    *joules += model->freq_joules;
+  }
+  if (from->cores != to->cores) {
+    *seconds += model->core_seconds;
+    *joules += model->core_joules;
+  }
+  return 0;
+}
+
+int cpu_actuator_switch_cost(void* arg,
+                             unsigned int from_id,
+                             unsigned int to_id,
+                             double* seconds,
+                             double* joules) {
+  const poet_cpu_actuator* act = (const poet_cpu_actuator*) arg;
+  double latency;
+
+  if (act == NULL || from_id >= act->num_states || to_id >= act->num_states) {
+    return -1;
+  }
+  // the actuator always writes the frequency
+  __atomic_load(&act->freq_seconds, seconds, __ATOMIC_RELAXED);
+  if (act->states[from_id].cores != act->states[to_id].cores) {
+    __atomic_load(&act->affinity_seconds, &latency, __ATOMIC_RELAXED);
+    *seconds += latency;
+  }
+  *joules = 0;
+  return 0;
+}
+
+/*
+ * Config files have one state per line with three fields separated by
+ * whitespace, the first being the id. Ids count up from 0. Lines starting with
+ * '#' are comments.
+ */
+
+// Parses the fields after the id into the state, returns -1 on syntax errors
+typedef int (* parse_fields_func) (void* state, unsigned int id, char* fields);
+
+// Initial number of states allocated by parse_states, doubled as needed
+#define PARSE_MIN_STATES 64
+
+/*
+ * Reads the whole file and parses it in a single pass, growing the array of
+ * states as it goes.
+ */
+static int parse_states(const char* func,
+                        const char* path,
+                        size_t size,
+                        parse_fields_func parse_fields,
+                        void** states,
+                        unsigned int* num_states) {
+  struct stat st;
+  char* buf;
+  char* line;
+  char* end;
+  char* next;
+  char* p;
+  char* tmp;
+  size_t len = 0;
+  ssize_t r;
   unsigned int linenum = 0;
-  char id_str[BUFSIZ];
   unsigned int nstates = 0;
-  unsigned int nstates_tmp;
-  while (fgets(line, BUFSIZ, rfile) != NULL) {
+  unsigned int capacity = 0;
+  unsigned long id;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "%s: Could not open file %s\n", func, path);
+    return -1;
+  }
+  if (fstat(fd, &st) || (buf = malloc(st.st_size + 1)) == NULL) {
+    fprintf(stderr, "%s: Could not read file %s\n", func, path);
+    close(fd);
+    return -1;
+  }
+  while (len < (size_t) st.st_size &&
+         (r = read(fd, buf + len, st.st_size - len)) > 0) {
+    len += r;
+  }
+  close(fd);
+  buf[len] = '\0';
+
+  *states = NULL;
+  for (line = buf; line < buf + len; line = next) {
     linenum++;
+    end = memchr(line, '\n', buf + len - line);
+    next = end != NULL ? end + 1 : buf + len;
+    if (end != NULL) {
+      *end = '\0';
+    }
     if (line[0] == '#') {
       continue;
     }
-    if (sscanf(line, "%s", id_str) < 1) {
-      fprintf(stderr, "get_num_states: Syntax error, line %u.\n", linenum);
-      return 0;
+
+    errno = 0;
+    id = strtoul(line, &p, 0);
+    if (p == line || errno) {
+      fprintf(stderr, "%s: Syntax error, line %u\n", func, linenum);
+      goto fail;
+    }
+    if (id != nstates) {
+      fprintf(stderr, "%s: States are missing or out of order.\n", func);
+      goto fail;
+    }
+    if (nstates == capacity) {
+      capacity = capacity == 0 ? PARSE_MIN_STATES : 2 * capacity;
+      tmp = realloc(*states, capacity * size);
+      if (tmp == NULL) {
+        fprintf(stderr, "%s: realloc failed.\n", func);
+        goto fail;
+      }
+      // clear padding, the states may be written to a cache
+      memset(tmp + nstates * size, 0, (capacity - nstates) * size);
+      *states = tmp;
     }
-    nstates_tmp = strtoul(id_str, NULL, 0) + 1;
-    if (nstates_tmp != nstates + 1) {
-      fprintf(stderr, "get_num_states: States are missing or out of order.\n");
-      return 0;
+    if (parse_fields((char*) *states + nstates * size, nstates, p)) {
+      fprintf(stderr, "%s: Syntax error, line %u\n", func, linenum);
+      goto fail;
     }
-    nstates = nstates_tmp;
+    nstates++;
   }
-  return nstates;
+
+  free(buf);
+  if (nstates == 0) {
+    fprintf(stderr, "%s: No states in %s\n", func, path);
+    free(*states);
+    *states = NULL;
+    return -1;
+  }
+  *num_states = nstates;
+  return 0;
+
+fail:
+  free(buf);
+  free(*states);
+  *states = NULL;
+  return -1;
+}
+
+// Fields must be separated from what precedes them
+static inline int field_start(const char* p) {
+  return *p == ' ' || *p == '\t';
+}
+
+static int parse_control_fields(void* state, unsigned int id, char* fields) {
+  poet_control_state_t* cstate = (poet_control_state_t*) state;
+  char* p;
+  double speedup;
+  double cost;
+
+  if (!field_start(fields)) {
+    return -1;
+  }
+  speedup = strtod(fields, &p);
+  if (p == fields || !field_start(p)) {
+    return -1;
+  }
+  fields = p;
+  cost = strtod(fields, &p);
+  if (p == fields) {
+    return -1;
+  }
+  cstate->id = id;
+  cstate->speedup = CONST(speedup);
+  cstate->cost = CONST(cost);
+  return 0;
+}
+
+static int parse_cpu_fields(void* state, unsigned int id, char* fields) {
+  poet_cpu_state_t* cpu_state = (poet_cpu_state_t*) state;
+  char* p;
+  unsigned long freq;
+  unsigned long cores;
+
+  if (!field_start(fields)) {
+    return -1;
+  }
+  freq = strtoul(fields, &p, 0);
+  if (p == fields || !field_start(p)) {
+    return -1;
+  }
+  fields = p;
+  cores = strtoul(fields, &p, 0);
+  if (p == fields) {
+    return -1;
+  }
+  cpu_state->id = id;
+  cpu_state->freq = freq;
+  cpu_state->cores = cores;
+  return 0;
 }
 
 /* Example file:
@@ -244,15 +747,6 @@ static inline unsigned int get_num_states(FILE* rfile) {
 int get_control_states(const char* path,
                        poet_control_state_t** cstates,
                        unsigned int* num_states) {
-  poet_control_state_t * states;
-  FILE * rfile;
-  char line[BUFSIZ];
-  unsigned int linenum = 0;
-  char argA[BUFSIZ];
-  char argB[BUFSIZ];
-  char argC[BUFSIZ];
-  unsigned int id;
-
   if (cstates == NULL) {
     fprintf(stderr, "get_control_states: cstates cannot be NULL.\n");
     return -1;
@@ -262,70 +756,267 @@ int get_control_states(const char* path,
     path = POET_CONTROL_STATE_CONFIG_FILE;
   }
 
-  rfile = fopen(path, "r");
-  if (rfile == NULL) {
-    fprintf(stderr, "get_control_states: Could not open file %s\n", path);
+  return parse_states("get_control_states", path, sizeof(poet_control_state_t),
+                      parse_control_fields, (void**) cstates, num_states);
+}
+
+/* Example file:
+  #id   freq    cores
+  0     300000  0
+  1     350000  2
+  2     400000  1
+ */
+int get_cpu_states(const char* path,
+                   poet_cpu_state_t** cstates,
+                   unsigned int* num_states) {
+  if (cstates == NULL) {
+    fprintf(stderr, "get_cpu_states: cstates cannot be NULL.\n");
     return -1;
   }
 
-  *num_states = get_num_states(rfile);
-  if (*num_states == 0) {
-    fclose(rfile);
-    return -1;
+  if (path == NULL) {
+    path = POET_CPU_STATE_CONFIG_FILE;
+  }
+
+  return parse_states("get_cpu_states", path, sizeof(poet_cpu_state_t),
+                      parse_cpu_fields, (void**) cstates, num_states);
+}
+
+/*
+ * Compiled state tables: a header followed by the states exactly as they are
+ * laid out in memory. A cache is only used if it was built from a text file
+ * with the same modification time and size, by a build with the same state
+ * layout and number format, and its checksum matches.
+ */
+
+#define CONFIG_CACHE_MAGIC "POETCFG"
+#define CONFIG_CACHE_VERSION 1
+#define CONFIG_CACHE_SUFFIX ".cache"
+
+typedef enum {
+  CONFIG_CACHE_CONTROL = 1,
+  CONFIG_CACHE_CPU = 2
+} config_cache_type;
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t type;
+  uint32_t state_size;
+  // fractional bits of real_t, 0 for double
+  uint32_t frac_bits;
+  uint32_t num_states;
+  uint32_t reserved;
+  // the text file the cache was built from
+  int64_t source_mtime_sec;
+  int64_t source_mtime_nsec;
+  uint64_t source_size;
+  // fnv1a() of the header, with this field 0, and the states
+  uint64_t checksum;
+} config_cache_header;
+
+#ifdef FIXED_POINT
+#define CONFIG_CACHE_FRAC_BITS FP_FRAC_BITS
+#else
+#define CONFIG_CACHE_FRAC_BITS 0
+#endif
+
+// FNV-1a over 64-bit words, then the remaining bytes
+static uint64_t fnv1a(uint64_t hash, const void* data, size_t len) {
+  const unsigned char* p = (const unsigned char*) data;
+  uint64_t word;
+  size_t i;
+  for (i = 0; i + sizeof(word) <= len; i += sizeof(word)) {
+    memcpy(&word, p + i, sizeof(word));
+    hash ^= word;
+    hash *= 0x100000001b3ULL;
+  }
+  for (; i < len; i++) {
+    hash ^= p[i];
+    hash *= 0x100000001b3ULL;
   }
-  rewind(rfile);
+  return hash;
+}
+
+static uint64_t cache_checksum(const config_cache_header* header,
+                               const void* states) {
+  config_cache_header h = *header;
+  h.checksum = 0;
+  return fnv1a(fnv1a(0xcbf29ce484222325ULL, &h, sizeof(h)), states,
+               (size_t) h.num_states * h.state_size);
+}
 
-  // allocate the space
-  states = (poet_control_state_t *) malloc(*num_states * sizeof(poet_control_state_t));
-  if (states == NULL) {
-    fprintf(stderr, "get_control_states: malloc failed.\n");
+static void cache_header_init(config_cache_header* header,
+                              config_cache_type type,
+                              size_t size,
+                              const struct stat* source) {
+  memset(header, 0, sizeof(*header));
+  memcpy(header->magic, CONFIG_CACHE_MAGIC, sizeof(header->magic));
+  header->version = CONFIG_CACHE_VERSION;
+  header->type = type;
+  header->state_size = size;
+  header->frac_bits = CONFIG_CACHE_FRAC_BITS;
+  header->source_mtime_sec = source->st_mtim.tv_sec;
+  header->source_mtime_nsec = source->st_mtim.tv_nsec;
+  header->source_size = source->st_size;
+}
+
+/*
+ * Maps the cache and copies its states if it is valid for the source.
+ * Returns -1 without printing anything if the cache is missing or stale.
+ */
+static int load_cache(const char* cache_path,
+                      const config_cache_header* expected,
+                      void** states,
+                      unsigned int* num_states) {
+  const config_cache_header* header;
+  struct stat st;
+  void* map;
+  size_t len;
+  int ret = -1;
+  int fd;
+
+  fd = open(cache_path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  if (fstat(fd, &st) || st.st_size < (off_t) sizeof(config_cache_header)) {
+    close(fd);
+    return -1;
+  }
+  len = st.st_size;
+  map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
     return -1;
   }
 
-  // now iterate again to get the lines and fill in the data structure
-  while (fgets(line, BUFSIZ, rfile) != NULL) {
-    linenum++;
-    if (line[0] == '#') {
-      continue;
-    }
+  header = (const config_cache_header*) map;
+  if (memcmp(header->magic, expected->magic, sizeof(header->magic)) ||
+      header->version != expected->version ||
+      header->type != expected->type ||
+      header->state_size != expected->state_size ||
+      header->frac_bits != expected->frac_bits ||
+      header->source_mtime_sec != expected->source_mtime_sec ||
+      header->source_mtime_nsec != expected->source_mtime_nsec ||
+      header->source_size != expected->source_size ||
+      header->num_states == 0 ||
+      len != sizeof(*header) + (size_t) header->num_states * header->state_size ||
+      header->checksum != cache_checksum(header, header + 1)) {
+    goto out;
+  }
+  *states = malloc(len - sizeof(*header));
+  if (*states == NULL) {
+    goto out;
+  }
+  memcpy(*states, header + 1, len - sizeof(*header));
+  *num_states = header->num_states;
+  ret = 0;
+
+out:
+  munmap(map, len);
+  return ret;
+}
 
-    if (sscanf(line, "%s %s %s", argA, argB, argC) < 3) {
-      fprintf(stderr, "get_control_states: Syntax error, line %u\n", linenum);
-      fclose(rfile);
-      free(states);
+/*
+ * Writes the cache to a temporary file and renames it, so readers never see a
+ * partial cache. Failures are reported but are not fatal to the caller.
+ */
+static void write_cache(const char* func,
+                        const char* cache_path,
+                        config_cache_header* header,
+                        const void* states,
+                        unsigned int num_states) {
+  char* tmp_path;
+  FILE* f;
+  int ok;
+
+  header->num_states = num_states;
+  header->checksum = cache_checksum(header, states);
+
+  if (asprintf(&tmp_path, "%s.%ld.tmp", cache_path, (long) getpid()) < 0) {
+    fprintf(stderr, "%s: asprintf failed.\n", func);
+    return;
+  }
+  f = fopen(tmp_path, "wb");
+  if (f == NULL) {
+    fprintf(stderr, "%s: Could not create cache %s\n", func, tmp_path);
+    free(tmp_path);
+    return;
+  }
+  ok = fwrite(header, sizeof(*header), 1, f) == 1 &&
+       fwrite(states, header->state_size, num_states, f) == num_states;
+  ok = !fclose(f) && ok;
+  if (!ok || rename(tmp_path, cache_path)) {
+    fprintf(stderr, "%s: Could not write cache %s\n", func, cache_path);
+    unlink(tmp_path);
+  }
+  free(tmp_path);
+}
+
+static int get_states_cached(const char* func,
+                             const char* path,
+                             const char* cache_path,
+                             config_cache_type type,
+                             size_t size,
+                             parse_fields_func parse_fields,
+                             void** states,
+                             unsigned int* num_states) {
+  config_cache_header header;
+  struct stat st;
+  char* default_cache = NULL;
+  int ret;
+
+  if (stat(path, &st)) {
+    fprintf(stderr, "%s: Could not open file %s\n", func, path);
+    return -1;
+  }
+  if (cache_path == NULL) {
+    if (asprintf(&default_cache, "%s" CONFIG_CACHE_SUFFIX, path) < 0) {
+      fprintf(stderr, "%s: asprintf failed.\n", func);
       return -1;
     }
-    id = strtoul(argA, NULL, 0);
-    states[id].id = id;
-    states[id].speedup = atof(argB);
-    states[id].cost = atof(argC);
+    cache_path = default_cache;
   }
 
-  fclose(rfile);
-  *cstates = states;
-  return 0;
+  cache_header_init(&header, type, size, &st);
+  ret = load_cache(cache_path, &header, states, num_states);
+  if (ret) {
+    // missing or stale, rebuild it from the text file
+    ret = parse_states(func, path, size, parse_fields, states, num_states);
+    if (ret == 0) {
+      write_cache(func, cache_path, &header, *states, *num_states);
+    }
+  }
+  free(default_cache);
+  return ret;
 }
 
-/* Example file:
-  #id   freq    cores
-  0     300000  0
-  1     350000  2
-  2     400000  1
- */
-int get_cpu_states(const char* path,
-                   poet_cpu_state_t** cstates,
-                   unsigned int* num_states) {
-  poet_cpu_state_t * states;
-  FILE * rfile;
-  char line[BUFSIZ];
-  unsigned int linenum = 0;
-  char argA[BUFSIZ];
-  char argB[BUFSIZ];
-  char argC[BUFSIZ];
-  unsigned int id;
+int get_control_states_cached(const char* path,
+                              const char* cache_path,
+                              poet_control_state_t** cstates,
+                              unsigned int* num_states) {
+  if (cstates == NULL) {
+    fprintf(stderr, "get_control_states_cached: cstates cannot be NULL.\n");
+    return -1;
+  }
+
+  if (path == NULL) {
+    path = POET_CONTROL_STATE_CONFIG_FILE;
+  }
 
+  return get_states_cached("get_control_states_cached", path, cache_path,
+                           CONFIG_CACHE_CONTROL, sizeof(poet_control_state_t),
+                           parse_control_fields, (void**) cstates,
+                           num_states);
+}
+
+int get_cpu_states_cached(const char* path,
+                          const char* cache_path,
+                          poet_cpu_state_t** cstates,
+                          unsigned int* num_states) {
   if (cstates == NULL) {
-    fprintf(stderr, "get_cpu_states: cstates cannot be NULL.\n");
+    fprintf(stderr, "get_cpu_states_cached: cstates cannot be NULL.\n");
     return -1;
   }
 
@@ -333,46 +1024,281 @@ int get_cpu_states(const char* path,
     path = POET_CPU_STATE_CONFIG_FILE;
   }
 
-  rfile = fopen(path, "r");
-  if (rfile == NULL) {
-    fprintf(stderr, "get_cpu_states: Could not open file %s\n", path);
+  return get_states_cached("get_cpu_states_cached", path, cache_path,
+                           CONFIG_CACHE_CPU, sizeof(poet_cpu_state_t),
+                           parse_cpu_fields, (void**) cstates, num_states);
+}
+
+/*
+ * Config watcher: a thread waits for inotify events on the directories of the
+ * config files, since editors often replace a file by renaming another one,
+ * and reads both files again after either changes. The new tables are handed
+ * to POET by config_watcher_update() on the thread that runs the controller.
+ */
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO)
+// quiet time after the last event before the files are read
+#define WATCH_SETTLE_MS 50
+
+struct poet_config_watcher {
+  char* control_path;
+  char* cpu_path;
+  // names of the files in their directories
+  const char* control_name;
+  const char* cpu_name;
+  int inotify_fd;
+  int stop_fd;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  // newest tables read by the thread, not given to POET yet
+  poet_control_state_t* pending_control;
+  poet_cpu_state_t* pending_cpu;
+  unsigned int pending_num;
+  int pending;
+  // tables in use by POET
+  poet_control_state_t* control;
+  poet_cpu_state_t* cpu;
+  unsigned int num;
+};
+
+static const char* file_name(const char* path) {
+  const char* slash = strrchr(path, '/');
+  return slash != NULL ? slash + 1 : path;
+}
+
+static int watch_dir(int fd, const char* path) {
+  const char* slash = strrchr(path, '/');
+  char* dir;
+  int ret;
+
+  if (slash == NULL) {
+    return inotify_add_watch(fd, ".", WATCH_EVENTS) < 0 ? -1 : 0;
+  }
+  dir = strndup(path, slash == path ? 1 : (size_t) (slash - path));
+  if (dir == NULL) {
     return -1;
   }
+  ret = inotify_add_watch(fd, dir, WATCH_EVENTS) < 0 ? -1 : 0;
+  free(dir);
+  return ret;
+}
 
-  *num_states = get_num_states(rfile);
-  if (*num_states == 0) {
-    fclose(rfile);
+// Reads both files, which must have the same number of states
+static int watcher_load(const poet_config_watcher* w,
+                        poet_control_state_t** control,
+                        poet_cpu_state_t** cpu,
+                        unsigned int* num) {
+  unsigned int ncpu;
+
+  if (get_control_states(w->control_path, control, num)) {
     return -1;
   }
-  rewind(rfile);
-
-  // allocate the space
-  states = (poet_cpu_state_t *) malloc(*num_states * sizeof(poet_cpu_state_t));
-  if (states == NULL) {
-    fprintf(stderr, "get_cpu_states: malloc failed.\n");
+  if (get_cpu_states(w->cpu_path, cpu, &ncpu)) {
+    free(*control);
     return -1;
   }
+  if (ncpu != *num) {
+    fprintf(stderr, "config_watcher: %s and %s have different numbers of "
+            "states\n", w->control_path, w->cpu_path);
+    free(*control);
+    free(*cpu);
+    return -1;
+  }
+  return 0;
+}
 
-  // now iterate again to get the lines and fill in the data structure
-  while (fgets(line, BUFSIZ, rfile) != NULL) {
-    linenum++;
-    if (line[0] == '#') {
+static void* watcher_thread(void* arg) {
+  poet_config_watcher* w = (poet_config_watcher*) arg;
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event* ev;
+  struct pollfd fds[2];
+  poet_control_state_t* control;
+  poet_cpu_state_t* cpu;
+  unsigned int num;
+  int changed = 0;
+  ssize_t len;
+  char* p;
+
+  fds[0].fd = w->inotify_fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = w->stop_fd;
+  fds[1].events = POLLIN;
+  while (1) {
+    if (poll(fds, 2, changed ? WATCH_SETTLE_MS : -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "config_watcher: poll failed: %s\n", strerror(errno));
+      break;
+    }
+    if (fds[1].revents) {
+      break;
+    }
+    if (fds[0].revents & POLLIN) {
+      len = read(w->inotify_fd, buf, sizeof(buf));
+      for (p = buf; len > 0 && p < buf + len;
+           p += sizeof(struct inotify_event) + ev->len) {
+        ev = (const struct inotify_event*) p;
+        if (ev->len > 0 && (!strcmp(ev->name, w->control_name) ||
+                            !strcmp(ev->name, w->cpu_name))) {
+          changed = 1;
+        }
+      }
       continue;
     }
-
-    if (sscanf(line, "%s %s %s", argA, argB, argC) < 3) {
-      fprintf(stderr, "get_cpu_states: Syntax error, line %u\n", linenum);
-      fclose(rfile);
-      free(states);
-      return -1;
+    // the files have been quiet for WATCH_SETTLE_MS
+    if (changed) {
+      changed = 0;
+      if (watcher_load(w, &control, &cpu, &num) == 0) {
+        pthread_mutex_lock(&w->mutex);
+        free(w->pending_control);
+        free(w->pending_cpu);
+        w->pending_control = control;
+        w->pending_cpu = cpu;
+        w->pending_num = num;
+        __atomic_store_n(&w->pending, 1, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&w->mutex);
+      }
     }
-    id = strtoul(argA, NULL, 0);
-    states[id].id = id;
-    states[id].freq = strtoul(argB, NULL, 0);
-    states[id].cores = strtoul(argC, NULL, 0);
   }
 
-  fclose(rfile);
-  *cstates = states;
-  return 0;
+  return NULL;
+}
+
+poet_config_watcher* config_watcher_init(const char* control_path,
+                                         const char* cpu_path) {
+  poet_config_watcher* w;
+  int err;
+
+  if (control_path == NULL || cpu_path == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  w = calloc(1, sizeof(poet_config_watcher));
+  if (w == NULL) {
+    return NULL;
+  }
+  w->inotify_fd = -1;
+  w->stop_fd = -1;
+  w->control_path = strdup(control_path);
+  w->cpu_path = strdup(cpu_path);
+  if (w->control_path == NULL || w->cpu_path == NULL) {
+    err = ENOMEM;
+    goto fail;
+  }
+  w->control_name = file_name(w->control_path);
+  w->cpu_name = file_name(w->cpu_path);
+
+  if (watcher_load(w, &w->control, &w->cpu, &w->num)) {
+    err = EINVAL;
+    goto fail;
+  }
+  w->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  w->stop_fd = eventfd(0, EFD_CLOEXEC);
+  if (w->inotify_fd < 0 || w->stop_fd < 0 ||
+      watch_dir(w->inotify_fd, w->control_path) ||
+      watch_dir(w->inotify_fd, w->cpu_path)) {
+    err = errno;
+    fprintf(stderr, "config_watcher_init: Failed to watch the config files: "
+            "%s\n", strerror(err));
+    goto fail;
+  }
+  pthread_mutex_init(&w->mutex, NULL);
+  err = pthread_create(&w->thread, NULL, watcher_thread, w);
+  if (err) {
+    pthread_mutex_destroy(&w->mutex);
+    goto fail;
+  }
+  return w;
+
+fail:
+  if (w->inotify_fd >= 0) {
+    close(w->inotify_fd);
+  }
+  if (w->stop_fd >= 0) {
+    close(w->stop_fd);
+  }
+  free(w->control);
+  free(w->cpu);
+  free(w->control_path);
+  free(w->cpu_path);
+  free(w);
+  errno = err;
+  return NULL;
+}
+
+void config_watcher_get_states(const poet_config_watcher* watcher,
+                               poet_control_state_t** control_states,
+                               poet_cpu_state_t** cpu_states,
+                               unsigned int* num_states) {
+  *control_states = watcher->control;
+  *cpu_states = watcher->cpu;
+  *num_states = watcher->num;
+}
+
+int config_watcher_update(poet_config_watcher* watcher,
+                          poet_state* state) {
+  poet_control_state_t* control;
+  poet_cpu_state_t* cpu;
+  unsigned int num;
+  int ret;
+  int err;
+
+  if (watcher == NULL || state == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (!__atomic_load_n(&watcher->pending, __ATOMIC_ACQUIRE)) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&watcher->mutex);
+  control = watcher->pending_control;
+  cpu = watcher->pending_cpu;
+  num = watcher->pending_num;
+  watcher->pending_control = NULL;
+  watcher->pending_cpu = NULL;
+  __atomic_store_n(&watcher->pending, 0, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&watcher->mutex);
+
+  ret = poet_update_states(state, num, control, cpu);
+  if (ret < 0) {
+    free(control);
+    free(cpu);
+    return -1;
+  }
+  // POET no longer uses the old tables, even if it could not restart
+  // asynchronous actuation
+  err = errno;
+  free(watcher->control);
+  free(watcher->cpu);
+  watcher->control = control;
+  watcher->cpu = cpu;
+  watcher->num = num;
+  if (ret > 0) {
+    errno = err;
+    return -1;
+  }
+  return 1;
+}
+
+void config_watcher_destroy(poet_config_watcher* watcher) {
+  uint64_t one = 1;
+  if (watcher != NULL) {
+    if (write(watcher->stop_fd, &one, sizeof(one)) != sizeof(one)) {
+      fprintf(stderr, "config_watcher_destroy: Failed to stop the thread\n");
+    }
+    pthread_join(watcher->thread, NULL);
+    pthread_mutex_destroy(&watcher->mutex);
+    close(watcher->inotify_fd);
+    close(watcher->stop_fd);
+    free(watcher->pending_control);
+    free(watcher->pending_cpu);
+    free(watcher->control);
+    free(watcher->cpu);
+    free(watcher->control_path);
+    free(watcher->cpu_path);
+    free(watcher);
+  }
 }
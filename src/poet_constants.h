@@ -21,6 +21,38 @@ static const real_t H_START            =   CONST(0.0);
 static const real_t R                  =   CONST(0.01);
 static const real_t K_START            =   CONST(0.0);
 
+// estimate_state constants
+static const real_t POWER_BASE_Q       =   CONST(0.0001);
+static const real_t COST_Q             =   CONST(0.00001);
+static const real_t POWER_R            =   CONST(0.001);
+static const real_t RATE_BASE_Q        =   CONST(0.0001);
+static const real_t SPEEDUP_Q          =   CONST(0.00001);
+static const real_t RATE_R             =   CONST(0.001);
+
+// switching cost constants, weight of a new sample of the power of a state
+// with cost 1
+static const double BASE_POWER_WEIGHT  =   0.125;
+
+// latency goal constants, a histogram of LATENCY_BINS_PER_OCTAVE bins per
+// octave over LATENCY_OCTAVES octaves centered on the goal, whose samples decay
+// over at least LATENCY_WINDOW_PERIODS periods and LATENCY_TAIL_SAMPLES
+// samples beyond the quantile
+#define LATENCY_BINS_PER_OCTAVE 8
+#define LATENCY_OCTAVES 8
+#define LATENCY_BINS (LATENCY_BINS_PER_OCTAVE * LATENCY_OCTAVES)
+static const double LATENCY_WINDOW_PERIODS = 4.0;
+static const double LATENCY_TAIL_SAMPLES = 10.0;
+
+// deadline constants, the goal has a margin of DEADLINE_SIGMAS standard
+// deviations of the rate over the remaining periods, and DEADLINE_STATS_WEIGHT
+// is the weight of a new period in the rate statistics
+static const double DEADLINE_SIGMAS = 2.0;
+static const double DEADLINE_STATS_WEIGHT = 0.1;
+
+// power cap constants, the pole of the cost controller, 0 moves to the cost
+// whose power is the cap in one period
+static const real_t POWER_CAP_POLE     =   CONST(0.5);
+
 // calculate_xup constants
 #define FAST 1
 #define SLOW 0
@@ -47,7 +79,7 @@ static const real_t EO_START           =   CONST(1.0);
 static const int CURRENT_ACTION_START  =  1;
 
 #ifdef FIXED_POINT
-static const real_t BIG_REAL_T         =   0x7FFFFFFF;
+static const real_t BIG_REAL_T         =   MAX_FP;
 #else
 static const real_t BIG_REAL_T         =   100000.0;
 #endif
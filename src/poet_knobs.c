@@ -0,0 +1,269 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "poet_knobs.h"
+#include "poet_math.h"
+
+typedef struct {
+  poet_control_state_t* states;
+  unsigned int num_states;
+  void* apply_states;
+  poet_apply_func apply;
+} poet_knob;
+
+struct poet_knobs {
+  poet_knob* knobs;
+  unsigned int num_knobs;
+  // settings[id * num_knobs + k] is the setting of knob k in composed state id
+  unsigned int* settings;
+  unsigned int num_states;
+};
+
+// A combination of a state of the partial composition and a setting of the
+// knob being merged
+typedef struct {
+  real_t speedup;
+  real_t cost;
+  unsigned int from;
+  unsigned int setting;
+} knob_candidate;
+
+poet_knobs* poet_knobs_init(void) {
+  return calloc(1, sizeof(poet_knobs));
+}
+
+void poet_knobs_destroy(poet_knobs* knobs) {
+  unsigned int i;
+  if (knobs == NULL) {
+    return;
+  }
+  for (i = 0; i < knobs->num_knobs; i++) {
+    free(knobs->knobs[i].states);
+  }
+  free(knobs->knobs);
+  free(knobs->settings);
+  free(knobs);
+}
+
+int poet_knobs_add(poet_knobs* knobs,
+                   const poet_control_state_t* states,
+                   unsigned int num_states,
+                   void* apply_states,
+                   poet_apply_func apply) {
+  poet_knob* grown;
+  poet_control_state_t* copy;
+  unsigned int i;
+
+  if (knobs == NULL || states == NULL || num_states == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (knobs->settings != NULL) {
+    fprintf(stderr, "poet_knobs_add: Knobs are already composed\n");
+    errno = EINVAL;
+    return -1;
+  }
+  for (i = 0; i < num_states; i++) {
+    if (states[i].speedup <= CONST(0) || states[i].cost <= CONST(0)) {
+      fprintf(stderr, "poet_knobs_add: State %u must have speedup and cost "
+              "> 0\n", i);
+      errno = EINVAL;
+      return -1;
+    }
+  }
+
+  copy = malloc(num_states * sizeof(poet_control_state_t));
+  if (copy == NULL) {
+    return -1;
+  }
+  grown = realloc(knobs->knobs, (knobs->num_knobs + 1) * sizeof(poet_knob));
+  if (grown == NULL) {
+    free(copy);
+    return -1;
+  }
+  memcpy(copy, states, num_states * sizeof(poet_control_state_t));
+  knobs->knobs = grown;
+  knobs->knobs[knobs->num_knobs].states = copy;
+  knobs->knobs[knobs->num_knobs].num_states = num_states;
+  knobs->knobs[knobs->num_knobs].apply_states = apply_states;
+  knobs->knobs[knobs->num_knobs].apply = apply;
+  return knobs->num_knobs++;
+}
+
+// Increasing speedup, and decreasing cost among equal speedups so the cheapest
+// is seen first when walking from the fastest
+static int candidate_cmp(const void* a, const void* b) {
+  const knob_candidate* ca = (const knob_candidate*) a;
+  const knob_candidate* cb = (const knob_candidate*) b;
+  if (ca->speedup < cb->speedup) {
+    return -1;
+  }
+  if (ca->speedup > cb->speedup) {
+    return 1;
+  }
+  if (ca->cost > cb->cost) {
+    return -1;
+  }
+  if (ca->cost < cb->cost) {
+    return 1;
+  }
+  if (ca->from != cb->from) {
+    return ca->from < cb->from ? -1 : 1;
+  }
+  return ca->setting < cb->setting ? -1 : (ca->setting > cb->setting ? 1 : 0);
+}
+
+// Sorts the candidates and packs the ones no other candidate dominates at the
+// start of the array, returns how many remain
+static unsigned int prune_candidates(knob_candidate* c, unsigned int n) {
+  unsigned int i;
+  unsigned int k;
+  real_t min_cost;
+
+  qsort(c, n, sizeof(knob_candidate), candidate_cmp);
+
+  // walk from the fastest, keep a candidate only if it is cheaper than every
+  // faster candidate that was kept; kept candidates are packed at the end
+  k = n - 1;
+  min_cost = c[k].cost;
+  for (i = n - 1; i-- > 0;) {
+    if (c[i].cost < min_cost) {
+      min_cost = c[i].cost;
+      c[--k] = c[i];
+    }
+  }
+
+  memmove(c, &c[k], (n - k) * sizeof(knob_candidate));
+  return n - k;
+}
+
+int poet_knobs_compose(poet_knobs* knobs,
+                       poet_control_state_t** states,
+                       unsigned int* num_states) {
+  // the partial composition starts as one state with speedup and cost 1
+  knob_candidate* frontier;
+  knob_candidate* candidates;
+  unsigned int* settings = NULL;
+  unsigned int* next_settings;
+  unsigned int n = 1;
+  unsigned int m;
+  unsigned int i;
+  unsigned int j;
+  unsigned int k;
+  poet_knob* knob;
+  poet_control_state_t* out;
+
+  if (knobs == NULL || knobs->num_knobs == 0 || states == NULL ||
+      num_states == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  frontier = malloc(sizeof(knob_candidate));
+  if (frontier == NULL) {
+    return -1;
+  }
+  frontier[0].speedup = CONST(1.0);
+  frontier[0].cost = CONST(1.0);
+
+  for (k = 0; k < knobs->num_knobs; k++) {
+    knob = &knobs->knobs[k];
+    candidates = malloc((size_t) n * knob->num_states * sizeof(knob_candidate));
+    if (candidates == NULL) {
+      free(frontier);
+      free(settings);
+      return -1;
+    }
+    m = 0;
+    for (i = 0; i < n; i++) {
+      for (j = 0; j < knob->num_states; j++) {
+        candidates[m].speedup = mult(frontier[i].speedup,
+                                     knob->states[j].speedup);
+        candidates[m].cost = mult(frontier[i].cost, knob->states[j].cost);
+        candidates[m].from = i;
+        candidates[m].setting = j;
+        m++;
+      }
+    }
+    m = prune_candidates(candidates, m);
+
+    // each remaining candidate extends the settings of the state it came from
+    next_settings = malloc((size_t) m * (k + 1) * sizeof(unsigned int));
+    if (next_settings == NULL) {
+      free(candidates);
+      free(frontier);
+      free(settings);
+      return -1;
+    }
+    for (i = 0; i < m; i++) {
+      if (k > 0) {
+        memcpy(&next_settings[i * (k + 1)], &settings[candidates[i].from * k],
+               k * sizeof(unsigned int));
+      }
+      next_settings[i * (k + 1) + k] = candidates[i].setting;
+    }
+    free(settings);
+    free(frontier);
+    settings = next_settings;
+    frontier = candidates;
+    n = m;
+  }
+
+  out = malloc(n * sizeof(poet_control_state_t));
+  if (out == NULL) {
+    free(frontier);
+    free(settings);
+    return -1;
+  }
+  for (i = 0; i < n; i++) {
+    out[i].id = i;
+    out[i].speedup = frontier[i].speedup;
+    out[i].cost = frontier[i].cost;
+  }
+  free(frontier);
+
+  free(knobs->settings);
+  knobs->settings = settings;
+  knobs->num_states = n;
+  *states = out;
+  *num_states = n;
+  return 0;
+}
+
+void poet_knobs_apply(void* knobs,
+                      unsigned int num_states,
+                      unsigned int id,
+                      unsigned int last_id) {
+  poet_knobs* kn = (poet_knobs*) knobs;
+  const unsigned int* to;
+  const unsigned int* from;
+  poet_knob* knob;
+  unsigned int k;
+  (void) num_states;
+
+  if (kn == NULL || kn->settings == NULL || id >= kn->num_states ||
+      last_id >= kn->num_states) {
+    fprintf(stderr, "poet_knobs_apply: No composed state %u\n", id);
+    return;
+  }
+  to = &kn->settings[id * kn->num_knobs];
+  from = &kn->settings[last_id * kn->num_knobs];
+  for (k = 0; k < kn->num_knobs; k++) {
+    knob = &kn->knobs[k];
+    if (to[k] != from[k] && knob->apply != NULL) {
+      knob->apply(knob->apply_states, knob->num_states, to[k], from[k]);
+    }
+  }
+}
+
+int poet_knobs_get_setting(const poet_knobs* knobs,
+                           unsigned int id,
+                           unsigned int knob) {
+  if (knobs == NULL || knobs->settings == NULL || id >= knobs->num_states ||
+      knob >= knobs->num_knobs) {
+    errno = EINVAL;
+    return -1;
+  }
+  return knobs->settings[id * knobs->num_knobs + knob];
+}
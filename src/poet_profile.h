@@ -0,0 +1,56 @@
+#ifndef _POET_PROFILE_H
+#define _POET_PROFILE_H
+
+/*
+ * Cycle counters for the stages of the decision engine.
+ * Only compiled in with POET_PROFILE, which the poet_bench target defines.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "poet.h"
+
+typedef struct {
+  // calls to poet_apply_control that ran the decision engine
+  uint64_t decisions;
+  // cycles spent in each stage, summed over all decisions
+  uint64_t estimate_cycles;
+  uint64_t xup_cycles;
+  uint64_t translate_cycles;
+} poet_profile;
+
+/*
+ * TSC on x86, the virtual counter on aarch64 (which does not tick at the CPU
+ * frequency), nanoseconds elsewhere.
+ */
+static inline uint64_t poet_profile_cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#elif defined(__aarch64__)
+  uint64_t t;
+  __asm__ __volatile__("mrs %0, cntvct_el0" : "=r" (t));
+  return t;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * (uint64_t) 1000000000 + ts.tv_nsec;
+#endif
+}
+
+void poet_get_profile(const poet_state * state,
+                      poet_profile * profile);
+
+void poet_reset_profile(poet_state * state);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
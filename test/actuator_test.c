@@ -0,0 +1,404 @@
+/**
+ * Checks the per-step errors that cpu_actuator_apply() and
+ * apply_cpu_config_native() report, against a fake cpufreq tree. Also checks
+ * that poet_calibrate() runs each state on its cores and restores the starting
+ * frequencies and affinity.
+ *
+ * Must be built with POET_CPU_SYSFS_DIR pointing at the fake tree, which is
+ * created relative to the working directory.
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "poet_calibrate.h"
+#include "poet_config.h"
+
+#ifndef POET_CPU_SYSFS_DIR
+  #error "POET_CPU_SYSFS_DIR must point at the fake cpufreq tree"
+#endif
+
+#define PATH_LEN 4096
+// At most two cores, so affinity changes where there is more than one CPU
+#define MAX_CORES 2
+
+static unsigned int num_cores;
+// set if poet_calibrate() ran work off the cores of the state
+static int wrong_affinity;
+
+static void setspeed_path(char* path, unsigned int cpu) {
+  snprintf(path, PATH_LEN, POET_CPU_SYSFS_DIR "/cpu%u/cpufreq/scaling_setspeed",
+           cpu);
+}
+
+static int make_tree(void) {
+  char path[PATH_LEN];
+  unsigned int i;
+  FILE* fp;
+
+  if (mkdir(POET_CPU_SYSFS_DIR, 0755) && errno != EEXIST) {
+    perror(POET_CPU_SYSFS_DIR);
+    return -1;
+  }
+  for (i = 0; i < num_cores; i++) {
+    snprintf(path, sizeof(path), POET_CPU_SYSFS_DIR "/cpu%u", i);
+    if (mkdir(path, 0755) && errno != EEXIST) {
+      perror(path);
+      return -1;
+    }
+    snprintf(path, sizeof(path), POET_CPU_SYSFS_DIR "/cpu%u/cpufreq", i);
+    if (mkdir(path, 0755) && errno != EEXIST) {
+      perror(path);
+      return -1;
+    }
+    setspeed_path(path, i);
+    unlink(path);
+    fp = fopen(path, "w");
+    if (fp == NULL) {
+      perror(path);
+      return -1;
+    }
+    fclose(fp);
+  }
+  return 0;
+}
+
+static void remove_tree(void) {
+  char path[PATH_LEN];
+  unsigned int i;
+
+  for (i = 0; i < num_cores; i++) {
+    setspeed_path(path, i);
+    unlink(path);
+    snprintf(path, sizeof(path), POET_CPU_SYSFS_DIR "/cpu%u/cpufreq", i);
+    rmdir(path);
+    snprintf(path, sizeof(path), POET_CPU_SYSFS_DIR "/cpu%u", i);
+    rmdir(path);
+  }
+  rmdir(POET_CPU_SYSFS_DIR);
+}
+
+static int check_result(const char* what,
+                        const poet_cpu_apply_result* result,
+                        unsigned int affinity_failures,
+                        int affinity_errno,
+                        unsigned int freq_failures,
+                        int freq_errno) {
+  if (result->affinity_failures != affinity_failures ||
+      result->affinity_errno != affinity_errno ||
+      result->freq_failures != freq_failures ||
+      result->freq_errno != freq_errno) {
+    fprintf(stderr, "%s: affinity failures=%u errno=%d, frequency "
+            "failures=%u errno=%d, expected %u %d %u %d\n", what,
+            result->affinity_failures, result->affinity_errno,
+            result->freq_failures, result->freq_errno, affinity_failures,
+            affinity_errno, freq_failures, freq_errno);
+    return -1;
+  }
+  return 0;
+}
+
+static int check_setspeed(unsigned int cpu, unsigned long freq) {
+  char path[PATH_LEN];
+  unsigned long written = 0;
+  FILE* fp;
+
+  setspeed_path(path, cpu);
+  fp = fopen(path, "r");
+  if (fp == NULL || fscanf(fp, "%lu", &written) != 1 || written != freq) {
+    fprintf(stderr, "cpu%u: wrote %lu, expected %lu\n", cpu, written, freq);
+    if (fp != NULL) {
+      fclose(fp);
+    }
+    return -1;
+  }
+  fclose(fp);
+  return 0;
+}
+
+// Every step succeeds, and only the frequency is set if the cores are the same
+static int test_success(const poet_cpu_state_t* states) {
+  poet_cpu_actuator* act;
+  poet_cpu_apply_result result;
+  unsigned int i;
+  int ret = -1;
+
+  if (make_tree()) {
+    return -1;
+  }
+  act = cpu_actuator_init(states, 3);
+  if (act == NULL) {
+    perror("cpu_actuator_init");
+    return -1;
+  }
+  if (cpu_actuator_apply(act, 1, 0, &result) ||
+      check_result("same cores", &result, 0, 0, 0, 0)) {
+    goto out;
+  }
+  for (i = 0; i < num_cores; i++) {
+    if (check_setspeed(i, states[1].freq)) {
+      goto out;
+    }
+  }
+  if (cpu_actuator_apply(act, 2, 1, &result) ||
+      check_result("new cores", &result, 0, 0, 0, 0)) {
+    goto out;
+  }
+  for (i = 0; i < num_cores; i++) {
+    if (check_setspeed(i, states[2].freq)) {
+      goto out;
+    }
+  }
+  ret = 0;
+
+out:
+  cpu_actuator_destroy(act);
+  return ret;
+}
+
+// Ids out of range fail both steps without touching anything
+static int test_invalid_id(const poet_cpu_state_t* states) {
+  poet_cpu_actuator* act;
+  poet_cpu_apply_result result;
+  int ret = -1;
+
+  if (make_tree()) {
+    return -1;
+  }
+  act = cpu_actuator_init(states, 3);
+  if (act == NULL) {
+    perror("cpu_actuator_init");
+    return -1;
+  }
+  if (cpu_actuator_apply(act, 3, 0, &result) == 0) {
+    fprintf(stderr, "invalid id: apply succeeded\n");
+  } else if (check_result("invalid id", &result, 0, EINVAL, 0, EINVAL) == 0) {
+    ret = 0;
+  }
+  cpu_actuator_destroy(act);
+  return ret;
+}
+
+// A core whose frequency cannot be written is counted with its errno, and the
+// native apply function leaves the same result for cpu_actuator_get_result()
+static int test_write_failure(const poet_cpu_state_t* states) {
+  poet_cpu_actuator* act;
+  poet_cpu_apply_result result;
+  char path[PATH_LEN];
+  unsigned int i;
+  int ret = -1;
+
+  if (make_tree()) {
+    return -1;
+  }
+  // writes to /dev/full fail with ENOSPC
+  setspeed_path(path, 0);
+  unlink(path);
+  if (symlink("/dev/full", path)) {
+    perror("symlink");
+    return -1;
+  }
+  act = cpu_actuator_init(states, 3);
+  if (act == NULL) {
+    perror("cpu_actuator_init");
+    return -1;
+  }
+  if (cpu_actuator_apply(act, 1, 0, &result) == 0) {
+    fprintf(stderr, "write failure: apply succeeded\n");
+    goto out;
+  }
+  if (check_result("write failure", &result, 0, 0, 1, ENOSPC)) {
+    goto out;
+  }
+  // the other cores are still set
+  for (i = 1; i < num_cores; i++) {
+    if (check_setspeed(i, states[1].freq)) {
+      goto out;
+    }
+  }
+
+  apply_cpu_config_native(act, 3, 0, 1);
+  cpu_actuator_get_result(act, &result);
+  if (check_result("native write failure", &result, 0, 0, 1, ENOSPC)) {
+    goto out;
+  }
+  ret = 0;
+
+out:
+  cpu_actuator_destroy(act);
+  return ret;
+}
+
+// A missing cpufreq file fails to create the actuator
+static int test_missing_file(const poet_cpu_state_t* states) {
+  poet_cpu_actuator* act;
+  char path[PATH_LEN];
+
+  if (make_tree()) {
+    return -1;
+  }
+  setspeed_path(path, num_cores - 1);
+  unlink(path);
+  errno = 0;
+  act = cpu_actuator_init(states, 3);
+  if (act != NULL) {
+    fprintf(stderr, "missing file: cpu_actuator_init succeeded\n");
+    cpu_actuator_destroy(act);
+    return -1;
+  }
+  if (errno != ENOENT) {
+    fprintf(stderr, "missing file: errno=%d, expected %d\n", errno, ENOENT);
+    return -1;
+  }
+  return 0;
+}
+
+static int write_setspeed(unsigned int cpu, unsigned long freq) {
+  char path[PATH_LEN];
+  FILE* fp;
+
+  setspeed_path(path, cpu);
+  fp = fopen(path, "w");
+  if (fp == NULL) {
+    perror(path);
+    return -1;
+  }
+  fprintf(fp, "%lu\n", freq);
+  fclose(fp);
+  return 0;
+}
+
+// Finds the state from the frequency written to cpu0 and checks that this
+// thread runs on exactly its cores
+static void calibrate_work(void* arg) {
+  const poet_cpu_state_t* states = (const poet_cpu_state_t*) arg;
+  char path[PATH_LEN];
+  unsigned long freq = 0;
+  cpu_set_t mask;
+  unsigned int id;
+  unsigned int i;
+  FILE* fp;
+
+  setspeed_path(path, 0);
+  fp = fopen(path, "r");
+  if (fp == NULL || fscanf(fp, "%lu", &freq) != 1) {
+    wrong_affinity = 1;
+  }
+  if (fp != NULL) {
+    fclose(fp);
+  }
+  for (id = 0; id < 3 && states[id].freq != freq; id++);
+  if (id == 3 || sched_getaffinity(0, sizeof(mask), &mask) ||
+      (unsigned int) CPU_COUNT(&mask) != states[id].cores + 1) {
+    wrong_affinity = 1;
+    return;
+  }
+  for (i = 0; i <= states[id].cores; i++) {
+    if (!CPU_ISSET(i, &mask)) {
+      wrong_affinity = 1;
+    }
+  }
+}
+
+// Every state is measured on its cores, and the starting frequency and
+// affinity are restored
+static int test_calibrate(const poet_cpu_state_t* states) {
+  poet_calibration_t results[3];
+  cpu_set_t before;
+  cpu_set_t after;
+  unsigned int i;
+
+  if (make_tree()) {
+    return -1;
+  }
+  for (i = 0; i < num_cores; i++) {
+    if (write_setspeed(i, 1234)) {
+      return -1;
+    }
+  }
+  // start on the cores of the last state, so the first states only run on
+  // their own cores if calibration sets the affinity before the first one
+  CPU_ZERO(&before);
+  for (i = 0; i <= states[2].cores; i++) {
+    CPU_SET(i, &before);
+  }
+  if (sched_setaffinity(0, sizeof(before), &before)) {
+    perror("sched_setaffinity");
+    return -1;
+  }
+
+  wrong_affinity = 0;
+  if (poet_calibrate(states, 3, 2, calibrate_work, (void*) states, NULL, NULL,
+                     results)) {
+    perror("poet_calibrate");
+    return -1;
+  }
+  if (wrong_affinity) {
+    fprintf(stderr, "calibrate: a state did not run on its cores\n");
+    return -1;
+  }
+  for (i = 0; i < 3; i++) {
+    if (results[i].id != states[i].id || results[i].rate <= 0) {
+      fprintf(stderr, "calibrate: no result for state %u\n", i);
+      return -1;
+    }
+  }
+  for (i = 0; i < num_cores; i++) {
+    if (check_setspeed(i, 1234)) {
+      return -1;
+    }
+  }
+  if (sched_getaffinity(0, sizeof(after), &after) ||
+      !CPU_EQUAL(&before, &after)) {
+    fprintf(stderr, "calibrate: affinity was not restored\n");
+    return -1;
+  }
+  return 0;
+}
+
+int main(void) {
+  poet_cpu_state_t states[3];
+  cpu_set_t mask;
+  long num_configured_cpus = sysconf(_SC_NPROCESSORS_CONF);
+  int ret = 1;
+
+  if (num_configured_cpus <= 0) {
+    fprintf(stderr, "Failed to get the number of configured CPUs\n");
+    return 1;
+  }
+  num_cores = num_configured_cpus < MAX_CORES ?
+              (unsigned int) num_configured_cpus : MAX_CORES;
+  // the actuator changes the affinity of every thread
+  if (sched_getaffinity(0, sizeof(mask), &mask)) {
+    perror("sched_getaffinity");
+    return 1;
+  }
+
+  states[0].id = 0;
+  states[0].freq = 1000000;
+  states[0].cores = 0;
+  states[1].id = 1;
+  states[1].freq = 1500000;
+  states[1].cores = 0;
+  states[2].id = 2;
+  states[2].freq = 2000000;
+  states[2].cores = num_cores - 1;
+
+  if (test_success(states) == 0 &&
+      test_invalid_id(states) == 0 &&
+      test_write_failure(states) == 0 &&
+      test_missing_file(states) == 0 &&
+      test_calibrate(states) == 0) {
+    ret = 0;
+  }
+
+  sched_setaffinity(0, sizeof(mask), &mask);
+  remove_tree();
+  printf("%s\n", ret ? "FAIL" : "OK");
+  return ret;
+}
@@ -0,0 +1,237 @@
+/**
+ * Runs a workload whose iterations take a modeled time that is shorter in
+ * faster states, with poet_beat() measuring the rate, and an energy source
+ * that models a power proportional to the cube of the speedup, as are the
+ * configured costs. One
+ * state is configured much cheaper than the power it draws, so the cheapest
+ * schedule for the configured costs uses it, while for the modeled power it
+ * runs the states next to the goal.
+ *
+ * Checks that POET holds the rate at the goal, and that cost estimation
+ * learned the modeled power from the beats, so the mis-configured state is
+ * rarely used once it settled.
+ *
+ * Also reports the time spent in poet_beat() per iteration.
+ */
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "poet.h"
+#include "poet_math.h"
+
+#define NUM_STATES 5
+// nanoseconds per iteration in the slowest state, fixed point rates must stay
+// in the range of real_t
+#ifdef FIXED_POINT
+#define ITER_NS 500000
+#else
+#define ITER_NS 50000
+#endif
+#define GOAL_FRACTION 0.5
+#define TOLERANCE 0.1
+// watts of the slowest state
+#define BASE_POWER 10.0
+// the state configured cheaper than its power, and the most iterations the
+// settled schedule may run in it
+#define CHEAP_STATE 3
+#define CHEAP_COST 4.0
+#define MAX_CHEAP_FRACTION 0.3
+
+typedef struct {
+  unsigned int curr_id;
+  uint64_t last_ns;
+  double joules;
+  unsigned long reads;
+} plant;
+
+static poet_control_state_t cstates[NUM_STATES];
+
+static inline uint64_t get_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * (uint64_t) 1000000000 + ts.tv_nsec;
+}
+
+static void plant_apply(void* states,
+                        unsigned int num_states,
+                        unsigned int id,
+                        unsigned int last_id) {
+  (void) num_states;
+  (void) last_id;
+  ((plant*) states)->curr_id = id;
+}
+
+// Energy counter of the modeled power of the current state
+static int plant_energy(void* arg, double* joules) {
+  plant* p = (plant*) arg;
+  uint64_t now = get_ns();
+  double speedup = p->curr_id + 1.0;
+  p->joules += BASE_POWER * speedup * speedup * speedup *
+               (now - p->last_ns) / 1000000000.0;
+  p->last_ns = now;
+  p->reads++;
+  *joules = p->joules;
+  return 0;
+}
+
+// Busy waits for the modeled time of an iteration in the current state, so
+// the time does not depend on how the compiler lays out a work loop
+static void work(const plant* p) {
+  uint64_t end = get_ns() + ITER_NS / real_to_db(cstates[p->curr_id].speedup);
+  while (get_ns() < end) {
+  }
+}
+
+/*
+ * Runs the workload for the given time and returns the rate over the second
+ * half, after the controller settled, and the fraction of the iterations
+ * there that ran in CHEAP_STATE. With a state, beats are timed.
+ */
+static double run(poet_state* state,
+                  plant* p,
+                  double seconds,
+                  uint64_t* beat_ns,
+                  unsigned long* beats,
+                  double* cheap) {
+  uint64_t half = get_ns() + seconds * 500000000.0;
+  uint64_t end = half + seconds * 500000000.0;
+  uint64_t start_ns = 0;
+  unsigned long start = 0;
+  unsigned long i;
+  unsigned long cheap_iters = 0;
+  uint64_t now = 0;
+  uint64_t t;
+
+  *beat_ns = 0;
+  for (i = 0; ; i++) {
+    work(p);
+    if (start_ns > 0 && p->curr_id == CHEAP_STATE) {
+      cheap_iters++;
+    }
+    if (state != NULL) {
+      t = get_ns();
+      poet_beat(state);
+      *beat_ns += get_ns() - t;
+    }
+    // check the time every few iterations so reading it does not dominate
+    if (i % 16 == 0) {
+      now = get_ns();
+      if (start_ns == 0 && now >= half) {
+        start = i;
+        start_ns = now;
+      } else if (now >= end) {
+        break;
+      }
+    }
+  }
+  *beats = i + 1;
+  *cheap = (double) cheap_iters / (i - start);
+  return (i - start) * 1000000000.0 / (now - start_ns);
+}
+
+static void print_usage(void) {
+  printf("usage:\n");
+  printf("beat_test [-s seconds] [-p period] [-w window]\n");
+  printf("  -s: seconds per run (default 2)\n");
+  printf("  -p: controller period (default 20)\n");
+  printf("  -w: beat window (default the period)\n");
+}
+
+int main(int argc, char** argv) {
+  double seconds = 2;
+  unsigned int period = 20;
+  unsigned int window = 0;
+  poet_state* state;
+  plant p;
+  double max_rate;
+  double goal;
+  double rate;
+  double err;
+  double cheap;
+  uint64_t beat_ns;
+  unsigned long beats;
+  unsigned int i;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:p:w:h")) != -1) {
+    switch (opt) {
+      case 's':
+        seconds = atof(optarg);
+        break;
+      case 'p':
+        period = strtoul(optarg, NULL, 0);
+        break;
+      case 'w':
+        window = strtoul(optarg, NULL, 0);
+        break;
+      case 'h':
+      default:
+        print_usage();
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (optind != argc || seconds <= 0 || period == 0) {
+    print_usage();
+    return 1;
+  }
+
+  for (i = 0; i < NUM_STATES; i++) {
+    cstates[i].id = i;
+    cstates[i].speedup = CONST(i + 1.0);
+    cstates[i].cost = CONST((i + 1.0) * (i + 1.0) * (i + 1.0));
+  }
+  cstates[CHEAP_STATE].cost = CONST(CHEAP_COST);
+
+  // throughput in the fastest state
+  p.curr_id = NUM_STATES - 1;
+  max_rate = run(NULL, &p, seconds, &beat_ns, &beats, &cheap);
+
+  goal = GOAL_FRACTION * max_rate;
+  p.curr_id = NUM_STATES - 1;
+  p.last_ns = get_ns();
+  p.joules = 0;
+  p.reads = 0;
+  state = poet_init(CONST(goal), NUM_STATES, cstates, &p, plant_apply, NULL,
+                    period, 1, NULL);
+  if (state == NULL) {
+    perror("poet_init");
+    return 1;
+  }
+  if (window > 0 && poet_set_beat_window(state, window)) {
+    perror("poet_set_beat_window");
+    poet_destroy(state);
+    return 1;
+  }
+  // learns the costs from the power of the energy source
+  if (poet_set_cost_estimation(state, 1)) {
+    perror("poet_set_cost_estimation");
+    poet_destroy(state);
+    return 1;
+  }
+  poet_set_energy_source(state, plant_energy, &p);
+
+  rate = run(state, &p, seconds, &beat_ns, &beats, &cheap);
+  poet_destroy(state);
+
+  err = rate / goal - 1.0;
+  printf("period=%u window=%u\n", period, window > 0 ? window : period);
+  printf("max rate %.1f, goal %.1f, rate %.1f, error %.1f%%\n", max_rate, goal,
+         rate, 100.0 * err);
+  printf("state configured too cheap: %.1f%% of the iterations\n",
+         100.0 * cheap);
+  printf("poet_beat: %.1f ns per beat, %lu energy reads in %lu beats\n",
+         (double) beat_ns / beats, p.reads, beats);
+  if (err >= TOLERANCE || err <= -TOLERANCE || p.reads < beats) {
+    printf("FAIL\n");
+    return 1;
+  }
+  if (cheap > MAX_CHEAP_FRACTION) {
+    fprintf(stderr, "Costs were not learned from the beats\n");
+    printf("FAIL\n");
+    return 1;
+  }
+  printf("OK\n");
+  return 0;
+}
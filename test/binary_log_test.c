@@ -0,0 +1,231 @@
+/**
+ * Logs the same decisions to a text log and to a binary log with a ring buffer
+ * that is smaller than the number of decisions.
+ *
+ * Checks the header and the records of the binary log of a run that doesn't
+ * fill the ring, and that after the ring wraps it holds exactly the newest
+ * records, oldest first from index count % capacity, with the values of the
+ * text log.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "poet.h"
+#include "poet_config.h"
+#include "poet_log.h"
+#include "poet_math.h"
+
+static const char* CONTROL_CONFIG =
+  "../config/examples/2x_Xeon_E5_2690/control_config_x264_native";
+
+#define CAPACITY 7
+#define NUM_DECISIONS (3 * CAPACITY + 3)
+// decisions of the run that doesn't fill the ring
+#define NUM_BEFORE_WRAP (CAPACITY - 2)
+#define FIRST_TAG 1000
+// the text log has 6 decimals
+#define TOLERANCE 0.000001
+
+#define NUM_REALS 10
+
+typedef struct {
+  unsigned long tag;
+  double reals[NUM_REALS];
+  int lower_id;
+  int upper_id;
+  int low_state_iters;
+} text_record;
+
+static double log_real_to_db(const poet_log_header* hdr, poet_log_real r) {
+  if (hdr->real_format == POET_LOG_REAL_FIXED) {
+    return (double) r.fp / (double) (1LL << hdr->real_frac_bits);
+  }
+  return r.d;
+}
+
+// Reads the records of a text log, returns their number or -1 on failure
+static int read_text_log(const char* path,
+                         text_record* recs,
+                         unsigned int max) {
+  FILE* f;
+  char line[512];
+  text_record* r;
+  unsigned int n = 0;
+
+  f = fopen(path, "r");
+  if (f == NULL) {
+    perror(path);
+    return -1;
+  }
+  // skip the column names
+  if (fgets(line, sizeof(line), f) == NULL) {
+    fclose(f);
+    return -1;
+  }
+  while (n < max && fgets(line, sizeof(line), f) != NULL) {
+    r = &recs[n];
+    if (sscanf(line, "%lu %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %d %d %d",
+               &r->tag, &r->reals[0], &r->reals[1], &r->reals[2],
+               &r->reals[3], &r->reals[4], &r->reals[5], &r->reals[6],
+               &r->reals[7], &r->reals[8], &r->reals[9], &r->lower_id,
+               &r->upper_id, &r->low_state_iters) != 14) {
+      fprintf(stderr, "Bad text log line: %s", line);
+      fclose(f);
+      return -1;
+    }
+    n++;
+  }
+  fclose(f);
+  return n;
+}
+
+static int same_record(const poet_log_header* hdr,
+                       const poet_log_record* b,
+                       const text_record* t) {
+  const poet_log_real reals[NUM_REALS] = {
+    b->act_rate, b->x_hat_minus, b->x_hat, b->p_minus, b->h, b->k, b->p,
+    b->speedup, b->error, b->workload
+  };
+  double d;
+  unsigned int i;
+
+  if (b->tag != t->tag || b->lower_id != t->lower_id ||
+      b->upper_id != t->upper_id || b->low_state_iters != t->low_state_iters) {
+    return 0;
+  }
+  for (i = 0; i < NUM_REALS; i++) {
+    d = log_real_to_db(hdr, reals[i]) - t->reals[i];
+    if (d > TOLERANCE || d < -TOLERANCE) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+ * Reads the binary log and compares its records, oldest first, with the last
+ * records of the text log. Returns the number of mismatches, or -1 if the log
+ * can't be read or its header is wrong.
+ */
+static int check_binary_log(const char* path,
+                            const text_record* text,
+                            unsigned int num_text) {
+  FILE* f;
+  poet_log_header hdr;
+  poet_log_record ring[CAPACITY];
+  uint64_t first;
+  uint64_t num;
+  uint64_t i;
+  int mismatches = 0;
+
+  f = fopen(path, "r");
+  if (f == NULL) {
+    perror(path);
+    return -1;
+  }
+  if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+      fread(ring, sizeof(poet_log_record), CAPACITY, f) != CAPACITY) {
+    fprintf(stderr, "Failed to read %s\n", path);
+    fclose(f);
+    return -1;
+  }
+  fclose(f);
+
+  if (memcmp(hdr.magic, POET_LOG_MAGIC, sizeof(POET_LOG_MAGIC)) ||
+      hdr.version != POET_LOG_VERSION ||
+      hdr.record_size != sizeof(poet_log_record) ||
+      hdr.capacity != CAPACITY || hdr.count != num_text) {
+    fprintf(stderr, "Bad header: capacity=%llu count=%llu, expected %u %u\n",
+            (unsigned long long) hdr.capacity,
+            (unsigned long long) hdr.count, CAPACITY, num_text);
+    return -1;
+  }
+
+  first = hdr.count > hdr.capacity ? hdr.count % hdr.capacity : 0;
+  num = hdr.count > hdr.capacity ? hdr.capacity : hdr.count;
+  for (i = 0; i < num; i++) {
+    if (!same_record(&hdr, &ring[(first + i) % hdr.capacity],
+                     &text[num_text - num + i])) {
+      fprintf(stderr, "Record %llu of %llu differs from the text log\n",
+              (unsigned long long) i, (unsigned long long) num);
+      mismatches++;
+    }
+  }
+  return mismatches;
+}
+
+/*
+ * Logs count decisions of a new controller to both logs, and checks the
+ * binary log against the text log once poet_destroy() has closed both.
+ */
+static int run(poet_control_state_t* cstates,
+               unsigned int nstates,
+               unsigned int count,
+               const char* text_path,
+               const char* binary_path) {
+  text_record text[NUM_DECISIONS];
+  poet_state* state;
+  unsigned long i;
+  int n;
+
+  // period 1 decides, and logs, on every call after the first
+  state = poet_init(CONST(1.0), nstates, cstates, NULL, NULL, NULL, 1, 1,
+                    text_path);
+  if (state == NULL) {
+    perror("poet_init");
+    return -1;
+  }
+  if (poet_set_binary_log(state, binary_path, CAPACITY)) {
+    perror("poet_set_binary_log");
+    poet_destroy(state);
+    return -1;
+  }
+  for (i = FIRST_TAG; i <= FIRST_TAG + count; i++) {
+    poet_apply_control(state, i, CONST(0.5 + 0.1 * (i % 5)), CONST(1.0));
+  }
+  poet_destroy(state);
+
+  n = read_text_log(text_path, text, NUM_DECISIONS);
+  if (n != (int) count) {
+    fprintf(stderr, "%d records in the text log, expected %u\n", n, count);
+    return -1;
+  }
+  return check_binary_log(binary_path, text, n);
+}
+
+int main(void) {
+  char dir[] = "/tmp/poet_binary_log_XXXXXX";
+  char text_path[256];
+  char binary_path[256];
+  poet_control_state_t* cstates;
+  unsigned int nstates;
+  int before;
+  int after;
+
+  if (get_control_states(CONTROL_CONFIG, &cstates, &nstates)) {
+    fprintf(stderr, "Failed to get control states from %s\n", CONTROL_CONFIG);
+    return 1;
+  }
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    free(cstates);
+    return 1;
+  }
+  snprintf(text_path, sizeof(text_path), "%s/poet.log", dir);
+  snprintf(binary_path, sizeof(binary_path), "%s/poet.bin", dir);
+
+  before = run(cstates, nstates, NUM_BEFORE_WRAP, text_path, binary_path);
+  printf("%u records, before wrapping: %d mismatches\n", NUM_BEFORE_WRAP,
+         before);
+  after = run(cstates, nstates, NUM_DECISIONS, text_path, binary_path);
+  printf("%u records, after wrapping: %d mismatches\n", NUM_DECISIONS, after);
+
+  unlink(text_path);
+  unlink(binary_path);
+  rmdir(dir);
+  free(cstates);
+  printf("%s\n", before == 0 && after == 0 ? "OK" : "FAIL");
+  return before == 0 && after == 0 ? 0 : 1;
+}
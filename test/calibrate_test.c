@@ -0,0 +1,173 @@
+/**
+ * Checks that pruning calibration results removes dominated states and states
+ * that are not cheaper than a faster state, and that the written configs load
+ * back with the kept states renumbered and normalized to the first one.
+ */
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "poet.h"
+#include "poet_calibrate.h"
+#include "poet_config.h"
+#include "poet_math.h"
+
+#define PATH_LEN 4096
+#define NUM_STATES 7
+#define TOLERANCE 0.001
+
+// Unsorted, states 2, 4 and 5 must be pruned
+static const poet_calibration_t RESULTS[NUM_STATES] = {
+  { 3, 30.0, 12.0 },
+  // slower and more expensive than state 1
+  { 2, 15.0, 12.0 },
+  { 0, 10.0, 5.0 },
+  // as fast as state 3 but more expensive
+  { 4, 30.0, 14.0 },
+  { 6, 40.0, 20.0 },
+  // slower than state 3 at the same power
+  { 5, 25.0, 12.0 },
+  { 1, 20.0, 8.0 },
+};
+static const unsigned int KEPT[] = { 0, 1, 3, 6 };
+#define NUM_KEPT (sizeof(KEPT) / sizeof(KEPT[0]))
+
+static int check_prune(poet_calibration_t* results, unsigned int* num) {
+  unsigned int i;
+
+  *num = poet_calibration_prune(results, NUM_STATES);
+  if (*num != NUM_KEPT) {
+    fprintf(stderr, "Kept %u states, expected %u\n", *num,
+            (unsigned int) NUM_KEPT);
+    return -1;
+  }
+  for (i = 0; i < NUM_KEPT; i++) {
+    if (results[i].id != KEPT[i]) {
+      fprintf(stderr, "Kept state %u has id %u, expected %u\n", i,
+              results[i].id, KEPT[i]);
+      return -1;
+    }
+    if (i > 0 && (results[i].rate <= results[i - 1].rate ||
+                  results[i].power <= results[i - 1].power)) {
+      fprintf(stderr, "Kept state %u is not faster and more expensive than "
+              "the previous one\n", i);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int check_written(const char* control_path,
+                         const char* cpu_path,
+                         const poet_cpu_state_t* cpu_states,
+                         const poet_calibration_t* results,
+                         unsigned int num) {
+  poet_control_state_t* control;
+  poet_cpu_state_t* cpu;
+  unsigned int control_n;
+  unsigned int cpu_n;
+  unsigned int i;
+  double speedup;
+  double cost;
+  int ret = 0;
+
+  if (get_control_states(control_path, &control, &control_n)) {
+    fprintf(stderr, "get_control_states failed\n");
+    return -1;
+  }
+  if (get_cpu_states(cpu_path, &cpu, &cpu_n)) {
+    fprintf(stderr, "get_cpu_states failed\n");
+    free(control);
+    return -1;
+  }
+
+  if (control_n != num || cpu_n != num) {
+    fprintf(stderr, "Loaded %u control and %u CPU states, expected %u\n",
+            control_n, cpu_n, num);
+    ret = -1;
+  }
+  for (i = 0; ret == 0 && i < num; i++) {
+    speedup = real_to_db(control[i].speedup);
+    cost = real_to_db(control[i].cost);
+    if (control[i].id != i || cpu[i].id != i) {
+      fprintf(stderr, "State %u was not renumbered\n", i);
+      ret = -1;
+    } else if (fabs(speedup - results[i].rate / results[0].rate) > TOLERANCE ||
+               fabs(cost - results[i].power / results[0].power) > TOLERANCE) {
+      fprintf(stderr, "State %u: speedup=%f cost=%f, expected %f %f\n", i,
+              speedup, cost, results[i].rate / results[0].rate,
+              results[i].power / results[0].power);
+      ret = -1;
+    } else if (cpu[i].freq != cpu_states[results[i].id].freq ||
+               cpu[i].cores != cpu_states[results[i].id].cores) {
+      fprintf(stderr, "State %u does not match CPU state %u\n", i,
+              results[i].id);
+      ret = -1;
+    }
+  }
+  free(control);
+  free(cpu);
+  return ret;
+}
+
+static void print_usage(void) {
+  printf("usage:\n");
+  printf("calibrate_test [-d dir]\n");
+  printf("  -d: directory for the written files (default /tmp)\n");
+}
+
+int main(int argc, char** argv) {
+  const char* dir = "/tmp";
+  char control_path[PATH_LEN];
+  char cpu_path[PATH_LEN];
+  poet_cpu_state_t cpu_states[NUM_STATES];
+  poet_calibration_t results[NUM_STATES];
+  unsigned int num;
+  unsigned int i;
+  int ret = 1;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "d:h")) != -1) {
+    switch (opt) {
+      case 'd':
+        dir = optarg;
+        break;
+      case 'h':
+      default:
+        print_usage();
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (optind != argc) {
+    print_usage();
+    return 1;
+  }
+
+  for (i = 0; i < NUM_STATES; i++) {
+    cpu_states[i].id = i;
+    cpu_states[i].freq = 1000000UL + 100000UL * i;
+    cpu_states[i].cores = i % 4;
+    results[i] = RESULTS[i];
+  }
+  snprintf(control_path, sizeof(control_path), "%s/poet_calibrate_control_%ld",
+           dir, (long) getpid());
+  snprintf(cpu_path, sizeof(cpu_path), "%s/poet_calibrate_cpu_%ld", dir,
+           (long) getpid());
+
+  if (check_prune(results, &num)) {
+    goto out;
+  }
+  if (poet_calibration_write(control_path, cpu_path, cpu_states, NUM_STATES,
+                             results, num) ||
+      check_written(control_path, cpu_path, cpu_states, results, num)) {
+    goto out;
+  }
+  ret = 0;
+
+out:
+  unlink(control_path);
+  unlink(cpu_path);
+  printf("%s\n", ret ? "FAIL" : "OK");
+  return ret;
+}
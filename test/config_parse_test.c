@@ -0,0 +1,297 @@
+/**
+ * Checks that the cached config loaders return exactly the states parsed from
+ * the text files, and that a cache is rebuilt when its checksum is wrong or the
+ * text file changes.
+ *
+ * Also reports the time to load large tables from text and from the cache.
+ */
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "poet.h"
+#include "poet_config.h"
+#include "poet_math.h"
+
+#define REPEAT 10
+#define PATH_LEN 4096
+
+static inline uint64_t get_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * (uint64_t) 1000000000 + ts.tv_nsec;
+}
+
+// Bitwise, the cache must hold exactly the parsed values
+static int real_equal(real_t a, real_t b) {
+  return memcmp(&a, &b, sizeof(real_t)) == 0;
+}
+
+static int write_configs(const char* control_path,
+                         const char* cpu_path,
+                         unsigned int n,
+                         double scale) {
+  FILE* control = fopen(control_path, "w");
+  FILE* cpu = fopen(cpu_path, "w");
+  unsigned int i;
+  double s;
+
+  if (control == NULL || cpu == NULL) {
+    perror("fopen");
+    if (control != NULL) {
+      fclose(control);
+    }
+    if (cpu != NULL) {
+      fclose(cpu);
+    }
+    return -1;
+  }
+  fprintf(control, "#id speedup powerup\n");
+  fprintf(cpu, "#id freq cores\n");
+  for (i = 0; i < n; i++) {
+    s = 1.0 + scale * i / n;
+    fprintf(control, "%u\t%.9f %.9f\n", i, s, s * s);
+    fprintf(cpu, "%u %lu\t%u\n", i, 300000UL + 1000UL * (i % 1000),
+            1 + i % 16);
+  }
+  fclose(control);
+  fclose(cpu);
+  return 0;
+}
+
+// Sets the modification time of the file one second later
+static int touch_later(const char* path) {
+  struct stat st;
+  struct timespec times[2];
+  if (stat(path, &st)) {
+    perror("stat");
+    return -1;
+  }
+  times[0] = st.st_atim;
+  times[1] = st.st_mtim;
+  times[1].tv_sec++;
+  if (utimensat(AT_FDCWD, path, times, 0)) {
+    perror("utimensat");
+    return -1;
+  }
+  return 0;
+}
+
+static int corrupt(const char* path) {
+  FILE* f = fopen(path, "r+b");
+  int c;
+  if (f == NULL) {
+    perror("fopen");
+    return -1;
+  }
+  // flip a byte of the last state
+  fseek(f, -1, SEEK_END);
+  c = fgetc(f);
+  fseek(f, -1, SEEK_END);
+  fputc(c ^ 0xff, f);
+  fclose(f);
+  return 0;
+}
+
+static int check_control(const char* path,
+                         const char* cache,
+                         const char* what,
+                         double* text_ms,
+                         double* cache_ms) {
+  poet_control_state_t* text_states;
+  poet_control_state_t* cached_states;
+  unsigned int text_n;
+  unsigned int cached_n;
+  unsigned int i;
+  uint64_t t;
+  int ret = 0;
+
+  t = get_ns();
+  if (get_control_states(path, &text_states, &text_n)) {
+    fprintf(stderr, "%s: get_control_states failed\n", what);
+    return -1;
+  }
+  *text_ms = (get_ns() - t) / 1000000.0;
+  t = get_ns();
+  if (get_control_states_cached(path, cache, &cached_states, &cached_n)) {
+    fprintf(stderr, "%s: get_control_states_cached failed\n", what);
+    free(text_states);
+    return -1;
+  }
+  *cache_ms = (get_ns() - t) / 1000000.0;
+
+  if (text_n != cached_n) {
+    fprintf(stderr, "%s: %u states from text, %u from cache\n", what, text_n,
+            cached_n);
+    ret = -1;
+  }
+  for (i = 0; ret == 0 && i < text_n; i++) {
+    if (text_states[i].id != cached_states[i].id ||
+        !real_equal(text_states[i].speedup, cached_states[i].speedup) ||
+        !real_equal(text_states[i].cost, cached_states[i].cost)) {
+      fprintf(stderr, "%s: control state %u differs\n", what, i);
+      ret = -1;
+    }
+  }
+  free(text_states);
+  free(cached_states);
+  return ret;
+}
+
+static int check_cpu(const char* path,
+                     const char* what,
+                     double* text_ms,
+                     double* cache_ms) {
+  poet_cpu_state_t* text_states;
+  poet_cpu_state_t* cached_states;
+  unsigned int text_n;
+  unsigned int cached_n;
+  unsigned int i;
+  uint64_t t;
+  int ret = 0;
+
+  t = get_ns();
+  if (get_cpu_states(path, &text_states, &text_n)) {
+    fprintf(stderr, "%s: get_cpu_states failed\n", what);
+    return -1;
+  }
+  *text_ms = (get_ns() - t) / 1000000.0;
+  t = get_ns();
+  if (get_cpu_states_cached(path, NULL, &cached_states, &cached_n)) {
+    fprintf(stderr, "%s: get_cpu_states_cached failed\n", what);
+    free(text_states);
+    return -1;
+  }
+  *cache_ms = (get_ns() - t) / 1000000.0;
+
+  if (text_n != cached_n) {
+    fprintf(stderr, "%s: %u states from text, %u from cache\n", what, text_n,
+            cached_n);
+    ret = -1;
+  }
+  for (i = 0; ret == 0 && i < text_n; i++) {
+    if (text_states[i].id != cached_states[i].id ||
+        text_states[i].freq != cached_states[i].freq ||
+        text_states[i].cores != cached_states[i].cores) {
+      fprintf(stderr, "%s: CPU state %u differs\n", what, i);
+      ret = -1;
+    }
+  }
+  free(text_states);
+  free(cached_states);
+  return ret;
+}
+
+static void print_usage(void) {
+  printf("usage:\n");
+  printf("config_parse_test [-n states] [-d dir]\n");
+  printf("  -n: states in the generated configs (default 10000)\n");
+  printf("  -d: directory for the generated files (default /tmp)\n");
+}
+
+int main(int argc, char** argv) {
+  unsigned int n = 10000;
+  const char* dir = "/tmp";
+  char control_path[PATH_LEN];
+  char control_cache[PATH_LEN + 8];
+  char cpu_path[PATH_LEN];
+  char cpu_cache[PATH_LEN + 8];
+  double text_ms;
+  double cache_ms;
+  double text_total = 0;
+  double cache_total = 0;
+  unsigned int i;
+  int ret = 1;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:d:h")) != -1) {
+    switch (opt) {
+      case 'n':
+        n = strtoul(optarg, NULL, 0);
+        break;
+      case 'd':
+        dir = optarg;
+        break;
+      case 'h':
+      default:
+        print_usage();
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (optind != argc || n == 0) {
+    print_usage();
+    return 1;
+  }
+
+  snprintf(control_path, sizeof(control_path), "%s/poet_control_%ld", dir,
+           (long) getpid());
+  snprintf(control_cache, sizeof(control_cache), "%s.bin", control_path);
+  snprintf(cpu_path, sizeof(cpu_path), "%s/poet_cpu_%ld", dir,
+           (long) getpid());
+  snprintf(cpu_cache, sizeof(cpu_cache), "%s.cache", cpu_path);
+  if (write_configs(control_path, cpu_path, n, 3.0)) {
+    return 1;
+  }
+
+  // the first loads build the caches
+  if (check_control(control_path, control_cache, "build", &text_ms,
+                    &cache_ms) ||
+      check_cpu(cpu_path, "build", &text_ms, &cache_ms) ||
+      access(control_cache, F_OK) || access(cpu_cache, F_OK)) {
+    fprintf(stderr, "Caches were not built\n");
+    goto out;
+  }
+
+  for (i = 0; i < REPEAT; i++) {
+    if (check_control(control_path, control_cache, "load", &text_ms,
+                      &cache_ms)) {
+      goto out;
+    }
+    text_total += text_ms;
+    cache_total += cache_ms;
+  }
+  printf("states=%u control text=%.3f ms cache=%.3f ms\n", n,
+         text_total / REPEAT, cache_total / REPEAT);
+  text_total = 0;
+  cache_total = 0;
+  for (i = 0; i < REPEAT; i++) {
+    if (check_cpu(cpu_path, "load", &text_ms, &cache_ms)) {
+      goto out;
+    }
+    text_total += text_ms;
+    cache_total += cache_ms;
+  }
+  printf("states=%u cpu text=%.3f ms cache=%.3f ms\n", n,
+         text_total / REPEAT, cache_total / REPEAT);
+
+  // a corrupted cache is rebuilt
+  if (corrupt(control_cache) || corrupt(cpu_cache) ||
+      check_control(control_path, control_cache, "corrupt", &text_ms,
+                    &cache_ms) ||
+      check_cpu(cpu_path, "corrupt", &text_ms, &cache_ms)) {
+    goto out;
+  }
+
+  // a newer text file with different values replaces the cache
+  if (write_configs(control_path, cpu_path, n / 2 + 1, 5.0) ||
+      touch_later(control_path) || touch_later(cpu_path) ||
+      check_control(control_path, control_cache, "newer", &text_ms,
+                    &cache_ms) ||
+      check_cpu(cpu_path, "newer", &text_ms, &cache_ms)) {
+    goto out;
+  }
+  ret = 0;
+
+out:
+  unlink(control_path);
+  unlink(control_cache);
+  unlink(cpu_path);
+  unlink(cpu_cache);
+  printf("%s\n", ret ? "FAIL" : "OK");
+  return ret;
+}
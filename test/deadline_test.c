@@ -0,0 +1,281 @@
+/**
+ * Runs a fixed number of iterations of a workload whose iterations are shorter
+ * in faster states, once in the fastest state and once with a deadline set by
+ * poet_set_deadline(), with poet_beat() measuring the rate. Power is modeled as
+ * proportional to the cost of the current state.
+ *
+ * Checks that the deadline is met and that it costs less energy than racing
+ * through the work in the fastest state.
+ *
+ * Before that, sets a deadline in the middle of a period and checks, from the
+ * binary log, that each goal is the rate of the iterations actually left.
+ */
+#include <getopt.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "poet.h"
+#include "poet_log.h"
+#include "poet_math.h"
+
+#define NUM_STATES 5
+// spin loop units per iteration in the slowest state, fixed point rates must
+// stay in the range of real_t
+#ifdef FIXED_POINT
+#define ITER_WORK 500000
+#else
+#define ITER_WORK 20000
+#endif
+// the work needs this fraction of the fastest rate to finish by the deadline
+#define WORK_FRACTION 0.5
+// the job may finish this much after the deadline
+#define TOLERANCE 0.05
+// periods of work and seconds of the deadline checked against the log
+#define COUNT_PERIODS 4
+#define COUNT_SECONDS 100.0
+
+typedef struct {
+  unsigned int curr_id;
+} plant;
+
+static poet_control_state_t cstates[NUM_STATES];
+
+static inline uint64_t get_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * (uint64_t) 1000000000 + ts.tv_nsec;
+}
+
+static void plant_apply(void* states,
+                        unsigned int num_states,
+                        unsigned int id,
+                        unsigned int last_id) {
+  (void) num_states;
+  (void) last_id;
+  ((plant*) states)->curr_id = id;
+}
+
+static void spin(unsigned long units) {
+  volatile unsigned long x = 0;
+  unsigned long i;
+  for (i = 0; i < units; i++) {
+    x += i;
+  }
+}
+
+/*
+ * Runs the iterations and returns the seconds they took. The energy is the
+ * cost of each iteration's state times its time.
+ */
+static double run(poet_state* state,
+                  plant* p,
+                  uint64_t iterations,
+                  double* energy) {
+  uint64_t start = get_ns();
+  uint64_t last = start;
+  uint64_t now;
+  uint64_t i;
+
+  *energy = 0;
+  for (i = 0; i < iterations; i++) {
+    spin(ITER_WORK / real_to_db(cstates[p->curr_id].speedup));
+    now = get_ns();
+    *energy += real_to_db(cstates[p->curr_id].cost) * (now - last) /
+               1000000000.0;
+    last = now;
+    if (state != NULL) {
+      poet_beat(state);
+    }
+  }
+  return (get_ns() - start) / 1000000000.0;
+}
+
+// Measures the rate in the fastest state
+static double max_rate(plant* p) {
+  uint64_t start = get_ns();
+  uint64_t i = 0;
+  p->curr_id = NUM_STATES - 1;
+  while (get_ns() - start < 500000000) {
+    spin(ITER_WORK / real_to_db(cstates[p->curr_id].speedup));
+    i++;
+  }
+  return i * 1000000000.0 / (get_ns() - start);
+}
+
+static double log_real(const poet_log_header* hdr,
+                       poet_log_real r) {
+  return hdr->real_format == POET_LOG_REAL_FIXED ?
+         ldexp((double) r.fp, -(int) hdr->real_frac_bits) : r.d;
+}
+
+/*
+ * Sets a deadline half way through a period and reports a rate far below the
+ * goal, so the margin stays small. Each logged goal (error + rate) must be the
+ * rate of the iterations left since the deadline was set. Returns 0 if all
+ * are.
+ */
+static int check_count(unsigned int period) {
+  char dir[] = "/tmp/poet_deadline_XXXXXX";
+  char path[256];
+  FILE* f;
+  poet_log_header hdr;
+  poet_log_record r;
+  poet_state* state;
+  uint64_t total = COUNT_PERIODS * period;
+  double done;
+  double goal;
+  double expected;
+  unsigned int before = period / 2;
+  unsigned int i;
+  int ret = 0;
+
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+  snprintf(path, sizeof(path), "%s/poet.bin", dir);
+  state = poet_init(CONST(1.0), NUM_STATES, cstates, NULL, NULL, NULL, period,
+                    1, NULL);
+  if (state == NULL || poet_set_binary_log(state, path, COUNT_PERIODS + 1)) {
+    perror("poet_init");
+    poet_destroy(state);
+    rmdir(dir);
+    return 1;
+  }
+  for (i = 0; i < before; i++) {
+    poet_apply_control(state, i, CONST(0.001), CONST(0.0));
+  }
+  if (poet_set_deadline(state, total, COUNT_SECONDS)) {
+    perror("poet_set_deadline");
+    ret = 1;
+  }
+  for (i = 0; i < total; i++) {
+    poet_apply_control(state, before + i, CONST(0.001), CONST(0.0));
+  }
+  poet_destroy(state);
+
+  f = fopen(path, "r");
+  if (f == NULL || fread(&hdr, sizeof(hdr), 1, f) != 1) {
+    fprintf(stderr, "Failed to read %s\n", path);
+    ret = 1;
+  } else {
+    // decisions run on iterations period, 2 * period, ... counting from 1
+    for (i = 0; i < hdr.count && fread(&r, sizeof(r), 1, f) == 1; i++) {
+      done = (i + 1.0) * period - before;
+      goal = log_real(&hdr, r.error) + log_real(&hdr, r.act_rate);
+      expected = (total - done) / COUNT_SECONDS;
+      printf("decision %u: done=%.0f goal=%f expected=%f\n", i, done, goal,
+             expected);
+      if (goal < expected * (1.0 - TOLERANCE) ||
+          goal > expected * (1.0 + TOLERANCE)) {
+        ret = 1;
+      }
+    }
+    if (hdr.count != COUNT_PERIODS) {
+      fprintf(stderr, "Expected %u decisions, got %lu\n", COUNT_PERIODS,
+              (unsigned long) hdr.count);
+      ret = 1;
+    }
+  }
+  if (f != NULL) {
+    fclose(f);
+  }
+  unlink(path);
+  rmdir(dir);
+  return ret;
+}
+
+static void print_usage(void) {
+  printf("usage:\n");
+  printf("deadline_test [-s seconds] [-p period]\n");
+  printf("  -s: seconds until the deadline (default 2)\n");
+  printf("  -p: controller period (default 20)\n");
+}
+
+int main(int argc, char** argv) {
+  double seconds = 2;
+  unsigned int period = 20;
+  poet_state* state;
+  plant p;
+  uint64_t iterations;
+  double rate;
+  double race_time;
+  double race_energy;
+  double time;
+  double energy;
+  unsigned int i;
+  int ret = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:p:h")) != -1) {
+    switch (opt) {
+      case 's':
+        seconds = atof(optarg);
+        break;
+      case 'p':
+        period = strtoul(optarg, NULL, 0);
+        break;
+      case 'h':
+      default:
+        print_usage();
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (optind != argc || seconds <= 0 || period == 0) {
+    print_usage();
+    return 1;
+  }
+
+  for (i = 0; i < NUM_STATES; i++) {
+    cstates[i].id = i;
+    cstates[i].speedup = CONST(i + 1.0);
+    cstates[i].cost = CONST((i + 1.0) * (i + 1.0));
+  }
+
+  if (check_count(period)) {
+    fprintf(stderr, "The deadline counted the wrong number of iterations\n");
+    ret = 1;
+  }
+
+  rate = max_rate(&p);
+  iterations = WORK_FRACTION * rate * seconds;
+
+  // race to finish in the fastest state
+  p.curr_id = NUM_STATES - 1;
+  race_time = run(NULL, &p, iterations, &race_energy);
+
+  p.curr_id = NUM_STATES - 1;
+  state = poet_init(CONST(rate), NUM_STATES, cstates, &p, plant_apply, NULL,
+                    period, 1, NULL);
+  if (state == NULL) {
+    perror("poet_init");
+    return 1;
+  }
+  if (poet_set_deadline(state, iterations, seconds)) {
+    perror("poet_set_deadline");
+    poet_destroy(state);
+    return 1;
+  }
+  time = run(state, &p, iterations, &energy);
+  poet_destroy(state);
+
+  printf("iterations=%lu deadline=%.2f s period=%u\n",
+         (unsigned long) iterations, seconds, period);
+  printf("%10s %10s %10s %12s\n", "MODE", "TIME_S", "ENERGY", "REL_ENERGY");
+  printf("%10s %10.3f %10.2f %12.3f\n", "race", race_time, race_energy, 1.0);
+  printf("%10s %10.3f %10.2f %12.3f\n", "deadline", time, energy,
+         energy / race_energy);
+  if (time > seconds * (1.0 + TOLERANCE)) {
+    fprintf(stderr, "Missed the deadline\n");
+    ret = 1;
+  }
+  if (energy >= race_energy) {
+    fprintf(stderr, "The deadline did not save energy\n");
+    ret = 1;
+  }
+  printf("%s\n", ret ? "FAIL" : "OK");
+  return ret;
+}
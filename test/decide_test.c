@@ -0,0 +1,203 @@
+/**
+ * Runs a plant in virtual time where the application only changes state at
+ * idle points, every few iterations. It polls POET with poet_decide(), applies
+ * the returned schedules itself and reports them with poet_report_applied().
+ *
+ * Checks that POET never calls the apply function, that the rate is at the
+ * goal, and that the predicted rate of the schedules matches the rate they
+ * achieve. The same plant with poet_apply_control() is run for comparison.
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "poet.h"
+#include "poet_config.h"
+#include "poet_math.h"
+#include "plant.h"
+
+#define GOAL_FRACTION 0.4
+#define TOLERANCE 0.05
+// the predicted rate must be this close to the rate of the period
+#define PREDICT_TOLERANCE 0.1
+
+/*
+ * Runs the plant, polling with poet_decide() if idle > 0 and changing state
+ * only every idle iterations. Returns the rate relative to the goal over the
+ * second half, and the mean error of the predicted rates there.
+ */
+static int run(poet_control_state_t* cstates,
+               unsigned int nstates,
+               double goal,
+               unsigned int period,
+               unsigned long iterations,
+               unsigned int idle,
+               double* rate,
+               double* predict_err) {
+  poet_state* state;
+  poet_schedule_t schedule;
+  plant p;
+  double seconds;
+  double time = 0;
+  double period_time = 0;
+  double predicted = 0;
+  double err_sum = 0;
+  unsigned long predictions = 0;
+  unsigned int pos = 0;
+  unsigned int want;
+  unsigned long i;
+  int ret;
+
+  plant_init(&p, cstates, nstates, 1);
+  schedule.lower_id = -1;
+  schedule.upper_id = -1;
+  state = poet_init(CONST(goal), nstates, cstates, &p, plant_apply, NULL,
+                    period, 1, NULL);
+  if (state == NULL) {
+    perror("poet_init");
+    return -1;
+  }
+
+  for (i = 0; i < iterations; i++) {
+    seconds = plant_seconds(&p);
+    if (i >= iterations / 2) {
+      time += seconds;
+    }
+    if (idle == 0) {
+      poet_apply_control(state, i, CONST(1.0 / seconds), CONST(0.0));
+      continue;
+    }
+
+    period_time += seconds;
+    ret = poet_decide(state, i, CONST(1.0 / seconds), CONST(0.0), &schedule);
+    if (ret < 0) {
+      perror("poet_decide");
+      poet_destroy(state);
+      return -1;
+    }
+    if (ret == 1) {
+      // compare the last prediction with the period it was made for
+      if (predicted > 0 && i >= iterations / 2) {
+        err_sum += fabs(predicted / (period / period_time) - 1.0);
+        predictions++;
+      }
+      predicted = real_to_db(schedule.rate);
+      period_time = 0;
+      pos = 0;
+    }
+
+    // the state the schedule wants for the next iteration, applied only at
+    // idle points
+    if (schedule.upper_id >= 0 && i % idle == 0) {
+      want = pos < schedule.low_state_iters ? schedule.lower_id :
+                                               schedule.upper_id;
+      if (want != p.curr_id) {
+        p.curr_id = want;
+        if (poet_report_applied(state, want, i + 1)) {
+          perror("poet_report_applied");
+          poet_destroy(state);
+          return -1;
+        }
+      }
+    }
+    pos++;
+  }
+
+  if (idle > 0 && (poet_report_applied(state, nstates, i) == 0 ||
+                   errno != EINVAL)) {
+    fprintf(stderr, "poet_report_applied accepted an invalid state\n");
+    poet_destroy(state);
+    return -1;
+  }
+  if (idle > 0 && p.applies > 0) {
+    fprintf(stderr, "poet_decide called the apply function %lu times\n",
+            p.applies);
+    poet_destroy(state);
+    return -1;
+  }
+  poet_destroy(state);
+
+  *rate = (iterations - iterations / 2) / time / goal;
+  *predict_err = predictions > 0 ? err_sum / predictions : 0;
+  return 0;
+}
+
+static void print_usage(void) {
+  printf("usage:\n");
+  printf("decide_test [-i iterations] [-p period] [-d idle] [-c control_config]\n");
+  printf("  -i: iterations per run (default 20000)\n");
+  printf("  -p: controller period (default 20)\n");
+  printf("  -d: iterations between idle points (default 4)\n");
+  printf("  -c: control config (default %s)\n", PLANT_CONTROL_CONFIG);
+}
+
+int main(int argc, char** argv) {
+  const char* control_config = PLANT_CONTROL_CONFIG;
+  unsigned long iterations = 20000;
+  unsigned int period = 20;
+  unsigned int idle = 4;
+  poet_control_state_t* cstates;
+  unsigned int nstates;
+  double goal;
+  double rate;
+  double err;
+  int ret = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "i:p:d:c:h")) != -1) {
+    switch (opt) {
+      case 'i':
+        iterations = strtoul(optarg, NULL, 0);
+        break;
+      case 'p':
+        period = strtoul(optarg, NULL, 0);
+        break;
+      case 'd':
+        idle = strtoul(optarg, NULL, 0);
+        break;
+      case 'c':
+        control_config = optarg;
+        break;
+      case 'h':
+      default:
+        print_usage();
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (optind != argc || iterations == 0 || period == 0 || idle == 0) {
+    print_usage();
+    return 1;
+  }
+
+  if (plant_load_states(control_config, &cstates, &nstates)) {
+    return 1;
+  }
+  goal = plant_goal(cstates, nstates, GOAL_FRACTION);
+
+  printf("states=%u period=%u idle=%u goal=%.1f\n", nstates, period, idle,
+         goal);
+  printf("%14s %10s %14s\n", "MODE", "RATE/GOAL", "PREDICT_ERROR");
+  if (run(cstates, nstates, goal, period, iterations, 0, &rate, &err)) {
+    free(cstates);
+    return 1;
+  }
+  printf("%14s %10.3f %14s\n", "apply_control", rate, "-");
+  if (run(cstates, nstates, goal, period, iterations, idle, &rate, &err)) {
+    free(cstates);
+    return 1;
+  }
+  printf("%14s %10.3f %13.1f%%\n", "decide", rate, 100.0 * err);
+  if (rate < 1.0 - TOLERANCE || rate > 1.0 + TOLERANCE) {
+    fprintf(stderr, "Rate is not at the goal\n");
+    ret = 1;
+  }
+  if (err > PREDICT_TOLERANCE) {
+    fprintf(stderr, "Predicted rates are off\n");
+    ret = 1;
+  }
+
+  printf("%s\n", ret ? "FAIL" : "OK");
+  free(cstates);
+  return ret;
+}
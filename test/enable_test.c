@@ -0,0 +1,188 @@
+/**
+ * Starts a controller with POET_DISABLE_CONTROL and POET_DISABLE_APPLY set,
+ * then toggles poet_set_control_enabled() and poet_set_apply_enabled() at
+ * runtime while a plant runs at a goal between two states.
+ *
+ * Checks that the controller makes a decision every period if and only if
+ * control is enabled, as counted by its binary log, and that the apply function
+ * is called if and only if both control and apply are enabled. Runs with
+ * synchronous and with asynchronous actuation.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "poet.h"
+#include "poet_config.h"
+#include "poet_log.h"
+#include "poet_math.h"
+
+static const char* CONTROL_CONFIG =
+  "../config/examples/2x_Xeon_E5_2690/control_config_x264_native";
+
+#define BASE_RATE 10.0
+// a goal between the slowest and the fastest state, so the state keeps changing
+#define GOAL_FRACTION 0.43
+#define PERIOD 10
+#define PHASE_PERIODS 20
+#define ACTUATOR_WAIT_US 20000
+
+typedef struct {
+  const char* name;
+  int control;
+  int apply;
+} phase;
+
+// the first phase runs with the settings of the environment variables
+static const phase PHASES[] = {
+  { "env disabled", 0, 0 },
+  { "control only", 1, 0 },
+  { "both enabled", 1, 1 },
+  { "apply only", 0, 1 },
+  { "re-enabled", 1, 1 },
+};
+
+typedef struct {
+  poet_control_state_t* cstates;
+  unsigned int curr_id;
+  unsigned long applies;
+} plant;
+
+static void plant_apply(void* states,
+                        unsigned int num_states,
+                        unsigned int id,
+                        unsigned int last_id) {
+  plant* p = (plant*) states;
+  (void) num_states;
+  (void) last_id;
+  // called from the actuator thread with asynchronous actuation
+  __atomic_store_n(&p->curr_id, id, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&p->applies, 1, __ATOMIC_RELEASE);
+}
+
+// Number of records in the binary log, or -1 if it can't be read
+static long long num_decisions(const char* path) {
+  FILE* f;
+  poet_log_header hdr;
+
+  f = fopen(path, "r");
+  if (f == NULL) {
+    perror(path);
+    return -1;
+  }
+  if (fread(&hdr, sizeof(hdr), 1, f) != 1) {
+    fprintf(stderr, "Failed to read %s\n", path);
+    fclose(f);
+    return -1;
+  }
+  fclose(f);
+  return hdr.count;
+}
+
+// Runs the phases, with asynchronous actuation if async, 0 if all pass
+static int run(poet_control_state_t* cstates,
+               unsigned int nstates,
+               int async,
+               const char* path) {
+  poet_state* state;
+  plant p;
+  double goal;
+  long long decisions;
+  long long last_decisions = 0;
+  unsigned long applies;
+  unsigned long tag = 0;
+  unsigned int id;
+  unsigned int ph;
+  unsigned int i;
+  int ok;
+  int ret = 0;
+
+  p.cstates = cstates;
+  p.curr_id = nstates - 1;
+  p.applies = 0;
+  goal = BASE_RATE * (1.0 + GOAL_FRACTION *
+                      (real_to_db(cstates[nstates - 1].speedup) - 1.0));
+  setenv(POET_DISABLE_CONTROL, "1", 1);
+  setenv(POET_DISABLE_APPLY, "1", 1);
+  state = poet_init(CONST(goal), nstates, cstates, &p, plant_apply, NULL,
+                    PERIOD, 1, NULL);
+  unsetenv(POET_DISABLE_CONTROL);
+  unsetenv(POET_DISABLE_APPLY);
+  if (state == NULL) {
+    perror("poet_init");
+    return 1;
+  }
+  if (poet_set_binary_log(state, path, 1) ||
+      (async && poet_set_apply_async(state, 1))) {
+    perror(async ? "poet_set_apply_async" : "poet_set_binary_log");
+    poet_destroy(state);
+    return 1;
+  }
+
+  printf("%s actuation\n", async ? "asynchronous" : "synchronous");
+  printf("%-14s %8s %8s %10s %8s\n", "PHASE", "CONTROL", "APPLY", "DECISIONS",
+         "APPLIES");
+  for (ph = 0; ph < sizeof(PHASES) / sizeof(PHASES[0]); ph++) {
+    if (ph > 0) {
+      poet_set_control_enabled(state, PHASES[ph].control);
+      poet_set_apply_enabled(state, PHASES[ph].apply);
+    }
+    applies = __atomic_load_n(&p.applies, __ATOMIC_ACQUIRE);
+    for (i = 0; i < PHASE_PERIODS * PERIOD; i++, tag++) {
+      id = __atomic_load_n(&p.curr_id, __ATOMIC_ACQUIRE);
+      poet_apply_control(state, tag,
+                         CONST(BASE_RATE * real_to_db(cstates[id].speedup)),
+                         CONST(1.0));
+    }
+    if (async) {
+      // let the actuator finish the requests of this phase
+      usleep(ACTUATOR_WAIT_US);
+    }
+    decisions = num_decisions(path);
+    if (decisions < 0) {
+      ret = 1;
+      break;
+    }
+    applies = __atomic_load_n(&p.applies, __ATOMIC_ACQUIRE) - applies;
+    decisions -= last_decisions;
+    last_decisions += decisions;
+
+    ok = decisions == (PHASES[ph].control ? PHASE_PERIODS : 0) &&
+         (PHASES[ph].control && PHASES[ph].apply ? applies > 0 : applies == 0);
+    printf("%-14s %8d %8d %10lld %8lu %s\n", PHASES[ph].name,
+           PHASES[ph].control, PHASES[ph].apply, decisions, applies,
+           ok ? "OK" : "FAIL");
+    ret |= !ok;
+  }
+
+  poet_destroy(state);
+  return ret;
+}
+
+int main(void) {
+  char dir[] = "/tmp/poet_enable_XXXXXX";
+  char path[256];
+  poet_control_state_t* cstates;
+  unsigned int nstates;
+  int ret;
+
+  if (get_control_states(CONTROL_CONFIG, &cstates, &nstates)) {
+    fprintf(stderr, "Failed to get control states from %s\n", CONTROL_CONFIG);
+    return 1;
+  }
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    free(cstates);
+    return 1;
+  }
+  snprintf(path, sizeof(path), "%s/poet.bin", dir);
+
+  ret = run(cstates, nstates, 0, path);
+  ret |= run(cstates, nstates, 1, path);
+
+  unlink(path);
+  rmdir(dir);
+  free(cstates);
+  printf("%s\n", ret ? "FAIL" : "OK");
+  return ret;
+}
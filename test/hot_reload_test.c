@@ -0,0 +1,397 @@
+/**
+ * Replaces the control states of a converged controller with a new table, once
+ * with poet_update_states() and once by re-initializing it, and compares the
+ * goal error of the periods that follow. Also checks that the current state is
+ * mapped to the new state with the closest speedup.
+ *
+ * Then changes config files watched by a config watcher and checks that the
+ * new states reach POET through config_watcher_update().
+ */
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "poet.h"
+#include "poet_config.h"
+#include "poet_math.h"
+#include "plant.h"
+
+#define GOAL_FRACTION 0.6
+#define WATCH_TIMEOUT_S 5
+
+typedef struct {
+  plant base;
+  // speedup of the state applied last, in the table it was applied from
+  double speedup;
+} reload_plant;
+
+static void reload_plant_apply(void* states,
+                               unsigned int num_states,
+                               unsigned int id,
+                               unsigned int last_id) {
+  reload_plant* p = (reload_plant*) states;
+  plant_apply(states, num_states, id, last_id);
+  p->speedup = real_to_db(p->base.cstates[id].speedup);
+}
+
+// Runs the plant in the last state of a new table
+static void reload_plant_init(reload_plant* p,
+                              const poet_control_state_t* cstates,
+                              unsigned int num_states) {
+  plant_init(&p->base, cstates, num_states, 1);
+  p->speedup = real_to_db(cstates[num_states - 1].speedup);
+}
+
+// Makes the plant apply states from a new table from now on
+static void reload_plant_swap(reload_plant* p,
+                              const poet_control_state_t* cstates,
+                              unsigned int num_states) {
+  p->base.cstates = cstates;
+  p->base.num_states = num_states;
+}
+
+// The watcher passes its CPU states as the apply_states
+static reload_plant* watched_plant;
+static unsigned long watched_freq;
+
+static void watched_apply(void* states,
+                          unsigned int num_states,
+                          unsigned int id,
+                          unsigned int last_id) {
+  watched_freq = ((const poet_cpu_state_t*) states)[id].freq;
+  reload_plant_apply(watched_plant, num_states, id, last_id);
+}
+
+static real_t plant_rate(reload_plant* p) {
+  return CONST(PLANT_BASE_RATE * p->speedup *
+               (1.0 + 0.1 * (plant_uniform(&p->base) - 0.5)));
+}
+
+// Mean absolute goal error of the per-period rates over the given periods
+static double run(poet_state* state,
+                  reload_plant* p,
+                  unsigned long* tag,
+                  unsigned int period,
+                  unsigned int periods,
+                  double goal) {
+  double err = 0;
+  double sum;
+  unsigned int i;
+  unsigned int j;
+
+  for (i = 0; i < periods; i++) {
+    sum = 0;
+    for (j = 0; j < period; j++) {
+      real_t rate = plant_rate(p);
+      sum += real_to_db(rate);
+      poet_apply_control(state, (*tag)++, rate, CONST(1.0));
+    }
+    err += sum / period > goal ? sum / period / goal - 1.0 :
+                                 1.0 - sum / period / goal;
+  }
+  return err / periods;
+}
+
+// Every other state of the table, and the fastest one, renumbered
+static unsigned int subset(const poet_control_state_t* cs,
+                           unsigned int n,
+                           poet_control_state_t* out) {
+  unsigned int m = 0;
+  unsigned int i;
+  for (i = 0; i < n; i++) {
+    if (i % 2 == 0 || i == n - 1) {
+      out[m] = cs[i];
+      out[m].id = m;
+      m++;
+    }
+  }
+  return m;
+}
+
+static unsigned int nearest(const poet_control_state_t* cs,
+                            unsigned int n,
+                            real_t speedup) {
+  unsigned int best = 0;
+  unsigned int i;
+  double d;
+  double best_d = -1;
+  for (i = 0; i < n; i++) {
+    d = real_to_db(cs[i].speedup) - real_to_db(speedup);
+    d = d < 0 ? -d : d;
+    if (best_d < 0 || d < best_d ||
+        (d <= best_d && cs[i].cost < cs[best].cost)) {
+      best = i;
+      best_d = d;
+    }
+  }
+  return best;
+}
+
+static int write_configs(const char* dir,
+                         const char* suffix,
+                         const poet_control_state_t* cs,
+                         unsigned int n) {
+  char control[256];
+  char cpu[256];
+  FILE* fc;
+  FILE* fp;
+  unsigned int i;
+
+  snprintf(control, sizeof(control), "%s/control_config%s", dir, suffix);
+  snprintf(cpu, sizeof(cpu), "%s/cpu_config%s", dir, suffix);
+  fc = fopen(control, "w");
+  fp = fopen(cpu, "w");
+  if (fc == NULL || fp == NULL) {
+    perror("fopen");
+    if (fc != NULL) {
+      fclose(fc);
+    }
+    if (fp != NULL) {
+      fclose(fp);
+    }
+    return -1;
+  }
+  fprintf(fc, "#id speedup powerup\n");
+  fprintf(fp, "#id freq cores\n");
+  for (i = 0; i < n; i++) {
+    fprintf(fc, "%u %.9f %.9f\n", i, real_to_db(cs[i].speedup),
+            real_to_db(cs[i].cost));
+    fprintf(fp, "%u %u %u\n", i, 1000000 + 100000 * i, 1 + i % 4);
+  }
+  fclose(fc);
+  fclose(fp);
+  return 0;
+}
+
+// Replaces the watched files with new ones by renaming, like editors do
+static int replace_configs(const char* dir,
+                           const poet_control_state_t* cs,
+                           unsigned int n) {
+  char from[256];
+  char to[256];
+
+  if (write_configs(dir, ".new", cs, n)) {
+    return -1;
+  }
+  snprintf(from, sizeof(from), "%s/control_config.new", dir);
+  snprintf(to, sizeof(to), "%s/control_config", dir);
+  if (rename(from, to)) {
+    perror("rename");
+    return -1;
+  }
+  snprintf(from, sizeof(from), "%s/cpu_config.new", dir);
+  snprintf(to, sizeof(to), "%s/cpu_config", dir);
+  if (rename(from, to)) {
+    perror("rename");
+    return -1;
+  }
+  return 0;
+}
+
+static int test_watcher(const poet_control_state_t* cs,
+                        unsigned int n,
+                        const poet_control_state_t* new_cs,
+                        unsigned int new_n,
+                        unsigned int period) {
+  char dir[] = "/tmp/poet_reload_XXXXXX";
+  char control_path[256];
+  char cpu_path[256];
+  poet_config_watcher* watcher = NULL;
+  poet_control_state_t* wcs;
+  poet_cpu_state_t* wcpu;
+  unsigned int wn;
+  poet_state* state = NULL;
+  reload_plant p;
+  unsigned long tag = 0;
+  time_t end;
+  int updated = 0;
+  int ret = -1;
+
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    return -1;
+  }
+  snprintf(control_path, sizeof(control_path), "%s/control_config", dir);
+  snprintf(cpu_path, sizeof(cpu_path), "%s/cpu_config", dir);
+  if (write_configs(dir, "", cs, n)) {
+    goto out;
+  }
+  watcher = config_watcher_init(control_path, cpu_path);
+  if (watcher == NULL) {
+    perror("config_watcher_init");
+    goto out;
+  }
+  config_watcher_get_states(watcher, &wcs, &wcpu, &wn);
+  reload_plant_init(&p, wcs, wn);
+  watched_plant = &p;
+  state = poet_init(CONST(PLANT_BASE_RATE * 2), wn, wcs, wcpu, watched_apply,
+                    NULL, period, 1, NULL);
+  if (state == NULL) {
+    perror("poet_init");
+    goto out;
+  }
+  run(state, &p, &tag, period, 5, PLANT_BASE_RATE * 2);
+
+  if (replace_configs(dir, new_cs, new_n)) {
+    goto out;
+  }
+  end = time(NULL) + WATCH_TIMEOUT_S;
+  while (!updated && time(NULL) < end) {
+    updated = config_watcher_update(watcher, state);
+    if (updated < 0) {
+      perror("config_watcher_update");
+      goto out;
+    }
+    if (updated) {
+      // the plant applies states from the new table from now on
+      config_watcher_get_states(watcher, &wcs, &wcpu, &wn);
+      reload_plant_swap(&p, wcs, wn);
+    }
+    run(state, &p, &tag, period, 1, PLANT_BASE_RATE * 2);
+    usleep(1000);
+  }
+  run(state, &p, &tag, period, 5, PLANT_BASE_RATE * 2);
+
+  printf("watcher: %s, %u states, current state %u at %lu kHz\n",
+         updated ? "updated" : "not updated", wn,
+         poet_get_applied_state(state), watched_freq);
+  ret = updated && wn == new_n && poet_get_applied_state(state) < new_n &&
+        watched_freq == wcpu[poet_get_applied_state(state)].freq ? 0 : -1;
+
+out:
+  poet_destroy(state);
+  config_watcher_destroy(watcher);
+  unlink(control_path);
+  unlink(cpu_path);
+  rmdir(dir);
+  return ret;
+}
+
+static void print_usage(void) {
+  printf("usage:\n");
+  printf("hot_reload_test [-p period] [-k periods] [-c control_config]\n");
+  printf("  -p: controller period (default 20)\n");
+  printf("  -k: periods measured after the new states (default 10)\n");
+  printf("  -c: control config (default %s)\n", PLANT_CONTROL_CONFIG);
+}
+
+int main(int argc, char** argv) {
+  const char* control_config = PLANT_CONTROL_CONFIG;
+  unsigned int period = 20;
+  unsigned int periods = 10;
+  poet_control_state_t* cs;
+  poet_control_state_t* new_cs;
+  unsigned int n;
+  unsigned int new_n;
+  unsigned int expected;
+  poet_state* state;
+  reload_plant p;
+  unsigned long tag;
+  double goal;
+  double update_err;
+  double reinit_err;
+  int ret = 1;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "p:k:c:h")) != -1) {
+    switch (opt) {
+      case 'p':
+        period = strtoul(optarg, NULL, 0);
+        break;
+      case 'k':
+        periods = strtoul(optarg, NULL, 0);
+        break;
+      case 'c':
+        control_config = optarg;
+        break;
+      case 'h':
+      default:
+        print_usage();
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (optind != argc || period == 0 || periods == 0) {
+    print_usage();
+    return 1;
+  }
+
+  if (plant_load_states(control_config, &cs, &n)) {
+    return 1;
+  }
+  new_cs = malloc(n * sizeof(poet_control_state_t));
+  if (new_cs == NULL) {
+    perror("malloc");
+    free(cs);
+    return 1;
+  }
+  new_n = subset(cs, n, new_cs);
+  goal = plant_goal(cs, n, GOAL_FRACTION);
+
+  // converge, then swap the table in place
+  reload_plant_init(&p, cs, n);
+  tag = 0;
+  state = poet_init(CONST(goal), n, cs, &p, reload_plant_apply, NULL, period,
+                    1, NULL);
+  if (state == NULL) {
+    perror("poet_init");
+    goto out;
+  }
+  run(state, &p, &tag, period, 50, goal);
+  expected = nearest(new_cs, new_n, cs[poet_get_applied_state(state)].speedup);
+  reload_plant_swap(&p, new_cs, new_n);
+  if (poet_update_states(state, new_n, new_cs, &p)) {
+    perror("poet_update_states");
+    poet_destroy(state);
+    goto out;
+  }
+  if (poet_get_applied_state(state) != expected) {
+    fprintf(stderr, "Current state mapped to %u instead of %u\n",
+            poet_get_applied_state(state), expected);
+    poet_destroy(state);
+    goto out;
+  }
+  update_err = run(state, &p, &tag, period, periods, goal);
+  poet_destroy(state);
+
+  // same, but replace the controller
+  reload_plant_init(&p, cs, n);
+  tag = 0;
+  state = poet_init(CONST(goal), n, cs, &p, reload_plant_apply, NULL, period,
+                    1, NULL);
+  if (state == NULL) {
+    perror("poet_init");
+    goto out;
+  }
+  run(state, &p, &tag, period, 50, goal);
+  poet_destroy(state);
+  reload_plant_swap(&p, new_cs, new_n);
+  state = poet_init(CONST(goal), new_n, new_cs, &p, reload_plant_apply, NULL,
+                    period, 1, NULL);
+  if (state == NULL) {
+    perror("poet_init");
+    goto out;
+  }
+  reinit_err = run(state, &p, &tag, period, periods, goal);
+  poet_destroy(state);
+
+  printf("states %u -> %u, period=%u, mean goal error over %u periods:\n", n,
+         new_n, period, periods);
+  printf("  poet_update_states: %.2f%%\n", 100.0 * update_err);
+  printf("  poet_destroy + poet_init: %.2f%%\n", 100.0 * reinit_err);
+  if (update_err > reinit_err) {
+    fprintf(stderr, "Updating the states was worse than re-initializing\n");
+    goto out;
+  }
+
+  if (test_watcher(cs, n, new_cs, new_n, period)) {
+    goto out;
+  }
+  ret = 0;
+
+out:
+  printf("%s\n", ret ? "FAIL" : "OK");
+  free(cs);
+  free(new_cs);
+  return ret;
+}
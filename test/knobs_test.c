@@ -0,0 +1,325 @@
+/**
+ * Composes a frequency, a core count and an application quality knob with
+ * poet_knobs_compose() and checks that the composed states are exactly the
+ * Pareto frontier of the full Cartesian product of the knobs.
+ *
+ * Then runs POET on the composed states in virtual time and checks that each
+ * knob is applied only when its own setting changes, that the knobs always
+ * hold the settings of the applied state, and that the rate is at the goal.
+ *
+ * Also reports the time to compose the knobs and to enumerate and prune the
+ * full product.
+ */
+#include <getopt.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "poet.h"
+#include "poet_knobs.h"
+#include "poet_math.h"
+
+#define NUM_KNOBS 3
+#define BASE_RATE 10.0
+#define GOAL_FRACTION 0.4
+#define TOLERANCE 0.05
+#define PERIOD 20
+#define ITERATIONS 20000
+
+static const char* KNOB_NAMES[NUM_KNOBS] = {"freq", "cores", "quality"};
+
+typedef struct {
+  poet_control_state_t* states;
+  unsigned int num_states;
+  unsigned int setting;
+  unsigned long applies;
+  unsigned long redundant;
+} knob;
+
+typedef struct {
+  real_t speedup;
+  real_t cost;
+} point;
+
+static knob knobs[NUM_KNOBS];
+
+static inline uint64_t get_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * (uint64_t) 1000000000 + ts.tv_nsec;
+}
+
+static void knob_apply(void* states,
+                       unsigned int num_states,
+                       unsigned int id,
+                       unsigned int last_id) {
+  knob* k = (knob*) states;
+  (void) num_states;
+  if (id == last_id || last_id != k->setting) {
+    k->redundant++;
+  }
+  k->setting = id;
+  k->applies++;
+}
+
+static int make_knobs(unsigned int levels) {
+  unsigned int i;
+  double f;
+  double c;
+  for (i = 0; i < NUM_KNOBS; i++) {
+    knobs[i].states = malloc(levels * sizeof(poet_control_state_t));
+    if (knobs[i].states == NULL) {
+      perror("malloc");
+      return -1;
+    }
+    knobs[i].num_states = levels;
+  }
+  for (i = 0; i < levels; i++) {
+    // frequency from 1x to 2.4x, dynamic power grows faster than speed
+    f = 1.0 + 1.4 * i / (levels - 1);
+    knobs[0].states[i].id = i;
+    knobs[0].states[i].speedup = CONST(pow(f, 0.9));
+    knobs[0].states[i].cost = CONST(pow(f, 2.5));
+    // 1 to 8 cores with some serial work
+    c = 1.0 + 7.0 * i / (levels - 1);
+    knobs[1].states[i].id = i;
+    knobs[1].states[i].speedup = CONST(c / (1.0 + 0.05 * (c - 1.0)));
+    knobs[1].states[i].cost = CONST(1.0 + 0.6 * (c - 1.0));
+    // lower quality is faster and draws a little more power
+    knobs[2].states[i].id = i;
+    knobs[2].states[i].speedup = CONST(1.0 + 1.8 * i / (levels - 1));
+    knobs[2].states[i].cost = CONST(1.0 + 0.3 * i / (levels - 1));
+  }
+  return 0;
+}
+
+static int point_cmp(const void* a, const void* b) {
+  const point* pa = (const point*) a;
+  const point* pb = (const point*) b;
+  if (pa->speedup < pb->speedup) {
+    return -1;
+  }
+  if (pa->speedup > pb->speedup) {
+    return 1;
+  }
+  if (pa->cost > pb->cost) {
+    return -1;
+  }
+  return pa->cost < pb->cost ? 1 : 0;
+}
+
+// Enumerates the full product and keeps the points no other point dominates
+static point* brute_force(unsigned int* num) {
+  unsigned int levels = knobs[0].num_states;
+  unsigned int n = levels * levels * levels;
+  point* p = malloc(n * sizeof(point));
+  unsigned int i;
+  unsigned int j;
+  unsigned int l;
+  unsigned int k = 0;
+  real_t min_cost;
+
+  if (p == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  for (i = 0; i < levels; i++) {
+    for (j = 0; j < levels; j++) {
+      for (l = 0; l < levels; l++) {
+        // same order of products as the composition
+        p[k].speedup = mult(mult(mult(CONST(1.0), knobs[0].states[i].speedup),
+                                 knobs[1].states[j].speedup),
+                            knobs[2].states[l].speedup);
+        p[k].cost = mult(mult(mult(CONST(1.0), knobs[0].states[i].cost),
+                              knobs[1].states[j].cost),
+                         knobs[2].states[l].cost);
+        k++;
+      }
+    }
+  }
+  qsort(p, n, sizeof(point), point_cmp);
+  k = n - 1;
+  min_cost = p[k].cost;
+  for (i = n - 1; i-- > 0;) {
+    if (p[i].cost < min_cost) {
+      min_cost = p[i].cost;
+      p[--k] = p[i];
+    }
+  }
+  memmove(p, &p[k], (n - k) * sizeof(point));
+  *num = n - k;
+  return p;
+}
+
+static int check_frontier(const poet_control_state_t* cstates,
+                          unsigned int nstates,
+                          const point* p,
+                          unsigned int np) {
+  unsigned int i;
+  if (nstates != np) {
+    fprintf(stderr, "%u composed states, %u on the frontier\n", nstates, np);
+    return -1;
+  }
+  for (i = 0; i < nstates; i++) {
+    if (memcmp(&cstates[i].speedup, &p[i].speedup, sizeof(real_t)) ||
+        memcmp(&cstates[i].cost, &p[i].cost, sizeof(real_t))) {
+      fprintf(stderr, "Composed state %u is not on the frontier\n", i);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Runs POET in virtual time, returns the rate relative to the goal
+static double run(poet_knobs* kn,
+                  poet_control_state_t* cstates,
+                  unsigned int nstates,
+                  double goal,
+                  int* mismatches) {
+  poet_state* state;
+  double seconds;
+  double time = 0;
+  unsigned int curr_id = nstates - 1;
+  unsigned int i;
+  unsigned int k;
+
+  for (k = 0; k < NUM_KNOBS; k++) {
+    knobs[k].setting = poet_knobs_get_setting(kn, curr_id, k);
+    knobs[k].applies = 0;
+    knobs[k].redundant = 0;
+  }
+  state = poet_init(CONST(goal), nstates, cstates, kn, poet_knobs_apply, NULL,
+                    PERIOD, 1, NULL);
+  if (state == NULL) {
+    perror("poet_init");
+    exit(1);
+  }
+  *mismatches = 0;
+  for (i = 0; i < ITERATIONS; i++) {
+    // the speedup of the knobs' settings, not of the state POET thinks it set
+    seconds = 1.0 / BASE_RATE;
+    for (k = 0; k < NUM_KNOBS; k++) {
+      seconds /= real_to_db(knobs[k].states[knobs[k].setting].speedup);
+    }
+    time += seconds;
+    poet_apply_control(state, i, CONST(1.0 / seconds), CONST(0.0));
+    curr_id = poet_get_applied_state(state);
+    for (k = 0; k < NUM_KNOBS; k++) {
+      if (knobs[k].setting != (unsigned int) poet_knobs_get_setting(kn, curr_id,
+                                                                    k)) {
+        (*mismatches)++;
+      }
+    }
+  }
+  poet_destroy(state);
+  return ITERATIONS / time / goal;
+}
+
+static void print_usage(void) {
+  printf("usage:\n");
+  printf("knobs_test [-l levels]\n");
+  printf("  -l: settings per knob (default 8)\n");
+}
+
+int main(int argc, char** argv) {
+  unsigned int levels = 8;
+  poet_knobs* kn;
+  poet_control_state_t* cstates = NULL;
+  unsigned int nstates;
+  point* frontier = NULL;
+  unsigned int nfrontier;
+  double goal;
+  double rate;
+  int mismatches;
+  uint64_t t;
+  double compose_ms;
+  double brute_ms;
+  unsigned int k;
+  int ret = 1;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "l:h")) != -1) {
+    switch (opt) {
+      case 'l':
+        levels = strtoul(optarg, NULL, 0);
+        break;
+      case 'h':
+      default:
+        print_usage();
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (optind != argc || levels < 2) {
+    print_usage();
+    return 1;
+  }
+
+  if (make_knobs(levels)) {
+    return 1;
+  }
+  kn = poet_knobs_init();
+  if (kn == NULL) {
+    perror("poet_knobs_init");
+    return 1;
+  }
+  for (k = 0; k < NUM_KNOBS; k++) {
+    if (poet_knobs_add(kn, knobs[k].states, levels, &knobs[k],
+                       knob_apply) != (int) k) {
+      perror("poet_knobs_add");
+      goto out;
+    }
+  }
+
+  t = get_ns();
+  if (poet_knobs_compose(kn, &cstates, &nstates)) {
+    perror("poet_knobs_compose");
+    goto out;
+  }
+  compose_ms = (get_ns() - t) / 1000000.0;
+  t = get_ns();
+  frontier = brute_force(&nfrontier);
+  brute_ms = (get_ns() - t) / 1000000.0;
+  printf("levels=%u product=%u composed=%u\n", levels,
+         levels * levels * levels, nstates);
+  printf("compose %.3f ms, full product %.3f ms\n", compose_ms, brute_ms);
+  if (check_frontier(cstates, nstates, frontier, nfrontier)) {
+    goto out;
+  }
+
+  goal = BASE_RATE * (real_to_db(cstates[0].speedup) + GOAL_FRACTION *
+         (real_to_db(cstates[nstates - 1].speedup) -
+          real_to_db(cstates[0].speedup)));
+  rate = run(kn, cstates, nstates, goal, &mismatches);
+  printf("goal %.1f, rate/goal %.3f\n", goal, rate);
+  printf("%8s %10s %10s\n", "KNOB", "APPLIES", "REDUNDANT");
+  for (k = 0; k < NUM_KNOBS; k++) {
+    printf("%8s %10lu %10lu\n", KNOB_NAMES[k], knobs[k].applies,
+           knobs[k].redundant);
+    if (knobs[k].redundant > 0) {
+      fprintf(stderr, "%s was applied without a change\n", KNOB_NAMES[k]);
+      goto out;
+    }
+  }
+  if (mismatches > 0) {
+    fprintf(stderr, "Knob settings differ from the applied state %d times\n",
+            mismatches);
+    goto out;
+  }
+  if (rate < 1.0 - TOLERANCE || rate > 1.0 + TOLERANCE) {
+    fprintf(stderr, "Rate is not at the goal\n");
+    goto out;
+  }
+  ret = 0;
+
+out:
+  printf("%s\n", ret ? "FAIL" : "OK");
+  free(frontier);
+  free(cstates);
+  poet_knobs_destroy(kn);
+  for (k = 0; k < NUM_KNOBS; k++) {
+    free(knobs[k].states);
+  }
+  return ret;
+}
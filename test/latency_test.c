@@ -0,0 +1,229 @@
+/**
+ * Runs a plant in virtual time whose iterations are occasionally several times
+ * slower than usual, and compares POET holding a p99 latency goal set with
+ * poet_set_latency_goal() against POET holding a mean rate goal of the same
+ * latency.
+ *
+ * Checks that the p99 latency is at the goal with the latency goal, and
+ * reports how far the mean rate goal misses it. Also checks that a latency
+ * goal too short for any state, whose rate does not fit real_t in fixed point,
+ * runs the fastest state.
+ */
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "poet.h"
+#include "poet_config.h"
+#include "poet_math.h"
+#include "plant.h"
+
+#define QUANTILE 0.99
+// fraction of iterations that are slower, and how much slower
+#define BURST_PROBABILITY 0.03
+#define BURST_FACTOR 3.0
+// the speedup the goal needs, as a fraction of the range of speedups
+#define GOAL_FRACTION 0.5
+#define TOLERANCE 0.1
+// a latency goal no state reaches, in seconds, whose rate does not fit Q16.16
+#define SHORT_LATENCY 1e-5
+
+typedef enum {
+  MODE_RATE = 0,
+  MODE_LATENCY,
+  NUM_MODES
+} run_mode;
+
+static const char* MODE_NAMES[] = {"rate", "latency"};
+
+typedef struct {
+  double quantile;
+  double mean;
+} result;
+
+static int double_cmp(const void* a, const void* b) {
+  double da = *(const double*) a;
+  double db = *(const double*) b;
+  return da < db ? -1 : (da > db ? 1 : 0);
+}
+
+// Runs the plant, returns the quantile and mean latency over the second half
+static int run(poet_control_state_t* cstates,
+               unsigned int nstates,
+               run_mode mode,
+               double goal,
+               unsigned int period,
+               unsigned long iterations,
+               result* r) {
+  unsigned long n = iterations - iterations / 2;
+  poet_state* state;
+  plant p;
+  double* latencies;
+  double* window;
+  double window_time = 0;
+  double latency;
+  double sum = 0;
+  unsigned long i;
+
+  latencies = malloc(n * sizeof(double));
+  window = calloc(period, sizeof(double));
+  if (latencies == NULL || window == NULL) {
+    perror("malloc");
+    free(latencies);
+    free(window);
+    return -1;
+  }
+  plant_init(&p, cstates, nstates, 1);
+  state = poet_init(CONST(1.0 / goal), nstates, cstates, &p, plant_apply, NULL,
+                    period, 1, NULL);
+  if (state == NULL) {
+    perror("poet_init");
+    free(latencies);
+    free(window);
+    return -1;
+  }
+  if (mode == MODE_LATENCY && poet_set_latency_goal(state, QUANTILE, goal)) {
+    perror("poet_set_latency_goal");
+    poet_destroy(state);
+    free(latencies);
+    free(window);
+    return -1;
+  }
+
+  for (i = 0; i < iterations; i++) {
+    latency = (1.0 + 0.2 * (plant_uniform(&p) - 0.5)) * plant_seconds(&p);
+    if (plant_uniform(&p) < BURST_PROBABILITY) {
+      latency *= BURST_FACTOR;
+    }
+    if (i >= iterations / 2) {
+      latencies[i - iterations / 2] = latency;
+      sum += latency;
+    }
+    if (mode == MODE_LATENCY) {
+      poet_apply_latency(state, i, latency, CONST(0.0));
+    } else {
+      // the rate over the last period, as from a heartbeat window
+      window_time += latency - window[i % period];
+      window[i % period] = latency;
+      poet_apply_control(state, i,
+                         CONST((i < period ? i + 1 : period) / window_time),
+                         CONST(0.0));
+    }
+  }
+  poet_destroy(state);
+
+  qsort(latencies, n, sizeof(double), double_cmp);
+  r->quantile = latencies[(unsigned long) (QUANTILE * (n - 1))];
+  r->mean = sum / n;
+  free(latencies);
+  free(window);
+  return 0;
+}
+
+// Holds a goal of SHORT_LATENCY, returns 0 if POET runs the fastest state
+static int check_short_latency(poet_control_state_t* cstates,
+                               unsigned int nstates,
+                               unsigned int period) {
+  poet_state* state;
+  plant p;
+  unsigned int fastest = 0;
+  unsigned long i;
+
+  for (i = 0; i < nstates; i++) {
+    if (cstates[i].speedup > cstates[fastest].speedup) {
+      fastest = i;
+    }
+  }
+  // start in the slowest state
+  plant_init(&p, cstates, nstates, 1);
+  p.curr_id = 0;
+  state = poet_init(CONST(1.0), nstates, cstates, &p, plant_apply,
+                    plant_current, period, 1, NULL);
+  if (state == NULL || poet_set_latency_goal(state, QUANTILE, SHORT_LATENCY)) {
+    perror("poet_init");
+    poet_destroy(state);
+    return -1;
+  }
+  for (i = 0; i < 10 * period; i++) {
+    poet_apply_latency(state, i, plant_seconds(&p), CONST(0.0));
+  }
+  poet_destroy(state);
+  printf("goal=%g ms state=%u fastest=%u\n", 1000 * SHORT_LATENCY, p.curr_id,
+         fastest);
+  return cstates[p.curr_id].speedup < cstates[fastest].speedup;
+}
+
+static void print_usage(void) {
+  printf("usage:\n");
+  printf("latency_test [-i iterations] [-p period] [-c control_config]\n");
+  printf("  -i: iterations per run (default 100000)\n");
+  printf("  -p: controller period (default 20)\n");
+  printf("  -c: control config (default %s)\n", PLANT_CONTROL_CONFIG);
+}
+
+int main(int argc, char** argv) {
+  const char* control_config = PLANT_CONTROL_CONFIG;
+  unsigned long iterations = 100000;
+  unsigned int period = 20;
+  poet_control_state_t* cstates;
+  unsigned int nstates;
+  result r[NUM_MODES];
+  double goal;
+  double err;
+  int ret = 0;
+  int opt;
+  int m;
+
+  while ((opt = getopt(argc, argv, "i:p:c:h")) != -1) {
+    switch (opt) {
+      case 'i':
+        iterations = strtoul(optarg, NULL, 0);
+        break;
+      case 'p':
+        period = strtoul(optarg, NULL, 0);
+        break;
+      case 'c':
+        control_config = optarg;
+        break;
+      case 'h':
+      default:
+        print_usage();
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (optind != argc || iterations < 2 || period == 0) {
+    print_usage();
+    return 1;
+  }
+
+  if (plant_load_states(control_config, &cstates, &nstates)) {
+    return 1;
+  }
+  // slow iterations set the quantile
+  goal = BURST_FACTOR / plant_goal(cstates, nstates, GOAL_FRACTION);
+
+  printf("states=%u period=%u p%.0f goal=%.3f ms\n", nstates, period,
+         100 * QUANTILE, 1000 * goal);
+  printf("%8s %14s %14s %12s\n", "MODE", "QUANTILE_MS", "MEAN_MS",
+         "QUANTILE/GOAL");
+  for (m = MODE_RATE; m < NUM_MODES; m++) {
+    if (run(cstates, nstates, m, goal, period, iterations, &r[m])) {
+      free(cstates);
+      return 1;
+    }
+    printf("%8s %14.3f %14.3f %12.3f\n", MODE_NAMES[m], 1000 * r[m].quantile,
+           1000 * r[m].mean, r[m].quantile / goal);
+  }
+  err = r[MODE_LATENCY].quantile / goal - 1.0;
+  if (err > TOLERANCE || err < -TOLERANCE) {
+    fprintf(stderr, "Quantile is not at the goal\n");
+    ret = 1;
+  }
+  if (check_short_latency(cstates, nstates, period)) {
+    fprintf(stderr, "A goal no state reaches did not run the fastest state\n");
+    ret = 1;
+  }
+
+  printf("%s\n", ret ? "FAIL" : "OK");
+  free(cstates);
+  return ret;
+}
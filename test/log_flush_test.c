@@ -0,0 +1,160 @@
+/**
+ * Logs the same decisions with every log flush policy and destroys the
+ * controller right after the last one, while records are still in the buffer
+ * being filled and possibly in the one handed to the background flusher.
+ *
+ * Checks that poet_destroy() writes all pending records, so that the log of
+ * every policy is identical to the one written with POET_LOG_FLUSH_SYNC.
+ * Each policy runs several times to catch races with the flusher.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "poet.h"
+#include "poet_config.h"
+#include "poet_math.h"
+
+static const char* CONTROL_CONFIG =
+  "../config/examples/2x_Xeon_E5_2690/control_config_x264_native";
+
+#define BUFFER_DEPTH 8
+// not a multiple of the buffer depth or of RECORDS_N, so some are pending
+#define NUM_DECISIONS (5 * BUFFER_DEPTH + 5)
+#define RECORDS_N 3
+#define TIME_MS 1
+// time between decisions with POET_LOG_FLUSH_TIME
+#define TIME_SLEEP_US 300
+#define NUM_ROUNDS 20
+
+static const char* POLICY_NAMES[] = {
+  "SYNC", "RECORDS", "TIME", "DESTROY"
+};
+
+// Reads a whole file into a null terminated buffer, or returns NULL
+static char* read_file(const char* path) {
+  FILE* f;
+  char* buf;
+  long size;
+
+  f = fopen(path, "r");
+  if (f == NULL) {
+    perror(path);
+    return NULL;
+  }
+  if (fseek(f, 0, SEEK_END) || (size = ftell(f)) < 0 ||
+      fseek(f, 0, SEEK_SET)) {
+    perror(path);
+    fclose(f);
+    return NULL;
+  }
+  buf = malloc(size + 1);
+  if (buf == NULL || fread(buf, 1, size, f) != (size_t) size) {
+    fprintf(stderr, "Failed to read %s\n", path);
+    free(buf);
+    fclose(f);
+    return NULL;
+  }
+  buf[size] = '\0';
+  fclose(f);
+  return buf;
+}
+
+// Logs the decisions with a policy and returns the log, or NULL on failure
+static char* run(poet_control_state_t* cstates,
+                 unsigned int nstates,
+                 poet_log_flush_policy policy,
+                 const char* path) {
+  poet_state* state;
+  unsigned int value;
+  unsigned long i;
+
+  // period 1 decides, and logs, on every call after the first
+  state = poet_init(CONST(1.0), nstates, cstates, NULL, NULL, NULL, 1,
+                    BUFFER_DEPTH, path);
+  if (state == NULL) {
+    perror("poet_init");
+    return NULL;
+  }
+  value = policy == POET_LOG_FLUSH_RECORDS ? RECORDS_N :
+          policy == POET_LOG_FLUSH_TIME ? TIME_MS : 0;
+  if (poet_set_log_flush_policy(state, policy, value)) {
+    perror("poet_set_log_flush_policy");
+    poet_destroy(state);
+    return NULL;
+  }
+  for (i = 0; i <= NUM_DECISIONS; i++) {
+    poet_apply_control(state, i, CONST(0.5 + 0.1 * (i % 5)), CONST(1.0));
+    if (policy == POET_LOG_FLUSH_TIME) {
+      usleep(TIME_SLEEP_US);
+    }
+  }
+  poet_destroy(state);
+
+  return read_file(path);
+}
+
+// Number of records in a log, not counting the column names
+static unsigned int count_records(const char* log) {
+  unsigned int lines = 0;
+
+  for (; *log != '\0'; log++) {
+    lines += *log == '\n';
+  }
+  return lines > 0 ? lines - 1 : 0;
+}
+
+int main(void) {
+  char dir[] = "/tmp/poet_log_flush_XXXXXX";
+  char path[256];
+  poet_control_state_t* cstates;
+  unsigned int nstates;
+  char* expected;
+  char* log;
+  unsigned int failures;
+  unsigned int round;
+  int policy;
+  int ret = 0;
+
+  if (get_control_states(CONTROL_CONFIG, &cstates, &nstates)) {
+    fprintf(stderr, "Failed to get control states from %s\n", CONTROL_CONFIG);
+    return 1;
+  }
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    free(cstates);
+    return 1;
+  }
+  snprintf(path, sizeof(path), "%s/poet.log", dir);
+
+  expected = run(cstates, nstates, POET_LOG_FLUSH_SYNC, path);
+  if (expected == NULL || count_records(expected) != NUM_DECISIONS) {
+    fprintf(stderr, "The synchronous log does not have %u records\n",
+            NUM_DECISIONS);
+    ret = 1;
+    goto out;
+  }
+
+  for (policy = POET_LOG_FLUSH_RECORDS; policy <= POET_LOG_FLUSH_DESTROY;
+       policy++) {
+    failures = 0;
+    for (round = 0; round < NUM_ROUNDS; round++) {
+      log = run(cstates, nstates, (poet_log_flush_policy) policy, path);
+      if (log == NULL || strcmp(log, expected)) {
+        failures++;
+      }
+      free(log);
+    }
+    printf("%-8s %u of %u logs differ from SYNC\n", POLICY_NAMES[policy],
+           failures, NUM_ROUNDS);
+    ret |= failures > 0;
+  }
+
+out:
+  free(expected);
+  unlink(path);
+  rmdir(dir);
+  free(cstates);
+  printf("%s\n", ret ? "FAIL" : "OK");
+  return ret;
+}
@@ -1,9 +1,25 @@
+/**
+ * Unit tests for the fixed point kernels in poet_math.h.
+ *
+ * Built once for every fixed point format (math_ut_q16_16, math_ut_q8_24,
+ * math_ut_q32_32) and once for the configured format (math_ut). Besides the
+ * functional tests, measures the accuracy of multiplication, division and a
+ * Kalman filter step against double, and the speed of each operation.
+ */
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include "poet_math.h"
 
 #define ERROR_MARGIN .0005
 
+// largest magnitude the format can represent
+#define FP_RANGE (MAX_FP / FP_SCALE)
+
+#define ACCURACY_SAMPLES 1000000
+#define SPEED_OPS 10000000
+#define KALMAN_STEPS 100000
+
 typedef int bool;
 #define true 1
 #define false 0
@@ -20,307 +36,376 @@ static void assert(bool expression, char * error_message) {
 }
 
 static double fp_to_db(fp_t a) {
-  return (double) (a / ((double) (1 << 16)));
+  return (double) (a / FP_SCALE);
+}
+
+// Whether all the values of a test fit the format, otherwise it is skipped
+static bool fits(double a, double b, double expected) {
+  return d_abs(a) < FP_RANGE && d_abs(b) < FP_RANGE &&
+         d_abs(expected) < FP_RANGE;
 }
 
-static void addition_test(fp_t a, fp_t b, double c, double d) {
+static void addition_test(double c, double d, double expected) {
   char error_message[256];
-  double expected;
   fp_t ans;
-  bool expression;
 
-  ans = FP_ADD2(a, b);
-  expected = c + d;
-
-  expression = d_abs(fp_to_db(ans) - expected) < ERROR_MARGIN;
+  ans = FP_ADD2(FP_CONST(c), FP_CONST(d));
 
   snprintf(error_message, sizeof(error_message), "\nExpected %f but calculated %f\n", expected, fp_to_db(ans));
 
-  assert(expression, error_message);
+  assert(d_abs(fp_to_db(ans) - expected) < ERROR_MARGIN, error_message);
 }
 
-static void subtraction_test(fp_t a, fp_t b, double c, double d) {
+static void subtraction_test(double c, double d, double expected) {
   char error_message[256];
-  double expected;
   fp_t ans;
-  bool expression;
-
-  ans = FP_SUB(a, b);
-  expected = c - d;
 
-  expression = d_abs(fp_to_db(ans) - expected) < ERROR_MARGIN;
+  ans = FP_SUB(FP_CONST(c), FP_CONST(d));
 
   snprintf(error_message, sizeof(error_message), "\nExpected %f but calculated %f\n", expected, fp_to_db(ans));
 
-  assert(expression, error_message);
+  assert(d_abs(fp_to_db(ans) - expected) < ERROR_MARGIN, error_message);
 }
 
-static void multiplication_test(fp_t a, fp_t b, double c, double d) {
+static void multiplication_test(double c, double d, double expected) {
   char error_message[256];
-  double expected;
   fp_t ans;
-  bool expression;
-
-  ans = FP_MULT2(a, b);
-  expected = DB_MULT2(c, d);
 
-  expression = d_abs(fp_to_db(ans) - expected) < ERROR_MARGIN;
+  ans = FP_MULT2(FP_CONST(c), FP_CONST(d));
 
   snprintf(error_message, sizeof(error_message),
       "\nExpected %f but calculated %f with a=%f b=%f\n",
       expected, fp_to_db(ans), c, d);
 
-  assert(expression, error_message);
+  assert(d_abs(fp_to_db(ans) - expected) < ERROR_MARGIN, error_message);
 }
 
-static void division_test(fp_t a, fp_t b, double c, double d) {
+static void division_test(double c, double d, double expected) {
   char error_message[256];
-  double expected;
   fp_t ans;
-  bool expression;
 
-  ans = FP_DIV(a, b);
-  expected = DB_DIV(c, d);
-
-  expression = d_abs(fp_to_db(ans) - expected) < ERROR_MARGIN;
+  ans = FP_DIV(FP_CONST(c), FP_CONST(d));
 
   snprintf(error_message, sizeof(error_message),
       "\nExpected %f but calculated %f with a=%f b=%f\n",
       expected, fp_to_db(ans), c, d);
 
-  assert(expression, error_message);
+  assert(d_abs(fp_to_db(ans) - expected) < ERROR_MARGIN, error_message);
 }
 
+#define RUN_TEST(test, c, d, expected) \
+  do { \
+    if (fits((c), (d), (expected))) { \
+      test((c), (d), (expected)); \
+    } else { \
+      skipped++; \
+    } \
+  } while (0)
+
 static void conversion_to_fp_test(void) {
   char error_message[256];
-  bool expression;
-  fp_t a1;
-  double a2;
+  static const double values[] = {1.2, 89.234, 189.24, -1.2};
+  unsigned int skipped = 0;
+  unsigned int i;
+  double a;
 
   printf("Testing FP_CONST macro...");
 
-  // Test 1
-  a1 = FP_CONST(1.2);
-  a2 = fp_to_db(a1);
-  expression = (d_abs(1.2 - a2) < ERROR_MARGIN);
-  snprintf(error_message, sizeof(error_message), "\nDouble was %f but fixed point was %f\n", 1.2, a2);
-  assert(expression, error_message);
-
-  // Test 2
-  a1 = FP_CONST(89.234);
-  a2 = fp_to_db(a1);
-  expression = d_abs(89.234 - a2) < ERROR_MARGIN;
-  snprintf(error_message, sizeof(error_message), "\nDouble was %f but fixed point was %f\n", 89.234, a2);
-  assert(expression, error_message);
-
-  // Test 3
-  a1 = FP_CONST(189.24);
-  a2 = fp_to_db(a1);
-  expression = d_abs(189.24 - a2) < ERROR_MARGIN;
-  snprintf(error_message, sizeof(error_message), "\nDouble was %f but fixed point was %f\n", 189.24, a2);
-  assert(expression, error_message);
-
-  // Test 4
-  a1 = FP_CONST(-1.2);
-  a2 = fp_to_db(a1);
-  expression = d_abs(-1.2 - a2) < ERROR_MARGIN;
-  snprintf(error_message, sizeof(error_message), "\nDouble was %f but fixed point was %f\n", -1.2, a2);
-  assert(expression, error_message);
+  for (i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+    if (d_abs(values[i]) >= FP_RANGE) {
+      skipped++;
+      continue;
+    }
+    a = fp_to_db(FP_CONST(values[i]));
+    snprintf(error_message, sizeof(error_message), "\nDouble was %f but fixed point was %f\n", values[i], a);
+    assert(d_abs(values[i] - a) < ERROR_MARGIN, error_message);
+  }
 
-  printf("Done\n");
+  printf("Done (%u out of range)\n", skipped);
 }
 
 static void addition_tests(void) {
-  fp_t a;
-  fp_t b;
+  unsigned int skipped = 0;
 
   printf("Testing fixed point addition...");
 
-  // Test 1
-  a = FP_CONST(1.52);
-  b = FP_CONST(-.32);
-  addition_test(a,b,1.52,-.32);
-
-  // Test 2
-  a = FP_CONST(902.314);
-  b = FP_CONST(123.432);
-  addition_test(a,b,902.314,123.432);
+  RUN_TEST(addition_test, 1.52, -.32, 1.2);
+  RUN_TEST(addition_test, 902.314, 123.432, 1025.746);
+  RUN_TEST(addition_test, -34.374, 3.432, -30.942);
+  RUN_TEST(addition_test, -310.132, -893.001, -1203.133);
 
-  // Test 3
-  a = FP_CONST(-34.374);
-  b = FP_CONST(3.432);
-  addition_test(a,b,-34.374,3.432);
+  // saturation
+  addition_test(FP_RANGE * .6, FP_RANGE * .6, FP_RANGE);
+  addition_test(-FP_RANGE * .6, -FP_RANGE * .6, -FP_RANGE);
 
-  // Test 4
-  a = FP_CONST(-310.132);
-  b = FP_CONST(-893.001);
-  addition_test(a,b,-310.132,-893.001);
-
-  // Test 5
-  a = FP_CONST(20000.132);
-  b = FP_CONST(20000.001);
-  addition_test(a,b,32768,0);
-
-  // Test 5
-  a = FP_CONST(-20000.132);
-  b = FP_CONST(-20000.001);
-  addition_test(a,b,-32768,0);
-
-  printf("Done\n");
+  printf("Done (%u out of range)\n", skipped);
 }
 
 static void subtraction_tests(void) {
-  fp_t a;
-  fp_t b;
+  unsigned int skipped = 0;
 
   printf("Testing fixed point subtraction...");
 
-  // Test 1
-  a = FP_CONST(1.52);
-  b = FP_CONST(-.32);
-  subtraction_test(a,b,1.52,-.32);
-
-  // Test 2
-  a = FP_CONST(902.314);
-  b = FP_CONST(123.432);
-  subtraction_test(a,b,902.314,123.432);
+  RUN_TEST(subtraction_test, 1.52, -.32, 1.84);
+  RUN_TEST(subtraction_test, 902.314, 123.432, 778.882);
+  RUN_TEST(subtraction_test, -34.374, 3.432, -37.806);
+  RUN_TEST(subtraction_test, -310.132, -893.001, 582.869);
 
-  // Test 3
-  a = FP_CONST(-34.374);
-  b = FP_CONST(3.432);
-  subtraction_test(a,b,-34.374,3.432);
+  // saturation
+  subtraction_test(FP_RANGE * .6, -FP_RANGE * .6, FP_RANGE);
+  subtraction_test(-FP_RANGE * .6, FP_RANGE * .6, -FP_RANGE);
 
-  // Test 4
-  a = FP_CONST(-310.132);
-  b = FP_CONST(-893.001);
-  subtraction_test(a,b,-310.132,-893.001);
-
-  // Test 5
-  a = FP_CONST(20000.132);
-  b = FP_CONST(-20000.001);
-  subtraction_test(a,b,32768,0);
-
-  // Test 5
-  a = FP_CONST(-20000.132);
-  b = FP_CONST(20000.001);
-  subtraction_test(a,b,-32768,0);
-
-  printf("Done\n");
+  printf("Done (%u out of range)\n", skipped);
 }
 
 static void multiplication_tests(void) {
-  fp_t a;
-  fp_t b;
+  unsigned int skipped = 0;
 
   printf("Testing fixed point multiplication...");
 
-  // Test 1
-  a = FP_CONST(1.52);
-  b = FP_CONST(-.32);
-  multiplication_test(a,b,1.52,-.32);
-
-  // Test 2
-  a = FP_CONST(2.314);
-  b = FP_CONST(3.432);
-  multiplication_test(a,b,2.314,3.432);
-
-  // Test 3
-  a = FP_CONST(-34.374);
-  b = FP_CONST(3.432);
-  multiplication_test(a,b,-34.374,3.432);
-
-  // Test 4
-  a = FP_CONST(-0.132);
-  b = FP_CONST(-3.001);
-  multiplication_test(a,b,-0.132,-3.001);
-
-  // Test 5
-  a = FP_CONST(128);
-  b = FP_CONST(1024);
-  multiplication_test(a,b,32768,1);
-
-  // Test 6
-  a = FP_CONST(-128);
-  b = FP_CONST(-1024);
-  multiplication_test(a,b,32768,1);
-
-  // Test 7
-  a = FP_CONST(-128);
-  b = FP_CONST(1024);
-  multiplication_test(a,b,-32768,1);
+  RUN_TEST(multiplication_test, 1.52, -.32, DB_MULT2(1.52, -.32));
+  RUN_TEST(multiplication_test, 2.314, 3.432, DB_MULT2(2.314, 3.432));
+  RUN_TEST(multiplication_test, -34.374, 3.432, DB_MULT2(-34.374, 3.432));
+  RUN_TEST(multiplication_test, -0.132, -3.001, DB_MULT2(-0.132, -3.001));
 
-  printf("Done\n");
+  // saturation
+  multiplication_test(FP_RANGE / 2, 4, FP_RANGE);
+  multiplication_test(-FP_RANGE / 2, -4, FP_RANGE);
+  multiplication_test(-FP_RANGE / 2, 4, -FP_RANGE);
+
+  printf("Done (%u out of range)\n", skipped);
 }
 
 static void division_tests(void) {
-  fp_t a;
-  fp_t b;
+  char error_message[256];
+  unsigned int skipped = 0;
+  fp_t ans;
 
   printf("Testing fixed point division...");
 
-  // Test 1
-  a = FP_CONST(1.0);
-  b = FP_CONST(1.0);
-  division_test(a,b,1.0,1.0);
+  RUN_TEST(division_test, 1.0, 1.0, 1.0);
+  RUN_TEST(division_test, 12.0, 2.0, 6.0);
+  RUN_TEST(division_test, 1.5, 0.3, DB_DIV(1.5, 0.3));
+  RUN_TEST(division_test, -20.0, 0.5, -40.0);
+  RUN_TEST(division_test, 11.34, 20.23, DB_DIV(11.34, 20.23));
+  RUN_TEST(division_test, 101.342, 002.231, DB_DIV(101.342, 002.231));
+
+  // saturation
+  division_test(-FP_RANGE / 2, .001, -FP_RANGE);
+  division_test(FP_RANGE / 2, .001, FP_RANGE);
+  division_test(1, 0, FP_RANGE);
+  division_test(-1, 0, -FP_RANGE);
+
+  // raw values, the scale cancels out
+  ans = FP_DIV(128, 5);
+  snprintf(error_message, sizeof(error_message), "\nExpected %f but calculated %f\n", 25.6, fp_to_db(ans));
+  assert(d_abs(fp_to_db(ans) - 25.6) < ERROR_MARGIN, error_message);
+
+  printf("Done (%u out of range)\n", skipped);
+}
 
-  // Test 2
-  a = FP_CONST(12.0);
-  b = FP_CONST(2.0);
-  division_test(a,b,12.0,2.0);
+/*
+ * Accuracy
+ */
 
-  // Test 3
-  a = FP_CONST(1.5);
-  b = FP_CONST(0.3);
-  division_test(a,b,1.5,0.3);
+// xorshift64*, deterministic everywhere
+static uint64_t rng = 0x9E3779B97F4A7C15ULL;
 
-  // Test 4
-  a = FP_CONST(-20.0);
-  b = FP_CONST(0.5);
-  division_test(a,b,-20.0,0.5);
+static double rand_uniform(double min, double max) {
+  rng ^= rng >> 12;
+  rng ^= rng << 25;
+  rng ^= rng >> 27;
+  return min + (max - min) *
+         (((rng * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0));
+}
 
-  // Test 5
-  a = FP_CONST(11.34);
-  b = FP_CONST(20.23);
-  division_test(a,b,11.34,20.23);
+/*
+ * Compares the kernels with the exact result of their (already rounded)
+ * operands, so only the error of the operation itself is measured. Operands are
+ * drawn so that the results fit the format. The double reference is exact for
+ * Q16.16 and Q8.24; for Q32.32 its own rounding, up to 2^-52 of the result, is
+ * subtracted from the error.
+ */
+static void accuracy_tests(void) {
+  char error_message[256];
+  double limit = FP_RANGE < 1000 ? FP_RANGE : 1000;
+  double max_mult = 0;
+  double max_div = 0;
+  double exact;
+  double err;
+  fp_t a;
+  fp_t b;
+  unsigned int i;
+
+  printf("Testing accuracy against double...");
+
+  for (i = 0; i < ACCURACY_SAMPLES; i++) {
+    a = FP_CONST(rand_uniform(-limit, limit));
+    b = FP_CONST(rand_uniform(-1, 1) * FP_RANGE / (limit + 1));
+    exact = fp_to_db(a) * fp_to_db(b);
+    err = d_abs(fp_to_db(FP_MULT2(a, b)) - exact) * FP_SCALE;
+    err -= d_abs(exact) * FP_SCALE * 0x1p-52;
+    max_mult = err > max_mult ? err : max_mult;
+
+    // |b| >= 1 keeps the quotient in range
+    b = FP_CONST(rand_uniform(1, limit)) * (i % 2 ? 1 : -1);
+    exact = fp_to_db(a) / fp_to_db(b);
+    err = d_abs(fp_to_db(FP_DIV(a, b)) - exact) * FP_SCALE;
+    err -= d_abs(exact) * FP_SCALE * 0x1p-52;
+    max_div = err > max_div ? err : max_div;
+  }
 
-  // Test 6
-  a = FP_CONST(101.342);
-  b = FP_CONST(002.231);
-  division_test(a,b,101.342,002.231);
+  // both truncate, so the error is below one LSB
+  snprintf(error_message, sizeof(error_message),
+      "\nMax error of multiplication is %f LSB\n", max_mult);
+  assert(max_mult < 1.0, error_message);
+  snprintf(error_message, sizeof(error_message),
+      "\nMax error of division is %f LSB\n", max_div);
+  assert(max_div < 1.0, error_message);
 
-  // Test 7
-  a = FP_CONST(-20000);
-  b = FP_CONST(.001);
-  division_test(a,b,-32768,1);
+  printf("Done\n");
+  printf("  mult: max error %.3f LSB, div: max error %.3f LSB (1 LSB = %g)\n",
+         max_mult, max_div, 1.0 / FP_SCALE);
+}
 
-  // Test 8
-  a = FP_CONST(20000);
-  b = FP_CONST(.001);
-  division_test(a,b,32768,1);
+/*
+ * Runs the Kalman filter that estimates the base workload in poet.c on a noisy
+ * rate in both formats. Its process noise Q = 0.00001 is below one LSB of
+ * Q16.16, so the fixed point filter stops adapting once its covariance settles.
+ */
+static void kalman_test(void) {
+  const double q = 0.00001;
+  const double r = 0.01;
+  fp_t fq = FP_CONST(q);
+  fp_t fr = FP_CONST(r);
+  fp_t fone = FP_CONST(1.0);
+  fp_t fh = FP_CONST(1.0);
+  fp_t fx = FP_CONST(0.2);
+  fp_t fp = FP_CONST(1.0);
+  fp_t fp_minus;
+  fp_t fk;
+  fp_t fz;
+  double x = 0.2;
+  double p = 1.0;
+  double p_minus;
+  double k;
+  double z;
+  double max_err = 0;
+  double err;
+  unsigned int i;
+
+  printf("Testing Kalman filter step against double...");
+
+  for (i = 0; i < KALMAN_STEPS; i++) {
+    // a rate of 10 with 10% noise and a step to 20 half way
+    z = (i < KALMAN_STEPS / 2 ? 10.0 : 20.0) * rand_uniform(0.95, 1.05);
+    if (z >= FP_RANGE) {
+      z = FP_RANGE / 2;
+    }
+    fz = FP_CONST(z);
+
+    p_minus = p + q;
+    k = (p_minus * 1.0) / (1.0 * p_minus * 1.0 + r);
+    x = x + k * (z - 1.0 * x);
+    p = (1.0 - k * 1.0) * p_minus;
+
+    fp_minus = FP_ADD2(fp, fq);
+    fk = FP_DIV(FP_MULT2(fp_minus, fh),
+                FP_ADD2(FP_MULT3(fh, fp_minus, fh), fr));
+    fx = FP_ADD2(fx, FP_MULT2(fk, FP_SUB(fz, FP_MULT2(fh, fx))));
+    fp = FP_MULT2(FP_SUB(fone, FP_MULT2(fk, fh)), fp_minus);
+
+    err = d_abs(fp_to_db(fx) - x);
+    max_err = err > max_err ? err : max_err;
+  }
 
-  // Test 9
-  b = FP_CONST(20);
-  a = FP_CONST(.001);
-  division_test(a,b,1,32768);
+  printf("Done\n");
+  printf("  Q rounds to %lld LSB, final x_hat %f (double %f), "
+         "max error %f\n",
+         (long long) fq, fp_to_db(fx), x, max_err);
+}
 
+/*
+ * Speed
+ */
 
+static inline uint64_t get_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * (uint64_t) 1000000000 + ts.tv_nsec;
+}
 
-  // Test 9
-  // ints
-  int32_t c = 128;
-  int32_t d = 5;
-  division_test(c, d, 128.0, 5.0);
+/*
+ * Each operation depends on the previous result, so this measures latency.
+ * The operands are one so nothing saturates, read through volatiles so the
+ * compiler cannot fold the operations.
+ */
+static void speed_tests(void) {
+  volatile fp_t fone = FP_CONST(1.0);
+  volatile double done = 1.0;
+  volatile fp_t fsink;
+  volatile double dsink;
+  fp_t fa = fone;
+  fp_t fb = fone;
+  double da = done;
+  double db = done;
+  double fmult_ns;
+  double fdiv_ns;
+  double dmult_ns;
+  double ddiv_ns;
+  uint64_t t;
+  unsigned int i;
+
+  printf("Measuring speed...");
+
+  t = get_ns();
+  for (i = 0; i < SPEED_OPS; i++) {
+    fa = FP_MULT2(fa, fb) | 1;
+  }
+  fmult_ns = (double) (get_ns() - t) / SPEED_OPS;
+  fsink = fa;
+
+  t = get_ns();
+  for (i = 0; i < SPEED_OPS; i++) {
+    fa = FP_DIV(fa, fb) | 1;
+  }
+  fdiv_ns = (double) (get_ns() - t) / SPEED_OPS;
+  fsink = fa;
+
+  t = get_ns();
+  for (i = 0; i < SPEED_OPS; i++) {
+    da = DB_MULT2(da, db);
+  }
+  dmult_ns = (double) (get_ns() - t) / SPEED_OPS;
+  dsink = da;
+
+  t = get_ns();
+  for (i = 0; i < SPEED_OPS; i++) {
+    da = DB_DIV(da, db);
+  }
+  ddiv_ns = (double) (get_ns() - t) / SPEED_OPS;
+  dsink = da;
+  (void) fsink;
+  (void) dsink;
 
   printf("Done\n");
+  printf("  ns/op: fixed point mult %.2f div %.2f, double mult %.2f div %.2f\n",
+         fmult_ns, fdiv_ns, dmult_ns, ddiv_ns);
 }
 
 int main(void) {
   printf("--------------------\nRunning Unit Tests\n--------------------\n\n");
+  printf("Format: Q%d.%d, range +-%g, resolution %g\n\n",
+         (int) (8 * sizeof(fp_t)) - FP_FRAC_BITS, FP_FRAC_BITS, FP_RANGE,
+         1.0 / FP_SCALE);
   conversion_to_fp_test();
   addition_tests();
   subtraction_tests();
   multiplication_tests();
   division_tests();
+  accuracy_tests();
+  kalman_test();
+  speed_tests();
   printf("\n");
   printf("--------------------\nFinished Unit Tests\n--------------------\n\n");
 
@@ -0,0 +1,255 @@
+/**
+ * Runs POET on core count states with apply_cpu_config_cooperative(), which
+ * tells a thread pool how many workers to run instead of pinning its threads.
+ * The pool parks and wakes its own workers, and a plant in virtual time runs
+ * at the speedup of the number of workers the pool was asked to run.
+ *
+ * Checks that the pool is only called when the core count changes, that its
+ * workers follow the requested parallelism, and that the rate is at the goal.
+ */
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "poet.h"
+#include "poet_config.h"
+#include "poet_math.h"
+
+#define MAX_THREADS 8
+#define BASE_RATE 10.0
+#define GOAL_FRACTION 0.4
+#define TOLERANCE 0.05
+// how long to wait for the workers to follow the requested parallelism
+#define SETTLE_MS 2000
+
+typedef struct {
+  pthread_t threads[MAX_THREADS];
+  unsigned int index[MAX_THREADS];
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  // workers with an index below target run, the others park
+  unsigned int target;
+  unsigned int running;
+  int stop;
+  unsigned long calls;
+  unsigned long redundant;
+} pool;
+
+static pool p;
+
+static void* worker(void* arg) {
+  unsigned int index = *(unsigned int*) arg;
+  volatile unsigned long x = 0;
+
+  pthread_mutex_lock(&p.mutex);
+  p.running++;
+  while (!p.stop) {
+    if (index >= p.target) {
+      p.running--;
+      while (!p.stop && index >= p.target) {
+        pthread_cond_wait(&p.cond, &p.mutex);
+      }
+      p.running++;
+      continue;
+    }
+    // a small unit of work, then check the target again
+    pthread_mutex_unlock(&p.mutex);
+    for (x = 0; x < 1000; x++) {
+    }
+    sched_yield();
+    pthread_mutex_lock(&p.mutex);
+  }
+  p.running--;
+  pthread_mutex_unlock(&p.mutex);
+  return NULL;
+}
+
+static int pool_set_parallelism(void* arg, unsigned int threads) {
+  pool* pl = (pool*) arg;
+  if (threads == 0 || threads > MAX_THREADS) {
+    return -1;
+  }
+  pthread_mutex_lock(&pl->mutex);
+  if (threads == pl->target) {
+    pl->redundant++;
+  }
+  pl->target = threads;
+  pl->calls++;
+  pthread_cond_broadcast(&pl->cond);
+  pthread_mutex_unlock(&pl->mutex);
+  return 0;
+}
+
+static unsigned int pool_target(void) {
+  unsigned int target;
+  pthread_mutex_lock(&p.mutex);
+  target = p.target;
+  pthread_mutex_unlock(&p.mutex);
+  return target;
+}
+
+// Waits until the running workers match the target, returns 0 if they do
+static int pool_settle(void) {
+  struct timespec ts = {0, 1000000};
+  unsigned int i;
+  int settled = 0;
+  for (i = 0; i < SETTLE_MS && !settled; i++) {
+    pthread_mutex_lock(&p.mutex);
+    settled = p.running == p.target;
+    pthread_mutex_unlock(&p.mutex);
+    if (!settled) {
+      nanosleep(&ts, NULL);
+    }
+  }
+  return settled ? 0 : -1;
+}
+
+static void print_usage(void) {
+  printf("usage:\n");
+  printf("parallelism_test [-i iterations] [-p period]\n");
+  printf("  -i: iterations (default 20000)\n");
+  printf("  -p: controller period (default 20)\n");
+}
+
+int main(int argc, char** argv) {
+  unsigned long iterations = 20000;
+  unsigned int period = 20;
+  poet_control_state_t cstates[MAX_THREADS];
+  poet_cpu_state_t cpu_states[MAX_THREADS];
+  poet_cpu_cooperative coop;
+  poet_state* state;
+  unsigned long core_changes = 0;
+  unsigned int last_target;
+  unsigned int target;
+  double n;
+  double goal;
+  double seconds;
+  double time = 0;
+  double* window;
+  double window_time = 0;
+  double rate;
+  unsigned long i;
+  int ret = 1;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "i:p:h")) != -1) {
+    switch (opt) {
+      case 'i':
+        iterations = strtoul(optarg, NULL, 0);
+        break;
+      case 'p':
+        period = strtoul(optarg, NULL, 0);
+        break;
+      case 'h':
+      default:
+        print_usage();
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (optind != argc || iterations == 0 || period == 0) {
+    print_usage();
+    return 1;
+  }
+
+  // state i runs cores 0 to i, with some serial work
+  for (i = 0; i < MAX_THREADS; i++) {
+    n = i + 1.0;
+    cstates[i].id = i;
+    cstates[i].speedup = CONST(n / (1.0 + 0.05 * (n - 1.0)));
+    cstates[i].cost = CONST(1.0 + 0.6 * (n - 1.0));
+    cpu_states[i].id = i;
+    cpu_states[i].freq = 1000000;
+    cpu_states[i].cores = i;
+  }
+
+  pthread_mutex_init(&p.mutex, NULL);
+  pthread_cond_init(&p.cond, NULL);
+  p.target = MAX_THREADS;
+  for (i = 0; i < MAX_THREADS; i++) {
+    p.index[i] = i;
+    if (pthread_create(&p.threads[i], NULL, worker, &p.index[i])) {
+      perror("pthread_create");
+      return 1;
+    }
+  }
+
+  coop.states = cpu_states;
+  coop.num_states = MAX_THREADS;
+  coop.parallelism = pool_set_parallelism;
+  coop.parallelism_arg = &p;
+  coop.actuator = NULL;
+  coop.narrow_affinity = 0;
+  goal = BASE_RATE * (real_to_db(cstates[0].speedup) + GOAL_FRACTION *
+         (real_to_db(cstates[MAX_THREADS - 1].speedup) -
+          real_to_db(cstates[0].speedup)));
+  state = poet_init(CONST(goal), MAX_THREADS, cstates, &coop,
+                    apply_cpu_config_cooperative, NULL, period, 1, NULL);
+  if (state == NULL) {
+    perror("poet_init");
+    goto out;
+  }
+
+  // POET gets the rate over the last period, as from a heartbeat window
+  window = calloc(period, sizeof(double));
+  if (window == NULL) {
+    perror("calloc");
+    poet_destroy(state);
+    goto out;
+  }
+  last_target = pool_target();
+  for (i = 0; i < iterations; i++) {
+    // the application runs as many workers as the pool was asked to
+    target = pool_target();
+    if (target != last_target) {
+      core_changes++;
+      last_target = target;
+    }
+    seconds = 1.0 / (BASE_RATE * real_to_db(cstates[target - 1].speedup));
+    if (i >= iterations / 2) {
+      time += seconds;
+    }
+    window_time += seconds - window[i % period];
+    window[i % period] = seconds;
+    poet_apply_control(state, i,
+                       CONST((i < period ? i + 1 : period) / window_time),
+                       CONST(0.0));
+    // check that the workers follow now and then
+    if (i % (iterations / 4) == 0 && pool_settle()) {
+      fprintf(stderr, "Workers did not follow the parallelism\n");
+      free(window);
+      poet_destroy(state);
+      goto out;
+    }
+  }
+  free(window);
+  poet_destroy(state);
+
+  rate = (iterations - iterations / 2) / time / goal;
+  printf("threads=%u period=%u goal=%.1f\n", MAX_THREADS, period, goal);
+  printf("parallelism calls %lu, redundant %lu, rate/goal %.3f\n", p.calls,
+         p.redundant, rate);
+  if (p.redundant > 0) {
+    fprintf(stderr, "The pool was called without a core count change\n");
+  } else if (p.calls < core_changes) {
+    fprintf(stderr, "Core count changed without calling the pool\n");
+  } else if (pool_settle()) {
+    fprintf(stderr, "Workers did not follow the parallelism\n");
+  } else if (rate < 1.0 - TOLERANCE || rate > 1.0 + TOLERANCE) {
+    fprintf(stderr, "Rate is not at the goal\n");
+  } else {
+    ret = 0;
+  }
+
+out:
+  pthread_mutex_lock(&p.mutex);
+  p.stop = 1;
+  pthread_cond_broadcast(&p.cond);
+  pthread_mutex_unlock(&p.mutex);
+  for (i = 0; i < MAX_THREADS; i++) {
+    pthread_join(p.threads[i], NULL);
+  }
+  printf("%s\n", ret ? "FAIL" : "OK");
+  return ret;
+}
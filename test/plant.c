@@ -0,0 +1,94 @@
+/**
+ * A simulated plant for the closed-loop tests.
+ */
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "poet.h"
+#include "poet_config.h"
+#include "poet_math.h"
+#include "plant.h"
+
+void plant_init(plant* p,
+                const poet_control_state_t* cstates,
+                unsigned int num_states,
+                uint64_t seed) {
+  p->cstates = cstates;
+  p->num_states = num_states;
+  p->curr_id = num_states - 1;
+  p->applies = 0;
+  p->switches = 0;
+  p->rng = seed;
+}
+
+// xorshift64*
+double plant_uniform(plant* p) {
+  p->rng ^= p->rng >> 12;
+  p->rng ^= p->rng << 25;
+  p->rng ^= p->rng >> 27;
+  return ((p->rng * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+double plant_normal(plant* p) {
+  double u = plant_uniform(p);
+  double v = plant_uniform(p);
+  return sqrt(-2.0 * log(u + 1e-300)) * cos(2.0 * M_PI * v);
+}
+
+void plant_apply(void* states,
+                 unsigned int num_states,
+                 unsigned int id,
+                 unsigned int last_id) {
+  plant* p = (plant*) states;
+  (void) num_states;
+  (void) last_id;
+  if (id >= p->num_states) {
+    fprintf(stderr, "plant_apply: Unknown state %u\n", id);
+    return;
+  }
+  p->applies++;
+  if (id != p->curr_id) {
+    p->switches++;
+  }
+  p->curr_id = id;
+}
+
+int plant_current(const void* states,
+                  unsigned int num_states,
+                  unsigned int* curr_state_id) {
+  (void) num_states;
+  *curr_state_id = ((const plant*) states)->curr_id;
+  return 0;
+}
+
+double plant_seconds(const plant* p) {
+  return 1.0 / (PLANT_BASE_RATE * real_to_db(p->cstates[p->curr_id].speedup));
+}
+
+double plant_goal(const poet_control_state_t* cstates,
+                  unsigned int num_states,
+                  double fraction) {
+  double min_speedup = real_to_db(cstates[0].speedup);
+  double max_speedup = min_speedup;
+  unsigned int i;
+  for (i = 1; i < num_states; i++) {
+    if (real_to_db(cstates[i].speedup) < min_speedup) {
+      min_speedup = real_to_db(cstates[i].speedup);
+    }
+    if (real_to_db(cstates[i].speedup) > max_speedup) {
+      max_speedup = real_to_db(cstates[i].speedup);
+    }
+  }
+  return PLANT_BASE_RATE * (min_speedup + fraction *
+                            (max_speedup - min_speedup));
+}
+
+int plant_load_states(const char* control_config,
+                      poet_control_state_t** cstates,
+                      unsigned int* num_states) {
+  if (get_control_states(control_config, cstates, num_states)) {
+    fprintf(stderr, "Failed to get control states from %s\n", control_config);
+    return -1;
+  }
+  return 0;
+}
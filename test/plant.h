@@ -0,0 +1,87 @@
+/**
+ * A simulated plant for the closed-loop tests, which run POET in virtual time
+ * against the speedups and costs of a control config instead of hardware.
+ *
+ * The plant tracks the state POET applied and carries a random number
+ * generator that is deterministic everywhere, so results can be compared
+ * between controller settings and builds. Tests that need more (switching
+ * costs, a true model that differs from the config) embed a plant as the first
+ * member of their own struct and wrap plant_apply.
+ */
+#ifndef _POET_TEST_PLANT_H
+#define _POET_TEST_PLANT_H
+
+#include <stdint.h>
+#include "poet.h"
+
+// iterations per second in a state with speedup 1
+#define PLANT_BASE_RATE 10.0
+
+#define PLANT_CONTROL_CONFIG \
+  "../config/examples/2x_Xeon_E5_2690/control_config_x264_native"
+#define PLANT_CPU_CONFIG \
+  "../config/examples/2x_Xeon_E5_2690/cpu_config_x264_native"
+
+typedef struct {
+  const poet_control_state_t* cstates;
+  unsigned int num_states;
+  unsigned int curr_id;
+  // calls to plant_apply, and those that changed the state
+  unsigned long applies;
+  unsigned long switches;
+  uint64_t rng;
+} plant;
+
+/*
+ * Starts the plant in the last state. The seed must not be 0.
+ */
+void plant_init(plant* p,
+                const poet_control_state_t* cstates,
+                unsigned int num_states,
+                uint64_t seed);
+
+/*
+ * Uniform in [0, 1).
+ */
+double plant_uniform(plant* p);
+
+/*
+ * Standard normal.
+ */
+double plant_normal(plant* p);
+
+/*
+ * A poet_apply_func for a plant passed as the apply_states.
+ */
+void plant_apply(void* states,
+                 unsigned int num_states,
+                 unsigned int id,
+                 unsigned int last_id);
+
+/*
+ * A poet_curr_state_func for a plant passed as the apply_states.
+ */
+int plant_current(const void* states,
+                  unsigned int num_states,
+                  unsigned int* curr_state_id);
+
+/*
+ * Seconds per iteration in the current state, without noise.
+ */
+double plant_seconds(const plant* p);
+
+/*
+ * The rate at the given fraction of the range of rates of the states.
+ */
+double plant_goal(const poet_control_state_t* cstates,
+                  unsigned int num_states,
+                  double fraction);
+
+/*
+ * Loads the control states, printing why if it fails.
+ */
+int plant_load_states(const char* control_config,
+                      poet_control_state_t** cstates,
+                      unsigned int* num_states);
+
+#endif
@@ -0,0 +1,465 @@
+/**
+ * Closed-loop simulation of POET controlling a simulated plant in virtual time.
+ *
+ * The plant runs a workload whose base rate changes in phases. Each state
+ * speeds it up and costs power according to the control config, optionally
+ * perturbed by a model error, and every iteration's time and power are
+ * perturbed by noise. No hardware is touched and runs are deterministic for a
+ * given seed, so results can be compared between controller settings and
+ * builds.
+ *
+ * For each phase, reports settling time, overshoot, mean goal error and the
+ * energy relative to an oracle that knows the true model. With -C, also runs
+ * the same plant without estimation first, and checks that estimation lowers
+ * both the mean goal error and the energy.
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "poet.h"
+#include "poet_config.h"
+#include "poet_math.h"
+#include "plant.h"
+
+#define NUM_PHASES 4
+// workload multipliers of the base rate in each phase
+static const double PHASE_RATES[NUM_PHASES] = {1.0, 0.7, 1.3, 1.0};
+
+// power in the first state (watts)
+#define BASE_POWER 50.0
+// a rate within this fraction of the goal is settled
+#define SETTLE_TOLERANCE 0.05
+// default for -t
+#define MAX_ERROR 0.1
+
+typedef struct {
+  plant base;
+  const poet_cpu_state_t* cpu_states;
+  // true model
+  double* speedup;
+  double* power;
+} sim_plant;
+
+typedef struct {
+  double goal_fraction;
+  unsigned int iterations;
+  unsigned int window;
+  unsigned long seed;
+  double noise;
+  double model_error;
+  int hull;
+  int estimate;
+} sim_options;
+
+typedef struct {
+  unsigned int settle;
+  double overshoot;
+  double error;
+  double energy;
+  double oracle_energy;
+} phase_result;
+
+// The apply function sees the CPU states, as it would with apply_cpu_config
+static void sim_plant_apply(void* states,
+                            unsigned int num_states,
+                            unsigned int id,
+                            unsigned int last_id) {
+  sim_plant* p = (sim_plant*) states;
+  if (id < p->base.num_states && p->cpu_states[id].id != id) {
+    fprintf(stderr, "sim_plant_apply: Unknown CPU state %u\n", id);
+    return;
+  }
+  plant_apply(states, num_states, id, last_id);
+}
+
+// Minimum power to sustain the speedup, mixing two states in time
+static double oracle_power(const sim_plant* p, double speedup) {
+  double best = -1;
+  double x;
+  double pw;
+  unsigned int i;
+  unsigned int j;
+  for (i = 0; i < p->base.num_states; i++) {
+    if (p->speedup[i] >= speedup && (best < 0 || p->power[i] < best)) {
+      best = p->power[i];
+    }
+    for (j = 0; j < p->base.num_states; j++) {
+      if (p->speedup[i] < speedup && p->speedup[j] > speedup) {
+        // fraction of time in state i
+        x = (p->speedup[j] - speedup) / (p->speedup[j] - p->speedup[i]);
+        pw = x * p->power[i] + (1 - x) * p->power[j];
+        if (best < 0 || pw < best) {
+          best = pw;
+        }
+      }
+    }
+  }
+  return best;
+}
+
+// Energy per iteration of the oracle, which runs as fast as possible when the
+// goal cannot be met
+static double oracle_iteration_energy(const sim_plant* p, double base_rate,
+                                      double goal) {
+  double max_speedup = 0;
+  double min_speedup = -1;
+  double speedup = goal / base_rate;
+  unsigned int i;
+  for (i = 0; i < p->base.num_states; i++) {
+    max_speedup = p->speedup[i] > max_speedup ? p->speedup[i] : max_speedup;
+    min_speedup = (min_speedup < 0 || p->speedup[i] < min_speedup) ?
+                  p->speedup[i] : min_speedup;
+  }
+  speedup = speedup > max_speedup ? max_speedup : speedup;
+  speedup = speedup < min_speedup ? min_speedup : speedup;
+  return oracle_power(p, speedup) / (speedup * base_rate);
+}
+
+/*
+ * Spread of the costs against the true power of the states whose cost POET
+ * learned, as the standard deviation of their log ratios, so it does not
+ * depend on the scale of the costs. Returns the number of states counted.
+ */
+static unsigned int cost_spread(const sim_plant* p,
+                                const poet_control_state_t* costs,
+                                const poet_control_state_t* learned,
+                                double* spread) {
+  double sum = 0;
+  double sum_sq = 0;
+  double r;
+  unsigned int n = 0;
+  unsigned int i;
+  for (i = 0; i < p->base.num_states; i++) {
+    if (learned[i].cost != p->base.cstates[i].cost) {
+      r = log(real_to_db(costs[i].cost) / p->power[i]);
+      sum += r;
+      sum_sq += r * r;
+      n++;
+    }
+  }
+  *spread = n > 0 ? sqrt(fmax(sum_sq / n - (sum / n) * (sum / n), 0)) : 0;
+  return n;
+}
+
+static void print_usage(void) {
+  printf("usage:\n");
+  printf("plant_sim_test [-c control_config] [-p cpu_config] [-g goal_fraction] "
+         "[-n iterations] [-w window] [-s seed] [-N noise] [-x model_error] "
+         "[-H] [-E] [-C] [-t max_error]\n");
+  printf("  -g: goal as a fraction of the maximum rate in the first phase "
+         "(default 0.5)\n");
+  printf("  -N: standard deviation of the relative noise (default 0.02)\n");
+  printf("  -x: maximum relative error of the config's speedups and costs "
+         "(default 0)\n");
+  printf("  -H: use POET_TRANSLATE_HULL\n");
+  printf("  -E: enable cost and speedup estimation\n");
+  printf("  -C: with -E, also run without estimation and fail unless "
+         "estimation lowers both the mean goal error and the energy\n");
+  printf("  -t: fail if the mean goal error exceeds max_error, < 0 to only "
+         "report it (default %.2f)\n", MAX_ERROR);
+}
+
+/*
+ * Runs the simulation and prints the results of each phase. Returns the mean
+ * goal error and the energy relative to the oracle over all phases. With
+ * estimation, also fails if the learned costs are not closer to the plant's
+ * power than the configured ones.
+ */
+static int simulate(const sim_options* o,
+                    poet_control_state_t* cstates,
+                    const poet_cpu_state_t* cpu_states,
+                    unsigned int nstates,
+                    double* error,
+                    double* energy) {
+  poet_state* state;
+  sim_plant p;
+  phase_result results[NUM_PHASES];
+  poet_control_state_t* learned = NULL;
+  double configured_spread;
+  double learned_spread;
+  double* window_times;
+  double* window_energies;
+  double window_time = 0;
+  double window_energy = 0;
+  double max_speedup = 0;
+  double goal;
+  double base_rate;
+  double speedup;
+  double rate;
+  double dt;
+  double pwr;
+  double total_energy = 0;
+  double total_oracle = 0;
+  double total_error = 0;
+  int direction = 0;
+  unsigned int phase_len;
+  unsigned int phase;
+  unsigned int i;
+  unsigned int k;
+  int ret = 0;
+
+  plant_init(&p.base, cstates, nstates, o->seed * 0x9E3779B97F4A7C15ULL + 1);
+  p.cpu_states = cpu_states;
+  p.speedup = malloc(nstates * sizeof(double));
+  p.power = malloc(nstates * sizeof(double));
+  window_times = calloc(o->window, sizeof(double));
+  window_energies = calloc(o->window, sizeof(double));
+  if (p.speedup == NULL || p.power == NULL || window_times == NULL ||
+      window_energies == NULL) {
+    perror("malloc");
+    free(window_times);
+    free(window_energies);
+    free(p.speedup);
+    free(p.power);
+    return -1;
+  }
+  for (i = 0; i < nstates; i++) {
+    p.speedup[i] = real_to_db(cstates[i].speedup) *
+                   (1 + o->model_error * (2 * plant_uniform(&p.base) - 1));
+    p.power[i] = BASE_POWER * real_to_db(cstates[i].cost) *
+                 (1 + o->model_error * (2 * plant_uniform(&p.base) - 1));
+    max_speedup = p.speedup[i] > max_speedup ? p.speedup[i] : max_speedup;
+  }
+  goal = o->goal_fraction * PLANT_BASE_RATE * max_speedup;
+
+  state = poet_init(CONST(goal), nstates, cstates, &p, sim_plant_apply,
+                    plant_current, o->window, 1, NULL);
+  if (state == NULL) {
+    perror("poet_init");
+    free(window_times);
+    free(window_energies);
+    free(p.speedup);
+    free(p.power);
+    return -1;
+  }
+  if (o->hull) {
+    poet_set_translate_mode(state, POET_TRANSLATE_HULL);
+  }
+  if (o->estimate) {
+    poet_set_cost_estimation(state, 1);
+    poet_set_speedup_estimation(state, 1);
+  }
+
+  phase_len = o->iterations / NUM_PHASES;
+  for (i = 0; i < o->iterations; i++) {
+    phase = i / phase_len < NUM_PHASES ? i / phase_len : NUM_PHASES - 1;
+    base_rate = PLANT_BASE_RATE * PHASE_RATES[phase];
+    if (i == phase * phase_len) {
+      results[phase].settle = o->iterations;
+      results[phase].overshoot = 0;
+      results[phase].error = 0;
+      results[phase].energy = 0;
+      results[phase].oracle_energy = 0;
+      direction = 0;
+    }
+
+    // run the iteration in the current state
+    speedup = p.speedup[p.base.curr_id];
+    dt = (1 + o->noise * plant_normal(&p.base)) / (base_rate * speedup);
+    dt = dt < 0.1 / (base_rate * speedup) ? 0.1 / (base_rate * speedup) : dt;
+    pwr = p.power[p.base.curr_id] * (1 + o->noise * plant_normal(&p.base));
+    pwr = pwr < 0 ? 0 : pwr;
+    results[phase].energy += pwr * dt;
+    results[phase].oracle_energy += oracle_iteration_energy(&p, base_rate, goal);
+
+    // the rate and power are averaged over the window, as a heartbeat
+    // window and an energy counter would measure them
+    k = i % o->window;
+    window_time += dt - window_times[k];
+    window_times[k] = dt;
+    window_energy += pwr * dt - window_energies[k];
+    window_energies[k] = pwr * dt;
+    rate = (i < o->window ? i + 1 : o->window) / window_time;
+
+    // metrics
+    if (direction == 0) {
+      direction = rate < goal ? 1 : -1;
+    }
+    if (direction * (rate - goal) / goal > results[phase].overshoot) {
+      results[phase].overshoot = direction * (rate - goal) / goal;
+    }
+    if (fabs(rate - goal) > SETTLE_TOLERANCE * goal) {
+      results[phase].settle = o->iterations;
+    } else if (results[phase].settle == o->iterations) {
+      results[phase].settle = i - phase * phase_len;
+    }
+    results[phase].error += fabs(rate - goal) / goal;
+
+    poet_apply_control(state, i, CONST(rate),
+                       CONST(window_energy / window_time));
+  }
+
+  // settling time is in iterations since the start of the phase, '-' if the
+  // rate did not stay within SETTLE_TOLERANCE of the goal until the end
+  printf("%-8s %10s %10s %10s %12s\n",
+         "PHASE", "SETTLE", "OVERSHOOT", "ERROR", "ENERGY/ORACLE");
+  for (phase = 0; phase < NUM_PHASES; phase++) {
+    // the last phase may be longer
+    k = phase == NUM_PHASES - 1 ? o->iterations - phase * phase_len : phase_len;
+    if (results[phase].settle == o->iterations) {
+      printf("%-8u %10s", phase, "-");
+    } else {
+      printf("%-8u %10u", phase, results[phase].settle);
+    }
+    printf(" %10f %10f %12f\n", results[phase].overshoot,
+           results[phase].error / k,
+           results[phase].energy / results[phase].oracle_energy);
+    total_energy += results[phase].energy;
+    total_oracle += results[phase].oracle_energy;
+    total_error += results[phase].error;
+  }
+  *error = total_error / o->iterations;
+  *energy = total_energy / total_oracle;
+  printf("%-8s %10s %10s %10f %12f\n", "TOTAL", "", "", *error, *energy);
+  printf("State switches: %lu\n", p.base.switches);
+
+  // the learned costs must be closer to the plant's power than the configured
+  if (o->estimate) {
+    learned = malloc(nstates * sizeof(poet_control_state_t));
+    if (learned == NULL || poet_get_control_states(state, learned, nstates)) {
+      perror("poet_get_control_states");
+      ret = -1;
+    } else if (cost_spread(&p, cstates, learned, &configured_spread) > 1) {
+      cost_spread(&p, learned, learned, &learned_spread);
+      printf("Cost spread against the power: %f configured, %f learned\n",
+             configured_spread, learned_spread);
+      if (learned_spread >= configured_spread) {
+        fprintf(stderr, "Learned costs did not move toward the power\n");
+        ret = -1;
+      }
+    }
+    free(learned);
+  }
+
+  poet_destroy(state);
+  free(window_times);
+  free(window_energies);
+  free(p.speedup);
+  free(p.power);
+  return ret;
+}
+
+int main(int argc, char** argv) {
+  const char* control_config = PLANT_CONTROL_CONFIG;
+  const char* cpu_config = PLANT_CPU_CONFIG;
+  sim_options o;
+  int compare = 0;
+  double max_error = MAX_ERROR;
+
+  poet_control_state_t* cstates;
+  poet_cpu_state_t* cpu_states;
+  unsigned int nstates;
+  unsigned int ncpu_states;
+  double error;
+  double energy;
+  double base_error;
+  double base_energy;
+  int opt;
+  int ret = 0;
+
+  o.goal_fraction = 0.5;
+  o.iterations = 4000;
+  o.window = 20;
+  o.seed = 1;
+  o.noise = 0.02;
+  o.model_error = 0;
+  o.hull = 0;
+  o.estimate = 0;
+
+  while ((opt = getopt(argc, argv, "c:p:g:n:w:s:N:x:HECt:h")) != -1) {
+    switch (opt) {
+      case 'c':
+        control_config = optarg;
+        break;
+      case 'p':
+        cpu_config = optarg;
+        break;
+      case 'g':
+        o.goal_fraction = atof(optarg);
+        break;
+      case 'n':
+        o.iterations = strtoul(optarg, NULL, 0);
+        break;
+      case 'w':
+        o.window = strtoul(optarg, NULL, 0);
+        break;
+      case 's':
+        o.seed = strtoul(optarg, NULL, 0);
+        break;
+      case 'N':
+        o.noise = atof(optarg);
+        break;
+      case 'x':
+        o.model_error = atof(optarg);
+        break;
+      case 'H':
+        o.hull = 1;
+        break;
+      case 'E':
+        o.estimate = 1;
+        break;
+      case 'C':
+        compare = 1;
+        break;
+      case 't':
+        max_error = atof(optarg);
+        break;
+      case 'h':
+      default:
+        print_usage();
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (optind != argc || o.goal_fraction <= 0 || o.window == 0 ||
+      o.iterations < NUM_PHASES * o.window || (compare && !o.estimate)) {
+    print_usage();
+    return 1;
+  }
+
+  if (plant_load_states(control_config, &cstates, &nstates)) {
+    return 1;
+  }
+  if (get_cpu_states(cpu_config, &cpu_states, &ncpu_states)) {
+    fprintf(stderr, "Failed to get CPU states from %s\n", cpu_config);
+    free(cstates);
+    return 1;
+  }
+  if (ncpu_states != nstates) {
+    fprintf(stderr, "Control and CPU configs have different numbers of states\n");
+    free(cstates);
+    free(cpu_states);
+    return 1;
+  }
+
+  if (compare) {
+    // the same seed gives the same true model and noise
+    o.estimate = 0;
+    printf("Without estimation:\n");
+    if (simulate(&o, cstates, cpu_states, nstates, &base_error, &base_energy)) {
+      ret = 1;
+    }
+    o.estimate = 1;
+    printf("With estimation:\n");
+  }
+  if (ret == 0 &&
+      simulate(&o, cstates, cpu_states, nstates, &error, &energy)) {
+    ret = 1;
+  }
+
+  if (ret == 0 && max_error >= 0 && error > max_error) {
+    fprintf(stderr, "Mean goal error %f exceeds %f\n", error, max_error);
+    ret = 1;
+  }
+  if (ret == 0 && compare && (error >= base_error || energy >= base_energy)) {
+    fprintf(stderr, "Estimation must lower both the mean goal error (%f vs %f) "
+            "and the energy (%f vs %f)\n", error, base_error, energy,
+            base_energy);
+    ret = 1;
+  }
+
+  free(cpu_states);
+  free(cstates);
+  return ret;
+}
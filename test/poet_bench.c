@@ -0,0 +1,243 @@
+/**
+ * Measures the overhead of poet_apply_control with a null apply function.
+ *
+ * For state tables of increasing size and both translation modes, reports the
+ * latency distribution of calls that only pick the next state (no decision)
+ * and of calls that run the decision engine, and the mean cycles per decision
+ * spent in estimate_base_workload, calculate_xup and translation.
+ *
+ * Built with POET_PROFILE, run it in both the FIXED_POINT and double builds to
+ * compare number formats.
+ */
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "poet.h"
+#include "poet_math.h"
+#include "poet_profile.h"
+
+#define PERF_GOAL 100.0
+#define MAX_SPEEDUP 10.0
+
+// limits the n^2 translation work so large tables finish in seconds
+#define N2_BUDGET 20000000ULL
+#define MIN_DECISIONS 3
+
+static const unsigned int NUM_STATES[] = {1, 10, 100, 1000, 10000};
+
+static void null_apply(void* states,
+                       unsigned int num_states,
+                       unsigned int id,
+                       unsigned int last_id) {
+  (void) states;
+  (void) num_states;
+  (void) id;
+  (void) last_id;
+}
+
+static inline uint64_t get_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * (uint64_t) 1000000000 + ts.tv_nsec;
+}
+
+static int u64_cmp(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*) a;
+  uint64_t y = *(const uint64_t*) b;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// Sorts the samples
+static void print_distribution(uint64_t* samples, unsigned long n) {
+  qsort(samples, n, sizeof(uint64_t), u64_cmp);
+  printf(" %10llu %10llu %10llu",
+         (unsigned long long) samples[n / 2],
+         (unsigned long long) samples[(n * 99) / 100],
+         (unsigned long long) samples[n - 1]);
+}
+
+// Speedups spread evenly over [1, MAX_SPEEDUP] with convex costs, every third
+// state is slightly more expensive so not all states are on the hull
+static void make_states(poet_control_state_t* states, unsigned int n) {
+  unsigned int i;
+  double s;
+  for (i = 0; i < n; i++) {
+    s = n == 1 ? 1.0 : 1.0 + (MAX_SPEEDUP - 1.0) * i / (n - 1);
+    states[i].id = i;
+    states[i].speedup = CONST(s);
+    states[i].cost = CONST(s * s * (i % 3 == 2 ? 1.1 : 1.0));
+  }
+}
+
+// Minimum overhead of timing a call
+static uint64_t timer_overhead(void) {
+  uint64_t min = (uint64_t) -1;
+  uint64_t t;
+  unsigned int i;
+  for (i = 0; i < 1000; i++) {
+    t = get_ns();
+    t = get_ns() - t;
+    min = t < min ? t : min;
+  }
+  return min;
+}
+
+static int run_bench(poet_control_state_t* states,
+                     unsigned int n,
+                     poet_translate_mode mode,
+                     unsigned int period,
+                     unsigned long decisions,
+                     uint64_t overhead) {
+  poet_state* state;
+  poet_profile prof;
+  uint64_t* dec_ns;
+  uint64_t* nodec_ns;
+  unsigned long num_dec = 0;
+  unsigned long num_nodec = 0;
+  unsigned long i;
+  uint64_t t;
+  real_t perf;
+
+  if (mode == POET_TRANSLATE_N2 && (uint64_t) n * n * decisions > N2_BUDGET) {
+    decisions = N2_BUDGET / ((uint64_t) n * n);
+    decisions = decisions < MIN_DECISIONS ? MIN_DECISIONS : decisions;
+  }
+
+  state = poet_init(CONST(PERF_GOAL), n, states, NULL, null_apply, NULL,
+                    period, 1, NULL);
+  if (state == NULL) {
+    perror("poet_init");
+    return -1;
+  }
+  poet_set_translate_mode(state, mode);
+  dec_ns = malloc(decisions * sizeof(uint64_t));
+  nodec_ns = malloc(decisions * period * sizeof(uint64_t));
+  if (dec_ns == NULL || nodec_ns == NULL) {
+    perror("malloc");
+    poet_destroy(state);
+    free(dec_ns);
+    free(nodec_ns);
+    return -1;
+  }
+
+  // warm up for one period
+  for (i = 0; i < period; i++) {
+    poet_apply_control(state, i, CONST(PERF_GOAL), CONST(1.0));
+  }
+  poet_reset_profile(state);
+
+  for (i = 0; num_dec < decisions; i++) {
+    // move the rate around the goal so the decisions change
+    perf = CONST(PERF_GOAL * (0.5 + ((i * 37) % 100) / 100.0));
+    t = get_ns();
+    poet_apply_control(state, i, perf, CONST(1.0));
+    t = get_ns() - t;
+    t = t > overhead ? t - overhead : 0;
+    // the profile counts decisions
+    poet_get_profile(state, &prof);
+    if (prof.decisions > num_dec) {
+      dec_ns[num_dec++] = t;
+    } else if (num_nodec < decisions * period) {
+      nodec_ns[num_nodec++] = t;
+    }
+  }
+  poet_get_profile(state, &prof);
+
+  printf("%8u %6s", n, mode == POET_TRANSLATE_HULL ? "hull" : "n2");
+  if (num_nodec > 0) {
+    print_distribution(nodec_ns, num_nodec);
+  } else {
+    printf(" %10s %10s %10s", "-", "-", "-");
+  }
+  print_distribution(dec_ns, num_dec);
+  printf(" %12llu %12llu %12llu %8lu\n",
+         (unsigned long long) (prof.estimate_cycles / prof.decisions),
+         (unsigned long long) (prof.xup_cycles / prof.decisions),
+         (unsigned long long) (prof.translate_cycles / prof.decisions),
+         num_dec);
+
+  poet_destroy(state);
+  free(dec_ns);
+  free(nodec_ns);
+  return 0;
+}
+
+static void print_usage(void) {
+  printf("usage:\n");
+  printf("poet_bench [-p period] [-d decisions] [-n max_states]\n");
+  printf("  -p: controller period (default 20)\n");
+  printf("  -d: decisions measured per table (default 10000), fewer for large "
+         "n^2 tables\n");
+  printf("  -n: largest state table (default 10000)\n");
+}
+
+int main(int argc, char** argv) {
+  unsigned int period = 20;
+  unsigned long decisions = 10000;
+  unsigned int max_states = 10000;
+  poet_control_state_t* states;
+  uint64_t overhead;
+  unsigned int i;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "p:d:n:h")) != -1) {
+    switch (opt) {
+      case 'p':
+        period = strtoul(optarg, NULL, 0);
+        break;
+      case 'd':
+        decisions = strtoul(optarg, NULL, 0);
+        break;
+      case 'n':
+        max_states = strtoul(optarg, NULL, 0);
+        break;
+      case 'h':
+      default:
+        print_usage();
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (optind != argc || period == 0 || decisions == 0) {
+    print_usage();
+    return 1;
+  }
+
+  states = malloc(max_states * sizeof(poet_control_state_t));
+  if (states == NULL) {
+    perror("malloc");
+    return 1;
+  }
+  overhead = timer_overhead();
+
+#ifdef FIXED_POINT
+  printf("Number format: fixed point Q%d.%d\n",
+         (int) (8 * sizeof(real_t)) - FP_FRAC_BITS, FP_FRAC_BITS);
+#else
+  printf("Number format: double\n");
+#endif
+  printf("Period: %u, timer overhead: %llu ns (subtracted)\n", period,
+         (unsigned long long) overhead);
+  printf("Latencies in ns, stage costs in cycles per decision\n");
+  printf("%8s %6s %10s %10s %10s %10s %10s %10s %12s %12s %12s %8s\n",
+         "STATES", "MODE", "SKIP_P50", "SKIP_P99", "SKIP_MAX",
+         "DEC_P50", "DEC_P99", "DEC_MAX",
+         "ESTIMATE", "XUP", "TRANSLATE", "DECS");
+  for (i = 0; i < sizeof(NUM_STATES) / sizeof(NUM_STATES[0]); i++) {
+    if (NUM_STATES[i] > max_states) {
+      break;
+    }
+    make_states(states, NUM_STATES[i]);
+    if (run_bench(states, NUM_STATES[i], POET_TRANSLATE_N2, period, decisions,
+                  overhead) ||
+        run_bench(states, NUM_STATES[i], POET_TRANSLATE_HULL, period,
+                  decisions, overhead)) {
+      free(states);
+      return 1;
+    }
+  }
+
+  free(states);
+  return 0;
+}
@@ -0,0 +1,200 @@
+/**
+ * Runs a plant in virtual time whose power is proportional to the cost of the
+ * current state, with some noise, under a power cap set by poet_set_power_cap()
+ * and then lowered at runtime.
+ *
+ * Checks that the average power is at the cap in both phases and that the rate
+ * is close to the fastest any schedule of the states reaches within the cap.
+ */
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "poet.h"
+#include "poet_config.h"
+#include "poet_math.h"
+#include "plant.h"
+
+// watts of a state with cost 1
+#define BASE_POWER 20.0
+#define NOISE 0.1
+// the caps, as fractions of the range of the power of the states
+#define CAP_FRACTION_1 0.6
+#define CAP_FRACTION_2 0.3
+#define TOLERANCE 0.05
+
+#define NUM_PHASES 2
+
+// The highest speedup of any state, or pair of states sharing the time, whose
+// average cost is within the budget
+static double best_speedup(const poet_control_state_t* cstates,
+                           unsigned int nstates,
+                           double budget) {
+  double best = 0;
+  double ci;
+  double cj;
+  double t;
+  double s;
+  unsigned int i;
+  unsigned int j;
+
+  for (i = 0; i < nstates; i++) {
+    ci = real_to_db(cstates[i].cost);
+    if (ci > budget) {
+      continue;
+    }
+    if (real_to_db(cstates[i].speedup) > best) {
+      best = real_to_db(cstates[i].speedup);
+    }
+    for (j = 0; j < nstates; j++) {
+      cj = real_to_db(cstates[j].cost);
+      if (cj <= budget) {
+        continue;
+      }
+      t = (cj - budget) / (cj - ci);
+      s = t * real_to_db(cstates[i].speedup) +
+          (1 - t) * real_to_db(cstates[j].speedup);
+      if (s > best) {
+        best = s;
+      }
+    }
+  }
+  return best;
+}
+
+static void print_usage(void) {
+  printf("usage:\n");
+  printf("power_cap_test [-i iterations] [-p period] [-c control_config]\n");
+  printf("  -i: iterations per phase (default 20000)\n");
+  printf("  -p: controller period (default 20)\n");
+  printf("  -c: control config (default %s)\n", PLANT_CONTROL_CONFIG);
+}
+
+int main(int argc, char** argv) {
+  const char* control_config = PLANT_CONTROL_CONFIG;
+  unsigned long iterations = 20000;
+  unsigned int period = 20;
+  poet_control_state_t* cstates;
+  unsigned int nstates;
+  poet_state* state;
+  plant p;
+  double min_cost;
+  double max_cost;
+  double cap[NUM_PHASES];
+  double seconds;
+  double power;
+  double time;
+  double energy;
+  double rate;
+  double best;
+  double* window;
+  double window_time = 0;
+  unsigned long i;
+  unsigned int ph;
+  unsigned int s;
+  int ret = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "i:p:c:h")) != -1) {
+    switch (opt) {
+      case 'i':
+        iterations = strtoul(optarg, NULL, 0);
+        break;
+      case 'p':
+        period = strtoul(optarg, NULL, 0);
+        break;
+      case 'c':
+        control_config = optarg;
+        break;
+      case 'h':
+      default:
+        print_usage();
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (optind != argc || iterations < 2 || period == 0) {
+    print_usage();
+    return 1;
+  }
+
+  if (plant_load_states(control_config, &cstates, &nstates)) {
+    return 1;
+  }
+  min_cost = max_cost = real_to_db(cstates[0].cost);
+  for (s = 1; s < nstates; s++) {
+    if (real_to_db(cstates[s].cost) < min_cost) {
+      min_cost = real_to_db(cstates[s].cost);
+    }
+    if (real_to_db(cstates[s].cost) > max_cost) {
+      max_cost = real_to_db(cstates[s].cost);
+    }
+  }
+  cap[0] = BASE_POWER * (min_cost + CAP_FRACTION_1 * (max_cost - min_cost));
+  cap[1] = BASE_POWER * (min_cost + CAP_FRACTION_2 * (max_cost - min_cost));
+
+  window = calloc(period, sizeof(double));
+  if (window == NULL) {
+    perror("calloc");
+    free(cstates);
+    return 1;
+  }
+  plant_init(&p, cstates, nstates, 1);
+  state = poet_init(CONST(PLANT_BASE_RATE), nstates, cstates, &p, plant_apply,
+                    NULL, period, 1, NULL);
+  if (state == NULL) {
+    perror("poet_init");
+    free(window);
+    free(cstates);
+    return 1;
+  }
+
+  printf("states=%u period=%u max power=%.1f W\n", nstates, period,
+         BASE_POWER * max_cost);
+  printf("%6s %10s %10s %10s %10s %10s\n", "PHASE", "CAP_W", "POWER_W",
+         "POWER/CAP", "RATE", "RATE/BEST");
+  for (ph = 0; ph < NUM_PHASES; ph++) {
+    if (poet_set_power_cap(state, CONST(cap[ph]))) {
+      perror("poet_set_power_cap");
+      ret = 1;
+      break;
+    }
+    time = 0;
+    energy = 0;
+    for (i = 0; i < iterations; i++) {
+      seconds = plant_seconds(&p);
+      power = BASE_POWER * real_to_db(cstates[p.curr_id].cost) *
+              (1.0 + NOISE * (plant_uniform(&p) - 0.5));
+      if (i >= iterations / 2) {
+        time += seconds;
+        energy += power * seconds;
+      }
+      // the rate over the last period, as from a heartbeat window
+      window_time += seconds - window[i % period];
+      window[i % period] = seconds;
+      poet_apply_control(state, ph * iterations + i,
+                         CONST((i < period && ph == 0 ? i + 1 : period) /
+                               window_time),
+                         CONST(power));
+    }
+
+    rate = (iterations - iterations / 2) / time;
+    best = PLANT_BASE_RATE *
+           best_speedup(cstates, nstates, cap[ph] / BASE_POWER);
+    printf("%6u %10.1f %10.1f %10.3f %10.2f %10.3f\n", ph + 1, cap[ph],
+           energy / time, energy / time / cap[ph], rate, rate / best);
+    if (energy / time > cap[ph] * (1.0 + TOLERANCE) ||
+        energy / time < cap[ph] * (1.0 - TOLERANCE)) {
+      fprintf(stderr, "Power is not at the cap\n");
+      ret = 1;
+    }
+    if (rate < best * (1.0 - TOLERANCE)) {
+      fprintf(stderr, "Rate is too far below the best within the cap\n");
+      ret = 1;
+    }
+  }
+  poet_destroy(state);
+
+  printf("%s\n", ret ? "FAIL" : "OK");
+  free(window);
+  free(cstates);
+  return ret;
+}
@@ -0,0 +1,221 @@
+/**
+ * Simulates a plant in virtual time where switching the number of cores costs
+ * far more than switching the frequency, and compares POET without switching
+ * costs, with them (poet_set_switch_costs), with a minimum dwell time
+ * (poet_set_min_dwell) and with both.
+ *
+ * For several goals, reports the state switches per 1000 iterations, the total
+ * energy including the switches, and the achieved rate relative to the goal.
+ */
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "poet.h"
+#include "poet_config.h"
+#include "poet_math.h"
+#include "plant.h"
+
+// watts in the state with cost 1
+#define BASE_POWER 50.0
+#define FREQ_SECONDS 0.00005
+#define FREQ_JOULES 0.0
+#define CORE_SECONDS 0.001
+#define CORE_JOULES 0.1
+// goals as fractions of the range of rates
+static const double GOAL_FRACTIONS[] = {0.3, 0.5, 0.7};
+#define NUM_GOALS (sizeof(GOAL_FRACTIONS) / sizeof(GOAL_FRACTIONS[0]))
+// with switching costs, the rate must stay this close to the goal
+#define RATE_TOLERANCE 0.05
+// the switching costs must not cost more energy than this
+#define ENERGY_TOLERANCE 0.01
+
+typedef enum {
+  MODE_NONE = 0,
+  MODE_COSTS,
+  MODE_DWELL,
+  MODE_BOTH,
+  NUM_MODES
+} run_mode;
+
+static const char* MODE_NAMES[] = {"none", "costs", "dwell", "both"};
+
+typedef struct {
+  plant base;
+  poet_cpu_switch_model* model;
+  // time and energy of switches not yet paid by an iteration
+  double switch_seconds;
+  double switch_joules;
+} switch_plant;
+
+typedef struct {
+  double switches;
+  double energy;
+  double rate;
+} result;
+
+static void switch_plant_apply(void* states,
+                               unsigned int num_states,
+                               unsigned int id,
+                               unsigned int last_id) {
+  switch_plant* p = (switch_plant*) states;
+  double seconds;
+  double joules;
+  cpu_switch_cost(p->model, last_id, id, &seconds, &joules);
+  p->switch_seconds += seconds;
+  p->switch_joules += joules + seconds * BASE_POWER *
+                      real_to_db(p->base.cstates[id].cost);
+  plant_apply(states, num_states, id, last_id);
+}
+
+static result run(poet_control_state_t* cstates,
+                  unsigned int nstates,
+                  poet_cpu_switch_model* model,
+                  run_mode mode,
+                  double goal,
+                  unsigned int period,
+                  unsigned long iterations) {
+  result r = {0, 0, 0};
+  poet_state* state;
+  switch_plant p;
+  double seconds;
+  double joules;
+  double time = 0;
+  unsigned long i;
+
+  plant_init(&p.base, cstates, nstates, 1);
+  p.model = model;
+  p.switch_seconds = 0;
+  p.switch_joules = 0;
+  state = poet_init(CONST(goal), nstates, cstates, &p, switch_plant_apply,
+                    NULL, period, 1, NULL);
+  if (state == NULL) {
+    perror("poet_init");
+    exit(1);
+  }
+  if (mode == MODE_COSTS || mode == MODE_BOTH) {
+    poet_set_switch_costs(state, cpu_switch_cost, model);
+  }
+  if (mode == MODE_DWELL || mode == MODE_BOTH) {
+    poet_set_min_dwell(state, period / 4);
+  }
+
+  for (i = 0; i < iterations; i++) {
+    seconds = (1.0 + 0.05 * (plant_uniform(&p.base) - 0.5)) *
+              plant_seconds(&p.base);
+    joules = seconds * BASE_POWER * real_to_db(cstates[p.base.curr_id].cost);
+    seconds += p.switch_seconds;
+    joules += p.switch_joules;
+    p.switch_seconds = 0;
+    p.switch_joules = 0;
+    time += seconds;
+    r.energy += joules;
+    poet_apply_control(state, i, CONST(1.0 / seconds),
+                       CONST(joules / seconds));
+  }
+  poet_destroy(state);
+
+  r.switches = 1000.0 * p.base.switches / iterations;
+  r.rate = iterations / time / goal;
+  return r;
+}
+
+static void print_usage(void) {
+  printf("usage:\n");
+  printf("switch_cost_test [-i iterations] [-p period] [-c control_config] "
+         "[-u cpu_config]\n");
+  printf("  -i: iterations per run (default 20000)\n");
+  printf("  -p: controller period (default 20)\n");
+  printf("  -c: control config (default %s)\n", PLANT_CONTROL_CONFIG);
+  printf("  -u: cpu config (default %s)\n", PLANT_CPU_CONFIG);
+}
+
+int main(int argc, char** argv) {
+  const char* control_config = PLANT_CONTROL_CONFIG;
+  const char* cpu_config = PLANT_CPU_CONFIG;
+  unsigned long iterations = 20000;
+  unsigned int period = 20;
+  poet_control_state_t* cstates;
+  poet_cpu_state_t* cpu_states;
+  unsigned int nstates;
+  unsigned int ncpu;
+  poet_cpu_switch_model model;
+  result r[NUM_MODES];
+  double goal;
+  unsigned int i;
+  int m;
+  int ret = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "i:p:c:u:h")) != -1) {
+    switch (opt) {
+      case 'i':
+        iterations = strtoul(optarg, NULL, 0);
+        break;
+      case 'p':
+        period = strtoul(optarg, NULL, 0);
+        break;
+      case 'c':
+        control_config = optarg;
+        break;
+      case 'u':
+        cpu_config = optarg;
+        break;
+      case 'h':
+      default:
+        print_usage();
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (optind != argc || iterations == 0 || period == 0) {
+    print_usage();
+    return 1;
+  }
+
+  if (plant_load_states(control_config, &cstates, &nstates)) {
+    return 1;
+  }
+  if (get_cpu_states(cpu_config, &cpu_states, &ncpu) || ncpu != nstates) {
+    fprintf(stderr, "Failed to get %u CPU states from %s\n", nstates,
+            cpu_config);
+    free(cstates);
+    return 1;
+  }
+  model.states = cpu_states;
+  model.num_states = ncpu;
+  model.freq_seconds = FREQ_SECONDS;
+  model.freq_joules = FREQ_JOULES;
+  model.core_seconds = CORE_SECONDS;
+  model.core_joules = CORE_JOULES;
+
+  printf("states=%u period=%u iterations=%lu dwell=%u\n", nstates, period,
+         iterations, period / 4);
+  printf("%6s %6s %14s %12s %10s %10s\n", "GOAL", "MODE", "SWITCHES/1000",
+         "ENERGY_J", "REL_ENERGY", "RATE/GOAL");
+  for (i = 0; i < NUM_GOALS; i++) {
+    goal = plant_goal(cstates, nstates, GOAL_FRACTIONS[i]);
+    for (m = MODE_NONE; m < NUM_MODES; m++) {
+      r[m] = run(cstates, nstates, &model, m, goal, period, iterations);
+      printf("%6.1f %6s %14.1f %12.1f %10.3f %10.3f\n", goal, MODE_NAMES[m],
+             r[m].switches, r[m].energy, r[m].energy / r[MODE_NONE].energy,
+             r[m].rate);
+      // without the costs, switch latency is unmodeled and may cost rate, so
+      // those modes are only for comparison
+      if ((m == MODE_COSTS || m == MODE_BOTH) &&
+          (r[m].rate < 1.0 - RATE_TOLERANCE ||
+           r[m].rate > 1.0 + RATE_TOLERANCE)) {
+        fprintf(stderr, "%s: rate is not at the goal\n", MODE_NAMES[m]);
+        ret = 1;
+      }
+    }
+    if (r[MODE_COSTS].switches > r[MODE_NONE].switches ||
+        r[MODE_COSTS].energy > (1.0 + ENERGY_TOLERANCE) * r[MODE_NONE].energy) {
+      fprintf(stderr, "Switching costs did not reduce switches and energy\n");
+      ret = 1;
+    }
+  }
+
+  printf("%s\n", ret ? "FAIL" : "OK");
+  free(cstates);
+  free(cpu_states);
+  return ret;
+}
@@ -0,0 +1,134 @@
+/**
+ * Runs the n^2 and hull translations, and the scalar n^2 kernel if a SIMD one
+ * is in use, on the same open-loop performance and compares their schedules.
+ *
+ * The SIMD kernel must pick exactly the schedules of the scalar one, and the
+ * hull exactly the schedules of the n^2 search, both with long periods where
+ * rounding the low state iterations is negligible and with short periods
+ * where it decides between pairs.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "poet.h"
+#include "poet_config.h"
+#include "poet_math.h"
+
+// Long periods make the rounding of the low state iterations negligible next
+// to the cost differences between the pairs of the example configs. Costs of
+// a period must stay below BIG_REAL_T.
+#ifdef FIXED_POINT
+#define LONG_PERIOD 10000
+#else
+#define LONG_PERIOD 30000
+#endif
+#define LONG_NUM_PERIODS 40
+#define SHORT_PERIOD 20
+#define SHORT_NUM_PERIODS 4000
+
+static const char* CONTROL_CONFIGS[] = {
+  "../config/examples/2x_Xeon_E5_2690/control_config_blackscholes_10M",
+  "../config/examples/2x_Xeon_E5_2690/control_config_ferret",
+  "../config/examples/2x_Xeon_E5_2690/control_config_sha",
+  "../config/examples/2x_Xeon_E5_2690/control_config_x264_native",
+  "../config/examples/odroidxue/control_config_x264_native",
+  "../config/examples/SVT11226CXB/control_config_stream",
+};
+
+// Energy spent on one iteration in a state
+static double state_energy(const poet_control_state_t* cstates,
+                           int id) {
+  return real_to_db(cstates[id].cost) / real_to_db(cstates[id].speedup);
+}
+
+// Energy spent on the period of a schedule
+static double schedule_energy(const poet_control_state_t* cstates,
+                              const poet_schedule_t* s) {
+  if (s->upper_id < 0 || s->lower_id < 0) {
+    return 0;
+  }
+  return s->low_state_iters * state_energy(cstates, s->lower_id) +
+         (s->period - s->low_state_iters) * state_energy(cstates, s->upper_id);
+}
+
+static int same_schedule(const poet_schedule_t* a,
+                         const poet_schedule_t* b) {
+  return a->lower_id == b->lower_id && a->upper_id == b->upper_id &&
+         a->low_state_iters == b->low_state_iters;
+}
+
+static int run_test(const char* path,
+                    unsigned int period,
+                    unsigned int num_periods) {
+  poet_control_state_t* cstates;
+  unsigned int nstates;
+  poet_state* n2;
+  poet_state* hull;
+  poet_state* scalar;
+  poet_schedule_t s_n2;
+  poet_schedule_t s_hull;
+  poet_schedule_t s_scalar;
+  unsigned long mismatches = 0;
+  unsigned long hull_mismatches = 0;
+  double e_n2 = 0;
+  double e_hull = 0;
+  real_t perf;
+  unsigned long i;
+  int ret;
+
+  if (get_control_states(path, &cstates, &nstates)) {
+    fprintf(stderr, "Failed to get control states from %s\n", path);
+    return -1;
+  }
+
+  n2 = poet_init(CONST(1.0), nstates, cstates, NULL, NULL, NULL, period, 1,
+                 NULL);
+  hull = poet_init(CONST(1.0), nstates, cstates, NULL, NULL, NULL, period, 1,
+                   NULL);
+  // the SIMD n^2 kernel, if any, must pick exactly what the scalar one picks
+  setenv(POET_DISABLE_SIMD, "1", 1);
+  scalar = poet_init(CONST(1.0), nstates, cstates, NULL, NULL, NULL, period, 1,
+                     NULL);
+  unsetenv(POET_DISABLE_SIMD);
+  if (n2 == NULL || hull == NULL || scalar == NULL) {
+    perror("poet_init");
+    return -1;
+  }
+  poet_set_translate_mode(hull, POET_TRANSLATE_HULL);
+
+  // All controllers see the same open-loop performance, so they request the
+  // same speedups and only their translations differ
+  for (i = 0; i < (unsigned long) period * num_periods; i++) {
+    perf = CONST(0.4 + 0.2 * ((i / period) % 7) + 0.013 * ((i / period) % 11));
+    // all decide on the same iterations
+    poet_decide(hull, i, perf, CONST(1.0), &s_hull);
+    poet_decide(scalar, i, perf, CONST(1.0), &s_scalar);
+    if (poet_decide(n2, i, perf, CONST(1.0), &s_n2) != 1) {
+      continue;
+    }
+    mismatches += !same_schedule(&s_scalar, &s_n2);
+    hull_mismatches += !same_schedule(&s_hull, &s_n2);
+    e_n2 += schedule_energy(cstates, &s_n2);
+    e_hull += schedule_energy(cstates, &s_hull);
+  }
+
+  ret = mismatches || hull_mismatches ? -1 : 0;
+  printf("%s period=%u: n2=%f hull=%f hull mismatches=%lu scalar "
+         "mismatches=%lu %s\n", path, period, e_n2, e_hull, hull_mismatches,
+         mismatches, ret ? "FAILED" : "OK");
+
+  poet_destroy(n2);
+  poet_destroy(hull);
+  poet_destroy(scalar);
+  free(cstates);
+  return ret;
+}
+
+int main(void) {
+  unsigned int i;
+  int ret = 0;
+  for (i = 0; i < sizeof(CONTROL_CONFIGS) / sizeof(CONTROL_CONFIGS[0]); i++) {
+    ret |= run_test(CONTROL_CONFIGS[i], LONG_PERIOD, LONG_NUM_PERIODS);
+    ret |= run_test(CONTROL_CONFIGS[i], SHORT_PERIOD, SHORT_NUM_PERIODS);
+  }
+  return ret;
+}
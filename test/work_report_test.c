@@ -0,0 +1,397 @@
+/**
+ * Runs a multithreaded workload whose iterations are shorter in faster states
+ * and checks that POET holds its rate at the goal when the threads report work
+ * with poet_report_work(), on period boundaries and on a timer.
+ *
+ * Also runs the same workload with every thread calling poet_apply_control()
+ * under a global mutex, and reports the throughput of each way when POET
+ * keeps the fastest state, to show the cost of serializing the threads.
+ *
+ * Finally switches between the goal modes while the threads report work, which
+ * frees the state of the previous mode under the steps. With -r, the rates are
+ * only reported, since they depend on the machine being idle, and only the
+ * switches are checked.
+ */
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "poet.h"
+#include "poet_math.h"
+
+#define NUM_STATES 5
+// spin loop units per iteration in the slowest state, fixed point rates must
+// stay in the range of real_t
+#ifdef FIXED_POINT
+#define ITER_WORK 500000
+#else
+#define ITER_WORK 20000
+#endif
+#define GOAL_FRACTION 0.5
+// a goal POET cannot reach, to measure the throughput in the fastest state
+#ifdef FIXED_POINT
+#define UNREACHABLE_GOAL (0.99 * MAX_FP / FP_SCALE)
+#else
+#define UNREACHABLE_GOAL 1e12
+#endif
+#define TOLERANCE 0.15
+
+typedef enum {
+  MODE_NONE = 0,
+  MODE_MUTEX,
+  MODE_REPORT,
+  MODE_TIMER
+} run_mode;
+
+static const char* MODE_NAMES[] = {"none", "mutex", "report", "timer"};
+
+typedef struct {
+  uint64_t iterations;
+} __attribute__((aligned(64))) thread_counter;
+
+static poet_control_state_t cstates[NUM_STATES];
+static unsigned int curr_id;
+static int stop;
+
+static poet_state* state;
+static run_mode mode;
+static thread_counter* counters;
+
+// baseline of the mutex mode: one shared counter and a windowed rate
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long mutex_count;
+static uint64_t mutex_window_ns;
+static real_t mutex_rate;
+static unsigned int period = 100;
+
+static inline uint64_t get_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * (uint64_t) 1000000000 + ts.tv_nsec;
+}
+
+// May be called from any worker
+static void plant_apply(void* states,
+                        unsigned int num_states,
+                        unsigned int id,
+                        unsigned int last_id) {
+  (void) states;
+  (void) num_states;
+  (void) last_id;
+  __atomic_store_n(&curr_id, id, __ATOMIC_RELAXED);
+}
+
+static void spin(unsigned long units) {
+  volatile unsigned long x = 0;
+  unsigned long i;
+  for (i = 0; i < units; i++) {
+    x += i;
+  }
+}
+
+static void mutex_report(void) {
+  uint64_t now;
+
+  pthread_mutex_lock(&mutex);
+  mutex_count++;
+  if (mutex_count % period == 0) {
+    now = get_ns();
+    mutex_rate = CONST(period * 1000000000.0 / (now - mutex_window_ns));
+    mutex_window_ns = now;
+  }
+  poet_apply_control(state, mutex_count, mutex_rate, CONST(0.0));
+  pthread_mutex_unlock(&mutex);
+}
+
+static void* worker(void* arg) {
+  thread_counter* counter = (thread_counter*) arg;
+  unsigned int id;
+
+  while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+    id = __atomic_load_n(&curr_id, __ATOMIC_RELAXED);
+    spin(ITER_WORK / real_to_db(cstates[id].speedup));
+    __atomic_store_n(&counter->iterations, counter->iterations + 1,
+                     __ATOMIC_RELAXED);
+    switch (mode) {
+      case MODE_MUTEX:
+        mutex_report();
+        break;
+      case MODE_REPORT:
+      case MODE_TIMER:
+        poet_report_work(state, 1, 0);
+        break;
+      case MODE_NONE:
+      default:
+        break;
+    }
+  }
+  return NULL;
+}
+
+static uint64_t total_iterations(unsigned int num_threads) {
+  uint64_t total = 0;
+  unsigned int i;
+  for (i = 0; i < num_threads; i++) {
+    total += __atomic_load_n(&counters[i].iterations, __ATOMIC_RELAXED);
+  }
+  return total;
+}
+
+/*
+ * Runs the workload for the given time and returns the rate over the second
+ * half, after the controller settled.
+ */
+static double run(run_mode m,
+                  double goal,
+                  unsigned int num_threads,
+                  double seconds,
+                  unsigned int batch,
+                  unsigned int timer_ms) {
+  pthread_t* threads;
+  uint64_t start;
+  uint64_t start_ns;
+  double rate;
+  unsigned int i;
+
+  mode = m;
+  stop = 0;
+  curr_id = NUM_STATES - 1;
+  mutex_count = 0;
+  mutex_window_ns = get_ns();
+  mutex_rate = CONST(goal);
+  state = NULL;
+  if (m != MODE_NONE) {
+    state = poet_init(CONST(goal), NUM_STATES, cstates, NULL, plant_apply,
+                      NULL, period, 1, NULL);
+    if (state == NULL) {
+      perror("poet_init");
+      return -1;
+    }
+    if ((m == MODE_REPORT || m == MODE_TIMER) &&
+        poet_set_work_reporting(state, num_threads, batch,
+                                m == MODE_TIMER ? timer_ms : 0)) {
+      perror("poet_set_work_reporting");
+      poet_destroy(state);
+      return -1;
+    }
+  }
+
+  threads = malloc(num_threads * sizeof(pthread_t));
+  if (threads == NULL) {
+    perror("malloc");
+    poet_destroy(state);
+    return -1;
+  }
+  for (i = 0; i < num_threads; i++) {
+    counters[i].iterations = 0;
+  }
+  for (i = 0; i < num_threads; i++) {
+    if (pthread_create(&threads[i], NULL, worker, &counters[i])) {
+      perror("pthread_create");
+      exit(1);
+    }
+  }
+
+  usleep(seconds * 500000);
+  start = total_iterations(num_threads);
+  start_ns = get_ns();
+  usleep(seconds * 500000);
+  rate = (total_iterations(num_threads) - start) * 1000000000.0 /
+         (get_ns() - start_ns);
+
+  __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+  for (i = 0; i < num_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  poet_destroy(state);
+  return rate;
+}
+
+/*
+ * Switches between the goal modes every millisecond while the threads report
+ * work on a timer. Returns the number of switches, or -1 on failure.
+ */
+static long run_goal_switches(double goal,
+                              unsigned int num_threads,
+                              double seconds,
+                              unsigned int batch,
+                              unsigned int timer_ms) {
+  pthread_t* threads;
+  uint64_t end_ns;
+  long switches = 0;
+  int err = 0;
+  unsigned int i;
+
+  mode = MODE_TIMER;
+  stop = 0;
+  curr_id = NUM_STATES - 1;
+  state = poet_init(CONST(goal), NUM_STATES, cstates, NULL, plant_apply, NULL,
+                    period, 1, NULL);
+  if (state == NULL) {
+    perror("poet_init");
+    return -1;
+  }
+  if (poet_set_work_reporting(state, num_threads, batch, timer_ms)) {
+    perror("poet_set_work_reporting");
+    poet_destroy(state);
+    return -1;
+  }
+
+  threads = malloc(num_threads * sizeof(pthread_t));
+  if (threads == NULL) {
+    perror("malloc");
+    poet_destroy(state);
+    return -1;
+  }
+  for (i = 0; i < num_threads; i++) {
+    if (pthread_create(&threads[i], NULL, worker, &counters[i])) {
+      perror("pthread_create");
+      exit(1);
+    }
+  }
+
+  end_ns = get_ns() + (uint64_t) (seconds * 1000000000.0);
+  while (!err && get_ns() < end_ns) {
+    switch (switches % 4) {
+      case 0:
+        err = poet_set_deadline(state, (uint64_t) (goal * seconds), seconds);
+        break;
+      case 1:
+        err = poet_set_power_cap(state, CONST(NUM_STATES));
+        break;
+      case 2:
+        err = poet_set_latency_goal(state, 0.9, 1.0 / goal);
+        break;
+      default:
+        poet_set_performance_goal(state, CONST(goal));
+        break;
+    }
+    switches++;
+    usleep(1000);
+  }
+  if (err) {
+    perror("setting the goal");
+  }
+
+  __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+  for (i = 0; i < num_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  poet_destroy(state);
+  return err ? -1 : switches;
+}
+
+static void print_usage(void) {
+  printf("usage:\n");
+  printf("work_report_test [-t threads] [-s seconds] [-p period] [-b batch] "
+         "[-m timer_ms] [-r]\n");
+  printf("  -t: worker threads (default 8)\n");
+  printf("  -s: seconds per run (default 2)\n");
+  printf("  -p: controller period (default 100)\n");
+  printf("  -b: iterations a thread batches before publishing (default 1)\n");
+  printf("  -m: timer period in ms of the timer mode (default 10)\n");
+  printf("  -r: only report the rates, do not fail when they miss the goal\n");
+}
+
+int main(int argc, char** argv) {
+  unsigned int num_threads = 8;
+  double seconds = 2;
+  unsigned int batch = 1;
+  unsigned int timer_ms = 10;
+  int check_rates = 1;
+  double max_rate;
+  double goal;
+  double rate;
+  double err;
+  long switches;
+  void* mem;
+  int ret = 0;
+  int opt;
+  int m;
+  unsigned int i;
+
+  while ((opt = getopt(argc, argv, "t:s:p:b:m:rh")) != -1) {
+    switch (opt) {
+      case 't':
+        num_threads = strtoul(optarg, NULL, 0);
+        break;
+      case 's':
+        seconds = atof(optarg);
+        break;
+      case 'p':
+        period = strtoul(optarg, NULL, 0);
+        break;
+      case 'b':
+        batch = strtoul(optarg, NULL, 0);
+        break;
+      case 'm':
+        timer_ms = strtoul(optarg, NULL, 0);
+        break;
+      case 'r':
+        check_rates = 0;
+        break;
+      case 'h':
+      default:
+        print_usage();
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (optind != argc || num_threads == 0 || seconds <= 0 || period == 0 ||
+      batch == 0 || timer_ms == 0) {
+    print_usage();
+    return 1;
+  }
+
+  for (i = 0; i < NUM_STATES; i++) {
+    cstates[i].id = i;
+    cstates[i].speedup = CONST(i + 1.0);
+    cstates[i].cost = CONST((i + 1.0) * (i + 1.0));
+  }
+  if (posix_memalign(&mem, 64, num_threads * sizeof(thread_counter))) {
+    perror("posix_memalign");
+    return 1;
+  }
+  counters = (thread_counter*) mem;
+
+  printf("threads=%u period=%u batch=%u timer_ms=%u\n", num_threads, period,
+         batch, timer_ms);
+
+  // throughput in the fastest state
+  max_rate = run(MODE_NONE, 1, num_threads, seconds, batch, timer_ms);
+  printf("%8s %14s %14s\n", "MODE", "MAX_RATE", "RELATIVE");
+  printf("%8s %14.1f %14.3f\n", MODE_NAMES[MODE_NONE], max_rate, 1.0);
+  for (m = MODE_MUTEX; m <= MODE_TIMER; m++) {
+    rate = run(m, UNREACHABLE_GOAL, num_threads, seconds, batch, timer_ms);
+    printf("%8s %14.1f %14.3f\n", MODE_NAMES[m], rate, rate / max_rate);
+  }
+
+  // hold a goal between two states
+  goal = GOAL_FRACTION * max_rate;
+  printf("%8s %14s %14s %14s\n", "MODE", "GOAL", "RATE", "ERROR");
+  for (m = MODE_MUTEX; m <= MODE_TIMER; m++) {
+    rate = run(m, goal, num_threads, seconds, batch, timer_ms);
+    err = rate / goal - 1.0;
+    printf("%8s %14.1f %14.1f %13.1f%% %s\n", MODE_NAMES[m], goal, rate,
+           100.0 * err, err < TOLERANCE && err > -TOLERANCE ? "OK" : "FAIL");
+    // the mutex baseline is only for comparison
+    if (check_rates && m != MODE_MUTEX &&
+        !(err < TOLERANCE && err > -TOLERANCE)) {
+      ret = 1;
+    }
+  }
+
+  switches = run_goal_switches(goal, num_threads, seconds, batch, timer_ms);
+  printf("Goal mode switches under work reporting: %ld %s\n", switches,
+         switches > 0 ? "OK" : "FAIL");
+  if (switches <= 0) {
+    ret = 1;
+  }
+
+  free(counters);
+  return ret;
+}
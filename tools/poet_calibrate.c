@@ -0,0 +1,195 @@
+/**
+ * Measure a workload in every state of a cpu_config and write a matching
+ * control_config (and a cpu_config with the states that were kept).
+ *
+ * The workload is either a command, run once per iteration, or a built-in CPU
+ * bound loop.
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "poet_calibrate.h"
+#include "poet_config.h"
+
+static const unsigned int WORK_ITERATIONS = 10000000;
+static const unsigned int DEFAULT_ITERATIONS = 10;
+
+static void work_loop(void* arg) {
+  volatile int dummy = 0;
+  unsigned int i;
+  (void) arg;
+  for (i = 0; i < WORK_ITERATIONS; i++) {
+    dummy = dummy >> 1;
+    dummy = dummy - 1;
+  }
+}
+
+// Run the command, it inherits our CPU affinity
+static void work_command(void* arg) {
+  char** argv = (char**) arg;
+  int status;
+  pid_t pid = fork();
+  if (pid == 0) {
+    execvp(argv[0], argv);
+    perror(argv[0]);
+    _exit(127);
+  } else if (pid < 0) {
+    perror("fork");
+  } else {
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR);
+  }
+}
+
+// A cumulative energy counter in microjoules, like RAPL's energy_uj
+typedef struct {
+  const char* path;
+  // the counter wraps to 0 after this value, 0 if unknown
+  unsigned long long max_uj;
+  unsigned long long last_uj;
+  unsigned long long wrapped_uj;
+  int started;
+} energy_counter;
+
+static int read_uj(const char* path, unsigned long long* uj) {
+  FILE* fp;
+  fp = fopen(path, "r");
+  if (fp == NULL) {
+    return -1;
+  }
+  if (fscanf(fp, "%llu", uj) != 1) {
+    fclose(fp);
+    return -1;
+  }
+  fclose(fp);
+  return 0;
+}
+
+// RAPL exposes the wrap point as max_energy_range_uj next to energy_uj
+static void energy_counter_init(energy_counter* ec, const char* path) {
+  char range_path[512];
+  const char* slash = strrchr(path, '/');
+  int dir_len = slash == NULL ? 0 : (int) (slash - path + 1);
+
+  memset(ec, 0, sizeof(energy_counter));
+  ec->path = path;
+  snprintf(range_path, sizeof(range_path), "%.*smax_energy_range_uj", dir_len,
+           path);
+  if (read_uj(range_path, &ec->max_uj)) {
+    ec->max_uj = 0;
+  }
+}
+
+// Read the counter in joules, unwrapping it if it passed its maximum
+static int read_energy_file(void* arg, double* joules) {
+  energy_counter* ec = (energy_counter*) arg;
+  unsigned long long uj;
+  if (read_uj(ec->path, &uj)) {
+    return -1;
+  }
+  if (ec->started && uj < ec->last_uj) {
+    if (ec->max_uj == 0) {
+      fprintf(stderr, "Energy counter %s wrapped, but its range is unknown\n",
+              ec->path);
+      return -1;
+    }
+    ec->wrapped_uj += ec->max_uj + 1;
+  }
+  ec->last_uj = uj;
+  ec->started = 1;
+  *joules = (ec->wrapped_uj + uj) / 1000000.0;
+  return 0;
+}
+
+static void print_usage(void) {
+  printf("usage:\n");
+  printf("poet_calibrate [-n iterations] [-e energy_uj_file] [-k] "
+         "cpu_config control_config_out cpu_config_out [-- command [args]]\n");
+  printf("  -n: iterations measured in each state (default %u)\n", DEFAULT_ITERATIONS);
+  printf("  -e: cumulative energy counter file in microjoules, "
+         "e.g. /sys/class/powercap/intel-rapl:0/energy_uj\n");
+  printf("  -k: keep all states, do not prune dominated states\n");
+}
+
+int main(int argc, char** argv) {
+  unsigned int iterations = DEFAULT_ITERATIONS;
+  char* energy_file = NULL;
+  energy_counter ec;
+  int keep = 0;
+  int opt;
+  poet_cpu_state_t* cpu_states;
+  unsigned int num_states;
+  unsigned int i;
+  poet_calibration_t* results;
+  char** command = NULL;
+  int ret;
+
+  while ((opt = getopt(argc, argv, "+n:e:kh")) != -1) {
+    switch (opt) {
+      case 'n':
+        iterations = strtoul(optarg, NULL, 0);
+        break;
+      case 'e':
+        energy_file = optarg;
+        break;
+      case 'k':
+        keep = 1;
+        break;
+      case 'h':
+      default:
+        print_usage();
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (argc - optind < 3 || iterations == 0) {
+    print_usage();
+    return 1;
+  }
+  if (argc - optind > 3) {
+    if (strcmp(argv[optind + 3], "--") || argc - optind < 5) {
+      print_usage();
+      return 1;
+    }
+    command = &argv[optind + 4];
+  }
+
+  if (get_cpu_states(argv[optind], &cpu_states, &num_states)) {
+    fprintf(stderr, "Failed to get CPU states.\n");
+    return 1;
+  }
+  results = malloc(num_states * sizeof(poet_calibration_t));
+  if (results == NULL) {
+    perror("malloc");
+    free(cpu_states);
+    return 1;
+  }
+
+  if (energy_file != NULL) {
+    energy_counter_init(&ec, energy_file);
+  }
+  if (poet_calibrate(cpu_states, num_states, iterations,
+                     command == NULL ? work_loop : work_command, command,
+                     energy_file == NULL ? NULL : read_energy_file,
+                     &ec, results)) {
+    perror("poet_calibrate");
+    ret = 1;
+  } else {
+    for (i = 0; i < num_states; i++) {
+      printf("State %u: rate=%f power=%f\n", results[i].id, results[i].rate,
+             results[i].power);
+    }
+    if (!keep) {
+      num_states = poet_calibration_prune(results, num_states);
+    }
+    ret = poet_calibration_write(argv[optind + 1], argv[optind + 2],
+                                 cpu_states, num_states, results, num_states) ? 1 : 0;
+  }
+
+  free(results);
+  free(cpu_states);
+  return ret;
+}
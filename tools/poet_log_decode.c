@@ -0,0 +1,114 @@
+/**
+ * Convert a binary log created with poet_set_binary_log() to the text log
+ * format written by poet_init().
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "poet_log.h"
+
+static double log_real_to_db(const poet_log_header* hdr, poet_log_real r) {
+  if (hdr->real_format == POET_LOG_REAL_FIXED) {
+    return (double) r.fp / (double) (1LL << hdr->real_frac_bits);
+  }
+  return r.d;
+}
+
+static int decode(FILE* in, FILE* out) {
+  poet_log_header hdr;
+  poet_log_record rec;
+  uint64_t first;
+  uint64_t num;
+  uint64_t i;
+
+  if (fread(&hdr, sizeof(hdr), 1, in) != 1) {
+    fprintf(stderr, "poet_log_decode: Failed to read header\n");
+    return -1;
+  }
+  if (memcmp(hdr.magic, POET_LOG_MAGIC, sizeof(POET_LOG_MAGIC)) ||
+      hdr.version != POET_LOG_VERSION ||
+      hdr.record_size != sizeof(poet_log_record) ||
+      hdr.capacity == 0) {
+    fprintf(stderr, "poet_log_decode: Not a POET binary log, or unsupported "
+            "version\n");
+    return -1;
+  }
+  if (hdr.real_format != POET_LOG_REAL_DOUBLE &&
+      (hdr.real_format != POET_LOG_REAL_FIXED || hdr.real_frac_bits > 62)) {
+    fprintf(stderr, "poet_log_decode: Unknown real format %u\n",
+            hdr.real_format);
+    return -1;
+  }
+
+  // oldest record first
+  if (hdr.count > hdr.capacity) {
+    first = hdr.count % hdr.capacity;
+    num = hdr.capacity;
+  } else {
+    first = 0;
+    num = hdr.count;
+  }
+
+  fprintf(out,
+          "%16s %16s %16s %16s %16s %16s %16s %16s %16s %16s %16s %16s %16s %16s\n",
+          "TAG", "ACTUAL_RATE", "X_HAT_MINUS", "X_HAT", "P_MINUS", "H", "K",
+          "P", "SPEEDUP", "ERROR", "WORKLOAD", "LOWER_ID", "UPPER_ID", "LOW_STATE_ITERS");
+  for (i = 0; i < num; i++) {
+    if (fseek(in, sizeof(hdr) + ((first + i) % hdr.capacity) * sizeof(rec), SEEK_SET) ||
+        fread(&rec, sizeof(rec), 1, in) != 1) {
+      fprintf(stderr, "poet_log_decode: Failed to read record %llu\n",
+              (unsigned long long) i);
+      return -1;
+    }
+    fprintf(out, "%16llu %16f %16f %16f %16f %16f %16f %16f %16f %16f %16f %16d %16d %16d\n",
+            (unsigned long long) rec.tag,
+            log_real_to_db(&hdr, rec.act_rate),
+            log_real_to_db(&hdr, rec.x_hat_minus),
+            log_real_to_db(&hdr, rec.x_hat),
+            log_real_to_db(&hdr, rec.p_minus),
+            log_real_to_db(&hdr, rec.h),
+            log_real_to_db(&hdr, rec.k),
+            log_real_to_db(&hdr, rec.p),
+            log_real_to_db(&hdr, rec.speedup),
+            log_real_to_db(&hdr, rec.error),
+            log_real_to_db(&hdr, rec.workload),
+            rec.lower_id,
+            rec.upper_id,
+            rec.low_state_iters);
+  }
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  FILE* in;
+  FILE* out = stdout;
+  int ret;
+
+  if (argc < 2 || argc > 3) {
+    printf("usage:\n");
+    printf("poet_log_decode binary_log [text_log]\n");
+    return 1;
+  }
+
+  in = fopen(argv[1], "rb");
+  if (in == NULL) {
+    perror(argv[1]);
+    return 1;
+  }
+  if (argc == 3) {
+    out = fopen(argv[2], "w");
+    if (out == NULL) {
+      perror(argv[2]);
+      fclose(in);
+      return 1;
+    }
+  }
+
+  ret = decode(in, out);
+
+  fclose(in);
+  if (out != stdout) {
+    fclose(out);
+  }
+  return ret ? 1 : 0;
+}